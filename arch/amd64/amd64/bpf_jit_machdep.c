@@ -0,0 +1,579 @@
+/*	$OpenBSD$ */
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bpf filter compiler for amd64.
+ *
+ * Register usage in the generated code:
+ *
+ *	%eax	A
+ *	%r15d	X
+ *	%rbx	packet
+ *	%r12	length of the packet data at %rbx
+ *	%r13	argument for the bpf_ops load functions
+ *	%r14	bpf_ops
+ *
+ * The stack frame holds the scratch memory words, the error from the
+ * load functions, the wire length, and a spill slot for A.
+ *
+ * Every jump is encoded with a 32 bit displacement so the size of the
+ * code does not depend on where things end up, and bpf only jumps
+ * forward, so one pass to find the instruction offsets and a second
+ * to emit the code is enough.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+
+#include <net/bpf.h>
+#include <net/bpf_jit.h>
+
+#define BJ_FRAME	88
+#define BJ_MEM(_k)	((_k) * sizeof(u_int32_t))
+#define BJ_ERR		64
+#define BJ_WIRELEN	68
+#define BJ_SPILL	72
+
+/* largest offset that can be checked and loaded with 32 bit immediates */
+#define BJ_MAXK		0x7fffff00U
+
+struct bpf_jit_ctx {
+	u_char		*bc_buf;
+	size_t		 bc_pos;
+	size_t		*bc_off;
+	size_t		 bc_ret0;
+	size_t		 bc_exit;
+};
+
+static inline void
+bj_emit(struct bpf_jit_ctx *bc, const u_char *b, size_t len)
+{
+	if (bc->bc_buf != NULL)
+		memcpy(bc->bc_buf + bc->bc_pos, b, len);
+	bc->bc_pos += len;
+}
+
+#define BJ_EMIT(_bc, ...) do {						\
+	const u_char __b[] = { __VA_ARGS__ };				\
+	bj_emit((_bc), __b, sizeof(__b));				\
+} while (0)
+
+static inline void
+bj_emit8(struct bpf_jit_ctx *bc, u_int8_t v)
+{
+	bj_emit(bc, &v, sizeof(v));
+}
+
+static inline void
+bj_emit32(struct bpf_jit_ctx *bc, u_int32_t v)
+{
+	bj_emit(bc, (u_char *)&v, sizeof(v));
+}
+
+static inline void
+bj_emit64(struct bpf_jit_ctx *bc, u_int64_t v)
+{
+	bj_emit(bc, (u_char *)&v, sizeof(v));
+}
+
+/* emit a 32 bit displacement to target from the end of the field */
+static inline void
+bj_rel32(struct bpf_jit_ctx *bc, size_t target)
+{
+	bj_emit32(bc, (u_int32_t)(target - (bc->bc_pos + 4)));
+}
+
+/* emit a placeholder displacement to be fixed up with bj_patch */
+static inline size_t
+bj_fwd32(struct bpf_jit_ctx *bc)
+{
+	size_t at = bc->bc_pos;
+
+	bj_emit32(bc, 0);
+	return (at);
+}
+
+static inline void
+bj_patch(struct bpf_jit_ctx *bc, size_t at)
+{
+	u_int32_t rel = bc->bc_pos - (at + 4);
+
+	if (bc->bc_buf != NULL)
+		memcpy(bc->bc_buf + at, &rel, sizeof(rel));
+}
+
+static inline void
+bj_jmp(struct bpf_jit_ctx *bc, size_t target)
+{
+	bj_emit8(bc, 0xe9);
+	bj_rel32(bc, target);
+}
+
+static inline void
+bj_jcc(struct bpf_jit_ctx *bc, u_int8_t cc, size_t target)
+{
+	bj_emit8(bc, 0x0f);
+	bj_emit8(bc, 0x80 | cc);
+	bj_rel32(bc, target);
+}
+
+#define BJ_CC_B		0x2
+#define BJ_CC_AE	0x3
+#define BJ_CC_E		0x4
+#define BJ_CC_NE	0x5
+#define BJ_CC_BE	0x6
+#define BJ_CC_A		0x7
+
+/*
+ * Load size bytes at the offset in %esi through the bpf_ops, and
+ * return 0 from the filter if it fails. The result is left in %eax.
+ */
+static void
+bj_slowload(struct bpf_jit_ctx *bc, u_int size)
+{
+	u_int8_t op;
+
+	switch (size) {
+	case sizeof(u_int32_t):
+		op = offsetof(struct bpf_ops, ldw);
+		break;
+	case sizeof(u_int16_t):
+		op = offsetof(struct bpf_ops, ldh);
+		break;
+	default:
+		op = offsetof(struct bpf_ops, ldb);
+		break;
+	}
+
+	BJ_EMIT(bc, 0x4c, 0x89, 0xef);			/* mov %r13,%rdi */
+	BJ_EMIT(bc, 0x48, 0x8d, 0x54, 0x24, BJ_ERR);	/* lea err(%rsp),%rdx */
+	BJ_EMIT(bc, 0x41, 0xff, 0x56);			/* call *op(%r14) */
+	bj_emit8(bc, op);
+	BJ_EMIT(bc, 0x83, 0x7c, 0x24, BJ_ERR, 0x00);	/* cmpl $0,err(%rsp) */
+	bj_jcc(bc, BJ_CC_NE, bc->bc_ret0);
+}
+
+/* A = ntoh(*(%rbx + disp)) or A = ntoh(*(%rbx + %rsi)) */
+static void
+bj_fastload(struct bpf_jit_ctx *bc, u_int size, int ind, u_int32_t k)
+{
+	switch (size) {
+	case sizeof(u_int32_t):
+		bj_emit8(bc, 0x8b);			/* mov */
+		break;
+	case sizeof(u_int16_t):
+		BJ_EMIT(bc, 0x0f, 0xb7);		/* movzwl */
+		break;
+	default:
+		BJ_EMIT(bc, 0x0f, 0xb6);		/* movzbl */
+		break;
+	}
+
+	if (ind)
+		BJ_EMIT(bc, 0x04, 0x33);		/* (%rbx,%rsi),%eax */
+	else {
+		bj_emit8(bc, 0x83);			/* disp32(%rbx),%eax */
+		bj_emit32(bc, k);
+	}
+
+	switch (size) {
+	case sizeof(u_int32_t):
+		BJ_EMIT(bc, 0x0f, 0xc8);		/* bswap %eax */
+		break;
+	case sizeof(u_int16_t):
+		BJ_EMIT(bc, 0x66, 0xc1, 0xc0, 0x08);	/* rol $8,%ax */
+		break;
+	}
+}
+
+static void
+bj_ld_abs(struct bpf_jit_ctx *bc, u_int size, u_int32_t k)
+{
+	size_t slow, done;
+
+	if (k > BJ_MAXK) {
+		bj_emit8(bc, 0xbe);			/* mov $k,%esi */
+		bj_emit32(bc, k);
+		bj_slowload(bc, size);
+		return;
+	}
+
+	BJ_EMIT(bc, 0x49, 0x81, 0xfc);			/* cmp $k+size,%r12 */
+	bj_emit32(bc, k + size);
+	BJ_EMIT(bc, 0x0f, 0x80 | BJ_CC_B);		/* jb slow */
+	slow = bj_fwd32(bc);
+	bj_fastload(bc, size, 0, k);
+	bj_emit8(bc, 0xe9);				/* jmp done */
+	done = bj_fwd32(bc);
+
+	bj_patch(bc, slow);
+	bj_emit8(bc, 0xbe);				/* mov $k,%esi */
+	bj_emit32(bc, k);
+	bj_slowload(bc, size);
+	bj_patch(bc, done);
+}
+
+static void
+bj_ld_ind(struct bpf_jit_ctx *bc, u_int size, u_int32_t k)
+{
+	size_t slow, done;
+
+	BJ_EMIT(bc, 0x44, 0x89, 0xfe);			/* mov %r15d,%esi */
+	if (k != 0) {
+		BJ_EMIT(bc, 0x81, 0xc6);		/* add $k,%esi */
+		bj_emit32(bc, k);
+	}
+	BJ_EMIT(bc, 0x48, 0x8d, 0x4e, size);	/* lea size(%rsi),%rcx */
+	BJ_EMIT(bc, 0x4c, 0x39, 0xe1);			/* cmp %r12,%rcx */
+	BJ_EMIT(bc, 0x0f, 0x80 | BJ_CC_A);		/* ja slow */
+	slow = bj_fwd32(bc);
+	bj_fastload(bc, size, 1, 0);
+	bj_emit8(bc, 0xe9);				/* jmp done */
+	done = bj_fwd32(bc);
+
+	bj_patch(bc, slow);
+	bj_slowload(bc, size);
+	bj_patch(bc, done);
+}
+
+/* X = (P[k] & 0xf) << 2 */
+static void
+bj_ldx_msh(struct bpf_jit_ctx *bc, u_int32_t k)
+{
+	size_t slow = 0, done = 0;
+
+	if (k <= BJ_MAXK) {
+		BJ_EMIT(bc, 0x49, 0x81, 0xfc);		/* cmp $k+1,%r12 */
+		bj_emit32(bc, k + 1);
+		BJ_EMIT(bc, 0x0f, 0x80 | BJ_CC_B);	/* jb slow */
+		slow = bj_fwd32(bc);
+		/* movzbl k(%rbx),%r15d */
+		BJ_EMIT(bc, 0x44, 0x0f, 0xb6, 0xbb);
+		bj_emit32(bc, k);
+		bj_emit8(bc, 0xe9);			/* jmp done */
+		done = bj_fwd32(bc);
+		bj_patch(bc, slow);
+	}
+
+	/* mov %eax,spill(%rsp) */
+	BJ_EMIT(bc, 0x89, 0x44, 0x24, BJ_SPILL);
+	bj_emit8(bc, 0xbe);				/* mov $k,%esi */
+	bj_emit32(bc, k);
+	bj_slowload(bc, sizeof(u_int8_t));
+	BJ_EMIT(bc, 0x41, 0x89, 0xc7);			/* mov %eax,%r15d */
+	/* mov spill(%rsp),%eax */
+	BJ_EMIT(bc, 0x8b, 0x44, 0x24, BJ_SPILL);
+
+	if (k <= BJ_MAXK)
+		bj_patch(bc, done);
+	BJ_EMIT(bc, 0x41, 0x83, 0xe7, 0x0f);		/* and $0xf,%r15d */
+	BJ_EMIT(bc, 0x41, 0xc1, 0xe7, 0x02);		/* shl $2,%r15d */
+}
+
+static void
+bj_jcond(struct bpf_jit_ctx *bc, const struct bpf_insn *pc, u_int i,
+    u_int8_t cc, u_int8_t ncc)
+{
+	size_t jt = bc->bc_off[i + 1 + pc->jt];
+	size_t jf = bc->bc_off[i + 1 + pc->jf];
+
+	if (pc->jt == pc->jf) {
+		if (pc->jt != 0)
+			bj_jmp(bc, jt);
+	} else if (pc->jt == 0)
+		bj_jcc(bc, ncc, jf);
+	else {
+		bj_jcc(bc, cc, jt);
+		if (pc->jf != 0)
+			bj_jmp(bc, jf);
+	}
+}
+
+static void
+bj_insn(struct bpf_jit_ctx *bc, const struct bpf_insn *pc, u_int i)
+{
+	u_int32_t k = pc->k;
+
+	switch (pc->code) {
+	case BPF_RET|BPF_K:
+		bj_emit8(bc, 0xb8);			/* mov $k,%eax */
+		bj_emit32(bc, k);
+		bj_jmp(bc, bc->bc_exit);
+		break;
+	case BPF_RET|BPF_A:
+		bj_jmp(bc, bc->bc_exit);
+		break;
+
+	case BPF_LD|BPF_W|BPF_ABS:
+		bj_ld_abs(bc, sizeof(u_int32_t), k);
+		break;
+	case BPF_LD|BPF_H|BPF_ABS:
+		bj_ld_abs(bc, sizeof(u_int16_t), k);
+		break;
+	case BPF_LD|BPF_B|BPF_ABS:
+		bj_ld_abs(bc, sizeof(u_int8_t), k);
+		break;
+	case BPF_LD|BPF_W|BPF_IND:
+		bj_ld_ind(bc, sizeof(u_int32_t), k);
+		break;
+	case BPF_LD|BPF_H|BPF_IND:
+		bj_ld_ind(bc, sizeof(u_int16_t), k);
+		break;
+	case BPF_LD|BPF_B|BPF_IND:
+		bj_ld_ind(bc, sizeof(u_int8_t), k);
+		break;
+	case BPF_LDX|BPF_MSH|BPF_B:
+		bj_ldx_msh(bc, k);
+		break;
+
+	case BPF_LD|BPF_W|BPF_LEN:
+		BJ_EMIT(bc, 0x8b, 0x44, 0x24, BJ_WIRELEN);
+		break;
+	case BPF_LDX|BPF_W|BPF_LEN:
+		BJ_EMIT(bc, 0x44, 0x8b, 0x7c, 0x24, BJ_WIRELEN);
+		break;
+	case BPF_LD|BPF_W|BPF_RND:
+		BJ_EMIT(bc, 0x48, 0xb8);	/* movabs $arc4random,%rax */
+		bj_emit64(bc, (u_int64_t)arc4random);
+		BJ_EMIT(bc, 0xff, 0xd0);		/* call *%rax */
+		break;
+	case BPF_LD|BPF_IMM:
+		bj_emit8(bc, 0xb8);			/* mov $k,%eax */
+		bj_emit32(bc, k);
+		break;
+	case BPF_LDX|BPF_IMM:
+		BJ_EMIT(bc, 0x41, 0xbf);		/* mov $k,%r15d */
+		bj_emit32(bc, k);
+		break;
+	case BPF_LD|BPF_MEM:
+		BJ_EMIT(bc, 0x8b, 0x44, 0x24, BJ_MEM(k));
+		break;
+	case BPF_LDX|BPF_MEM:
+		BJ_EMIT(bc, 0x44, 0x8b, 0x7c, 0x24, BJ_MEM(k));
+		break;
+	case BPF_ST:
+		BJ_EMIT(bc, 0x89, 0x44, 0x24, BJ_MEM(k));
+		break;
+	case BPF_STX:
+		BJ_EMIT(bc, 0x44, 0x89, 0x7c, 0x24, BJ_MEM(k));
+		break;
+
+	case BPF_JMP|BPF_JA:
+		bj_jmp(bc, bc->bc_off[i + 1 + k]);
+		break;
+	case BPF_JMP|BPF_JGT|BPF_K:
+		bj_emit8(bc, 0x3d);			/* cmp $k,%eax */
+		bj_emit32(bc, k);
+		bj_jcond(bc, pc, i, BJ_CC_A, BJ_CC_BE);
+		break;
+	case BPF_JMP|BPF_JGE|BPF_K:
+		bj_emit8(bc, 0x3d);
+		bj_emit32(bc, k);
+		bj_jcond(bc, pc, i, BJ_CC_AE, BJ_CC_B);
+		break;
+	case BPF_JMP|BPF_JEQ|BPF_K:
+		bj_emit8(bc, 0x3d);
+		bj_emit32(bc, k);
+		bj_jcond(bc, pc, i, BJ_CC_E, BJ_CC_NE);
+		break;
+	case BPF_JMP|BPF_JSET|BPF_K:
+		bj_emit8(bc, 0xa9);			/* test $k,%eax */
+		bj_emit32(bc, k);
+		bj_jcond(bc, pc, i, BJ_CC_NE, BJ_CC_E);
+		break;
+	case BPF_JMP|BPF_JGT|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x39, 0xf8);		/* cmp %r15d,%eax */
+		bj_jcond(bc, pc, i, BJ_CC_A, BJ_CC_BE);
+		break;
+	case BPF_JMP|BPF_JGE|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x39, 0xf8);
+		bj_jcond(bc, pc, i, BJ_CC_AE, BJ_CC_B);
+		break;
+	case BPF_JMP|BPF_JEQ|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x39, 0xf8);
+		bj_jcond(bc, pc, i, BJ_CC_E, BJ_CC_NE);
+		break;
+	case BPF_JMP|BPF_JSET|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x85, 0xf8);		/* test %r15d,%eax */
+		bj_jcond(bc, pc, i, BJ_CC_NE, BJ_CC_E);
+		break;
+
+	case BPF_ALU|BPF_ADD|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x01, 0xf8);		/* add %r15d,%eax */
+		break;
+	case BPF_ALU|BPF_SUB|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x29, 0xf8);		/* sub %r15d,%eax */
+		break;
+	case BPF_ALU|BPF_MUL|BPF_X:
+		BJ_EMIT(bc, 0x41, 0x0f, 0xaf, 0xc7);	/* imul %r15d,%eax */
+		break;
+	case BPF_ALU|BPF_DIV|BPF_X:
+		BJ_EMIT(bc, 0x45, 0x85, 0xff);		/* test %r15d,%r15d */
+		bj_jcc(bc, BJ_CC_E, bc->bc_ret0);
+		BJ_EMIT(bc, 0x31, 0xd2);		/* xor %edx,%edx */
+		BJ_EMIT(bc, 0x41, 0xf7, 0xf7);		/* div %r15d */
+		break;
+	case BPF_ALU|BPF_AND|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x21, 0xf8);		/* and %r15d,%eax */
+		break;
+	case BPF_ALU|BPF_OR|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x09, 0xf8);		/* or %r15d,%eax */
+		break;
+	case BPF_ALU|BPF_LSH|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x89, 0xf9);		/* mov %r15d,%ecx */
+		BJ_EMIT(bc, 0xd3, 0xe0);		/* shl %cl,%eax */
+		break;
+	case BPF_ALU|BPF_RSH|BPF_X:
+		BJ_EMIT(bc, 0x44, 0x89, 0xf9);		/* mov %r15d,%ecx */
+		BJ_EMIT(bc, 0xd3, 0xe8);		/* shr %cl,%eax */
+		break;
+	case BPF_ALU|BPF_ADD|BPF_K:
+		bj_emit8(bc, 0x05);			/* add $k,%eax */
+		bj_emit32(bc, k);
+		break;
+	case BPF_ALU|BPF_SUB|BPF_K:
+		bj_emit8(bc, 0x2d);			/* sub $k,%eax */
+		bj_emit32(bc, k);
+		break;
+	case BPF_ALU|BPF_MUL|BPF_K:
+		BJ_EMIT(bc, 0x69, 0xc0);		/* imul $k,%eax,%eax */
+		bj_emit32(bc, k);
+		break;
+	case BPF_ALU|BPF_DIV|BPF_K:
+		/* bpf_validate() rejects division by a constant 0 */
+		BJ_EMIT(bc, 0x31, 0xd2);		/* xor %edx,%edx */
+		bj_emit8(bc, 0xb9);			/* mov $k,%ecx */
+		bj_emit32(bc, k);
+		BJ_EMIT(bc, 0xf7, 0xf1);		/* div %ecx */
+		break;
+	case BPF_ALU|BPF_AND|BPF_K:
+		bj_emit8(bc, 0x25);			/* and $k,%eax */
+		bj_emit32(bc, k);
+		break;
+	case BPF_ALU|BPF_OR|BPF_K:
+		bj_emit8(bc, 0x0d);			/* or $k,%eax */
+		bj_emit32(bc, k);
+		break;
+	case BPF_ALU|BPF_LSH|BPF_K:
+		BJ_EMIT(bc, 0xc1, 0xe0);		/* shl $k,%eax */
+		bj_emit8(bc, k);
+		break;
+	case BPF_ALU|BPF_RSH|BPF_K:
+		BJ_EMIT(bc, 0xc1, 0xe8);		/* shr $k,%eax */
+		bj_emit8(bc, k);
+		break;
+	case BPF_ALU|BPF_NEG:
+		BJ_EMIT(bc, 0xf7, 0xd8);		/* neg %eax */
+		break;
+
+	case BPF_MISC|BPF_TAX:
+		BJ_EMIT(bc, 0x41, 0x89, 0xc7);		/* mov %eax,%r15d */
+		break;
+	case BPF_MISC|BPF_TXA:
+		BJ_EMIT(bc, 0x44, 0x89, 0xf8);		/* mov %r15d,%eax */
+		break;
+
+	default:
+		/* the interpreter rejects anything else at run time */
+		bj_jmp(bc, bc->bc_ret0);
+		break;
+	}
+}
+
+static void
+bj_pass(struct bpf_jit_ctx *bc, const struct bpf_insn *insns, u_int len)
+{
+	u_int i, k;
+
+	bc->bc_pos = 0;
+
+	BJ_EMIT(bc, 0x55);				/* push %rbp */
+	BJ_EMIT(bc, 0x48, 0x89, 0xe5);			/* mov %rsp,%rbp */
+	BJ_EMIT(bc, 0x53);				/* push %rbx */
+	BJ_EMIT(bc, 0x41, 0x54);			/* push %r12 */
+	BJ_EMIT(bc, 0x41, 0x55);			/* push %r13 */
+	BJ_EMIT(bc, 0x41, 0x56);			/* push %r14 */
+	BJ_EMIT(bc, 0x41, 0x57);			/* push %r15 */
+	BJ_EMIT(bc, 0x48, 0x83, 0xec, BJ_FRAME);	/* sub $frame,%rsp */
+	BJ_EMIT(bc, 0x48, 0x89, 0xfb);			/* mov %rdi,%rbx */
+	BJ_EMIT(bc, 0x41, 0x89, 0xf4);			/* mov %esi,%r12d */
+	/* mov %edx,wirelen(%rsp) */
+	BJ_EMIT(bc, 0x89, 0x54, 0x24, BJ_WIRELEN);
+	BJ_EMIT(bc, 0x49, 0x89, 0xcd);			/* mov %rcx,%r13 */
+	BJ_EMIT(bc, 0x4d, 0x89, 0xc6);			/* mov %r8,%r14 */
+	BJ_EMIT(bc, 0x31, 0xc0);			/* xor %eax,%eax */
+	BJ_EMIT(bc, 0x45, 0x31, 0xff);			/* xor %r15d,%r15d */
+	for (k = 0; k < BPF_MEMWORDS; k += 2) {
+		/* mov %rax,mem[k](%rsp) */
+		BJ_EMIT(bc, 0x48, 0x89, 0x44, 0x24);
+		bj_emit8(bc, BJ_MEM(k));
+	}
+
+	for (i = 0; i < len; i++) {
+		bc->bc_off[i] = bc->bc_pos;
+		bj_insn(bc, &insns[i], i);
+	}
+	bc->bc_off[len] = bc->bc_pos;
+
+	/* falling off the end of the program is rejected by bpf_validate */
+	bc->bc_ret0 = bc->bc_pos;
+	BJ_EMIT(bc, 0x31, 0xc0);			/* xor %eax,%eax */
+	bc->bc_exit = bc->bc_pos;
+	BJ_EMIT(bc, 0x48, 0x83, 0xc4, BJ_FRAME);	/* add $frame,%rsp */
+	BJ_EMIT(bc, 0x41, 0x5f);			/* pop %r15 */
+	BJ_EMIT(bc, 0x41, 0x5e);			/* pop %r14 */
+	BJ_EMIT(bc, 0x41, 0x5d);			/* pop %r13 */
+	BJ_EMIT(bc, 0x41, 0x5c);			/* pop %r12 */
+	BJ_EMIT(bc, 0x5b);				/* pop %rbx */
+	BJ_EMIT(bc, 0x5d);				/* pop %rbp */
+	BJ_EMIT(bc, 0xc3);				/* ret */
+}
+
+int
+bpf_jit_md_compile(const struct bpf_insn *insns, u_int len, u_char *buf,
+    size_t *sizep)
+{
+	struct bpf_jit_ctx bc;
+
+	memset(&bc, 0, sizeof(bc));
+	bc.bc_off = mallocarray(len + 1, sizeof(*bc.bc_off), M_TEMP,
+	    M_WAITOK | M_CANFAIL);
+	if (bc.bc_off == NULL)
+		return (ENOMEM);
+
+	/* size the code and find the instruction offsets and labels */
+	bj_pass(&bc, insns, len);
+
+	if (buf != NULL) {
+		if (bc.bc_pos > *sizep) {
+			free(bc.bc_off, M_TEMP, (len + 1) * sizeof(*bc.bc_off));
+			return (ENOSPC);
+		}
+		bc.bc_buf = buf;
+		bj_pass(&bc, insns, len);
+	}
+	*sizep = bc.bc_pos;
+
+	free(bc.bc_off, M_TEMP, (len + 1) * sizeof(*bc.bc_off));
+	return (0);
+}
+
+void
+bpf_jit_md_sync(vaddr_t va, vsize_t len)
+{
+	/* instruction fetch is coherent with stores on x86 */
+}
@@ -80,6 +80,7 @@
 #define	NKMEMPAGES_MAX_DEFAULT	((128 * 1024 * 1024) >> PAGE_SHIFT)
 
 #define __HAVE_ACPI
+#define __HAVE_BPF_JIT
 
 #endif /* _KERNEL */
 
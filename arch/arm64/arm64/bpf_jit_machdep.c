@@ -0,0 +1,581 @@
+/*	$OpenBSD$ */
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * bpf filter compiler for arm64.
+ *
+ * Register usage in the generated code:
+ *
+ *	w24	A
+ *	w25	X
+ *	x19	packet
+ *	x20	length of the packet data at x19
+ *	x21	argument for the bpf_ops load functions
+ *	x22	bpf_ops
+ *	w23	wire length
+ *	x9-x11	scratch
+ *
+ * A and X live in callee saved registers so they survive calls to
+ * the load functions. The stack frame holds the saved registers, the
+ * scratch memory words, and the error from the load functions.
+ *
+ * Instructions are a fixed size and bpf only jumps forward, so one
+ * pass to find the instruction offsets and a second to emit the code
+ * is enough.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+
+#include <machine/cpufunc.h>
+
+#include <net/bpf.h>
+#include <net/bpf_jit.h>
+
+#define BJ_FRAME	160
+#define BJ_MEM(_k)	(80 + (_k) * sizeof(u_int32_t))
+#define BJ_ERR		144
+
+/* largest offset that is checked inline */
+#define BJ_MAXK		0x7fffff00U
+
+#define R_A		24
+#define R_X		25
+#define R_PKT		19
+#define R_BUFLEN	20
+#define R_ARG		21
+#define R_OPS		22
+#define R_WIRELEN	23
+#define R_T0		9
+#define R_T1		10
+#define R_T2		11
+#define R_IP0		16
+#define R_FP		29
+#define R_LR		30
+#define R_SP		31
+#define R_ZR		31
+
+#define CC_EQ		0x0
+#define CC_NE		0x1
+#define CC_HS		0x2
+#define CC_LO		0x3
+#define CC_HI		0x8
+#define CC_LS		0x9
+
+struct bpf_jit_ctx {
+	u_int32_t	*bc_buf;
+	size_t		 bc_pos;	/* in instructions */
+	size_t		*bc_off;
+	size_t		 bc_ret0;
+	size_t		 bc_exit;
+};
+
+static inline void
+bj_emit(struct bpf_jit_ctx *bc, u_int32_t insn)
+{
+	if (bc->bc_buf != NULL)
+		bc->bc_buf[bc->bc_pos] = insn;
+	bc->bc_pos++;
+}
+
+static inline void
+bj_patch(struct bpf_jit_ctx *bc, size_t at, u_int32_t insn)
+{
+	if (bc->bc_buf != NULL)
+		bc->bc_buf[at] = insn;
+}
+
+#define bj_rr(_op, _d, _n, _m)	((_op) | ((_m) << 16) | ((_n) << 5) | (_d))
+
+/* 32 bit register operations */
+#define ADD_W(_d, _n, _m)	bj_rr(0x0b000000, _d, _n, _m)
+#define SUB_W(_d, _n, _m)	bj_rr(0x4b000000, _d, _n, _m)
+#define AND_W(_d, _n, _m)	bj_rr(0x0a000000, _d, _n, _m)
+#define ORR_W(_d, _n, _m)	bj_rr(0x2a000000, _d, _n, _m)
+#define MUL_W(_d, _n, _m)	bj_rr(0x1b007c00, _d, _n, _m)
+#define UDIV_W(_d, _n, _m)	bj_rr(0x1ac00800, _d, _n, _m)
+#define LSLV_W(_d, _n, _m)	bj_rr(0x1ac02000, _d, _n, _m)
+#define LSRV_W(_d, _n, _m)	bj_rr(0x1ac02400, _d, _n, _m)
+#define CMP_W(_n, _m)		bj_rr(0x6b000000, R_ZR, _n, _m)
+#define TST_W(_n, _m)		bj_rr(0x6a000000, R_ZR, _n, _m)
+#define MOV_W(_d, _m)		ORR_W(_d, R_ZR, _m)
+#define NEG_W(_d, _m)		SUB_W(_d, R_ZR, _m)
+#define REV_W(_d, _n)		bj_rr(0x5ac00800, _d, _n, 0)
+#define REV16_W(_d, _n)		bj_rr(0x5ac00400, _d, _n, 0)
+#define UBFIZ_W(_d, _n, _lsb, _w)					\
+	(0x53000000 | (((32 - (_lsb)) & 31) << 16) | (((_w) - 1) << 10) | \
+	    ((_n) << 5) | (_d))
+#define MOVZ_W(_d, _imm, _hw)	(0x52800000 | ((_hw) << 21) |		\
+				    ((_imm) << 5) | (_d))
+#define MOVK_W(_d, _imm, _hw)	(0x72800000 | ((_hw) << 21) |		\
+				    ((_imm) << 5) | (_d))
+
+/* 64 bit operations */
+#define MOV_X(_d, _m)		bj_rr(0xaa000000, _d, R_ZR, _m)
+#define CMP_X(_n, _m)		bj_rr(0xeb000000, R_ZR, _n, _m)
+#define ADDI_X(_d, _n, _imm)	(0x91000000 | ((_imm) << 10) |		\
+				    ((_n) << 5) | (_d))
+#define MOVZ_X(_d, _imm, _hw)	(0xd2800000 | ((_hw) << 21) |		\
+				    ((_imm) << 5) | (_d))
+#define MOVK_X(_d, _imm, _hw)	(0xf2800000 | ((_hw) << 21) |		\
+				    ((_imm) << 5) | (_d))
+
+/* loads and stores */
+#define LDR_W(_t, _n, _off)	(0xb9400000 | (((_off) / 4) << 10) |	\
+				    ((_n) << 5) | (_t))
+#define STR_W(_t, _n, _off)	(0xb9000000 | (((_off) / 4) << 10) |	\
+				    ((_n) << 5) | (_t))
+#define LDR_X(_t, _n, _off)	(0xf9400000 | (((_off) / 8) << 10) |	\
+				    ((_n) << 5) | (_t))
+#define STR_X(_t, _n, _off)	(0xf9000000 | (((_off) / 8) << 10) |	\
+				    ((_n) << 5) | (_t))
+#define LDRR_W(_t, _n, _m)	bj_rr(0xb8606800, _t, _n, _m)
+#define LDRRH_W(_t, _n, _m)	bj_rr(0x78606800, _t, _n, _m)
+#define LDRRB_W(_t, _n, _m)	bj_rr(0x38606800, _t, _n, _m)
+#define bj_pair(_op, _t, _t2, _n, _off)					\
+	((_op) | ((((_off) / 8) & 0x7f) << 15) | ((_t2) << 10) |	\
+	    ((_n) << 5) | (_t))
+#define STP_X(_t, _t2, _n, _off)	bj_pair(0xa9000000, _t, _t2, _n, _off)
+#define LDP_X(_t, _t2, _n, _off)	bj_pair(0xa9400000, _t, _t2, _n, _off)
+#define STP_X_PRE(_t, _t2, _n, _off)	bj_pair(0xa9800000, _t, _t2, _n, _off)
+#define LDP_X_POST(_t, _t2, _n, _off)	bj_pair(0xa8c00000, _t, _t2, _n, _off)
+
+/* branches */
+#define BLR(_n)			(0xd63f0000 | ((_n) << 5))
+#define RET			0xd65f03c0
+
+static inline void
+bj_b(struct bpf_jit_ctx *bc, size_t target)
+{
+	bj_emit(bc, 0x14000000 | ((target - bc->bc_pos) & 0x3ffffff));
+}
+
+static inline void
+bj_bcc(struct bpf_jit_ctx *bc, u_int cc, size_t target)
+{
+	bj_emit(bc, 0x54000000 | (((target - bc->bc_pos) & 0x7ffff) << 5) | cc);
+}
+
+static inline void
+bj_cbz(struct bpf_jit_ctx *bc, int nz, u_int rt, size_t target)
+{
+	bj_emit(bc, (nz ? 0x35000000 : 0x34000000) |
+	    (((target - bc->bc_pos) & 0x7ffff) << 5) | rt);
+}
+
+/* placeholders for forward branches within an instruction */
+static inline size_t
+bj_fwd(struct bpf_jit_ctx *bc)
+{
+	size_t at = bc->bc_pos;
+
+	bj_emit(bc, 0);
+	return (at);
+}
+
+static inline void
+bj_patch_b(struct bpf_jit_ctx *bc, size_t at)
+{
+	bj_patch(bc, at, 0x14000000 | ((bc->bc_pos - at) & 0x3ffffff));
+}
+
+static inline void
+bj_patch_bcc(struct bpf_jit_ctx *bc, size_t at, u_int cc)
+{
+	bj_patch(bc, at,
+	    0x54000000 | (((bc->bc_pos - at) & 0x7ffff) << 5) | cc);
+}
+
+static inline void
+bj_imm32(struct bpf_jit_ctx *bc, u_int rd, u_int32_t k)
+{
+	bj_emit(bc, MOVZ_W(rd, k & 0xffff, 0));
+	bj_emit(bc, MOVK_W(rd, k >> 16, 1));
+}
+
+/*
+ * Load size bytes at the offset in w1 through the bpf_ops into rd,
+ * and return 0 from the filter if it fails.
+ */
+static void
+bj_slowload(struct bpf_jit_ctx *bc, u_int size, u_int rd)
+{
+	u_int op;
+
+	switch (size) {
+	case sizeof(u_int32_t):
+		op = offsetof(struct bpf_ops, ldw);
+		break;
+	case sizeof(u_int16_t):
+		op = offsetof(struct bpf_ops, ldh);
+		break;
+	default:
+		op = offsetof(struct bpf_ops, ldb);
+		break;
+	}
+
+	bj_emit(bc, MOV_X(0, R_ARG));
+	bj_emit(bc, ADDI_X(2, R_SP, BJ_ERR));
+	bj_emit(bc, LDR_X(R_IP0, R_OPS, op));
+	bj_emit(bc, BLR(R_IP0));
+	bj_emit(bc, LDR_W(R_T0, R_SP, BJ_ERR));
+	bj_cbz(bc, 1, R_T0, bc->bc_ret0);
+	bj_emit(bc, MOV_W(rd, 0));
+}
+
+/* rd = ntoh(*(x19 + x10)) */
+static void
+bj_fastload(struct bpf_jit_ctx *bc, u_int size, u_int rd)
+{
+	switch (size) {
+	case sizeof(u_int32_t):
+		bj_emit(bc, LDRR_W(rd, R_PKT, R_T1));
+		bj_emit(bc, REV_W(rd, rd));
+		break;
+	case sizeof(u_int16_t):
+		bj_emit(bc, LDRRH_W(rd, R_PKT, R_T1));
+		bj_emit(bc, REV16_W(rd, rd));
+		break;
+	default:
+		bj_emit(bc, LDRRB_W(rd, R_PKT, R_T1));
+		break;
+	}
+}
+
+static void
+bj_ld_abs(struct bpf_jit_ctx *bc, u_int size, u_int32_t k, u_int rd)
+{
+	size_t slow, done;
+
+	bj_imm32(bc, R_T1, k);
+	if (k > BJ_MAXK) {
+		bj_emit(bc, MOV_W(1, R_T1));
+		bj_slowload(bc, size, rd);
+		return;
+	}
+
+	bj_imm32(bc, R_T0, k + size);
+	bj_emit(bc, CMP_X(R_BUFLEN, R_T0));
+	slow = bj_fwd(bc);				/* b.lo slow */
+	bj_fastload(bc, size, rd);
+	done = bj_fwd(bc);				/* b done */
+
+	bj_patch_bcc(bc, slow, CC_LO);
+	bj_emit(bc, MOV_W(1, R_T1));
+	bj_slowload(bc, size, rd);
+	bj_patch_b(bc, done);
+}
+
+static void
+bj_ld_ind(struct bpf_jit_ctx *bc, u_int size, u_int32_t k)
+{
+	size_t slow, done;
+
+	bj_imm32(bc, R_T0, k);
+	bj_emit(bc, ADD_W(R_T1, R_X, R_T0));
+	bj_emit(bc, ADDI_X(R_T2, R_T1, size));
+	bj_emit(bc, CMP_X(R_T2, R_BUFLEN));
+	slow = bj_fwd(bc);				/* b.hi slow */
+	bj_fastload(bc, size, R_A);
+	done = bj_fwd(bc);				/* b done */
+
+	bj_patch_bcc(bc, slow, CC_HI);
+	bj_emit(bc, MOV_W(1, R_T1));
+	bj_slowload(bc, size, R_A);
+	bj_patch_b(bc, done);
+}
+
+static void
+bj_jcond(struct bpf_jit_ctx *bc, const struct bpf_insn *pc, u_int i,
+    u_int cc, u_int ncc)
+{
+	size_t jt = bc->bc_off[i + 1 + pc->jt];
+	size_t jf = bc->bc_off[i + 1 + pc->jf];
+
+	if (pc->jt == pc->jf) {
+		if (pc->jt != 0)
+			bj_b(bc, jt);
+	} else if (pc->jt == 0)
+		bj_bcc(bc, ncc, jf);
+	else {
+		bj_bcc(bc, cc, jt);
+		if (pc->jf != 0)
+			bj_b(bc, jf);
+	}
+}
+
+static void
+bj_alu(struct bpf_jit_ctx *bc, u_int op, u_int rm)
+{
+	switch (op) {
+	case BPF_ADD:
+		bj_emit(bc, ADD_W(R_A, R_A, rm));
+		break;
+	case BPF_SUB:
+		bj_emit(bc, SUB_W(R_A, R_A, rm));
+		break;
+	case BPF_MUL:
+		bj_emit(bc, MUL_W(R_A, R_A, rm));
+		break;
+	case BPF_DIV:
+		bj_emit(bc, UDIV_W(R_A, R_A, rm));
+		break;
+	case BPF_AND:
+		bj_emit(bc, AND_W(R_A, R_A, rm));
+		break;
+	case BPF_OR:
+		bj_emit(bc, ORR_W(R_A, R_A, rm));
+		break;
+	case BPF_LSH:
+		bj_emit(bc, LSLV_W(R_A, R_A, rm));
+		break;
+	case BPF_RSH:
+		bj_emit(bc, LSRV_W(R_A, R_A, rm));
+		break;
+	}
+}
+
+static void
+bj_insn(struct bpf_jit_ctx *bc, const struct bpf_insn *pc, u_int i)
+{
+	u_int32_t k = pc->k;
+	u_int64_t f;
+
+	switch (pc->code) {
+	case BPF_RET|BPF_K:
+		bj_imm32(bc, R_A, k);
+		bj_b(bc, bc->bc_exit);
+		break;
+	case BPF_RET|BPF_A:
+		bj_b(bc, bc->bc_exit);
+		break;
+
+	case BPF_LD|BPF_W|BPF_ABS:
+		bj_ld_abs(bc, sizeof(u_int32_t), k, R_A);
+		break;
+	case BPF_LD|BPF_H|BPF_ABS:
+		bj_ld_abs(bc, sizeof(u_int16_t), k, R_A);
+		break;
+	case BPF_LD|BPF_B|BPF_ABS:
+		bj_ld_abs(bc, sizeof(u_int8_t), k, R_A);
+		break;
+	case BPF_LD|BPF_W|BPF_IND:
+		bj_ld_ind(bc, sizeof(u_int32_t), k);
+		break;
+	case BPF_LD|BPF_H|BPF_IND:
+		bj_ld_ind(bc, sizeof(u_int16_t), k);
+		break;
+	case BPF_LD|BPF_B|BPF_IND:
+		bj_ld_ind(bc, sizeof(u_int8_t), k);
+		break;
+	case BPF_LDX|BPF_MSH|BPF_B:
+		bj_ld_abs(bc, sizeof(u_int8_t), k, R_X);
+		bj_emit(bc, UBFIZ_W(R_X, R_X, 2, 4));
+		break;
+
+	case BPF_LD|BPF_W|BPF_LEN:
+		bj_emit(bc, MOV_W(R_A, R_WIRELEN));
+		break;
+	case BPF_LDX|BPF_W|BPF_LEN:
+		bj_emit(bc, MOV_W(R_X, R_WIRELEN));
+		break;
+	case BPF_LD|BPF_W|BPF_RND:
+		f = (u_int64_t)arc4random;
+		bj_emit(bc, MOVZ_X(R_IP0, f & 0xffff, 0));
+		bj_emit(bc, MOVK_X(R_IP0, (f >> 16) & 0xffff, 1));
+		bj_emit(bc, MOVK_X(R_IP0, (f >> 32) & 0xffff, 2));
+		bj_emit(bc, MOVK_X(R_IP0, (f >> 48) & 0xffff, 3));
+		bj_emit(bc, BLR(R_IP0));
+		bj_emit(bc, MOV_W(R_A, 0));
+		break;
+	case BPF_LD|BPF_IMM:
+		bj_imm32(bc, R_A, k);
+		break;
+	case BPF_LDX|BPF_IMM:
+		bj_imm32(bc, R_X, k);
+		break;
+	case BPF_LD|BPF_MEM:
+		bj_emit(bc, LDR_W(R_A, R_SP, BJ_MEM(k)));
+		break;
+	case BPF_LDX|BPF_MEM:
+		bj_emit(bc, LDR_W(R_X, R_SP, BJ_MEM(k)));
+		break;
+	case BPF_ST:
+		bj_emit(bc, STR_W(R_A, R_SP, BJ_MEM(k)));
+		break;
+	case BPF_STX:
+		bj_emit(bc, STR_W(R_X, R_SP, BJ_MEM(k)));
+		break;
+
+	case BPF_JMP|BPF_JA:
+		bj_b(bc, bc->bc_off[i + 1 + k]);
+		break;
+	case BPF_JMP|BPF_JGT|BPF_K:
+		bj_imm32(bc, R_T0, k);
+		bj_emit(bc, CMP_W(R_A, R_T0));
+		bj_jcond(bc, pc, i, CC_HI, CC_LS);
+		break;
+	case BPF_JMP|BPF_JGE|BPF_K:
+		bj_imm32(bc, R_T0, k);
+		bj_emit(bc, CMP_W(R_A, R_T0));
+		bj_jcond(bc, pc, i, CC_HS, CC_LO);
+		break;
+	case BPF_JMP|BPF_JEQ|BPF_K:
+		bj_imm32(bc, R_T0, k);
+		bj_emit(bc, CMP_W(R_A, R_T0));
+		bj_jcond(bc, pc, i, CC_EQ, CC_NE);
+		break;
+	case BPF_JMP|BPF_JSET|BPF_K:
+		bj_imm32(bc, R_T0, k);
+		bj_emit(bc, TST_W(R_A, R_T0));
+		bj_jcond(bc, pc, i, CC_NE, CC_EQ);
+		break;
+	case BPF_JMP|BPF_JGT|BPF_X:
+		bj_emit(bc, CMP_W(R_A, R_X));
+		bj_jcond(bc, pc, i, CC_HI, CC_LS);
+		break;
+	case BPF_JMP|BPF_JGE|BPF_X:
+		bj_emit(bc, CMP_W(R_A, R_X));
+		bj_jcond(bc, pc, i, CC_HS, CC_LO);
+		break;
+	case BPF_JMP|BPF_JEQ|BPF_X:
+		bj_emit(bc, CMP_W(R_A, R_X));
+		bj_jcond(bc, pc, i, CC_EQ, CC_NE);
+		break;
+	case BPF_JMP|BPF_JSET|BPF_X:
+		bj_emit(bc, TST_W(R_A, R_X));
+		bj_jcond(bc, pc, i, CC_NE, CC_EQ);
+		break;
+
+	case BPF_ALU|BPF_DIV|BPF_X:
+		/* udiv gives 0, but the interpreter rejects the packet */
+		bj_cbz(bc, 0, R_X, bc->bc_ret0);
+		/* FALLTHROUGH */
+	case BPF_ALU|BPF_ADD|BPF_X:
+	case BPF_ALU|BPF_SUB|BPF_X:
+	case BPF_ALU|BPF_MUL|BPF_X:
+	case BPF_ALU|BPF_AND|BPF_X:
+	case BPF_ALU|BPF_OR|BPF_X:
+	case BPF_ALU|BPF_LSH|BPF_X:
+	case BPF_ALU|BPF_RSH|BPF_X:
+		bj_alu(bc, BPF_OP(pc->code), R_X);
+		break;
+	case BPF_ALU|BPF_ADD|BPF_K:
+	case BPF_ALU|BPF_SUB|BPF_K:
+	case BPF_ALU|BPF_MUL|BPF_K:
+	case BPF_ALU|BPF_DIV|BPF_K:
+	case BPF_ALU|BPF_AND|BPF_K:
+	case BPF_ALU|BPF_OR|BPF_K:
+	case BPF_ALU|BPF_LSH|BPF_K:
+	case BPF_ALU|BPF_RSH|BPF_K:
+		bj_imm32(bc, R_T0, k);
+		bj_alu(bc, BPF_OP(pc->code), R_T0);
+		break;
+	case BPF_ALU|BPF_NEG:
+		bj_emit(bc, NEG_W(R_A, R_A));
+		break;
+
+	case BPF_MISC|BPF_TAX:
+		bj_emit(bc, MOV_W(R_X, R_A));
+		break;
+	case BPF_MISC|BPF_TXA:
+		bj_emit(bc, MOV_W(R_A, R_X));
+		break;
+
+	default:
+		/* the interpreter rejects anything else at run time */
+		bj_b(bc, bc->bc_ret0);
+		break;
+	}
+}
+
+static void
+bj_pass(struct bpf_jit_ctx *bc, const struct bpf_insn *insns, u_int len)
+{
+	u_int i, k;
+
+	bc->bc_pos = 0;
+
+	bj_emit(bc, STP_X_PRE(R_FP, R_LR, R_SP, -BJ_FRAME));
+	bj_emit(bc, ADDI_X(R_FP, R_SP, 0));
+	bj_emit(bc, STP_X(19, 20, R_SP, 16));
+	bj_emit(bc, STP_X(21, 22, R_SP, 32));
+	bj_emit(bc, STP_X(23, 24, R_SP, 48));
+	bj_emit(bc, STR_X(25, R_SP, 64));
+	bj_emit(bc, MOV_X(R_PKT, 0));
+	bj_emit(bc, MOV_W(R_BUFLEN, 1));
+	bj_emit(bc, MOV_W(R_WIRELEN, 2));
+	bj_emit(bc, MOV_X(R_ARG, 3));
+	bj_emit(bc, MOV_X(R_OPS, 4));
+	bj_emit(bc, MOV_W(R_A, R_ZR));
+	bj_emit(bc, MOV_W(R_X, R_ZR));
+	for (k = 0; k < BPF_MEMWORDS; k += 4)
+		bj_emit(bc, STP_X(R_ZR, R_ZR, R_SP, BJ_MEM(k)));
+
+	for (i = 0; i < len; i++) {
+		bc->bc_off[i] = bc->bc_pos;
+		bj_insn(bc, &insns[i], i);
+	}
+	bc->bc_off[len] = bc->bc_pos;
+
+	/* falling off the end of the program is rejected by bpf_validate */
+	bc->bc_ret0 = bc->bc_pos;
+	bj_emit(bc, MOV_W(R_A, R_ZR));
+	bc->bc_exit = bc->bc_pos;
+	bj_emit(bc, MOV_W(0, R_A));
+	bj_emit(bc, LDP_X(19, 20, R_SP, 16));
+	bj_emit(bc, LDP_X(21, 22, R_SP, 32));
+	bj_emit(bc, LDP_X(23, 24, R_SP, 48));
+	bj_emit(bc, LDR_X(25, R_SP, 64));
+	bj_emit(bc, LDP_X_POST(R_FP, R_LR, R_SP, BJ_FRAME));
+	bj_emit(bc, RET);
+}
+
+int
+bpf_jit_md_compile(const struct bpf_insn *insns, u_int len, u_char *buf,
+    size_t *sizep)
+{
+	struct bpf_jit_ctx bc;
+
+	memset(&bc, 0, sizeof(bc));
+	bc.bc_off = mallocarray(len + 1, sizeof(*bc.bc_off), M_TEMP,
+	    M_WAITOK | M_CANFAIL);
+	if (bc.bc_off == NULL)
+		return (ENOMEM);
+
+	/* size the code and find the instruction offsets and labels */
+	bj_pass(&bc, insns, len);
+
+	if (buf != NULL) {
+		if (bc.bc_pos * sizeof(u_int32_t) > *sizep) {
+			free(bc.bc_off, M_TEMP, (len + 1) * sizeof(*bc.bc_off));
+			return (ENOSPC);
+		}
+		bc.bc_buf = (u_int32_t *)buf;
+		bj_pass(&bc, insns, len);
+	}
+	*sizep = bc.bc_pos * sizeof(u_int32_t);
+
+	free(bc.bc_off, M_TEMP, (len + 1) * sizeof(*bc.bc_off));
+	return (0);
+}
+
+void
+bpf_jit_md_sync(vaddr_t va, vsize_t len)
+{
+	cpu_icache_sync_range(va, len);
+}
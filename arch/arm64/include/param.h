@@ -80,6 +80,7 @@
 
 #define __HAVE_ACPI
 #define __HAVE_FDT
+#define __HAVE_BPF_JIT
 
 #endif /* _KERNEL */
 
@@ -24,6 +24,9 @@
 #include <sys/systm.h>
 #include <sys/malloc.h>
 #include <sys/pool.h>
+#include <sys/task.h>
+#include <sys/percpu.h>
+#include <sys/smr.h>
 
 #include <crypto/cryptodev.h>
 
@@ -32,13 +35,42 @@
  *	A	allocated during driver attach, no hotplug, no detach
  *	I	immutable after creation
  *	K	kernel lock
+ *	S	SMR for readers, kernel lock for writers
  */
 
-struct cryptocap *crypto_drivers;	/* [A] array allocated by driver
+struct cryptocap *crypto_drivers;	/* [S] array allocated by driver
 					   [K] driver data and session count */
-int crypto_drivers_num = 0;		/* [A] attached drivers array size */
+int crypto_drivers_num = 0;		/* [S] attached drivers array size */
 
 struct pool cryptop_pool;		/* [I] set of crypto descriptors */
+struct taskq *crypto_taskq;		/* [I] asynchronous request workers */
+
+enum cryptocounters {
+	crypto_ops,			/* requests passed to drivers */
+	crypto_bytes,			/* bytes passed to drivers */
+	crypto_ncounters
+};
+struct cpumem *crypto_counters;		/* [I] per cpu statistics */
+
+/* an array replaced by crypto_get_driverid(), freed after readers left */
+struct crypto_drivers_old {
+	struct smr_entry	 cdo_smr;
+	struct cryptocap	*cdo_drivers;
+	int			 cdo_num;
+};
+
+/*
+ * Session ids carry the driver id in the upper and the driver's session
+ * in the lower 32 bits.  The top bit records whether the driver was
+ * MP safe when the session was created, so it can be tested without
+ * looking at crypto_drivers.
+ */
+#define CRYPTO_SID_MPSAFE	(1ULL << 63)
+#define CRYPTO_SID2HID(sid)	(((sid) >> 32) & 0x7fffffff)
+
+void	crypto_task(void *);
+int	crypto_mpsafe(u_int64_t);
+void	crypto_drivers_free(void *);
 
 /*
  * Create a new session.
@@ -164,6 +196,8 @@ crypto_newsession(u_int64_t *sid, struct cryptoini *cri, int hard)
 		(*sid) = hid;
 		(*sid) <<= 32;
 		(*sid) |= (lid & 0xffffffff);
+		if (crypto_drivers[hid].cc_flags & CRYPTOCAP_F_MPSAFE)
+			(*sid) |= CRYPTO_SID_MPSAFE;
 		crypto_drivers[hid].cc_sessions++;
 	}
 
@@ -185,7 +219,7 @@ crypto_freesession(u_int64_t sid)
 		return EINVAL;
 
 	/* Determine two IDs. */
-	hid = (sid >> 32) & 0xffffffff;
+	hid = CRYPTO_SID2HID(sid);
 
 	if (hid >= crypto_drivers_num)
 		return ENOENT;
@@ -220,6 +254,7 @@ int32_t
 crypto_get_driverid(u_int8_t flags)
 {
 	struct cryptocap *newdrv;
+	struct crypto_drivers_old *cdo;
 	int i, s;
 
 	/* called from attach routines */
@@ -228,14 +263,16 @@ crypto_get_driverid(u_int8_t flags)
 	s = splvm();
 
 	if (crypto_drivers_num == 0) {
-		crypto_drivers_num = CRYPTO_DRIVERS_INITIAL;
-		crypto_drivers = mallocarray(crypto_drivers_num,
+		newdrv = mallocarray(CRYPTO_DRIVERS_INITIAL,
 		    sizeof(struct cryptocap), M_CRYPTO_DATA, M_NOWAIT | M_ZERO);
-		if (crypto_drivers == NULL) {
-			crypto_drivers_num = 0;
+		if (newdrv == NULL) {
 			splx(s);
 			return -1;
 		}
+		/* crypto_invoke() reads the size before the array */
+		SMR_PTR_SET_LOCKED(&crypto_drivers, newdrv);
+		membar_producer();
+		crypto_drivers_num = CRYPTO_DRIVERS_INITIAL;
 	}
 
 	for (i = 0; i < crypto_drivers_num; i++) {
@@ -255,9 +292,15 @@ crypto_get_driverid(u_int8_t flags)
 		return -1;
 	}
 
+	cdo = malloc(sizeof(*cdo), M_CRYPTO_DATA, M_NOWAIT);
+	if (cdo == NULL) {
+		splx(s);
+		return -1;
+	}
 	newdrv = mallocarray(crypto_drivers_num,
 	    2 * sizeof(struct cryptocap), M_CRYPTO_DATA, M_NOWAIT);
 	if (newdrv == NULL) {
+		free(cdo, M_CRYPTO_DATA, sizeof(*cdo));
 		splx(s);
 		return -1;
 	}
@@ -270,15 +313,30 @@ crypto_get_driverid(u_int8_t flags)
 	newdrv[i].cc_sessions = 1; /* Mark */
 	newdrv[i].cc_flags = flags;
 
-	free(crypto_drivers, M_CRYPTO_DATA,
-	    crypto_drivers_num * sizeof(struct cryptocap));
+	/* crypto_invoke() may still look at the old array without a lock */
+	smr_init(&cdo->cdo_smr);
+	cdo->cdo_drivers = crypto_drivers;
+	cdo->cdo_num = crypto_drivers_num;
 
+	SMR_PTR_SET_LOCKED(&crypto_drivers, newdrv);
+	membar_producer();
 	crypto_drivers_num *= 2;
-	crypto_drivers = newdrv;
 	splx(s);
+
+	smr_call(&cdo->cdo_smr, crypto_drivers_free, cdo);
 	return i;
 }
 
+void
+crypto_drivers_free(void *arg)
+{
+	struct crypto_drivers_old *cdo = arg;
+
+	free(cdo->cdo_drivers, M_CRYPTO_DATA,
+	    cdo->cdo_num * sizeof(struct cryptocap));
+	free(cdo, M_CRYPTO_DATA, sizeof(*cdo));
+}
+
 /*
  * Register a crypto driver. It should be called once for each algorithm
  * supported by the driver.
@@ -376,47 +434,82 @@ crypto_unregister(u_int32_t driverid, int alg)
 	return 0;
 }
 
+/*
+ * Check if the driver owning a session may be called without the kernel lock.
+ */
+int
+crypto_mpsafe(u_int64_t sid)
+{
+	return ISSET(sid, CRYPTO_SID_MPSAFE);
+}
+
 /*
  * Dispatch a crypto request to the appropriate crypto devices.
  */
 int
 crypto_invoke(struct cryptop *crp)
 {
+	struct cryptocap *cpc;
+	int (*process)(struct cryptop *) = NULL;
 	u_int64_t nid;
 	u_int32_t hid;
+	u_int8_t flags = 0;
 	int error;
-	int s, i;
+	int s, i, num;
 
 	/* Sanity checks. */
 	KASSERT(crp != NULL);
 
-	KERNEL_ASSERT_LOCKED();
+	if (!crypto_mpsafe(crp->crp_sid))
+		KERNEL_ASSERT_LOCKED();
 
 	s = splvm();
-	if (crp->crp_ndesc < 1 || crypto_drivers == NULL) {
+	if (crp->crp_ndesc < 1) {
 		error = EINVAL;
 		goto done;
 	}
 
-	hid = (crp->crp_sid >> 32) & 0xffffffff;
-	if (hid >= crypto_drivers_num)
+	/*
+	 * MP safe sessions get here without the kernel lock, a driver
+	 * attaching may replace the array.  Copy what we need under SMR.
+	 */
+	hid = CRYPTO_SID2HID(crp->crp_sid);
+	num = READ_ONCE(crypto_drivers_num);
+	membar_consumer();
+	smr_read_enter();
+	cpc = SMR_PTR_GET(&crypto_drivers);
+	if (cpc != NULL && hid < num) {
+		flags = cpc[hid].cc_flags;
+		process = cpc[hid].cc_process;
+	}
+	smr_read_leave();
+
+	if (cpc == NULL) {
+		error = EINVAL;
+		goto done;
+	}
+	if (hid >= num)
 		goto migrate;
 
-	if (crypto_drivers[hid].cc_flags & CRYPTOCAP_F_CLEANUP) {
+	if (flags & CRYPTOCAP_F_CLEANUP) {
+		KERNEL_LOCK();
 		crypto_freesession(crp->crp_sid);
+		KERNEL_UNLOCK();
 		goto migrate;
 	}
 
-	if (crypto_drivers[hid].cc_process == NULL)
+	if (process == NULL)
 		goto migrate;
 
-	crypto_drivers[hid].cc_operations++;
-	crypto_drivers[hid].cc_bytes += crp->crp_ilen;
+	counters_pkt(crypto_counters, crypto_ops, crypto_bytes,
+	    crp->crp_ilen);
 
-	error = crypto_drivers[hid].cc_process(crp);
+	error = (*process)(crp);
 	if (error == ERESTART) {
 		/* Unregister driver and migrate session. */
+		KERNEL_LOCK();
 		crypto_unregister(hid, CRYPTO_ALGORITHM_MAX + 1);
+		KERNEL_UNLOCK();
 		goto migrate;
 	}
 
@@ -429,8 +522,10 @@ crypto_invoke(struct cryptop *crp)
 		crp->crp_desc[i].CRD_INI.cri_next = &crp->crp_desc[i+1].CRD_INI;
 	crp->crp_desc[crp->crp_ndesc].CRD_INI.cri_next = NULL;
 
+	KERNEL_LOCK();
 	if (crypto_newsession(&nid, &(crp->crp_desc->CRD_INI), 0) == 0)
 		crp->crp_sid = nid;
+	KERNEL_UNLOCK();
 
 	error = EAGAIN;
  done:
@@ -438,6 +533,42 @@ crypto_invoke(struct cryptop *crp)
 	return error;
 }
 
+/*
+ * Queue a crypto request to the worker threads.  The request is processed
+ * on one of them and crp_callback is called from there once it is done,
+ * with crp_etype set to the result.  Requests complete in no particular
+ * order, callers that care have to restore it themselves.
+ */
+void
+crypto_dispatch(struct cryptop *crp)
+{
+	KASSERT(crp->crp_callback != NULL);
+
+	task_set(&crp->crp_task, crypto_task, crp);
+	task_add(crypto_taskq, &crp->crp_task);
+}
+
+void
+crypto_task(void *arg)
+{
+	struct cryptop *crp = arg;
+	int error;
+
+	do {
+		/* Migration may move the session to another driver. */
+		if (crypto_mpsafe(crp->crp_sid))
+			error = crypto_invoke(crp);
+		else {
+			KERNEL_LOCK();
+			error = crypto_invoke(crp);
+			KERNEL_UNLOCK();
+		}
+	} while (error == EAGAIN);
+
+	crp->crp_etype = error;
+	(*crp->crp_callback)(crp);
+}
+
 /*
  * Release a set of crypto descriptors.
  */
@@ -485,4 +616,10 @@ crypto_init(void)
 {
 	pool_init(&cryptop_pool, sizeof(struct cryptop), 0, IPL_VM, 0,
 	    "cryptop", NULL);
+
+	crypto_counters = counters_alloc(crypto_ncounters);
+
+	crypto_taskq = taskq_create("crypto", ncpus, IPL_VM, TASKQ_MPSAFE);
+	if (crypto_taskq == NULL)
+		panic("unable to create crypto taskq");
 }
@@ -167,6 +167,12 @@ struct cryptop {
 	int		 crp_ndescalloc;/* Amount of descriptors allocated */
 
 	caddr_t		crp_mac;
+
+	/* Asynchronous requests, see crypto_dispatch(). */
+	struct task	crp_task;
+	void		(*crp_callback)(struct cryptop *);
+	void		*crp_opaque;	/* Passed through to the callback */
+	int		crp_etype;	/* Error returned by the driver */
 };
 
 #define CRYPTO_BUF_IOV		0x1
@@ -177,9 +183,6 @@ struct cryptop {
 
 /* Crypto capabilities structure */
 struct cryptocap {
-	u_int64_t	cc_operations;	/* Counter of how many ops done */
-	u_int64_t	cc_bytes;	/* Counter of how many bytes done */
-
 	u_int32_t	cc_sessions;	/* How many sessions allocated */
 
 	/* Symmetric/hash algorithms supported */
@@ -205,6 +208,7 @@ int	crypto_register(u_int32_t, int *,
 int	crypto_unregister(u_int32_t, int);
 int32_t	crypto_get_driverid(u_int8_t);
 int	crypto_invoke(struct cryptop *);
+void	crypto_dispatch(struct cryptop *);
 
 void	cuio_copydata(struct uio *, int, int, caddr_t);
 void	cuio_copyback(struct uio *, int, int, const void *);
@@ -86,7 +86,7 @@ int		virtio_mmio_match(struct device *, void *, void *);
 void		virtio_mmio_attach(struct device *, struct device *, void *);
 int		virtio_mmio_detach(struct device *, int);
 
-void		virtio_mmio_kick(struct virtio_softc *, uint16_t);
+void		virtio_mmio_kick(struct virtio_softc *, struct virtqueue *);
 uint8_t		virtio_mmio_read_device_config_1(struct virtio_softc *, int);
 uint16_t	virtio_mmio_read_device_config_2(struct virtio_softc *, int);
 uint32_t	virtio_mmio_read_device_config_4(struct virtio_softc *, int);
@@ -101,6 +101,7 @@ void		virtio_mmio_set_status(struct virtio_softc *, int);
 int		virtio_mmio_negotiate_features(struct virtio_softc *,
     const struct virtio_feature_name *);
 int		virtio_mmio_intr(void *);
+void		virtio_mmio_intr_barrier(struct virtio_softc *);
 
 struct virtio_mmio_softc {
 	struct virtio_softc	sc_sc;
@@ -147,6 +148,7 @@ struct virtio_ops virtio_mmio_ops = {
 	virtio_mmio_set_status,
 	virtio_mmio_negotiate_features,
 	virtio_mmio_intr,
+	virtio_mmio_intr_barrier,
 };
 
 uint16_t
@@ -490,9 +492,18 @@ virtio_mmio_intr(void *arg)
 }
 
 void
-virtio_mmio_kick(struct virtio_softc *vsc, uint16_t idx)
+virtio_mmio_intr_barrier(struct virtio_softc *vsc)
+{
+	struct virtio_mmio_softc *sc = (struct virtio_mmio_softc *)vsc;
+
+	if (sc->sc_ih != NULL)
+		intr_barrier(sc->sc_ih);
+}
+
+void
+virtio_mmio_kick(struct virtio_softc *vsc, struct virtqueue *vq)
 {
 	struct virtio_mmio_softc *sc = (struct virtio_mmio_softc *)vsc;
 	bus_space_write_4(sc->sc_iot, sc->sc_ioh, VIRTIO_MMIO_QUEUE_NOTIFY,
-	    idx);
+	    vq->vq_index);
 }
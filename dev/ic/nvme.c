@@ -16,6 +16,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "kstat.h"
+
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/buf.h>
@@ -27,8 +29,10 @@
 #include <sys/pool.h>
 
 #include <sys/atomic.h>
+#include <sys/kstat.h>
 
 #include <machine/bus.h>
+#include <machine/cpu.h>
 
 #include <scsi/scsi_all.h>
 #include <scsi/scsi_disk.h>
@@ -52,6 +56,10 @@ int	nvme_resume(struct nvme_softc *);
 void	nvme_dumpregs(struct nvme_softc *);
 int	nvme_identify(struct nvme_softc *, u_int);
 void	nvme_fill_identify(struct nvme_softc *, struct nvme_ccb *, void *);
+u_int	nvme_set_nqueues(struct nvme_softc *, u_int);
+void	nvme_fill_nqueues(struct nvme_softc *, struct nvme_ccb *, void *);
+void	nvme_nqueues_done(struct nvme_softc *, struct nvme_ccb *,
+	    struct nvme_cqe *);
 
 int	nvme_ccbs_alloc(struct nvme_softc *, u_int);
 void	nvme_ccbs_free(struct nvme_softc *, u_int);
@@ -78,6 +86,12 @@ void	nvme_q_submit(struct nvme_softc *,
 	    void (*)(struct nvme_softc *, struct nvme_ccb *, void *));
 int	nvme_q_complete(struct nvme_softc *, struct nvme_queue *);
 void	nvme_q_free(struct nvme_softc *, struct nvme_queue *);
+struct nvme_queue *
+	nvme_q_select(struct nvme_softc *);
+
+#if NKSTAT > 0
+void	nvme_q_kstat_attach(struct nvme_softc *, struct nvme_queue *);
+#endif
 
 void	nvme_scsi_cmd(struct scsi_xfer *);
 void	nvme_minphys(struct buf *, struct scsi_link *);
@@ -273,9 +287,10 @@ int
 nvme_attach(struct nvme_softc *sc)
 {
 	struct scsibus_attach_args saa;
+	struct nvme_queue *q;
 	u_int64_t cap;
 	u_int32_t reg;
-	u_int nccbs = 0;
+	u_int nccbs = 0, entries, nq, i;
 
 	mtx_init(&sc->sc_ccb_mtx, IPL_BIO);
 	SIMPLEQ_INIT(&sc->sc_ccb_list);
@@ -284,6 +299,10 @@ nvme_attach(struct nvme_softc *sc)
 		sc->sc_ops = &nvme_ops;
 	if (sc->sc_openings == 0)
 		sc->sc_openings = 64;
+	if (sc->sc_nq == 0)
+		sc->sc_nq = 1;
+	else if (sc->sc_nq > NVME_MAXQ)
+		sc->sc_nq = NVME_MAXQ;
 
 	reg = nvme_read4(sc, NVME_VS);
 	if (reg == 0xffffffff) {
@@ -337,27 +356,79 @@ nvme_attach(struct nvme_softc *sc)
 		goto disable;
 	}
 
+	if (sc->sc_nq > 1) {
+		nq = nvme_set_nqueues(sc, sc->sc_nq);
+		if (nq == 0)
+			nq = 1;
+		if (nq < sc->sc_nq)
+			sc->sc_nq = nq;
+	}
+
 	/* We now know the real values of sc_mdts and sc_max_prpl. */
 	nvme_ccbs_free(sc, nccbs);
-	if (nvme_ccbs_alloc(sc, 64) != 0) {
+
+	/*
+	 * The ccbs are shared by all the io queues, so any one queue has
+	 * to be able to hold all of them if every command is submitted
+	 * from the same cpu.
+	 */
+	nccbs = 64;
+	entries = 128;
+	if (sc->sc_nq > 1) {
+		nccbs = MIN(nccbs * sc->sc_nq, NVME_MAXCCBS);
+		entries = MAX(entries, nccbs + 1);
+		if (entries > NVME_CAP_MQES(cap)) {
+			entries = NVME_CAP_MQES(cap);
+			nccbs = MIN(nccbs, entries - 1);
+		}
+	}
+
+	if (nvme_ccbs_alloc(sc, nccbs) != 0) {
 		printf("%s: unable to allocate ccbs\n", DEVNAME(sc));
 		goto free_admin_q;
 	}
-	nccbs = 64;
 
-	sc->sc_q = nvme_q_alloc(sc, NVME_IO_Q, 128, sc->sc_dstrd);
-	if (sc->sc_q == NULL) {
-		printf("%s: unable to allocate io q\n", DEVNAME(sc));
-		goto disable;
+	sc->sc_q = mallocarray(sc->sc_nq, sizeof(*sc->sc_q), M_DEVBUF,
+	    M_WAITOK | M_ZERO);
+
+	for (i = 0; i < sc->sc_nq; i++) {
+		q = nvme_q_alloc(sc, NVME_IO_Q + i, entries, sc->sc_dstrd);
+		if (q == NULL) {
+			printf("%s: unable to allocate io q %u\n",
+			    DEVNAME(sc), i);
+			goto free_q;
+		}
+		sc->sc_q[i] = q;
+
+		/* the first io queue shares vector 0 with the admin queue */
+		if (i > 0 && sc->sc_intr_establish != NULL) {
+			q->q_vec = i;
+			if (sc->sc_intr_establish(sc, q) != 0) {
+				printf("%s: unable to establish interrupt "
+				    "for io q %u\n", DEVNAME(sc), i);
+				goto free_q;
+			}
+		}
+
+		if (nvme_q_create(sc, q) != 0) {
+			printf("%s: unable to create io q %u\n",
+			    DEVNAME(sc), i);
+			goto free_q;
+		}
+
+#if NKSTAT > 0
+		nvme_q_kstat_attach(sc, q);
+#endif
 	}
 
-	if (nvme_q_create(sc, sc->sc_q) != 0) {
-		printf("%s: unable to create io q\n", DEVNAME(sc));
-		goto free_q;
+	if (sc->sc_nq > 1) {
+		printf("%s: %u io queues, %u ccbs\n", DEVNAME(sc),
+		    sc->sc_nq, nccbs);
 	}
 
 #ifdef HIBERNATE
-	sc->sc_hib_q = nvme_q_alloc(sc, NVME_HIB_Q, 4, sc->sc_dstrd);
+	sc->sc_hib_q = nvme_q_alloc(sc, NVME_IO_Q + sc->sc_nq, 4,
+	    sc->sc_dstrd);
 	if (sc->sc_hib_q == NULL) {
 		printf("%s: unable to allocate hibernate io queue\n", DEVNAME(sc));
 		goto free_q;
@@ -384,7 +455,17 @@ nvme_attach(struct nvme_softc *sc)
 	return (0);
 
 free_q:
-	nvme_q_free(sc, sc->sc_q);
+	for (i = 0; i < sc->sc_nq; i++) {
+		q = sc->sc_q[i];
+		if (q == NULL)
+			continue;
+
+		if (q->q_ih != NULL)
+			sc->sc_intr_disestablish(sc, q);
+		nvme_q_free(sc, q);
+	}
+	free(sc->sc_q, M_DEVBUF, sc->sc_nq * sizeof(*sc->sc_q));
+	sc->sc_q = NULL;
 disable:
 	nvme_disable(sc);
 free_ccbs:
@@ -398,6 +479,9 @@ free_admin_q:
 int
 nvme_resume(struct nvme_softc *sc)
 {
+	struct nvme_queue *q;
+	u_int i;
+
 	if (nvme_disable(sc) != 0) {
 		printf("%s: unable to disable controller\n", DEVNAME(sc));
 		return (1);
@@ -413,23 +497,26 @@ nvme_resume(struct nvme_softc *sc)
 		return (1);
 	}
 
-	sc->sc_q = nvme_q_alloc(sc, NVME_IO_Q, 128, sc->sc_dstrd);
-	if (sc->sc_q == NULL) {
-		printf("%s: unable to allocate io q\n", DEVNAME(sc));
+	if (sc->sc_nq > 1 && nvme_set_nqueues(sc, sc->sc_nq) < sc->sc_nq) {
+		printf("%s: unable to allocate io queues\n", DEVNAME(sc));
 		goto disable;
 	}
 
-	if (nvme_q_create(sc, sc->sc_q) != 0) {
-		printf("%s: unable to create io q\n", DEVNAME(sc));
-		goto free_q;
+	for (i = 0; i < sc->sc_nq; i++) {
+		q = sc->sc_q[i];
+
+		nvme_q_reset(sc, q);
+		if (nvme_q_create(sc, q) != 0) {
+			printf("%s: unable to create io q %u\n",
+			    DEVNAME(sc), i);
+			goto disable;
+		}
 	}
 
 	nvme_write4(sc, NVME_INTMC, 1);
 
 	return (0);
 
-free_q:
-	nvme_q_free(sc, sc->sc_q);
 disable:
 	nvme_disable(sc);
 
@@ -494,9 +581,12 @@ nvme_shutdown(struct nvme_softc *sc)
 
 	nvme_write4(sc, NVME_INTMC, 0);
 
-	if (nvme_q_delete(sc, sc->sc_q) != 0) {
-		printf("%s: unable to delete q, disabling\n", DEVNAME(sc));
-		goto disable;
+	for (i = 0; i < sc->sc_nq; i++) {
+		if (nvme_q_delete(sc, sc->sc_q[i]) != 0) {
+			printf("%s: unable to delete q, disabling\n",
+			    DEVNAME(sc));
+			goto disable;
+		}
 	}
 
 	cc = nvme_read4(sc, NVME_CC);
@@ -636,11 +726,11 @@ nvme_scsi_io(struct scsi_xfer *xs, int dir)
 	}
 
 	if (ISSET(xs->flags, SCSI_POLL)) {
-		nvme_poll(sc, sc->sc_q, ccb, nvme_scsi_io_fill);
+		nvme_poll(sc, nvme_q_select(sc), ccb, nvme_scsi_io_fill);
 		return;
 	}
 
-	nvme_q_submit(sc, sc->sc_q, ccb, nvme_scsi_io_fill);
+	nvme_q_submit(sc, nvme_q_select(sc), ccb, nvme_scsi_io_fill);
 	return;
 
 stuffup:
@@ -723,11 +813,11 @@ nvme_scsi_sync(struct scsi_xfer *xs)
 	ccb->ccb_cookie = xs;
 
 	if (ISSET(xs->flags, SCSI_POLL)) {
-		nvme_poll(sc, sc->sc_q, ccb, nvme_scsi_sync_fill);
+		nvme_poll(sc, nvme_q_select(sc), ccb, nvme_scsi_sync_fill);
 		return;
 	}
 
-	nvme_q_submit(sc, sc->sc_q, ccb, nvme_scsi_sync_fill);
+	nvme_q_submit(sc, nvme_q_select(sc), ccb, nvme_scsi_sync_fill);
 }
 
 void
@@ -940,9 +1030,21 @@ nvme_q_submit(struct nvme_softc *sc, struct nvme_queue *q, struct nvme_ccb *ccb,
 	bus_dmamap_sync(sc->sc_dmat, NVME_DMA_MAP(q->q_sq_dmamem),
 	    sizeof(*sqe) * tail, sizeof(*sqe), BUS_DMASYNC_PREWRITE);
 
+	q->q_submits++;
 	sc->sc_ops->op_sq_leave(sc, q, ccb);
 }
 
+/*
+ * Pick the io queue for the current cpu. The bus glue binds the queue
+ * interrupts to cpus in the same order, so completions are usually
+ * handled where the command was submitted.
+ */
+struct nvme_queue *
+nvme_q_select(struct nvme_softc *sc)
+{
+	return (sc->sc_q[cpu_number() % sc->sc_nq]);
+}
+
 struct nvme_poll_state {
 	struct nvme_sqe s;
 	struct nvme_cqe c;
@@ -1049,6 +1151,7 @@ nvme_q_complete(struct nvme_softc *sc, struct nvme_queue *q)
 		ccb = &sc->sc_ccbs[cqe->cid];
 		sc->sc_ops->op_cq_done(sc, q, ccb);
 		ccb->ccb_done(sc, ccb, cqe);
+		q->q_completes++;
 
 		if (++head >= q->q_entries) {
 			head = 0;
@@ -1150,6 +1253,7 @@ nvme_q_create(struct nvme_softc *sc, struct nvme_queue *q)
 	htolem64(&sqe.prp1, NVME_DMA_DVA(q->q_cq_dmamem));
 	htolem16(&sqe.qsize, q->q_entries - 1);
 	htolem16(&sqe.qid, q->q_id);
+	htolem16(&sqe.cqid, q->q_vec);
 	sqe.qflags = NVM_SQE_CQ_IEN | NVM_SQE_Q_PC;
 
 	rv = nvme_poll(sc, sc->sc_admin_q, ccb, nvme_sqe_fill);
@@ -1208,8 +1312,6 @@ nvme_q_delete(struct nvme_softc *sc, struct nvme_queue *q)
 	if (rv != 0)
 		goto fail;
 
-	nvme_q_free(sc, q);
-
 fail:
 	scsi_io_put(&sc->sc_iopool, ccb);
 	return (rv);
@@ -1227,6 +1329,66 @@ nvme_fill_identify(struct nvme_softc *sc, struct nvme_ccb *ccb, void *slot)
 	htolem32(&sqe->cdw10, 1);
 }
 
+/*
+ * Ask the controller for nq io queue pairs, plus one for hibernate.
+ * Returns the number of io queue pairs available, or 0 on failure.
+ */
+u_int
+nvme_set_nqueues(struct nvme_softc *sc, u_int nq)
+{
+	struct nvme_ccb *ccb;
+	u_int32_t n;
+	int rv;
+
+	n = nq;
+#ifdef HIBERNATE
+	n++;
+#endif
+
+	ccb = scsi_io_get(&sc->sc_iopool, 0);
+	KASSERT(ccb != NULL);
+
+	ccb->ccb_done = nvme_nqueues_done;
+	ccb->ccb_cookie = &n;
+
+	rv = nvme_poll(sc, sc->sc_admin_q, ccb, nvme_fill_nqueues);
+
+	scsi_io_put(&sc->sc_iopool, ccb);
+
+	if (rv != 0)
+		return (0);
+
+#ifdef HIBERNATE
+	if (n < 2)
+		return (0);
+	n--;
+#endif
+
+	return (MIN(n, nq));
+}
+
+void
+nvme_fill_nqueues(struct nvme_softc *sc, struct nvme_ccb *ccb, void *slot)
+{
+	struct nvme_sqe *sqe = slot;
+	u_int32_t *n = ccb->ccb_cookie;
+
+	sqe->opcode = NVM_ADMIN_SET_FEATURES;
+	htolem32(&sqe->cdw10, NVM_FEAT_NUMBER_OF_QUEUES);
+	htolem32(&sqe->cdw11, NVM_FEAT_NQ_NSQR(*n) | NVM_FEAT_NQ_NCQR(*n));
+}
+
+void
+nvme_nqueues_done(struct nvme_softc *sc, struct nvme_ccb *ccb,
+    struct nvme_cqe *cqe)
+{
+	u_int32_t *n = ccb->ccb_cookie;
+	u_int32_t r;
+
+	r = lemtoh32(&cqe->cdw0);
+	*n = MIN(NVM_FEAT_NQ_NSQA(r), NVM_FEAT_NQ_NCQA(r));
+}
+
 int
 nvme_ccbs_alloc(struct nvme_softc *sc, u_int nccbs)
 {
@@ -1341,12 +1503,21 @@ nvme_q_alloc(struct nvme_softc *sc, u_int16_t id, u_int entries, u_int dstrd)
 	q->q_sqtdbl = NVME_SQTDBL(id, dstrd);
 	q->q_cqhdbl = NVME_CQHDBL(id, dstrd);
 
+	q->q_sc = sc;
 	q->q_id = id;
 	q->q_entries = entries;
 	q->q_sq_tail = 0;
 	q->q_cq_head = 0;
 	q->q_cq_phase = NVME_CQE_PHASE;
 
+	q->q_vec = 0;
+	q->q_ih = NULL;
+	snprintf(q->q_name, sizeof(q->q_name), "%s:%u", DEVNAME(sc), id);
+
+	q->q_submits = 0;
+	q->q_completes = 0;
+	q->q_kstat = NULL;
+
 	if (sc->sc_ops->op_q_alloc != NULL) {
 		if (sc->sc_ops->op_q_alloc(sc, q) != 0)
 			goto free_cq;
@@ -1386,6 +1557,11 @@ nvme_q_reset(struct nvme_softc *sc, struct nvme_queue *q)
 void
 nvme_q_free(struct nvme_softc *sc, struct nvme_queue *q)
 {
+#if NKSTAT > 0
+	if (q->q_kstat != NULL)
+		kstat_destroy(q->q_kstat);
+#endif
+
 	nvme_dmamem_sync(sc, q->q_cq_dmamem, BUS_DMASYNC_POSTREAD);
 	nvme_dmamem_sync(sc, q->q_sq_dmamem, BUS_DMASYNC_POSTWRITE);
 
@@ -1401,16 +1577,36 @@ int
 nvme_intr(void *xsc)
 {
 	struct nvme_softc *sc = xsc;
+	struct nvme_queue *q;
+	u_int i;
 	int rv = 0;
 
-	if (nvme_q_complete(sc, sc->sc_q))
-		rv = 1;
+	if (sc->sc_q != NULL) {
+		for (i = 0; i < sc->sc_nq; i++) {
+			q = sc->sc_q[i];
+
+			/* skip queues with their own interrupt vector */
+			if (q == NULL || q->q_ih != NULL)
+				continue;
+
+			if (nvme_q_complete(sc, q))
+				rv = 1;
+		}
+	}
 	if (nvme_q_complete(sc, sc->sc_admin_q))
 		rv = 1;
 
 	return (rv);
 }
 
+int
+nvme_intr_q(void *xq)
+{
+	struct nvme_queue *q = xq;
+
+	return (nvme_q_complete(q->q_sc, q));
+}
+
 int
 nvme_intr_intx(void *xsc)
 {
@@ -1467,6 +1663,59 @@ ndmfree:
 	return (NULL);
 }
 
+#if NKSTAT > 0
+struct nvme_q_kstat_data {
+	struct kstat_kv		kd_submits;
+	struct kstat_kv		kd_completes;
+	struct kstat_kv		kd_entries;
+	struct kstat_kv		kd_vec;
+};
+
+static const struct nvme_q_kstat_data nvme_q_kstat_tpl = {
+	KSTAT_KV_UNIT_INITIALIZER("submits",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_NONE),
+	KSTAT_KV_UNIT_INITIALIZER("completes",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_NONE),
+	KSTAT_KV_UNIT_INITIALIZER("entries",
+	    KSTAT_KV_T_UINT32, KSTAT_KV_U_NONE),
+	KSTAT_KV_INITIALIZER("vector", KSTAT_KV_T_UINT32),
+};
+
+int
+nvme_q_kstat_copy(struct kstat *ks, void *dst)
+{
+	struct nvme_queue *q = ks->ks_softc;
+	struct nvme_q_kstat_data *kd = dst;
+
+	*kd = nvme_q_kstat_tpl;
+	kstat_kv_u64(&kd->kd_submits) = q->q_submits;
+	kstat_kv_u64(&kd->kd_completes) = q->q_completes;
+	kstat_kv_u32(&kd->kd_entries) = q->q_entries;
+	kstat_kv_u32(&kd->kd_vec) = q->q_vec;
+
+	return (0);
+}
+
+void
+nvme_q_kstat_attach(struct nvme_softc *sc, struct nvme_queue *q)
+{
+	struct kstat *ks;
+
+	ks = kstat_create(DEVNAME(sc), 0, "nvme-queue", q->q_id,
+	    KSTAT_T_KV, 0);
+	if (ks == NULL)
+		return;
+
+	kstat_set_mutex(ks, &q->q_sq_mtx);
+	ks->ks_softc = q;
+	ks->ks_datalen = sizeof(nvme_q_kstat_tpl);
+	ks->ks_copy = nvme_q_kstat_copy;
+	kstat_install(ks);
+
+	q->q_kstat = ks;
+}
+#endif
+
 void
 nvme_dmamem_sync(struct nvme_softc *sc, struct nvme_dmamem *mem, int ops)
 {
@@ -1653,9 +1902,8 @@ nvme_hibernate_io(dev_t dev, daddr_t blkno, vaddr_t addr, size_t size,
 	isqe->nlb = (size / DEV_BSIZE) - 1;
 	isqe->cid = blkno % 0xffff;
 
-	nvme_write4(my->sc, NVME_SQTDBL(NVME_HIB_Q, my->sc->sc_dstrd),
-	    my->sq_tail);
-	nvme_barrier(my->sc, NVME_SQTDBL(NVME_HIB_Q, my->sc->sc_dstrd), 4,
+	nvme_write4(my->sc, my->sc->sc_hib_q->q_sqtdbl, my->sq_tail);
+	nvme_barrier(my->sc, my->sc->sc_hib_q->q_sqtdbl, 4,
 	    BUS_SPACE_BARRIER_WRITE);
 
 	error = 0;
@@ -1687,9 +1935,8 @@ nvme_hibernate_io(dev_t dev, daddr_t blkno, vaddr_t addr, size_t size,
 		my->cqe_phase ^= NVME_CQE_PHASE;
 	}
 
-	nvme_write4(my->sc, NVME_CQHDBL(NVME_HIB_Q, my->sc->sc_dstrd),
-	    my->cq_head);
-	nvme_barrier(my->sc, NVME_CQHDBL(NVME_HIB_Q, my->sc->sc_dstrd), 4,
+	nvme_write4(my->sc, my->sc->sc_hib_q->q_cqhdbl, my->cq_head);
+	nvme_barrier(my->sc, my->sc->sc_hib_q->q_cqhdbl, 4,
 	    BUS_SPACE_BARRIER_WRITE);
 
 	return (error);
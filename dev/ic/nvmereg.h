@@ -154,7 +154,7 @@ struct nvme_sqe_q {
 #define NVM_SQE_CQ_IEN		(1 << 1)
 #define NVM_SQE_Q_PC		(1 << 0)
 	u_int8_t	_reserved3;
-	u_int16_t	cqid; /* XXX interrupt vector for cq */
+	u_int16_t	cqid; /* interrupt vector for cq */
 
 	u_int8_t	_reserved4[16];
 } __packed __aligned(8);
@@ -248,6 +248,12 @@ struct nvme_cqe {
 #define NVM_ADMIN_FW_ACTIVATE	0x10 /* Firmware Activate */
 #define NVM_ADMIN_FW_DOWNLOAD	0x11 /* Firmware Image Download */
 
+#define NVM_FEAT_NUMBER_OF_QUEUES	0x07
+#define  NVM_FEAT_NQ_NSQR(_n)		(((_n) - 1) & 0xffff)
+#define  NVM_FEAT_NQ_NCQR(_n)		((((_n) - 1) & 0xffff) << 16)
+#define  NVM_FEAT_NQ_NSQA(_r)		(((_r) & 0xffff) + 1)
+#define  NVM_FEAT_NQ_NCQA(_r)		((((_r) >> 16) & 0xffff) + 1)
+
 #define NVM_CMD_FLUSH		0x00 /* Flush */
 #define NVM_CMD_WRITE		0x01 /* Write */
 #define NVM_CMD_READ		0x02 /* Read */
@@ -17,8 +17,9 @@
  */
 
 #define NVME_IO_Q	1
-#define NVME_HIB_Q	2
 #define NVME_MAXPHYS	(128 * 1024)
+#define NVME_MAXQ	64	/* max number of io queue pairs */
+#define NVME_MAXCCBS	1024
 
 struct nvme_dmamem {
 	bus_dmamap_t		ndm_map;
@@ -52,6 +53,7 @@ struct nvme_ccb {
 SIMPLEQ_HEAD(nvme_ccb_list, nvme_ccb);
 
 struct nvme_queue {
+	struct nvme_softc	*q_sc;
 	struct mutex		q_sq_mtx;
 	struct mutex		q_cq_mtx;
 	struct nvme_dmamem	*q_sq_dmamem;
@@ -64,6 +66,14 @@ struct nvme_queue {
 	u_int32_t		q_sq_tail;
 	u_int32_t		q_cq_head;
 	u_int16_t		q_cq_phase;
+
+	u_int16_t		q_vec;	/* interrupt vector for the cq */
+	void			*q_ih;	/* set if q_vec is not shared */
+	char			q_name[16];
+
+	u_int64_t		q_submits;
+	u_int64_t		q_completes;
+	struct kstat		*q_kstat;
 };
 
 struct nvme_namespace {
@@ -117,9 +127,19 @@ struct nvme_softc {
 	struct nvme_namespace	*sc_namespaces;
 
 	struct nvme_queue	*sc_admin_q;
-	struct nvme_queue	*sc_q;
+	struct nvme_queue	**sc_q;
+	u_int			sc_nq;
 	struct nvme_queue	*sc_hib_q;
 
+	/*
+	 * Set by the bus glue if each io queue can have its own interrupt
+	 * vector. Vector 0 is always shared with the admin queue.
+	 */
+	int			(*sc_intr_establish)(struct nvme_softc *,
+				    struct nvme_queue *);
+	void			(*sc_intr_disestablish)(struct nvme_softc *,
+				    struct nvme_queue *);
+
 	struct mutex		sc_ccb_mtx;
 	struct nvme_ccb		*sc_ccbs;
 	struct nvme_ccb_list	sc_ccb_list;
@@ -133,6 +153,7 @@ int	nvme_attach(struct nvme_softc *);
 int	nvme_activate(struct nvme_softc *, int);
 int	nvme_intr(void *);
 int	nvme_intr_intx(void *);
+int	nvme_intr_q(void *);
 
 #define nvme_read4(_s, _r) \
 	bus_space_read_4((_s)->sc_iot, (_s)->sc_ioh, (_r))
@@ -1977,6 +1977,7 @@ em_setup_interface(struct em_softc *sc)
 	if (sc->hw.mac_type >= em_82575 && sc->hw.mac_type <= em_i210) {
 		ifp->if_capabilities |= IFCAP_CSUM_IPv4;
 		ifp->if_capabilities |= IFCAP_CSUM_TCPv6 | IFCAP_CSUM_UDPv6;
+		ifp->if_capabilities |= IFCAP_TSOv4 | IFCAP_TSOv6;
 	}
 
 	/* 
@@ -2220,7 +2221,7 @@ em_setup_transmit_structures(struct em_softc *sc)
 
 		for (i = 0; i < sc->sc_tx_slots; i++) {
 			pkt = &que->tx.sc_tx_pkts_ring[i];
-			error = bus_dmamap_create(sc->sc_dmat, MAX_JUMBO_FRAME_SIZE,
+			error = bus_dmamap_create(sc->sc_dmat, EM_TSO_SIZE,
 			    EM_MAX_SCATTER / (sc->pcix_82544 ? 2 : 1),
 			    MAX_JUMBO_FRAME_SIZE, 0, BUS_DMA_NOWAIT, &pkt->pkt_map);
 			if (error != 0) {
@@ -2402,6 +2403,7 @@ em_tx_ctx_setup(struct em_queue *que, struct mbuf *mp, u_int head,
 	struct ether_header *eh = mtod(mp, struct ether_header *);
 	struct mbuf *m;
 	uint32_t vlan_macip_lens = 0, type_tucmd_mlhl = 0, mss_l4len_idx = 0;
+	uint32_t paylen = mp->m_pkthdr.len;
 	int off = 0, hoff;
 	uint8_t ipproto, iphlen;
 
@@ -2460,7 +2462,6 @@ em_tx_ctx_setup(struct em_queue *que, struct mbuf *mp, u_int head,
 
 	*cmd_type_len |= E1000_ADVTXD_DTYP_DATA | E1000_ADVTXD_DCMD_IFCS;
 	*cmd_type_len |= E1000_ADVTXD_DCMD_DEXT;
-	*olinfo_status |= mp->m_pkthdr.len << E1000_ADVTXD_PAYLEN_SHIFT;
 	vlan_macip_lens |= iphlen;
 	type_tucmd_mlhl |= E1000_ADVTXD_DCMD_DEXT | E1000_ADVTXD_DTYP_CTXT;
 
@@ -2471,6 +2472,22 @@ em_tx_ctx_setup(struct em_queue *que, struct mbuf *mp, u_int head,
 			*olinfo_status |= E1000_TXD_POPTS_TXSM << 8;
 			off = 1;
 		}
+		if (ISSET(mp->m_pkthdr.csum_flags, M_TCP_TSO)) {
+			struct tcphdr th;
+			uint32_t thlen;
+
+			/* the TCP header may be split across mbufs */
+			m_copydata(mp, sizeof(*eh) + iphlen, sizeof(th), &th);
+			thlen = th.th_off << 2;
+
+			mss_l4len_idx |= mp->m_pkthdr.ph_mss <<
+			    E1000_ADVTXD_MSS_SHIFT;
+			mss_l4len_idx |= thlen << E1000_ADVTXD_L4LEN_SHIFT;
+			*cmd_type_len |= E1000_ADVTXD_DCMD_TSE;
+			/* the hardware needs the TCP payload length for TSO */
+			paylen -= sizeof(*eh) + iphlen + thlen;
+			off = 1;
+		}
 		break;
 	case IPPROTO_UDP:
 		type_tucmd_mlhl |= E1000_ADVTXD_TUCMD_L4T_UDP;
@@ -2481,6 +2498,8 @@ em_tx_ctx_setup(struct em_queue *que, struct mbuf *mp, u_int head,
 		break;
 	}
 
+	*olinfo_status |= paylen << E1000_ADVTXD_PAYLEN_SHIFT;
+
 	if (!off)
 		return (0);
 
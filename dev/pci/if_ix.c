@@ -149,6 +149,7 @@ void	ixgbe_disable_intr(struct ix_softc *);
 int	ixgbe_txeof(struct tx_ring *);
 int	ixgbe_rxeof(struct rx_ring *);
 void	ixgbe_rx_checksum(uint32_t, struct mbuf *);
+void	ixgbe_rx_rsc(struct mbuf *);
 void	ixgbe_iff(struct ix_softc *);
 void	ixgbe_map_queue_statistics(struct ix_softc *);
 void	ixgbe_update_link_status(struct ix_softc *);
@@ -1925,8 +1926,9 @@ ixgbe_setup_interface(struct ix_softc *sc)
 	ifp->if_capabilities |= IFCAP_CSUM_TCPv6 | IFCAP_CSUM_UDPv6;
 	ifp->if_capabilities |= IFCAP_CSUM_IPv4;
 
+	ifp->if_capabilities |= IFCAP_TSOv4 | IFCAP_TSOv6;
 	if (sc->hw.mac.type != ixgbe_mac_82598EB)
-		ifp->if_capabilities |= IFCAP_TSO;
+		ifp->if_capabilities |= IFCAP_LRO;
 
 	/*
 	 * Specify the media types supported by this sc and register
@@ -2475,7 +2477,8 @@ ixgbe_free_transmit_buffers(struct tx_ring *txr)
 
 static inline int
 ixgbe_csum_offload(struct mbuf *mp, uint32_t *vlan_macip_lens,
-    uint32_t *type_tucmd_mlhl, uint32_t *olinfo_status)
+    uint32_t *type_tucmd_mlhl, uint32_t *olinfo_status, uint32_t *cmd_type_len,
+    uint32_t *mss_l4len_idx, uint32_t *paylen)
 {
 	struct ether_header *eh = mtod(mp, struct ether_header *);
 	struct mbuf *m;
@@ -2545,6 +2548,27 @@ ixgbe_csum_offload(struct mbuf *mp, uint32_t *vlan_macip_lens,
 		break;
 	}
 
+	if (ISSET(mp->m_pkthdr.csum_flags, M_TCP_TSO)) {
+		struct tcphdr *th;
+		uint32_t thlen;
+
+		if (ipproto != IPPROTO_TCP || mp->m_pkthdr.ph_mss == 0)
+			return (-1);
+
+		m = m_getptr(mp, sizeof(*eh) + iphlen, &hoff);
+		if (m == NULL || m->m_len - hoff < sizeof(*th))
+			return (-1);
+		th = (struct tcphdr *)(mtod(m, caddr_t) + hoff);
+		thlen = th->th_off << 2;
+
+		*mss_l4len_idx |= mp->m_pkthdr.ph_mss << IXGBE_ADVTXD_MSS_SHIFT;
+		*mss_l4len_idx |= thlen << IXGBE_ADVTXD_L4LEN_SHIFT;
+		*cmd_type_len |= IXGBE_ADVTXD_DCMD_TSE;
+		/* the hardware needs the TCP payload length for TSO */
+		*paylen -= sizeof(*eh) + iphlen + thlen;
+		offload = 1;
+	}
+
 	return offload;
 }
 
@@ -2554,12 +2578,10 @@ ixgbe_tx_ctx_setup(struct tx_ring *txr, struct mbuf *mp,
 {
 	struct ixgbe_adv_tx_context_desc *TXD;
 	struct ixgbe_tx_buf *tx_buffer;
-	uint32_t vlan_macip_lens = 0, type_tucmd_mlhl = 0;
+	uint32_t vlan_macip_lens = 0, type_tucmd_mlhl = 0, mss_l4len_idx = 0;
 	int	ctxd = txr->next_avail_desc;
-	int	offload = 0;
-
-	/* Indicate the whole packet as payload when not doing TSO */
-	*olinfo_status |= mp->m_pkthdr.len << IXGBE_ADVTXD_PAYLEN_SHIFT;
+	uint32_t paylen = mp->m_pkthdr.len;
+	int	offload = 0, csum;
 
 #if NVLAN > 0
 	if (ISSET(mp->m_flags, M_VLANTAG)) {
@@ -2570,8 +2592,14 @@ ixgbe_tx_ctx_setup(struct tx_ring *txr, struct mbuf *mp,
 	}
 #endif
 
-	offload |= ixgbe_csum_offload(mp, &vlan_macip_lens, &type_tucmd_mlhl,
-	    olinfo_status);
+	csum = ixgbe_csum_offload(mp, &vlan_macip_lens, &type_tucmd_mlhl,
+	    olinfo_status, cmd_type_len, &mss_l4len_idx, &paylen);
+	if (csum == -1)
+		return (-1);
+	offload |= csum;
+
+	/* Indicate the whole packet as payload when not doing TSO */
+	*olinfo_status |= paylen << IXGBE_ADVTXD_PAYLEN_SHIFT;
 
 	if (!offload)
 		return (0);
@@ -2585,7 +2613,7 @@ ixgbe_tx_ctx_setup(struct tx_ring *txr, struct mbuf *mp,
 	TXD->vlan_macip_lens = htole32(vlan_macip_lens);
 	TXD->type_tucmd_mlhl = htole32(type_tucmd_mlhl);
 	TXD->seqnum_seed = htole32(0);
-	TXD->mss_l4len_idx = htole32(0);
+	TXD->mss_l4len_idx = htole32(mss_l4len_idx);
 
 	tx_buffer->m_head = NULL;
 	tx_buffer->eop_index = -1;
@@ -2899,7 +2927,7 @@ ixgbe_initialize_receive_units(struct ix_softc *sc)
 	hlreg |= IXGBE_HLREG0_JUMBOEN;
 	IXGBE_WRITE_REG(hw, IXGBE_HLREG0, hlreg);
 
-	if (ISSET(ifp->if_xflags, IFXF_TSO)) {
+	if (ISSET(ifp->if_xflags, IFXF_LRO)) {
 		rdrxctl = IXGBE_READ_REG(hw, IXGBE_RDRXCTL);
 
 		/* This field has to be set to zero. */
@@ -2928,7 +2956,7 @@ ixgbe_initialize_receive_units(struct ix_softc *sc)
 		srrctl = bufsz | IXGBE_SRRCTL_DESCTYPE_ADV_ONEBUF;
 		IXGBE_WRITE_REG(hw, IXGBE_SRRCTL(i), srrctl);
 
-		if (ISSET(ifp->if_xflags, IFXF_TSO)) {
+		if (ISSET(ifp->if_xflags, IFXF_LRO)) {
 			rdrxctl = IXGBE_READ_REG(&sc->hw, IXGBE_RSCCTL(i));
 
 			/* Enable TSO Receive Side Coalescing */
@@ -3215,6 +3243,9 @@ ixgbe_rxeof(struct rx_ring *rxr)
 #endif
 		}
 
+		/* ph_mss counts the segments merged by RSC until EOP */
+		sendmp->m_pkthdr.ph_mss += rsccnt;
+
 		/* Pass the head pointer on */
 		if (eop == 0) {
 			nxbuf->fmp = sendmp;
@@ -3222,6 +3253,7 @@ ixgbe_rxeof(struct rx_ring *rxr)
 			mp->m_next = nxbuf->buf;
 		} else { /* Sending this frame? */
 			ixgbe_rx_checksum(staterr, sendmp);
+			ixgbe_rx_rsc(sendmp);
 
 			if (hashtype != IXGBE_RXDADV_RSSTYPE_NONE) {
 				sendmp->m_pkthdr.ph_flowid = hash;
@@ -3278,6 +3310,71 @@ ixgbe_rx_checksum(uint32_t staterr, struct mbuf * mp)
 	}
 }
 
+/*
+ * A frame coalesced by RSC carries the payload of several TCP
+ * segments.  Mark it so it gets segmented again if it is forwarded.
+ */
+void
+ixgbe_rx_rsc(struct mbuf *m)
+{
+	struct ether_vlan_header *evh;
+	struct tcphdr *th;
+	u_int nsegs, hlen = ETHER_HDR_LEN;
+	uint16_t etype;
+
+	nsegs = m->m_pkthdr.ph_mss;
+	m->m_pkthdr.ph_mss = 0;
+	if (nsegs < 2 || m->m_len < sizeof(*evh))
+		return;
+
+	evh = mtod(m, struct ether_vlan_header *);
+	etype = evh->evl_encap_proto;
+	if (etype == htons(ETHERTYPE_VLAN)) {
+		hlen += ETHER_VLAN_ENCAP_LEN;
+		etype = evh->evl_proto;
+	}
+
+	switch (ntohs(etype)) {
+	case ETHERTYPE_IP: {
+		struct ip *ip;
+
+		if (m->m_len < hlen + sizeof(*ip))
+			return;
+		ip = (struct ip *)(mtod(m, caddr_t) + hlen);
+		if (ip->ip_p != IPPROTO_TCP)
+			return;
+		hlen += ip->ip_hl << 2;
+		break;
+	}
+#ifdef INET6
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr *ip6;
+
+		if (m->m_len < hlen + sizeof(*ip6))
+			return;
+		ip6 = (struct ip6_hdr *)(mtod(m, caddr_t) + hlen);
+		if (ip6->ip6_nxt != IPPROTO_TCP)
+			return;
+		hlen += sizeof(*ip6);
+		break;
+	}
+#endif
+	default:
+		return;
+	}
+
+	if (m->m_len < hlen + sizeof(*th))
+		return;
+	th = (struct tcphdr *)(mtod(m, caddr_t) + hlen);
+	hlen += th->th_off << 2;
+	if (m->m_pkthdr.len <= hlen ||
+	    !ISSET(m->m_pkthdr.csum_flags, M_TCP_CSUM_IN_OK))
+		return;
+
+	m->m_pkthdr.ph_mss = howmany(m->m_pkthdr.len - hlen, nsegs);
+	SET(m->m_pkthdr.csum_flags, M_TCP_TSO | M_TCP_CSUM_OUT);
+}
+
 void
 ixgbe_setup_vlan_hw_support(struct ix_softc *sc)
 {
@@ -3289,7 +3386,7 @@ ixgbe_setup_vlan_hw_support(struct ix_softc *sc)
 	 * We have to disable VLAN striping when using TCP offloading, due to a
 	 * firmware bug.
 	 */
-	if (ISSET(ifp->if_xflags, IFXF_TSO)) {
+	if (ISSET(ifp->if_xflags, IFXF_LRO)) {
 		sc->vlan_stripping = 0;
 		return;
 	}
@@ -833,7 +833,7 @@ oce_attach_ifp(struct oce_softc *sc)
 #endif
 
 #ifdef OCE_TSO
-	ifp->if_capabilities |= IFCAP_TSO;
+	ifp->if_capabilities |= IFCAP_TSOv4;
 	ifp->if_capabilities |= IFCAP_VLAN_HWTSO;
 #endif
 #ifdef OCE_LRO
@@ -26,6 +26,7 @@
 #include <sys/queue.h>
 #include <sys/mutex.h>
 #include <sys/pool.h>
+#include <sys/intrmap.h>
 
 #include <machine/bus.h>
 
@@ -45,6 +46,11 @@
 struct nvme_pci_softc {
 	struct nvme_softc	psc_nvme;
 	pci_chipset_tag_t	psc_pc;
+
+	struct intrmap		*psc_intrmap;
+	pci_intr_handle_t	*psc_ihs;
+	u_int			psc_nihs;	/* vectors mapped */
+	u_int			psc_nihs_alloc;	/* size of psc_ihs */
 };
 
 int	nvme_pci_match(struct device *, void *, void *);
@@ -52,6 +58,10 @@ void	nvme_pci_attach(struct device *, struct device *, void *);
 int	nvme_pci_detach(struct device *, int);
 int	nvme_pci_activate(struct device *, int);
 
+void	nvme_pci_intr_free(struct nvme_pci_softc *);
+int	nvme_pci_intr_establish(struct nvme_softc *, struct nvme_queue *);
+void	nvme_pci_intr_disestablish(struct nvme_softc *, struct nvme_queue *);
+
 const struct cfattach nvme_pci_ca = {
 	sizeof(struct nvme_pci_softc),
 	nvme_pci_match,
@@ -90,7 +100,9 @@ nvme_pci_attach(struct device *parent, struct device *self, void *aux)
 	struct pci_attach_args *pa = aux;
 	pcireg_t maptype;
 	pci_intr_handle_t ih;
-	int msi = 1;
+	struct cpu_info *ci = NULL;
+	int msi = 1, nmsix = 0;
+	u_int i;
 
 	psc->psc_pc = pa->pa_pc;
 	sc->sc_dmat = pa->pa_dmat;
@@ -107,8 +119,9 @@ nvme_pci_attach(struct device *parent, struct device *self, void *aux)
 		return;
 	}
 
-	if (pci_intr_map_msix(pa, 0, &ih) != 0 &&
-	    pci_intr_map_msi(pa, &ih) != 0) {
+	if (pci_intr_map_msix(pa, 0, &ih) == 0)
+		nmsix = pci_intr_msix_count(pa);
+	else if (pci_intr_map_msi(pa, &ih) != 0) {
 		if (pci_intr_map(pa, &ih) != 0) {
 			printf("unable to map interrupt\n");
 			goto unmap;
@@ -116,8 +129,41 @@ nvme_pci_attach(struct device *parent, struct device *self, void *aux)
 		msi = 0;
 	}
 
-	sc->sc_ih = pci_intr_establish(pa->pa_pc, ih, IPL_BIO,
-	    msi ? nvme_intr : nvme_intr_intx, sc, DEVNAME(sc));
+	/*
+	 * Give each io queue pair its own MSI-X vector and cpu. nvme_attach
+	 * may end up using fewer queues than this if the controller
+	 * does not support as many.
+	 */
+	if (nmsix > 1) {
+		psc->psc_intrmap = intrmap_create(&sc->sc_dev, nmsix,
+		    NVME_MAXQ, 0);
+		psc->psc_nihs_alloc = intrmap_count(psc->psc_intrmap);
+		psc->psc_ihs = mallocarray(psc->psc_nihs_alloc,
+		    sizeof(*psc->psc_ihs), M_DEVBUF, M_WAITOK | M_ZERO);
+
+		psc->psc_ihs[0] = ih;
+		for (i = 1; i < psc->psc_nihs_alloc; i++) {
+			if (pci_intr_map_msix(pa, i, &psc->psc_ihs[i]) != 0)
+				break;
+		}
+		psc->psc_nihs = i;
+
+		if (psc->psc_nihs > 1) {
+			sc->sc_nq = psc->psc_nihs;
+			sc->sc_intr_establish = nvme_pci_intr_establish;
+			sc->sc_intr_disestablish = nvme_pci_intr_disestablish;
+			ci = intrmap_cpu(psc->psc_intrmap, 0);
+		} else
+			nvme_pci_intr_free(psc);
+	}
+
+	if (ci != NULL) {
+		sc->sc_ih = pci_intr_establish_cpu(pa->pa_pc, ih, IPL_BIO, ci,
+		    nvme_intr, sc, DEVNAME(sc));
+	} else {
+		sc->sc_ih = pci_intr_establish(pa->pa_pc, ih, IPL_BIO,
+		    msi ? nvme_intr : nvme_intr_intx, sc, DEVNAME(sc));
+	}
 	if (sc->sc_ih == NULL) {
 		printf("unable to establish interrupt\n");
 		goto unmap;
@@ -136,13 +182,57 @@ disestablish:
 	sc->sc_ih = NULL;
 
 unmap:
+	nvme_pci_intr_free(psc);
 	bus_space_unmap(sc->sc_iot, sc->sc_ioh, sc->sc_ios);
 	sc->sc_ios = 0;
 }
 
+void
+nvme_pci_intr_free(struct nvme_pci_softc *psc)
+{
+	if (psc->psc_intrmap == NULL)
+		return;
+
+	free(psc->psc_ihs, M_DEVBUF,
+	    psc->psc_nihs_alloc * sizeof(*psc->psc_ihs));
+	psc->psc_ihs = NULL;
+	psc->psc_nihs = psc->psc_nihs_alloc = 0;
+	intrmap_destroy(psc->psc_intrmap);
+	psc->psc_intrmap = NULL;
+}
+
+int
+nvme_pci_intr_establish(struct nvme_softc *sc, struct nvme_queue *q)
+{
+	struct nvme_pci_softc *psc = (struct nvme_pci_softc *)sc;
+
+	KASSERT(q->q_vec > 0 && q->q_vec < psc->psc_nihs);
+
+	q->q_ih = pci_intr_establish_cpu(psc->psc_pc, psc->psc_ihs[q->q_vec],
+	    IPL_BIO, intrmap_cpu(psc->psc_intrmap, q->q_vec),
+	    nvme_intr_q, q, q->q_name);
+	if (q->q_ih == NULL)
+		return (1);
+
+	return (0);
+}
+
+void
+nvme_pci_intr_disestablish(struct nvme_softc *sc, struct nvme_queue *q)
+{
+	struct nvme_pci_softc *psc = (struct nvme_pci_softc *)sc;
+
+	pci_intr_disestablish(psc->psc_pc, q->q_ih);
+	q->q_ih = NULL;
+}
+
 int
 nvme_pci_detach(struct device *self, int flags)
 {
+	struct nvme_pci_softc *psc = (struct nvme_pci_softc *)self;
+
+	nvme_pci_intr_free(psc);
+
 	return (0);
 }
 
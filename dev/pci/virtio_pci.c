@@ -51,7 +51,7 @@
  * XXX: PCI-endian while the device specific registers are native endian.
  */
 
-#define MAX_MSIX_VECS	8
+#define MAX_MSIX_VECS	64
 
 struct virtio_pci_softc;
 
@@ -61,7 +61,7 @@ int		virtio_pci_attach_09(struct virtio_pci_softc *sc, struct pci_attach_args *p
 int		virtio_pci_attach_10(struct virtio_pci_softc *sc, struct pci_attach_args *pa);
 int		virtio_pci_detach(struct device *, int);
 
-void		virtio_pci_kick(struct virtio_softc *, uint16_t);
+void		virtio_pci_kick(struct virtio_softc *, struct virtqueue *);
 int		virtio_pci_adjust_config_region(struct virtio_pci_softc *);
 uint8_t		virtio_pci_read_device_config_1(struct virtio_softc *, int);
 uint16_t	virtio_pci_read_device_config_2(struct virtio_softc *, int);
@@ -78,10 +78,11 @@ int		virtio_pci_negotiate_features(struct virtio_softc *, const struct virtio_fe
 int		virtio_pci_negotiate_features_10(struct virtio_softc *, const struct virtio_feature_name *);
 void		virtio_pci_set_msix_queue_vector(struct virtio_pci_softc *, uint32_t, uint16_t);
 void		virtio_pci_set_msix_config_vector(struct virtio_pci_softc *, uint16_t);
-int		virtio_pci_msix_establish(struct virtio_pci_softc *, struct pci_attach_args *, int, int (*)(void *), void *);
+int		virtio_pci_msix_establish(struct virtio_pci_softc *, struct pci_attach_args *, int, struct cpu_info *, int (*)(void *), void *);
 int		virtio_pci_setup_msix(struct virtio_pci_softc *, struct pci_attach_args *, int);
 void		virtio_pci_free_irqs(struct virtio_pci_softc *);
 int		virtio_pci_poll_intr(void *);
+void		virtio_pci_intr_barrier(struct virtio_softc *);
 int		virtio_pci_legacy_intr(void *);
 int		virtio_pci_legacy_intr_mpsafe(void *);
 int		virtio_pci_config_intr(void *);
@@ -159,6 +160,7 @@ struct virtio_ops virtio_pci_ops = {
 	virtio_pci_set_status,
 	virtio_pci_negotiate_features,
 	virtio_pci_poll_intr,
+	virtio_pci_intr_barrier,
 };
 
 static inline
@@ -266,7 +268,7 @@ virtio_pci_setup_queue(struct virtio_softc *vsc, struct virtqueue *vq,
 	if (sc->sc_irq_type != IRQ_NO_MSIX) {
 		int vec = 1;
 		if (sc->sc_irq_type == IRQ_MSIX_PER_VQ)
-		       vec += vq->vq_index;
+		       vec += vq - sc->sc_sc.sc_vqs;
 		if (sc->sc_sc.sc_version_1) {
 			CWRITE(sc, queue_msix_vector, vec);
 		} else {
@@ -884,7 +886,8 @@ virtio_pci_write_device_config_8(struct virtio_softc *vsc,
 
 int
 virtio_pci_msix_establish(struct virtio_pci_softc *sc,
-    struct pci_attach_args *pa, int idx, int (*handler)(void *), void *ih_arg)
+    struct pci_attach_args *pa, int idx, struct cpu_info *ci,
+    int (*handler)(void *), void *ih_arg)
 {
 	struct virtio_softc *vsc = &sc->sc_sc;
 	pci_intr_handle_t ih;
@@ -896,8 +899,8 @@ virtio_pci_msix_establish(struct virtio_pci_softc *sc,
 #endif
 		return 1;
 	}
-	sc->sc_ih[idx] = pci_intr_establish(sc->sc_pc, ih, vsc->sc_ipl,
-	    handler, ih_arg, vsc->sc_dev.dv_xname);
+	sc->sc_ih[idx] = pci_intr_establish_cpu(sc->sc_pc, ih, vsc->sc_ipl,
+	    ci, handler, ih_arg, vsc->sc_dev.dv_xname);
 	if (sc->sc_ih[idx] == NULL) {
 		printf("%s[%d]: couldn't establish msix interrupt\n",
 		    vsc->sc_dev.dv_xname, idx);
@@ -940,8 +943,8 @@ virtio_pci_free_irqs(struct virtio_pci_softc *sc)
 
 	if (sc->sc_devcfg_offset == VIRTIO_CONFIG_DEVICE_CONFIG_MSI) {
 		for (i = 0; i < vsc->sc_nvqs; i++) {
-			virtio_pci_set_msix_queue_vector(sc, i,
-			    VIRTIO_MSI_NO_VECTOR);
+			virtio_pci_set_msix_queue_vector(sc,
+			    vsc->sc_vqs[i].vq_index, VIRTIO_MSI_NO_VECTOR);
 		}
 	}
 
@@ -956,6 +959,18 @@ virtio_pci_free_irqs(struct virtio_pci_softc *sc)
 	virtio_pci_adjust_config_region(sc);
 }
 
+void
+virtio_pci_intr_barrier(struct virtio_softc *vsc)
+{
+	struct virtio_pci_softc *sc = (struct virtio_pci_softc *)vsc;
+	int i;
+
+	for (i = 0; i < MAX_MSIX_VECS; i++) {
+		if (sc->sc_ih[i] != NULL)
+			intr_barrier(sc->sc_ih[i]);
+	}
+}
+
 int
 virtio_pci_setup_msix(struct virtio_pci_softc *sc, struct pci_attach_args *pa,
     int shared)
@@ -963,27 +978,40 @@ virtio_pci_setup_msix(struct virtio_pci_softc *sc, struct pci_attach_args *pa,
 	struct virtio_softc *vsc = &sc->sc_sc;
 	int i;
 
-	if (virtio_pci_msix_establish(sc, pa, 0, virtio_pci_config_intr, vsc))
+	if (!shared && vsc->sc_nvqs + 1 > MAX_MSIX_VECS)
+		return 1;
+
+	if (virtio_pci_msix_establish(sc, pa, 0, NULL, virtio_pci_config_intr,
+	    vsc))
 		return 1;
 	sc->sc_devcfg_offset = VIRTIO_CONFIG_DEVICE_CONFIG_MSI;
 	virtio_pci_adjust_config_region(sc);
 	virtio_pci_set_msix_config_vector(sc, 0);
 
 	if (shared) {
-		if (virtio_pci_msix_establish(sc, pa, 1,
+		if (virtio_pci_msix_establish(sc, pa, 1, NULL,
 		    virtio_pci_shared_queue_intr, vsc)) {
 			goto fail;
 		}
 
-		for (i = 0; i < vsc->sc_nvqs; i++)
-			virtio_pci_set_msix_queue_vector(sc, i, 1);
+		for (i = 0; i < vsc->sc_nvqs; i++) {
+			virtio_pci_set_msix_queue_vector(sc,
+			    vsc->sc_vqs[i].vq_index, 1);
+		}
 	} else {
-		for (i = 0; i <= vsc->sc_nvqs; i++) {
+		/*
+		 * The child may ask for a vq interrupt to be bound to a
+		 * specific cpu by setting vq_intr_cpu.
+		 */
+		for (i = 0; i < vsc->sc_nvqs; i++) {
+			struct virtqueue *vq = &vsc->sc_vqs[i];
+
 			if (virtio_pci_msix_establish(sc, pa, i + 1,
-			    virtio_pci_queue_intr, &vsc->sc_vqs[i])) {
+			    vq->vq_intr_cpu, virtio_pci_queue_intr, vq)) {
 				goto fail;
 			}
-			virtio_pci_set_msix_queue_vector(sc, i, i + 1);
+			virtio_pci_set_msix_queue_vector(sc, vq->vq_index,
+			    i + 1);
 		}
 	}
 
@@ -1095,13 +1123,13 @@ virtio_pci_poll_intr(void *arg)
 }
 
 void
-virtio_pci_kick(struct virtio_softc *vsc, uint16_t idx)
+virtio_pci_kick(struct virtio_softc *vsc, struct virtqueue *vq)
 {
 	struct virtio_pci_softc *sc = (struct virtio_pci_softc *)vsc;
 	unsigned offset = 0;
 	if (vsc->sc_version_1) {
-		offset = vsc->sc_vqs[idx].vq_notify_off *
-		    sc->sc_notify_off_multiplier;
+		offset = vq->vq_notify_off * sc->sc_notify_off_multiplier;
 	}
-	bus_space_write_2(sc->sc_notify_iot, sc->sc_notify_ioh, offset, idx);
+	bus_space_write_2(sc->sc_notify_iot, sc->sc_notify_ioh, offset,
+	    vq->vq_index);
 }
@@ -37,16 +37,19 @@
 #include <sys/socket.h>
 #include <sys/sockio.h>
 #include <sys/timeout.h>
+#include <sys/intrmap.h>
 
 #include <dev/pv/virtioreg.h>
 #include <dev/pv/virtiovar.h>
 
 #include <net/if.h>
 #include <net/if_media.h>
+#include <net/toeplitz.h>
 
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
 
@@ -66,6 +69,10 @@
 /* Configuration registers */
 #define VIRTIO_NET_CONFIG_MAC		0 /* 8bit x 6byte */
 #define VIRTIO_NET_CONFIG_STATUS	6 /* 16bit */
+#define VIRTIO_NET_CONFIG_MAX_QUEUES	8 /* 16bit */
+#define VIRTIO_NET_CONFIG_RSS_KEY_SIZE	17 /* 8bit */
+#define VIRTIO_NET_CONFIG_RSS_IND_LEN	18 /* 16bit */
+#define VIRTIO_NET_CONFIG_RSS_HASHTYPES	20 /* 32bit */
 
 /* Feature bits */
 #define VIRTIO_NET_F_CSUM			(1ULL<<0)
@@ -91,6 +98,7 @@
 #define VIRTIO_NET_F_GUEST_ANNOUNCE		(1ULL<<21)
 #define VIRTIO_NET_F_MQ				(1ULL<<22)
 #define VIRTIO_NET_F_CTRL_MAC_ADDR		(1ULL<<23)
+#define VIRTIO_NET_F_RSS			(1ULL<<60)
 
 /*
  * Config(8) flags. The lowest byte is reserved for generic virtio stuff.
@@ -169,6 +177,10 @@ struct virtio_net_ctrl_cmd {
 # define VIRTIO_NET_CTRL_VLAN_ADD	0
 # define VIRTIO_NET_CTRL_VLAN_DEL	1
 
+#define VIRTIO_NET_CTRL_MQ		4
+# define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+# define VIRTIO_NET_CTRL_MQ_RSS_CONFIG		1
+
 struct virtio_net_ctrl_status {
 	uint8_t	ack;
 } __packed;
@@ -188,6 +200,30 @@ struct virtio_net_ctrl_vlan {
 	uint16_t id;
 } __packed;
 
+struct virtio_net_ctrl_mq {
+	uint16_t virtqueue_pairs;
+} __packed;
+
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4	(1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4	(1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4	(1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6	(1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6	(1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6	(1 << 5)
+
+#define VIRTIO_NET_RSS_TABLE_LEN	128 /* minimum the device must support */
+#define VIRTIO_NET_RSS_KEY_LEN		40 /* ditto */
+
+struct virtio_net_ctrl_rss {
+	uint32_t hash_types;
+	uint16_t indirection_table_mask;
+	uint16_t unclassified_queue;
+	uint16_t indirection_table[VIRTIO_NET_RSS_TABLE_LEN];
+	uint16_t max_tx_vq;
+	uint8_t hash_key_length;
+	uint8_t hash_key_data[VIRTIO_NET_RSS_KEY_LEN];
+} __packed;
+
 /*
  * if_viovar.h:
  */
@@ -195,14 +231,40 @@ enum vio_ctrl_state {
 	FREE, INUSE, DONE, RESET
 };
 
+struct vio_softc;
+
+struct vio_queue {
+	struct vio_softc	*viq_sc;
+	struct virtqueue	*viq_rxvq;
+	struct virtqueue	*viq_txvq;
+	struct mutex		viq_rxmtx;
+	struct mutex		viq_txmtx;
+	struct ifiqueue		*viq_ifiq;
+	struct ifqueue		*viq_ifq;
+
+	/* bus_dmamem */
+	struct virtio_net_hdr	*viq_txhdrs;
+
+	/* kmem */
+	bus_dmamap_t		*viq_arrays;
+#define viq_rxdmamaps viq_arrays
+	bus_dmamap_t		*viq_txdmamaps;
+	struct mbuf		**viq_rxmbufs;
+	struct mbuf		**viq_txmbufs;
+	struct if_rxring	viq_rxring;
+};
+
 struct vio_softc {
 	struct device		sc_dev;
 
 	struct virtio_softc	*sc_virtio;
-#define	VQRX	0
-#define	VQTX	1
-#define	VQCTL	2
-	struct virtqueue	sc_vq[3];
+	/* rx0, tx0, rx1, tx1, ..., rxN, txN, and then the control vq */
+	struct virtqueue	*sc_vq;
+	struct virtqueue	*sc_ctl_vq;
+	struct vio_queue	*sc_q;
+	unsigned int		sc_nqueues;
+	struct intrmap		*sc_intrmap;
+	uint32_t		sc_rss_hash_types;
 
 	struct arpcom		sc_ac;
 	struct ifmedia		sc_media;
@@ -216,21 +278,14 @@ struct vio_softc {
 	caddr_t			sc_dma_kva;
 
 	int			sc_hdr_size;
-	struct virtio_net_hdr	*sc_tx_hdrs;
 	struct virtio_net_ctrl_cmd *sc_ctrl_cmd;
 	struct virtio_net_ctrl_status *sc_ctrl_status;
 	struct virtio_net_ctrl_rx *sc_ctrl_rx;
 	struct virtio_net_ctrl_mac_tbl *sc_ctrl_mac_tbl_uc;
 #define sc_ctrl_mac_info sc_ctrl_mac_tbl_uc
 	struct virtio_net_ctrl_mac_tbl *sc_ctrl_mac_tbl_mc;
-
-	/* kmem */
-	bus_dmamap_t		*sc_arrays;
-#define sc_rx_dmamaps sc_arrays
-	bus_dmamap_t		*sc_tx_dmamaps;
-	struct mbuf		**sc_rx_mbufs;
-	struct mbuf		**sc_tx_mbufs;
-	struct if_rxring	sc_rx_ring;
+	struct virtio_net_ctrl_mq *sc_ctrl_mq;
+	struct virtio_net_ctrl_rss *sc_ctrl_rss;
 
 	enum vio_ctrl_state	sc_ctrl_inuse;
 
@@ -246,8 +301,16 @@ struct vio_softc {
 	    VIO_DMAMEM_OFFSET((sc), (p)), (size), (write))
 #define VIO_HAVE_MRG_RXBUF(sc)					\
 	((sc)->sc_hdr_size == sizeof(struct virtio_net_hdr))
+#define VIO_HAVE_TSO(vsc)					\
+	(virtio_has_feature((vsc), VIRTIO_NET_F_HOST_TSO4) ||	\
+	 virtio_has_feature((vsc), VIRTIO_NET_F_HOST_TSO6))
+/* rx and tx vq of queue pair n have index 2n and 2n + 1 */
+#define VIO_VQ2Q(sc, vq)	(&(sc)->sc_q[(vq)->vq_index / 2])
+
+#define VIO_MAX_QUEUES			8
 
 #define VIRTIO_NET_TX_MAXNSEGS		16 /* for larger chains, defrag */
+#define VIRTIO_NET_TSO_MAXNSEGS		(MAXMCLBYTES / PAGE_SIZE + 1)
 #define VIRTIO_NET_CTRL_MAC_MC_ENTRIES	64 /* for more entries, use ALLMULTI */
 #define VIRTIO_NET_CTRL_MAC_UC_ENTRIES	 1 /* one entry for own unicast addr */
 
@@ -263,31 +326,34 @@ void	vio_attach(struct device *, struct device *, void *);
 /* ifnet interface functions */
 int	vio_init(struct ifnet *);
 void	vio_stop(struct ifnet *, int);
-void	vio_start(struct ifnet *);
+void	vio_start(struct ifqueue *);
 int	vio_ioctl(struct ifnet *, u_long, caddr_t);
+int	vio_rxrinfo(struct vio_softc *, struct if_rxrinfo *);
 void	vio_get_lladr(struct arpcom *ac, struct virtio_softc *vsc);
 void	vio_put_lladr(struct arpcom *ac, struct virtio_softc *vsc);
 
 /* rx */
-int	vio_add_rx_mbuf(struct vio_softc *, int);
-void	vio_free_rx_mbuf(struct vio_softc *, int);
-void	vio_populate_rx_mbufs(struct vio_softc *);
-int	vio_rxeof(struct vio_softc *);
+int	vio_add_rx_mbuf(struct vio_softc *, struct vio_queue *, int);
+void	vio_free_rx_mbuf(struct vio_softc *, struct vio_queue *, int);
+void	vio_populate_rx_mbufs(struct vio_softc *, struct vio_queue *);
+int	vio_rxeof(struct vio_queue *);
 int	vio_rx_intr(struct virtqueue *);
 void	vio_rx_drain(struct vio_softc *);
 void	vio_rxtick(void *);
 
 /* tx */
 int	vio_tx_intr(struct virtqueue *);
-int	vio_txeof(struct virtqueue *);
+int	vio_txeof(struct vio_queue *);
 void	vio_tx_drain(struct vio_softc *);
-int	vio_encap(struct vio_softc *, int, struct mbuf *);
+int	vio_encap(struct vio_softc *, struct vio_queue *, int, struct mbuf *);
+int	vio_tx_offload(struct virtio_net_hdr *, struct mbuf *);
 void	vio_txtick(void *);
 
 /* other control */
 void	vio_link_state(struct ifnet *);
 int	vio_config_change(struct virtio_softc *);
 int	vio_ctrl_rx(struct vio_softc *, int, int);
+int	vio_ctrl_mq(struct vio_softc *);
 int	vio_set_rx_filter(struct vio_softc *);
 void	vio_iff(struct vio_softc *);
 int	vio_media_change(struct ifnet *);
@@ -367,7 +433,7 @@ vio_free_dmamem(struct vio_softc *sc)
 /* allocate memory */
 /*
  * dma memory is used for:
- *   sc_tx_hdrs[slot]:	 metadata array for frames to be sent (WRITE)
+ *   viq_txhdrs[slot]:	 metadata array for frames to be sent (WRITE)
  *   sc_ctrl_cmd:	 command to be sent via ctrl vq (WRITE)
  *   sc_ctrl_status:	 return value for a command via ctrl vq (READ)
  *   sc_ctrl_rx:	 parameter for a VIRTIO_NET_CTRL_RX class command
@@ -376,6 +442,10 @@ vio_free_dmamem(struct vio_softc *sc)
  *			 class command (WRITE)
  *   sc_ctrl_mac_tbl_mc: multicast MAC address filter for a VIRTIO_NET_CTRL_MAC
  *			 class command (WRITE)
+ *   sc_ctrl_mq:	 number of queue pairs for a VIRTIO_NET_CTRL_MQ class
+ *			 command (WRITE)
+ *   sc_ctrl_rss:	 RSS configuration for a VIRTIO_NET_CTRL_MQ class
+ *			 command (WRITE)
  * sc_ctrl_* structures are allocated only one each; they are protected by
  * sc_ctrl_inuse, which must only be accessed at splnet
  *
@@ -383,37 +453,41 @@ vio_free_dmamem(struct vio_softc *sc)
  * rx mbufs.
  */
 /*
- * dynamically allocated memory is used for:
- *   sc_rx_dmamaps[slot]:	bus_dmamap_t array for received payload
- *   sc_tx_dmamaps[slot]:	bus_dmamap_t array for sent payload
- *   sc_rx_mbufs[slot]:		mbuf pointer array for received frames
- *   sc_tx_mbufs[slot]:		mbuf pointer array for sent frames
+ * dynamically allocated memory is used for, per queue pair:
+ *   viq_rxdmamaps[slot]:	bus_dmamap_t array for received payload
+ *   viq_txdmamaps[slot]:	bus_dmamap_t array for sent payload
+ *   viq_rxmbufs[slot]:		mbuf pointer array for received frames
+ *   viq_txmbufs[slot]:		mbuf pointer array for sent frames
  */
 int
 vio_alloc_mem(struct vio_softc *sc)
 {
 	struct virtio_softc *vsc = sc->sc_virtio;
 	struct ifnet *ifp = &sc->sc_ac.ac_if;
-	int allocsize, r, i, txsize;
+	struct vio_queue *viq;
+	int allocsize, r, i, qidx, txsize, txnsegs;
 	unsigned int offset = 0;
 	int rxqsize, txqsize;
 	caddr_t kva;
 
-	rxqsize = vsc->sc_vqs[0].vq_num;
-	txqsize = vsc->sc_vqs[1].vq_num;
-
 	/*
 	 * For simplicity, we always allocate the full virtio_net_hdr size
 	 * even if VIRTIO_NET_F_MRG_RXBUF is not negotiated and
 	 * only a part of the memory is ever used.
 	 */
-	allocsize = sizeof(struct virtio_net_hdr) * txqsize;
+	allocsize = 0;
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		allocsize += sizeof(struct virtio_net_hdr) *
+		    sc->sc_q[qidx].viq_txvq->vq_num;
+	}
 
-	if (vsc->sc_nvqs == 3) {
+	if (sc->sc_ctl_vq != NULL) {
 		allocsize += sizeof(struct virtio_net_ctrl_cmd) * 1;
 		allocsize += sizeof(struct virtio_net_ctrl_status) * 1;
 		allocsize += sizeof(struct virtio_net_ctrl_rx) * 1;
 		allocsize += VIO_CTRL_MAC_INFO_SIZE;
+		allocsize += sizeof(struct virtio_net_ctrl_mq) * 1;
+		allocsize += sizeof(struct virtio_net_ctrl_rss) * 1;
 	}
 	sc->sc_dma_size = allocsize;
 
@@ -423,9 +497,12 @@ vio_alloc_mem(struct vio_softc *sc)
 	}
 
 	kva = sc->sc_dma_kva;
-	sc->sc_tx_hdrs = (struct virtio_net_hdr*)(kva + offset);
-	offset += sizeof(struct virtio_net_hdr) * txqsize;
-	if (vsc->sc_nvqs == 3) {
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+		viq->viq_txhdrs = (struct virtio_net_hdr*)(kva + offset);
+		offset += sizeof(struct virtio_net_hdr) * viq->viq_txvq->vq_num;
+	}
+	if (sc->sc_ctl_vq != NULL) {
 		sc->sc_ctrl_cmd = (void*)(kva + offset);
 		offset += sizeof(*sc->sc_ctrl_cmd);
 		sc->sc_ctrl_status = (void*)(kva + offset);
@@ -436,56 +513,81 @@ vio_alloc_mem(struct vio_softc *sc)
 		offset += sizeof(*sc->sc_ctrl_mac_tbl_uc) +
 		    ETHER_ADDR_LEN * VIRTIO_NET_CTRL_MAC_UC_ENTRIES;
 		sc->sc_ctrl_mac_tbl_mc = (void*)(kva + offset);
+		offset += sizeof(*sc->sc_ctrl_mac_tbl_mc) +
+		    ETHER_ADDR_LEN * VIRTIO_NET_CTRL_MAC_MC_ENTRIES;
+		sc->sc_ctrl_mq = (void*)(kva + offset);
+		offset += sizeof(*sc->sc_ctrl_mq);
+		sc->sc_ctrl_rss = (void*)(kva + offset);
 	}
 
-	sc->sc_arrays = mallocarray(rxqsize + txqsize,
-	    2 * sizeof(bus_dmamap_t) + sizeof(struct mbuf *), M_DEVBUF,
-	    M_WAITOK | M_CANFAIL | M_ZERO);
-	if (sc->sc_arrays == NULL) {
-		printf("unable to allocate mem for dmamaps\n");
-		goto err_hdr;
+	if (VIO_HAVE_TSO(vsc)) {
+		txsize = MAXMCLBYTES;
+		txnsegs = VIRTIO_NET_TSO_MAXNSEGS;
+	} else {
+		txsize = ifp->if_hardmtu + sc->sc_hdr_size + ETHER_HDR_LEN;
+		txnsegs = VIRTIO_NET_TX_MAXNSEGS;
 	}
-	allocsize = (rxqsize + txqsize) *
-	    (2 * sizeof(bus_dmamap_t) + sizeof(struct mbuf *));
 
-	sc->sc_tx_dmamaps = sc->sc_arrays + rxqsize;
-	sc->sc_rx_mbufs = (void*) (sc->sc_tx_dmamaps + txqsize);
-	sc->sc_tx_mbufs = sc->sc_rx_mbufs + rxqsize;
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+		rxqsize = viq->viq_rxvq->vq_num;
+		txqsize = viq->viq_txvq->vq_num;
 
-	for (i = 0; i < rxqsize; i++) {
-		r = bus_dmamap_create(vsc->sc_dmat, MCLBYTES, 1, MCLBYTES, 0,
-		    BUS_DMA_NOWAIT|BUS_DMA_ALLOCNOW, &sc->sc_rx_dmamaps[i]);
-		if (r != 0)
+		viq->viq_arrays = mallocarray(rxqsize + txqsize,
+		    2 * sizeof(bus_dmamap_t) + sizeof(struct mbuf *), M_DEVBUF,
+		    M_WAITOK | M_CANFAIL | M_ZERO);
+		if (viq->viq_arrays == NULL) {
+			printf("unable to allocate mem for dmamaps\n");
 			goto err_reqs;
-	}
+		}
 
-	txsize = ifp->if_hardmtu + sc->sc_hdr_size + ETHER_HDR_LEN;
-	for (i = 0; i < txqsize; i++) {
-		r = bus_dmamap_create(vsc->sc_dmat, txsize,
-		    VIRTIO_NET_TX_MAXNSEGS, txsize, 0,
-		    BUS_DMA_NOWAIT|BUS_DMA_ALLOCNOW,
-		    &sc->sc_tx_dmamaps[i]);
-		if (r != 0)
-			goto err_reqs;
+		viq->viq_txdmamaps = viq->viq_arrays + rxqsize;
+		viq->viq_rxmbufs = (void*) (viq->viq_txdmamaps + txqsize);
+		viq->viq_txmbufs = viq->viq_rxmbufs + rxqsize;
+
+		for (i = 0; i < rxqsize; i++) {
+			r = bus_dmamap_create(vsc->sc_dmat, MCLBYTES, 1,
+			    MCLBYTES, 0, BUS_DMA_NOWAIT|BUS_DMA_ALLOCNOW,
+			    &viq->viq_rxdmamaps[i]);
+			if (r != 0)
+				goto err_dmamap;
+		}
+
+		for (i = 0; i < txqsize; i++) {
+			r = bus_dmamap_create(vsc->sc_dmat, txsize,
+			    txnsegs, txsize, 0,
+			    BUS_DMA_NOWAIT|BUS_DMA_ALLOCNOW,
+			    &viq->viq_txdmamaps[i]);
+			if (r != 0)
+				goto err_dmamap;
+		}
 	}
 
 	return 0;
 
-err_reqs:
+err_dmamap:
 	printf("dmamap creation failed, error %d\n", r);
-	for (i = 0; i < txqsize; i++) {
-		if (sc->sc_tx_dmamaps[i])
-			bus_dmamap_destroy(vsc->sc_dmat, sc->sc_tx_dmamaps[i]);
-	}
-	for (i = 0; i < rxqsize; i++) {
-		if (sc->sc_rx_dmamaps[i])
-			bus_dmamap_destroy(vsc->sc_dmat, sc->sc_rx_dmamaps[i]);
-	}
-	if (sc->sc_arrays) {
-		free(sc->sc_arrays, M_DEVBUF, allocsize);
-		sc->sc_arrays = 0;
+err_reqs:
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+		if (viq->viq_arrays == NULL)
+			continue;
+		rxqsize = viq->viq_rxvq->vq_num;
+		txqsize = viq->viq_txvq->vq_num;
+		for (i = 0; i < txqsize; i++) {
+			if (viq->viq_txdmamaps[i])
+				bus_dmamap_destroy(vsc->sc_dmat,
+				    viq->viq_txdmamaps[i]);
+		}
+		for (i = 0; i < rxqsize; i++) {
+			if (viq->viq_rxdmamaps[i])
+				bus_dmamap_destroy(vsc->sc_dmat,
+				    viq->viq_rxdmamaps[i]);
+		}
+		free(viq->viq_arrays, M_DEVBUF, (rxqsize + txqsize) *
+		    (2 * sizeof(bus_dmamap_t) + sizeof(struct mbuf *)));
+		viq->viq_arrays = NULL;
 	}
-err_hdr:
 	vio_free_dmamem(sc);
 	return -1;
 }
@@ -515,7 +617,8 @@ vio_attach(struct device *parent, struct device *self, void *aux)
 {
 	struct vio_softc *sc = (struct vio_softc *)self;
 	struct virtio_softc *vsc = (struct virtio_softc *)parent;
-	int i;
+	struct vio_queue *viq;
+	int i, maxpairs = 1;
 	struct ifnet *ifp = &sc->sc_ac.ac_if;
 
 	if (vsc->sc_child != NULL) {
@@ -527,12 +630,13 @@ vio_attach(struct device *parent, struct device *self, void *aux)
 	sc->sc_virtio = vsc;
 
 	vsc->sc_child = self;
-	vsc->sc_ipl = IPL_NET;
-	vsc->sc_vqs = &sc->sc_vq[0];
+	vsc->sc_ipl = IPL_NET | IPL_MPSAFE;
 	vsc->sc_config_change = 0;
 	vsc->sc_driver_features = VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS |
 	    VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_CTRL_RX |
 	    VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_CSUM |
+	    VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_HOST_TSO6 |
+	    VIRTIO_NET_F_MQ | VIRTIO_NET_F_RSS |
 	    VIRTIO_F_RING_EVENT_IDX;
 
 	virtio_negotiate_features(vsc, virtio_net_feature_names);
@@ -542,7 +646,46 @@ vio_attach(struct device *parent, struct device *self, void *aux)
 		ether_fakeaddr(ifp);
 		vio_put_lladr(&sc->sc_ac, vsc);
 	}
-	printf(": address %s\n", ether_sprintf(sc->sc_ac.ac_enaddr));
+
+	/*
+	 * Multiple queue pairs are configured through the control vq,
+	 * which sits behind all the queue pairs the device offers.
+	 */
+	sc->sc_nqueues = 1;
+	if (virtio_has_feature(vsc, VIRTIO_NET_F_MQ) &&
+	    virtio_has_feature(vsc, VIRTIO_NET_F_CTRL_VQ) &&
+	    virtio_has_feature(vsc, VIRTIO_NET_F_CTRL_RX)) {
+		maxpairs = virtio_read_device_config_2(vsc,
+		    VIRTIO_NET_CONFIG_MAX_QUEUES);
+		if (maxpairs < 1)
+			maxpairs = 1;
+		if (maxpairs > 1) {
+			sc->sc_intrmap = intrmap_create(&sc->sc_dev, maxpairs,
+			    VIO_MAX_QUEUES, 0);
+			sc->sc_nqueues = intrmap_count(sc->sc_intrmap);
+		}
+	}
+	if (sc->sc_nqueues > 1 && virtio_has_feature(vsc, VIRTIO_NET_F_RSS) &&
+	    virtio_read_device_config_1(vsc, VIRTIO_NET_CONFIG_RSS_KEY_SIZE) >=
+	    VIRTIO_NET_RSS_KEY_LEN &&
+	    virtio_read_device_config_2(vsc, VIRTIO_NET_CONFIG_RSS_IND_LEN) >=
+	    VIRTIO_NET_RSS_TABLE_LEN) {
+		sc->sc_rss_hash_types = virtio_read_device_config_4(vsc,
+		    VIRTIO_NET_CONFIG_RSS_HASHTYPES) &
+		    (VIRTIO_NET_RSS_HASH_TYPE_IPv4 |
+		    VIRTIO_NET_RSS_HASH_TYPE_TCPv4 |
+		    VIRTIO_NET_RSS_HASH_TYPE_UDPv4 |
+		    VIRTIO_NET_RSS_HASH_TYPE_IPv6 |
+		    VIRTIO_NET_RSS_HASH_TYPE_TCPv6 |
+		    VIRTIO_NET_RSS_HASH_TYPE_UDPv6);
+	}
+
+	printf(": address %s", ether_sprintf(sc->sc_ac.ac_enaddr));
+	if (sc->sc_nqueues > 1) {
+		printf(", %u queues%s", sc->sc_nqueues,
+		    sc->sc_rss_hash_types != 0 ? ", rss" : "");
+	}
+	printf("\n");
 
 	if (virtio_has_feature(vsc, VIRTIO_NET_F_MRG_RXBUF) ||
 	    vsc->sc_version_1) {
@@ -555,30 +698,59 @@ vio_attach(struct device *parent, struct device *self, void *aux)
 	else
 		ifp->if_hardmtu = MCLBYTES - sc->sc_hdr_size - ETHER_HDR_LEN;
 
-	if (virtio_alloc_vq(vsc, &sc->sc_vq[VQRX], 0, MCLBYTES, 2, "rx") != 0)
-		goto err;
-	vsc->sc_nvqs = 1;
-	sc->sc_vq[VQRX].vq_done = vio_rx_intr;
-	if (virtio_alloc_vq(vsc, &sc->sc_vq[VQTX], 1,
-	    sc->sc_hdr_size + ifp->if_hardmtu + ETHER_HDR_LEN,
-	    VIRTIO_NET_TX_MAXNSEGS + 1, "tx") != 0) {
-		goto err;
+	sc->sc_vq = mallocarray(2 * sc->sc_nqueues + 1, sizeof(*sc->sc_vq),
+	    M_DEVBUF, M_WAITOK | M_ZERO);
+	sc->sc_q = mallocarray(sc->sc_nqueues, sizeof(*sc->sc_q),
+	    M_DEVBUF, M_WAITOK | M_ZERO);
+	vsc->sc_vqs = sc->sc_vq;
+	vsc->sc_nvqs = 0;
+
+	for (i = 0; i < sc->sc_nqueues; i++) {
+		viq = &sc->sc_q[i];
+		viq->viq_sc = sc;
+		viq->viq_rxvq = &sc->sc_vq[2 * i];
+		viq->viq_txvq = &sc->sc_vq[2 * i + 1];
+		mtx_init(&viq->viq_rxmtx, IPL_NET);
+		mtx_init(&viq->viq_txmtx, IPL_NET);
+
+		if (virtio_alloc_vq(vsc, viq->viq_rxvq, 2 * i, MCLBYTES, 2,
+		    "rx") != 0)
+			goto err;
+		vsc->sc_nvqs++;
+		viq->viq_rxvq->vq_done = vio_rx_intr;
+		if (virtio_alloc_vq(vsc, viq->viq_txvq, 2 * i + 1,
+		    sc->sc_hdr_size + ifp->if_hardmtu + ETHER_HDR_LEN,
+		    (VIO_HAVE_TSO(vsc) ? VIRTIO_NET_TSO_MAXNSEGS :
+		    VIRTIO_NET_TX_MAXNSEGS) + 1, "tx") != 0) {
+			goto err;
+		}
+		vsc->sc_nvqs++;
+		viq->viq_txvq->vq_done = vio_tx_intr;
+		if (sc->sc_intrmap != NULL) {
+			viq->viq_rxvq->vq_intr_cpu =
+			    intrmap_cpu(sc->sc_intrmap, i);
+			viq->viq_txvq->vq_intr_cpu =
+			    intrmap_cpu(sc->sc_intrmap, i);
+		}
+		virtio_start_vq_intr(vsc, viq->viq_rxvq);
+		if (virtio_has_feature(vsc, VIRTIO_F_RING_EVENT_IDX))
+			virtio_postpone_intr_far(viq->viq_txvq);
+		else
+			virtio_stop_vq_intr(vsc, viq->viq_txvq);
 	}
-	vsc->sc_nvqs = 2;
-	sc->sc_vq[VQTX].vq_done = vio_tx_intr;
-	virtio_start_vq_intr(vsc, &sc->sc_vq[VQRX]);
-	if (virtio_has_feature(vsc, VIRTIO_F_RING_EVENT_IDX))
-		virtio_postpone_intr_far(&sc->sc_vq[VQTX]);
-	else
-		virtio_stop_vq_intr(vsc, &sc->sc_vq[VQTX]);
+
 	if (virtio_has_feature(vsc, VIRTIO_NET_F_CTRL_VQ)
 	    && virtio_has_feature(vsc, VIRTIO_NET_F_CTRL_RX)) {
-		if (virtio_alloc_vq(vsc, &sc->sc_vq[VQCTL], 2, NBPG, 1,
+		struct virtqueue *vq = &sc->sc_vq[2 * sc->sc_nqueues];
+
+		if (virtio_alloc_vq(vsc, vq, 2 * maxpairs, NBPG, 1,
 		    "control") == 0) {
-			sc->sc_vq[VQCTL].vq_done = vio_ctrleof;
-			virtio_start_vq_intr(vsc, &sc->sc_vq[VQCTL]);
-			vsc->sc_nvqs = 3;
-		}
+			vq->vq_done = vio_ctrleof;
+			virtio_start_vq_intr(vsc, vq);
+			vsc->sc_nvqs++;
+			sc->sc_ctl_vq = vq;
+		} else if (sc->sc_nqueues > 1)
+			goto err;
 	}
 
 	if (vio_alloc_mem(sc) < 0)
@@ -587,27 +759,50 @@ vio_attach(struct device *parent, struct device *self, void *aux)
 	strlcpy(ifp->if_xname, self->dv_xname, IFNAMSIZ);
 	ifp->if_softc = sc;
 	ifp->if_flags = IFF_BROADCAST | IFF_SIMPLEX | IFF_MULTICAST;
-	ifp->if_start = vio_start;
+	ifp->if_xflags = IFXF_MPSAFE;
+	ifp->if_qstart = vio_start;
 	ifp->if_ioctl = vio_ioctl;
 	ifp->if_capabilities = IFCAP_VLAN_MTU;
-	if (virtio_has_feature(vsc, VIRTIO_NET_F_CSUM))
+	if (virtio_has_feature(vsc, VIRTIO_NET_F_CSUM)) {
 		ifp->if_capabilities |= IFCAP_CSUM_TCPv4|IFCAP_CSUM_UDPv4;
-	ifq_set_maxlen(&ifp->if_snd, vsc->sc_vqs[1].vq_num - 1);
+		ifp->if_capabilities |= IFCAP_CSUM_TCPv6|IFCAP_CSUM_UDPv6;
+	}
+	if (virtio_has_feature(vsc, VIRTIO_NET_F_HOST_TSO4))
+		ifp->if_capabilities |= IFCAP_TSOv4;
+	if (virtio_has_feature(vsc, VIRTIO_NET_F_HOST_TSO6))
+		ifp->if_capabilities |= IFCAP_TSOv6;
 	ifmedia_init(&sc->sc_media, 0, vio_media_change, vio_media_status);
 	ifmedia_add(&sc->sc_media, IFM_ETHER | IFM_AUTO, 0, NULL);
 	ifmedia_set(&sc->sc_media, IFM_ETHER | IFM_AUTO);
 	vsc->sc_config_change = vio_config_change;
-	timeout_set(&sc->sc_txtick, vio_txtick, &sc->sc_vq[VQTX]);
-	timeout_set(&sc->sc_rxtick, vio_rxtick, &sc->sc_vq[VQRX]);
+	timeout_set(&sc->sc_txtick, vio_txtick, sc);
+	timeout_set(&sc->sc_rxtick, vio_rxtick, sc);
 
 	if_attach(ifp);
 	ether_ifattach(ifp);
 
+	if_attach_queues(ifp, sc->sc_nqueues);
+	if_attach_iqueues(ifp, sc->sc_nqueues);
+
+	for (i = 0; i < sc->sc_nqueues; i++) {
+		ifp->if_ifqs[i]->ifq_softc = &sc->sc_q[i];
+		sc->sc_q[i].viq_ifq = ifp->if_ifqs[i];
+		sc->sc_q[i].viq_ifiq = ifp->if_iqs[i];
+		ifq_set_maxlen(ifp->if_ifqs[i],
+		    sc->sc_q[i].viq_txvq->vq_num - 1);
+	}
+
 	return;
 
 err:
 	for (i = 0; i < vsc->sc_nvqs; i++)
 		virtio_free_vq(vsc, &sc->sc_vq[i]);
+	free(sc->sc_vq, M_DEVBUF,
+	    (2 * sc->sc_nqueues + 1) * sizeof(*sc->sc_vq));
+	free(sc->sc_q, M_DEVBUF, sc->sc_nqueues * sizeof(*sc->sc_q));
+	if (sc->sc_intrmap != NULL)
+		intrmap_destroy(sc->sc_intrmap);
+	vsc->sc_vqs = NULL;
 	vsc->sc_nvqs = 0;
 	vsc->sc_child = VIRTIO_CHILD_ERROR;
 	return;
@@ -637,7 +832,10 @@ int
 vio_config_change(struct virtio_softc *vsc)
 {
 	struct vio_softc *sc = (struct vio_softc *)vsc->sc_child;
+
+	KERNEL_LOCK();
 	vio_link_state(&sc->sc_ac.ac_if);
+	KERNEL_UNLOCK();
 	return 1;
 }
 
@@ -666,14 +864,25 @@ int
 vio_init(struct ifnet *ifp)
 {
 	struct vio_softc *sc = ifp->if_softc;
+	struct vio_queue *viq;
+	int qidx;
 
 	vio_stop(ifp, 0);
-	if_rxr_init(&sc->sc_rx_ring, 2 * ((ifp->if_hardmtu / MCLBYTES) + 1),
-	    sc->sc_vq[VQRX].vq_num);
-	vio_populate_rx_mbufs(sc);
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+
+		mtx_enter(&viq->viq_rxmtx);
+		if_rxr_init(&viq->viq_rxring,
+		    2 * ((ifp->if_hardmtu / MCLBYTES) + 1),
+		    viq->viq_rxvq->vq_num);
+		vio_populate_rx_mbufs(sc, viq);
+		mtx_leave(&viq->viq_rxmtx);
+		ifq_clr_oactive(viq->viq_ifq);
+	}
 	ifp->if_flags |= IFF_RUNNING;
-	ifq_clr_oactive(&ifp->if_snd);
 	vio_iff(sc);
+	if (sc->sc_nqueues > 1)
+		vio_ctrl_mq(sc);
 	vio_link_state(ifp);
 	return 0;
 }
@@ -683,27 +892,48 @@ vio_stop(struct ifnet *ifp, int disable)
 {
 	struct vio_softc *sc = ifp->if_softc;
 	struct virtio_softc *vsc = sc->sc_virtio;
+	struct vio_queue *viq;
+	int qidx;
 
 	timeout_del(&sc->sc_txtick);
 	timeout_del(&sc->sc_rxtick);
 	ifp->if_flags &= ~IFF_RUNNING;
-	ifq_clr_oactive(&ifp->if_snd);
 	/* only way to stop I/O and DMA is resetting... */
 	virtio_reset(vsc);
-	vio_rxeof(sc);
-	if (vsc->sc_nvqs >= 3)
-		vio_ctrleof(&sc->sc_vq[VQCTL]);
+
+	/*
+	 * The interrupts are MP safe.  Wait for handlers and start
+	 * routines still running on other cpus before the rings go.
+	 */
+	virtio_intr_barrier(vsc);
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++)
+		ifq_barrier(sc->sc_q[qidx].viq_ifq);
+
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+
+		mtx_enter(&viq->viq_rxmtx);
+		vio_rxeof(viq);
+		mtx_leave(&viq->viq_rxmtx);
+		ifq_clr_oactive(viq->viq_ifq);
+	}
+	if (sc->sc_ctl_vq != NULL)
+		vio_ctrleof(sc->sc_ctl_vq);
 	vio_tx_drain(sc);
 	if (disable)
 		vio_rx_drain(sc);
 
 	virtio_reinit_start(vsc);
-	virtio_start_vq_intr(vsc, &sc->sc_vq[VQRX]);
-	virtio_stop_vq_intr(vsc, &sc->sc_vq[VQTX]);
-	if (vsc->sc_nvqs >= 3)
-		virtio_start_vq_intr(vsc, &sc->sc_vq[VQCTL]);
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+
+		virtio_start_vq_intr(vsc, viq->viq_rxvq);
+		virtio_stop_vq_intr(vsc, viq->viq_txvq);
+	}
+	if (sc->sc_ctl_vq != NULL)
+		virtio_start_vq_intr(vsc, sc->sc_ctl_vq);
 	virtio_reinit_end(vsc);
-	if (vsc->sc_nvqs >= 3) {
+	if (sc->sc_ctl_vq != NULL) {
 		if (sc->sc_ctrl_inuse != FREE)
 			sc->sc_ctrl_inuse = RESET;
 		wakeup(&sc->sc_ctrl_inuse);
@@ -711,92 +941,80 @@ vio_stop(struct ifnet *ifp, int disable)
 }
 
 void
-vio_start(struct ifnet *ifp)
+vio_start(struct ifqueue *ifq)
 {
-	struct vio_softc *sc = ifp->if_softc;
+	struct ifnet *ifp = ifq->ifq_if;
+	struct vio_queue *viq = ifq->ifq_softc;
+	struct vio_softc *sc = viq->viq_sc;
 	struct virtio_softc *vsc = sc->sc_virtio;
-	struct virtqueue *vq = &sc->sc_vq[VQTX];
+	struct virtqueue *vq = viq->viq_txvq;
 	struct mbuf *m;
 	int queued = 0;
 
-	vio_txeof(vq);
+	mtx_enter(&viq->viq_txmtx);
+	vio_txeof(viq);
 
-	if (!(ifp->if_flags & IFF_RUNNING) || ifq_is_oactive(&ifp->if_snd))
-		return;
-	if (ifq_empty(&ifp->if_snd))
-		return;
+	if (!(ifp->if_flags & IFF_RUNNING) || ifq_is_oactive(ifq))
+		goto out;
+	if (ifq_empty(ifq))
+		goto out;
 
 again:
 	for (;;) {
 		int slot, r;
 		struct virtio_net_hdr *hdr;
 
-		m = ifq_deq_begin(&ifp->if_snd);
+		m = ifq_deq_begin(ifq);
 		if (m == NULL)
 			break;
 
 		r = virtio_enqueue_prep(vq, &slot);
 		if (r == EAGAIN) {
-			ifq_deq_rollback(&ifp->if_snd, m);
-			ifq_set_oactive(&ifp->if_snd);
+			ifq_deq_rollback(ifq, m);
+			ifq_set_oactive(ifq);
 			break;
 		}
 		if (r != 0)
 			panic("enqueue_prep for a tx buffer: %d", r);
 
-		hdr = &sc->sc_tx_hdrs[slot];
+		hdr = &viq->viq_txhdrs[slot];
 		memset(hdr, 0, sc->sc_hdr_size);
 		if (m->m_pkthdr.csum_flags & (M_TCP_CSUM_OUT|M_UDP_CSUM_OUT)) {
-			struct mbuf *mip;
-			struct ip *ip;
-			int ehdrlen = ETHER_HDR_LEN;
-			int ipoff;
-#if NVLAN > 0
-			struct ether_vlan_header *eh;
-
-			eh = mtod(m, struct ether_vlan_header *);
-			if (eh->evl_encap_proto == htons(ETHERTYPE_VLAN))
-				ehdrlen += ETHER_VLAN_ENCAP_LEN;
-#endif
-
-			if (m->m_pkthdr.csum_flags & M_TCP_CSUM_OUT)
-				hdr->csum_offset = offsetof(struct tcphdr, th_sum);
-			else
-				hdr->csum_offset = offsetof(struct udphdr, uh_sum);
-
-			mip = m_getptr(m, ehdrlen, &ipoff);
-			KASSERT(mip != NULL && mip->m_len - ipoff >= sizeof(*ip));
-			ip = (struct ip *)(mip->m_data + ipoff);
-			hdr->csum_start = ehdrlen + (ip->ip_hl << 2);
-			hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+			if (vio_tx_offload(hdr, m) != 0) {
+				virtio_enqueue_abort(vq, slot);
+				ifq_deq_commit(ifq, m);
+				m_freem(m);
+				ifq->ifq_errors++;
+				continue;
+			}
 		}
 
-		r = vio_encap(sc, slot, m);
+		r = vio_encap(sc, viq, slot, m);
 		if (r != 0) {
 			virtio_enqueue_abort(vq, slot);
-			ifq_deq_commit(&ifp->if_snd, m);
+			ifq_deq_commit(ifq, m);
 			m_freem(m);
-			ifp->if_oerrors++;
+			ifq->ifq_errors++;
 			continue;
 		}
 		r = virtio_enqueue_reserve(vq, slot,
-		    sc->sc_tx_dmamaps[slot]->dm_nsegs + 1);
+		    viq->viq_txdmamaps[slot]->dm_nsegs + 1);
 		if (r != 0) {
 			bus_dmamap_unload(vsc->sc_dmat,
-			    sc->sc_tx_dmamaps[slot]);
-			ifq_deq_rollback(&ifp->if_snd, m);
-			sc->sc_tx_mbufs[slot] = NULL;
-			ifq_set_oactive(&ifp->if_snd);
+			    viq->viq_txdmamaps[slot]);
+			ifq_deq_rollback(ifq, m);
+			viq->viq_txmbufs[slot] = NULL;
+			ifq_set_oactive(ifq);
 			break;
 		}
-		ifq_deq_commit(&ifp->if_snd, m);
+		ifq_deq_commit(ifq, m);
 
-		bus_dmamap_sync(vsc->sc_dmat, sc->sc_tx_dmamaps[slot], 0,
-		    sc->sc_tx_dmamaps[slot]->dm_mapsize, BUS_DMASYNC_PREWRITE);
+		bus_dmamap_sync(vsc->sc_dmat, viq->viq_txdmamaps[slot], 0,
+		    viq->viq_txdmamaps[slot]->dm_mapsize, BUS_DMASYNC_PREWRITE);
 		VIO_DMAMEM_SYNC(vsc, sc, hdr, sc->sc_hdr_size,
 		    BUS_DMASYNC_PREWRITE);
 		VIO_DMAMEM_ENQUEUE(sc, vq, slot, hdr, sc->sc_hdr_size, 1);
-		virtio_enqueue(vq, slot, sc->sc_tx_dmamaps[slot], 1);
+		virtio_enqueue(vq, slot, viq->viq_txdmamaps[slot], 1);
 		virtio_enqueue_commit(vsc, vq, slot, 0);
 		queued++;
 #if NBPFILTER > 0
@@ -804,14 +1022,14 @@ again:
 			bpf_mtap(ifp->if_bpf, m, BPF_DIRECTION_OUT);
 #endif
 	}
-	if (ifq_is_oactive(&ifp->if_snd)) {
+	if (ifq_is_oactive(ifq)) {
 		int r;
 		if (virtio_has_feature(vsc, VIRTIO_F_RING_EVENT_IDX))
-			r = virtio_postpone_intr_smart(&sc->sc_vq[VQTX]);
+			r = virtio_postpone_intr_smart(vq);
 		else
-			r = virtio_start_vq_intr(vsc, &sc->sc_vq[VQTX]);
-		if (r) {
-			vio_txeof(vq);
+			r = virtio_start_vq_intr(vsc, vq);
+		if (r && vio_txeof(viq) > 0) {
+			ifq_clr_oactive(ifq);
 			goto again;
 		}
 	}
@@ -820,6 +1038,95 @@ again:
 		virtio_notify(vsc, vq);
 		timeout_add_sec(&sc->sc_txtick, 1);
 	}
+out:
+	mtx_leave(&viq->viq_txmtx);
+}
+
+/*
+ * Fill the virtio header for checksum and segmentation offload.
+ * The stack provides the pseudo header checksum in the packet, for
+ * TSO without the length, but the host wants it with the length of
+ * the whole payload.
+ */
+int
+vio_tx_offload(struct virtio_net_hdr *hdr, struct mbuf *m)
+{
+	struct ether_vlan_header *eh;
+	struct mbuf *mip;
+	struct tcphdr *th;
+	int ehdrlen = ETHER_HDR_LEN;
+	int iphlen, ipoff, thoff;
+	uint32_t sum;
+	uint16_t etype;
+	uint8_t ipproto;
+
+	eh = mtod(m, struct ether_vlan_header *);
+	etype = eh->evl_encap_proto;
+#if NVLAN > 0
+	if (etype == htons(ETHERTYPE_VLAN)) {
+		ehdrlen += ETHER_VLAN_ENCAP_LEN;
+		etype = eh->evl_proto;
+	}
+#endif
+
+	mip = m_getptr(m, ehdrlen, &ipoff);
+	if (mip == NULL)
+		return (EINVAL);
+
+	switch (ntohs(etype)) {
+	case ETHERTYPE_IP: {
+		struct ip *ip;
+
+		if (mip->m_len - ipoff < sizeof(*ip))
+			return (EINVAL);
+		ip = (struct ip *)(mip->m_data + ipoff);
+		iphlen = ip->ip_hl << 2;
+		ipproto = ip->ip_p;
+		break;
+	}
+#ifdef INET6
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr *ip6;
+
+		if (mip->m_len - ipoff < sizeof(*ip6))
+			return (EINVAL);
+		ip6 = (struct ip6_hdr *)(mip->m_data + ipoff);
+		iphlen = sizeof(*ip6);
+		ipproto = ip6->ip6_nxt;
+		break;
+	}
+#endif
+	default:
+		return (EINVAL);
+	}
+
+	if (m->m_pkthdr.csum_flags & M_TCP_CSUM_OUT)
+		hdr->csum_offset = offsetof(struct tcphdr, th_sum);
+	else
+		hdr->csum_offset = offsetof(struct udphdr, uh_sum);
+	hdr->csum_start = ehdrlen + iphlen;
+	hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+
+	if (!ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO))
+		return (0);
+
+	if (ipproto != IPPROTO_TCP || m->m_pkthdr.ph_mss == 0)
+		return (EINVAL);
+	mip = m_getptr(m, ehdrlen + iphlen, &thoff);
+	if (mip == NULL || mip->m_len - thoff < sizeof(*th))
+		return (EINVAL);
+	th = (struct tcphdr *)(mip->m_data + thoff);
+
+	hdr->gso_type = (ntohs(etype) == ETHERTYPE_IP) ?
+	    VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+	hdr->hdr_len = ehdrlen + iphlen + (th->th_off << 2);
+	hdr->gso_size = m->m_pkthdr.ph_mss;
+
+	/* add the payload length to the pseudo header checksum */
+	sum = th->th_sum + htons(m->m_pkthdr.len - ehdrlen - iphlen);
+	th->th_sum = (sum & 0xffff) + (sum >> 16);
+
+	return (0);
 }
 
 #if VIRTIO_DEBUG
@@ -827,18 +1134,22 @@ void
 vio_dump(struct vio_softc *sc)
 {
 	struct ifnet *ifp = &sc->sc_ac.ac_if;
-	struct virtio_softc *vsc = sc->sc_virtio;
+	struct vio_queue *viq;
+	int qidx;
 
 	printf("%s status dump:\n", ifp->if_xname);
-	printf("TX virtqueue:\n");
-	virtio_vq_dump(&vsc->sc_vqs[VQTX]);
 	printf("tx tick active: %d\n", !timeout_triggered(&sc->sc_txtick));
 	printf("rx tick active: %d\n", !timeout_triggered(&sc->sc_rxtick));
-	printf("RX virtqueue:\n");
-	virtio_vq_dump(&vsc->sc_vqs[VQRX]);
-	if (vsc->sc_nvqs == 3) {
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+		printf("TX virtqueue %d:\n", qidx);
+		virtio_vq_dump(viq->viq_txvq);
+		printf("RX virtqueue %d:\n", qidx);
+		virtio_vq_dump(viq->viq_rxvq);
+	}
+	if (sc->sc_ctl_vq != NULL) {
 		printf("CTL virtqueue:\n");
-		virtio_vq_dump(&vsc->sc_vqs[VQCTL]);
+		virtio_vq_dump(sc->sc_ctl_vq);
 		printf("ctrl_inuse: %d\n", sc->sc_ctrl_inuse);
 	}
 }
@@ -878,8 +1189,7 @@ vio_ioctl(struct ifnet *ifp, u_long cmd, caddr_t data)
 		r = ifmedia_ioctl(ifp, ifr, &sc->sc_media, cmd);
 		break;
 	case SIOCGIFRXR:
-		r = if_rxr_ioctl((struct if_rxrinfo *)ifr->ifr_data,
-		    NULL, MCLBYTES, &sc->sc_rx_ring);
+		r = vio_rxrinfo(sc, (struct if_rxrinfo *)ifr->ifr_data);
 		break;
 	default:
 		r = ether_ioctl(ifp, &sc->sc_ac, cmd, data);
@@ -894,12 +1204,33 @@ vio_ioctl(struct ifnet *ifp, u_long cmd, caddr_t data)
 	return r;
 }
 
+int
+vio_rxrinfo(struct vio_softc *sc, struct if_rxrinfo *ifri)
+{
+	struct if_rxring_info *ifr;
+	int error, i;
+
+	ifr = mallocarray(sc->sc_nqueues, sizeof(*ifr), M_TEMP,
+	    M_WAITOK | M_ZERO);
+
+	for (i = 0; i < sc->sc_nqueues; i++) {
+		ifr[i].ifr_size = MCLBYTES;
+		snprintf(ifr[i].ifr_name, sizeof(ifr[i].ifr_name), "%d", i);
+		ifr[i].ifr_info = sc->sc_q[i].viq_rxring;
+	}
+
+	error = if_rxr_info_ioctl(ifri, sc->sc_nqueues, ifr);
+	free(ifr, M_TEMP, sc->sc_nqueues * sizeof(*ifr));
+
+	return error;
+}
+
 /*
  * Receive implementation
  */
 /* allocate and initialize a mbuf for receive */
 int
-vio_add_rx_mbuf(struct vio_softc *sc, int i)
+vio_add_rx_mbuf(struct vio_softc *sc, struct vio_queue *viq, int i)
 {
 	struct mbuf *m;
 	int r;
@@ -907,13 +1238,13 @@ vio_add_rx_mbuf(struct vio_softc *sc, int i)
 	m = MCLGETL(NULL, M_DONTWAIT, MCLBYTES);
 	if (m == NULL)
 		return ENOBUFS;
-	sc->sc_rx_mbufs[i] = m;
+	viq->viq_rxmbufs[i] = m;
 	m->m_len = m->m_pkthdr.len = m->m_ext.ext_size;
-	r = bus_dmamap_load_mbuf(sc->sc_virtio->sc_dmat, sc->sc_rx_dmamaps[i],
-	    m, BUS_DMA_READ|BUS_DMA_NOWAIT);
+	r = bus_dmamap_load_mbuf(sc->sc_virtio->sc_dmat,
+	    viq->viq_rxdmamaps[i], m, BUS_DMA_READ|BUS_DMA_NOWAIT);
 	if (r) {
 		m_freem(m);
-		sc->sc_rx_mbufs[i] = NULL;
+		viq->viq_rxmbufs[i] = NULL;
 		return r;
 	}
 
@@ -922,24 +1253,26 @@ vio_add_rx_mbuf(struct vio_softc *sc, int i)
 
 /* free a mbuf for receive */
 void
-vio_free_rx_mbuf(struct vio_softc *sc, int i)
+vio_free_rx_mbuf(struct vio_softc *sc, struct vio_queue *viq, int i)
 {
-	bus_dmamap_unload(sc->sc_virtio->sc_dmat, sc->sc_rx_dmamaps[i]);
-	m_freem(sc->sc_rx_mbufs[i]);
-	sc->sc_rx_mbufs[i] = NULL;
+	bus_dmamap_unload(sc->sc_virtio->sc_dmat, viq->viq_rxdmamaps[i]);
+	m_freem(viq->viq_rxmbufs[i]);
+	viq->viq_rxmbufs[i] = NULL;
 }
 
 /* add mbufs for all the empty receive slots */
 void
-vio_populate_rx_mbufs(struct vio_softc *sc)
+vio_populate_rx_mbufs(struct vio_softc *sc, struct vio_queue *viq)
 {
 	struct virtio_softc *vsc = sc->sc_virtio;
 	int r, done = 0;
 	u_int slots;
-	struct virtqueue *vq = &sc->sc_vq[VQRX];
+	struct virtqueue *vq = viq->viq_rxvq;
 	int mrg_rxbuf = VIO_HAVE_MRG_RXBUF(sc);
 
-	for (slots = if_rxr_get(&sc->sc_rx_ring, vq->vq_num);
+	MUTEX_ASSERT_LOCKED(&viq->viq_rxmtx);
+
+	for (slots = if_rxr_get(&viq->viq_rxring, vq->vq_num);
 	    slots > 0; slots--) {
 		int slot;
 		r = virtio_enqueue_prep(vq, &slot);
@@ -947,38 +1280,38 @@ vio_populate_rx_mbufs(struct vio_softc *sc)
 			break;
 		if (r != 0)
 			panic("enqueue_prep for rx buffers: %d", r);
-		if (sc->sc_rx_mbufs[slot] == NULL) {
-			r = vio_add_rx_mbuf(sc, slot);
+		if (viq->viq_rxmbufs[slot] == NULL) {
+			r = vio_add_rx_mbuf(sc, viq, slot);
 			if (r != 0) {
 				virtio_enqueue_abort(vq, slot);
 				break;
 			}
 		}
 		r = virtio_enqueue_reserve(vq, slot,
-		    sc->sc_rx_dmamaps[slot]->dm_nsegs + (mrg_rxbuf ? 0 : 1));
+		    viq->viq_rxdmamaps[slot]->dm_nsegs + (mrg_rxbuf ? 0 : 1));
 		if (r != 0) {
-			vio_free_rx_mbuf(sc, slot);
+			vio_free_rx_mbuf(sc, viq, slot);
 			break;
 		}
-		bus_dmamap_sync(vsc->sc_dmat, sc->sc_rx_dmamaps[slot], 0,
+		bus_dmamap_sync(vsc->sc_dmat, viq->viq_rxdmamaps[slot], 0,
 		    MCLBYTES, BUS_DMASYNC_PREREAD);
 		if (mrg_rxbuf) {
-			virtio_enqueue(vq, slot, sc->sc_rx_dmamaps[slot], 0);
+			virtio_enqueue(vq, slot, viq->viq_rxdmamaps[slot], 0);
 		} else {
 			/*
 			 * Buggy kvm wants a buffer of exactly the size of
 			 * the header in this case, so we have to split in
 			 * two.
 			 */
-			virtio_enqueue_p(vq, slot, sc->sc_rx_dmamaps[slot],
+			virtio_enqueue_p(vq, slot, viq->viq_rxdmamaps[slot],
 			    0, sc->sc_hdr_size, 0);
-			virtio_enqueue_p(vq, slot, sc->sc_rx_dmamaps[slot],
+			virtio_enqueue_p(vq, slot, viq->viq_rxdmamaps[slot],
 			    sc->sc_hdr_size, MCLBYTES - sc->sc_hdr_size, 0);
 		}
 		virtio_enqueue_commit(vsc, vq, slot, 0);
 		done = 1;
 	}
-	if_rxr_put(&sc->sc_rx_ring, slots);
+	if_rxr_put(&viq->viq_rxring, slots);
 
 	if (done)
 		virtio_notify(vsc, vq);
@@ -987,27 +1320,29 @@ vio_populate_rx_mbufs(struct vio_softc *sc)
 
 /* dequeue received packets */
 int
-vio_rxeof(struct vio_softc *sc)
+vio_rxeof(struct vio_queue *viq)
 {
+	struct vio_softc *sc = viq->viq_sc;
 	struct virtio_softc *vsc = sc->sc_virtio;
-	struct virtqueue *vq = &sc->sc_vq[VQRX];
-	struct ifnet *ifp = &sc->sc_ac.ac_if;
+	struct virtqueue *vq = viq->viq_rxvq;
 	struct mbuf_list ml = MBUF_LIST_INITIALIZER();
 	struct mbuf *m, *m0 = NULL, *mlast;
 	int r = 0;
 	int slot, len, bufs_left;
 	struct virtio_net_hdr *hdr;
 
+	MUTEX_ASSERT_LOCKED(&viq->viq_rxmtx);
+
 	while (virtio_dequeue(vsc, vq, &slot, &len) == 0) {
 		r = 1;
-		bus_dmamap_sync(vsc->sc_dmat, sc->sc_rx_dmamaps[slot], 0,
+		bus_dmamap_sync(vsc->sc_dmat, viq->viq_rxdmamaps[slot], 0,
 		    MCLBYTES, BUS_DMASYNC_POSTREAD);
-		m = sc->sc_rx_mbufs[slot];
+		m = viq->viq_rxmbufs[slot];
 		KASSERT(m != NULL);
-		bus_dmamap_unload(vsc->sc_dmat, sc->sc_rx_dmamaps[slot]);
-		sc->sc_rx_mbufs[slot] = NULL;
+		bus_dmamap_unload(vsc->sc_dmat, viq->viq_rxdmamaps[slot]);
+		viq->viq_rxmbufs[slot] = NULL;
 		virtio_dequeue_commit(vq, slot);
-		if_rxr_put(&sc->sc_rx_ring, 1);
+		if_rxr_put(&viq->viq_rxring, 1);
 		m->m_len = m->m_pkthdr.len = len;
 		m->m_pkthdr.csum_flags = 0;
 		if (m0 == NULL) {
@@ -1035,12 +1370,12 @@ vio_rxeof(struct vio_softc *sc)
 		DPRINTF("%s: expected %d buffers, got %d\n", __func__,
 		    (int)hdr->num_buffers,
 		    (int)hdr->num_buffers - bufs_left);
-		ifp->if_ierrors++;
+		viq->viq_ifiq->ifiq_errors++;
 		m_freem(m0);
 	}
 
-	if (ifiq_input(&ifp->if_rcv, &ml))
-		if_rxr_livelocked(&sc->sc_rx_ring);
+	if (ifiq_input(viq->viq_ifiq, &ml))
+		if_rxr_livelocked(&viq->viq_rxring);
 
 	return r;
 }
@@ -1050,19 +1385,22 @@ vio_rx_intr(struct virtqueue *vq)
 {
 	struct virtio_softc *vsc = vq->vq_owner;
 	struct vio_softc *sc = (struct vio_softc *)vsc->sc_child;
+	struct vio_queue *viq = VIO_VQ2Q(sc, vq);
 	int r, sum = 0;
 
+	mtx_enter(&viq->viq_rxmtx);
 again:
-	r = vio_rxeof(sc);
+	r = vio_rxeof(viq);
 	sum += r;
 	if (r) {
-		vio_populate_rx_mbufs(sc);
+		vio_populate_rx_mbufs(sc, viq);
 		/* set used event index to the next slot */
 		if (virtio_has_feature(vsc, VIRTIO_F_RING_EVENT_IDX)) {
 			if (virtio_start_vq_intr(vq->vq_owner, vq))
 				goto again;
 		}
 	}
+	mtx_leave(&viq->viq_rxmtx);
 
 	return sum;
 }
@@ -1070,27 +1408,36 @@ again:
 void
 vio_rxtick(void *arg)
 {
-	struct virtqueue *vq = arg;
-	struct virtio_softc *vsc = vq->vq_owner;
-	struct vio_softc *sc = (struct vio_softc *)vsc->sc_child;
-	int s;
+	struct vio_softc *sc = arg;
+	struct vio_queue *viq;
+	int qidx;
 
-	s = splnet();
-	vio_populate_rx_mbufs(sc);
-	splx(s);
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+
+		mtx_enter(&viq->viq_rxmtx);
+		vio_populate_rx_mbufs(sc, viq);
+		mtx_leave(&viq->viq_rxmtx);
+	}
 }
 
 /* free all the mbufs; called from if_stop(disable) */
 void
 vio_rx_drain(struct vio_softc *sc)
 {
-	struct virtqueue *vq = &sc->sc_vq[VQRX];
-	int i;
+	struct vio_queue *viq;
+	int i, qidx;
 
-	for (i = 0; i < vq->vq_num; i++) {
-		if (sc->sc_rx_mbufs[i] == NULL)
-			continue;
-		vio_free_rx_mbuf(sc, i);
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+
+		mtx_enter(&viq->viq_rxmtx);
+		for (i = 0; i < viq->viq_rxvq->vq_num; i++) {
+			if (viq->viq_rxmbufs[i] == NULL)
+				continue;
+			vio_free_rx_mbuf(sc, viq, i);
+		}
+		mtx_leave(&viq->viq_rxmtx);
 	}
 }
 
@@ -1101,7 +1448,7 @@ vio_rx_drain(struct vio_softc *sc)
 /* tx interrupt; dequeue and free mbufs */
 /*
  * tx interrupt is actually disabled unless the tx queue is full, i.e.
- * IFF_OACTIVE is set. vio_txtick is used to make sure that mbufs
+ * the ifq is oactive. vio_txtick is used to make sure that mbufs
  * are dequeued and freed even if no further transfer happens.
  */
 int
@@ -1109,64 +1456,68 @@ vio_tx_intr(struct virtqueue *vq)
 {
 	struct virtio_softc *vsc = vq->vq_owner;
 	struct vio_softc *sc = (struct vio_softc *)vsc->sc_child;
-	struct ifnet *ifp = &sc->sc_ac.ac_if;
+	struct vio_queue *viq = VIO_VQ2Q(sc, vq);
 	int r;
 
-	r = vio_txeof(vq);
-	vio_start(ifp);
+	mtx_enter(&viq->viq_txmtx);
+	r = vio_txeof(viq);
+	mtx_leave(&viq->viq_txmtx);
+	if (r && ifq_is_oactive(viq->viq_ifq))
+		ifq_restart(viq->viq_ifq);
 	return r;
 }
 
 void
 vio_txtick(void *arg)
 {
-	struct virtqueue *vq = arg;
-	int s = splnet();
-	vio_tx_intr(vq);
-	splx(s);
+	struct vio_softc *sc = arg;
+	int qidx;
+
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++)
+		vio_tx_intr(sc->sc_q[qidx].viq_txvq);
 }
 
 int
-vio_txeof(struct virtqueue *vq)
+vio_txeof(struct vio_queue *viq)
 {
-	struct virtio_softc *vsc = vq->vq_owner;
-	struct vio_softc *sc = (struct vio_softc *)vsc->sc_child;
-	struct ifnet *ifp = &sc->sc_ac.ac_if;
+	struct vio_softc *sc = viq->viq_sc;
+	struct virtio_softc *vsc = sc->sc_virtio;
+	struct virtqueue *vq = viq->viq_txvq;
 	struct mbuf *m;
 	int r = 0;
 	int slot, len;
 
+	MUTEX_ASSERT_LOCKED(&viq->viq_txmtx);
+
 	while (virtio_dequeue(vsc, vq, &slot, &len) == 0) {
-		struct virtio_net_hdr *hdr = &sc->sc_tx_hdrs[slot];
+		struct virtio_net_hdr *hdr = &viq->viq_txhdrs[slot];
 		r++;
 		VIO_DMAMEM_SYNC(vsc, sc, hdr, sc->sc_hdr_size,
 		    BUS_DMASYNC_POSTWRITE);
-		bus_dmamap_sync(vsc->sc_dmat, sc->sc_tx_dmamaps[slot], 0,
-		    sc->sc_tx_dmamaps[slot]->dm_mapsize,
+		bus_dmamap_sync(vsc->sc_dmat, viq->viq_txdmamaps[slot], 0,
+		    viq->viq_txdmamaps[slot]->dm_mapsize,
 		    BUS_DMASYNC_POSTWRITE);
-		m = sc->sc_tx_mbufs[slot];
-		bus_dmamap_unload(vsc->sc_dmat, sc->sc_tx_dmamaps[slot]);
-		sc->sc_tx_mbufs[slot] = NULL;
+		m = viq->viq_txmbufs[slot];
+		bus_dmamap_unload(vsc->sc_dmat, viq->viq_txdmamaps[slot]);
+		viq->viq_txmbufs[slot] = NULL;
 		virtio_dequeue_commit(vq, slot);
 		m_freem(m);
 	}
 
-	if (r) {
-		ifq_clr_oactive(&ifp->if_snd);
-		virtio_stop_vq_intr(vsc, &sc->sc_vq[VQTX]);
-	}
-	if (vq->vq_used_idx == vq->vq_avail_idx)
-		timeout_del(&sc->sc_txtick);
-	else if (r)
+	if (r)
+		virtio_stop_vq_intr(vsc, vq);
+	/* the tick is shared by all queues, so only ever push it out */
+	if (r && vq->vq_used_idx != vq->vq_avail_idx)
 		timeout_add_sec(&sc->sc_txtick, 1);
 	return r;
 }
 
 int
-vio_encap(struct vio_softc *sc, int slot, struct mbuf *m)
+vio_encap(struct vio_softc *sc, struct vio_queue *viq, int slot,
+    struct mbuf *m)
 {
 	struct virtio_softc	*vsc = sc->sc_virtio;
-	bus_dmamap_t		 dmap= sc->sc_tx_dmamaps[slot];
+	bus_dmamap_t		 dmap= viq->viq_txdmamaps[slot];
 	int			 r;
 
 	r = bus_dmamap_load_mbuf(vsc->sc_dmat, dmap, m,
@@ -1184,7 +1535,7 @@ vio_encap(struct vio_softc *sc, int slot, struct mbuf *m)
 	default:
 		return ENOBUFS;
 	}
-	sc->sc_tx_mbufs[slot] = m;
+	viq->viq_txmbufs[slot] = m;
 	return 0;
 }
 
@@ -1193,15 +1544,22 @@ void
 vio_tx_drain(struct vio_softc *sc)
 {
 	struct virtio_softc *vsc = sc->sc_virtio;
-	struct virtqueue *vq = &sc->sc_vq[VQTX];
-	int i;
+	struct vio_queue *viq;
+	int i, qidx;
 
-	for (i = 0; i < vq->vq_num; i++) {
-		if (sc->sc_tx_mbufs[i] == NULL)
-			continue;
-		bus_dmamap_unload(vsc->sc_dmat, sc->sc_tx_dmamaps[i]);
-		m_freem(sc->sc_tx_mbufs[i]);
-		sc->sc_tx_mbufs[i] = NULL;
+	for (qidx = 0; qidx < sc->sc_nqueues; qidx++) {
+		viq = &sc->sc_q[qidx];
+
+		mtx_enter(&viq->viq_txmtx);
+		for (i = 0; i < viq->viq_txvq->vq_num; i++) {
+			if (viq->viq_txmbufs[i] == NULL)
+				continue;
+			bus_dmamap_unload(vsc->sc_dmat,
+			    viq->viq_txdmamaps[i]);
+			m_freem(viq->viq_txmbufs[i]);
+			viq->viq_txmbufs[i] = NULL;
+		}
+		mtx_leave(&viq->viq_txmtx);
 	}
 }
 
@@ -1213,7 +1571,7 @@ int
 vio_ctrl_rx(struct vio_softc *sc, int cmd, int onoff)
 {
 	struct virtio_softc *vsc = sc->sc_virtio;
-	struct virtqueue *vq = &sc->sc_vq[VQCTL];
+	struct virtqueue *vq = sc->sc_ctl_vq;
 	int r, slot;
 
 	splassert(IPL_NET);
@@ -1269,6 +1627,90 @@ out:
 	return r;
 }
 
+/*
+ * issue a VIRTIO_NET_CTRL_MQ class command to enable all our queue pairs
+ * and wait for completion. If the device does RSS, program the hash key
+ * and spread the indirection table over the queues, otherwise leave it to
+ * the device to steer flows.
+ */
+int
+vio_ctrl_mq(struct vio_softc *sc)
+{
+	struct virtio_softc *vsc = sc->sc_virtio;
+	struct virtqueue *vq = sc->sc_ctl_vq;
+	struct virtio_net_ctrl_rss *rss = sc->sc_ctrl_rss;
+	void *arg;
+	size_t arglen;
+	int r, slot, i;
+
+	splassert(IPL_NET);
+
+	if ((r = vio_wait_ctrl(sc)) != 0)
+		return r;
+
+	sc->sc_ctrl_cmd->class = VIRTIO_NET_CTRL_MQ;
+	if (sc->sc_rss_hash_types != 0) {
+		sc->sc_ctrl_cmd->command = VIRTIO_NET_CTRL_MQ_RSS_CONFIG;
+		rss->hash_types = htole32(sc->sc_rss_hash_types);
+		rss->indirection_table_mask =
+		    htole16(VIRTIO_NET_RSS_TABLE_LEN - 1);
+		rss->unclassified_queue = htole16(0);
+		for (i = 0; i < VIRTIO_NET_RSS_TABLE_LEN; i++)
+			rss->indirection_table[i] = htole16(i % sc->sc_nqueues);
+		rss->max_tx_vq = htole16(sc->sc_nqueues);
+		rss->hash_key_length = sizeof(rss->hash_key_data);
+		stoeplitz_to_key(rss->hash_key_data,
+		    sizeof(rss->hash_key_data));
+		arg = rss;
+		arglen = sizeof(*rss);
+	} else {
+		sc->sc_ctrl_cmd->command = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+		sc->sc_ctrl_mq->virtqueue_pairs = htole16(sc->sc_nqueues);
+		arg = sc->sc_ctrl_mq;
+		arglen = sizeof(*sc->sc_ctrl_mq);
+	}
+
+	VIO_DMAMEM_SYNC(vsc, sc, sc->sc_ctrl_cmd,
+	    sizeof(*sc->sc_ctrl_cmd), BUS_DMASYNC_PREWRITE);
+	VIO_DMAMEM_SYNC(vsc, sc, arg, arglen, BUS_DMASYNC_PREWRITE);
+	VIO_DMAMEM_SYNC(vsc, sc, sc->sc_ctrl_status,
+	    sizeof(*sc->sc_ctrl_status), BUS_DMASYNC_PREREAD);
+
+	r = virtio_enqueue_prep(vq, &slot);
+	if (r != 0)
+		panic("%s: control vq busy!?", sc->sc_dev.dv_xname);
+	r = virtio_enqueue_reserve(vq, slot, 3);
+	if (r != 0)
+		panic("%s: control vq busy!?", sc->sc_dev.dv_xname);
+	VIO_DMAMEM_ENQUEUE(sc, vq, slot, sc->sc_ctrl_cmd,
+	    sizeof(*sc->sc_ctrl_cmd), 1);
+	VIO_DMAMEM_ENQUEUE(sc, vq, slot, arg, arglen, 1);
+	VIO_DMAMEM_ENQUEUE(sc, vq, slot, sc->sc_ctrl_status,
+	    sizeof(*sc->sc_ctrl_status), 0);
+	virtio_enqueue_commit(vsc, vq, slot, 1);
+
+	if ((r = vio_wait_ctrl_done(sc)) != 0)
+		goto out;
+
+	VIO_DMAMEM_SYNC(vsc, sc, sc->sc_ctrl_cmd,
+	    sizeof(*sc->sc_ctrl_cmd), BUS_DMASYNC_POSTWRITE);
+	VIO_DMAMEM_SYNC(vsc, sc, arg, arglen, BUS_DMASYNC_POSTWRITE);
+	VIO_DMAMEM_SYNC(vsc, sc, sc->sc_ctrl_status,
+	    sizeof(*sc->sc_ctrl_status), BUS_DMASYNC_POSTREAD);
+
+	if (sc->sc_ctrl_status->ack == VIRTIO_NET_OK) {
+		r = 0;
+	} else {
+		printf("%s: failed setting %u queues\n", sc->sc_dev.dv_xname,
+		    sc->sc_nqueues);
+		r = EIO;
+	}
+
+out:
+	vio_ctrl_wakeup(sc, FREE);
+	return r;
+}
+
 /*
  * XXXSMP As long as some per-ifp ioctl(2)s are executed with the
  * NET_LOCK() deadlocks are possible.  So release it here.
@@ -1332,16 +1774,18 @@ vio_ctrleof(struct virtqueue *vq)
 	struct vio_softc *sc = (struct vio_softc *)vsc->sc_child;
 	int r = 0, ret, slot;
 
+	KERNEL_LOCK();
 again:
 	ret = virtio_dequeue(vsc, vq, &slot, NULL);
 	if (ret == ENOENT)
-		return r;
+		goto out;
 	virtio_dequeue_commit(vq, slot);
 	r++;
 	vio_ctrl_wakeup(sc, DONE);
 	if (virtio_start_vq_intr(vsc, vq))
 		goto again;
-
+out:
+	KERNEL_UNLOCK();
 	return r;
 }
 
@@ -1351,7 +1795,7 @@ vio_set_rx_filter(struct vio_softc *sc)
 {
 	/* filter already set in sc_ctrl_mac_tbl */
 	struct virtio_softc *vsc = sc->sc_virtio;
-	struct virtqueue *vq = &sc->sc_vq[VQCTL];
+	struct virtqueue *vq = sc->sc_ctl_vq;
 	int r, slot;
 
 	splassert(IPL_NET);
@@ -1413,7 +1857,6 @@ out:
 void
 vio_iff(struct vio_softc *sc)
 {
-	struct virtio_softc *vsc = sc->sc_virtio;
 	struct ifnet *ifp = &sc->sc_ac.ac_if;
 	struct arpcom *ac = &sc->sc_ac;
 	struct ether_multi *enm;
@@ -1426,7 +1869,7 @@ vio_iff(struct vio_softc *sc)
 
 	ifp->if_flags &= ~IFF_ALLMULTI;
 
-	if (vsc->sc_nvqs < 3) {
+	if (sc->sc_ctl_vq == NULL) {
 		/* no ctrl vq; always promisc */
 		ifp->if_flags |= IFF_ALLMULTI | IFF_PROMISC;
 		return;
@@ -1460,7 +1903,7 @@ vio_iff(struct vio_softc *sc)
 
 	sc->sc_ctrl_mac_tbl_mc->nentries = rxfilter ? nentries : 0;
 
-	if (vsc->sc_nvqs < 3)
+	if (sc->sc_ctl_vq == NULL)
 		return;
 
 	r = vio_set_rx_filter(sc);
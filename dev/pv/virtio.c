@@ -686,13 +686,13 @@ notify:
 			virtio_membar_sync();
 			t = VQ_AVAIL_EVENT(vq) + 1;
 			if ((uint16_t)(n - t) < (uint16_t)(n - o))
-				sc->sc_ops->kick(sc, vq->vq_index);
+				sc->sc_ops->kick(sc, vq);
 		} else {
 			publish_avail_idx(sc, vq);
 
 			virtio_membar_sync();
 			if (!(vq->vq_used->flags & VRING_USED_F_NO_NOTIFY))
-				sc->sc_ops->kick(sc, vq->vq_index);
+				sc->sc_ops->kick(sc, vq);
 		}
 	}
 }
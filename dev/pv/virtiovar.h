@@ -133,6 +133,8 @@ struct virtqueue {
 
 	/* interrupt handler */
 	int			(*vq_done)(struct virtqueue*);
+	/* with per-vq MSI-X, the cpu to run vq_done on (NULL for any) */
+	struct cpu_info		*vq_intr_cpu;
 	/* 1.x only: offset for notify address calculation */
 	uint32_t		vq_notify_off;
 };
@@ -143,7 +145,7 @@ struct virtio_feature_name {
 };
 
 struct virtio_ops {
-	void		(*kick)(struct virtio_softc *, uint16_t);
+	void		(*kick)(struct virtio_softc *, struct virtqueue *);
 	uint8_t		(*read_dev_cfg_1)(struct virtio_softc *, int);
 	uint16_t	(*read_dev_cfg_2)(struct virtio_softc *, int);
 	uint32_t	(*read_dev_cfg_4)(struct virtio_softc *, int);
@@ -157,6 +159,7 @@ struct virtio_ops {
 	void		(*set_status)(struct virtio_softc *, int);
 	int		(*neg_features)(struct virtio_softc *, const struct virtio_feature_name *);
 	int		(*poll_intr)(void *);
+	void		(*intr_barrier)(struct virtio_softc *);
 };
 
 #define VIRTIO_CHILD_ERROR	((void*)1)
@@ -196,6 +199,7 @@ struct virtio_softc {
 #define	virtio_read_queue_size(sc, i)		(sc)->sc_ops->read_queue_size(sc, i)
 #define	virtio_setup_queue(sc, i, v)		(sc)->sc_ops->setup_queue(sc, i, v)
 #define	virtio_negotiate_features(sc, n)	(sc)->sc_ops->neg_features(sc, n)
+#define	virtio_intr_barrier(sc)			(sc)->sc_ops->intr_barrier(sc)
 #define	virtio_poll_intr(sc)			(sc)->sc_ops->poll_intr(sc)
 
 /* only for transport drivers */
@@ -203,7 +207,7 @@ struct virtio_softc {
 #define	virtio_device_reset(sc)			virtio_set_status((sc), 0)
 
 static inline int
-virtio_has_feature(struct virtio_softc *sc, unsigned int fbit)
+virtio_has_feature(struct virtio_softc *sc, uint64_t fbit)
 {
 	if (sc->sc_active_features & fbit)
 		return 1;
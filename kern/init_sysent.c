@@ -334,8 +334,8 @@ const struct sysent sysent[] = {
 	    sys_nosys },			/* 149 = obsolete oquota */
 	{ 1, s(struct sys_ypconnect_args), SY_NOLOCK | 0,
 	    sys_ypconnect },			/* 150 = ypconnect */
-	{ 0, 0, 0,
-	    sys_nosys },			/* 151 = unimplemented */
+	{ 4, s(struct sys_sendfile_args), 0,
+	    sys_sendfile },			/* 151 = sendfile */
 	{ 0, 0, 0,
 	    sys_nosys },			/* 152 = unimplemented */
 	{ 0, 0, 0,
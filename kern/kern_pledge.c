@@ -191,6 +191,7 @@ const uint64_t pledge_syscalls[SYS_MAXSYSCALL] = {
 	 * "unix", "dns".
 	 */
 	[SYS_sendto] = PLEDGE_STDIO,
+	[SYS_sendfile] = PLEDGE_STDIO,
 
 	/*
 	 * Address specification required a network pledge ("inet",
@@ -171,7 +171,7 @@ const char *const syscallnames[] = {
 	"quotactl",			/* 148 = quotactl */
 	"#149 (obsolete oquota)",		/* 149 = obsolete oquota */
 	"ypconnect",			/* 150 = ypconnect */
-	"#151 (unimplemented)",		/* 151 = unimplemented */
+	"sendfile",			/* 151 = sendfile */
 	"#152 (unimplemented)",		/* 152 = unimplemented */
 	"#153 (unimplemented)",		/* 153 = unimplemented */
 	"#154 (unimplemented)",		/* 154 = unimplemented */
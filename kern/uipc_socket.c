@@ -64,6 +64,7 @@ void	soidle(void *);
 void	sotask(void *);
 void	soreaper(void *);
 void	soput(void *);
+struct taskq *sosplice_taskq_next(void);
 int	somove(struct socket *, int);
 void	sorflush(struct socket *);
 
@@ -121,8 +122,12 @@ int	sominconn = SOMINCONN;
 
 struct pool socket_pool;
 #ifdef SOCKET_SPLICE
+#define	SOSPLICE_MAXTASKQ	32	/* at most one task queue per cpu */
+
 struct pool sosplice_pool;
-struct taskq *sosplice_taskq;
+struct taskq *sosplice_taskq[SOSPLICE_MAXTASKQ];
+unsigned int sosplice_ntaskq;
+unsigned int sosplice_nexttaskq;
 struct rwlock sosplice_lock = RWLOCK_INITIALIZER("sosplicelk");
 #endif
 
@@ -1239,23 +1244,29 @@ sosplice(struct socket *so, int fd, off_t max, struct timeval *tv)
 	struct socket	*sosp;
 	struct sosplice	*sp;
 	struct taskq	*tq;
-	int		 error = 0;
+	int		 error = 0, i;
 
 	soassertlocked(so);
 
-	if (sosplice_taskq == NULL) {
+	if (sosplice_ntaskq == 0) {
 		rw_enter_write(&sosplice_lock);
-		if (sosplice_taskq == NULL) {
-			tq = taskq_create("sosplice", 1, IPL_SOFTNET,
-			    TASKQ_MPSAFE);
-			/* Ensure the taskq is fully visible to other CPUs. */
+		if (sosplice_ntaskq == 0) {
+			for (i = 0; i < min(ncpus, SOSPLICE_MAXTASKQ); i++) {
+				tq = taskq_create("sosplice", 1, IPL_SOFTNET,
+				    TASKQ_MPSAFE);
+				if (tq == NULL)
+					break;
+				sosplice_taskq[i] = tq;
+			}
+			/* Ensure the taskqs are fully visible to other CPUs. */
 			membar_producer();
-			sosplice_taskq = tq;
+			sosplice_ntaskq = i;
 		}
 		rw_exit_write(&sosplice_lock);
 	}
-	if (sosplice_taskq == NULL)
+	if (sosplice_ntaskq == 0)
 		return (ENOMEM);
+	membar_consumer();
 
 	if ((so->so_proto->pr_flags & PR_SPLICE) == 0)
 		return (EPROTONOSUPPORT);
@@ -1266,6 +1277,7 @@ sosplice(struct socket *so, int fd, off_t max, struct timeval *tv)
 		return (ENOTCONN);
 	if (so->so_sp == NULL) {
 		sp = pool_get(&sosplice_pool, PR_WAITOK | PR_ZERO);
+		sp->ssp_taskq = sosplice_taskq_next();
 		if (so->so_sp == NULL)
 			so->so_sp = sp;
 		else
@@ -1301,6 +1313,7 @@ sosplice(struct socket *so, int fd, off_t max, struct timeval *tv)
 	}
 	if (sosp->so_sp == NULL) {
 		sp = pool_get(&sosplice_pool, PR_WAITOK | PR_ZERO);
+		sp->ssp_taskq = sosplice_taskq_next();
 		if (sosp->so_sp == NULL)
 			sosp->so_sp = sp;
 		else
@@ -1366,12 +1379,25 @@ sosplice(struct socket *so, int fd, off_t max, struct timeval *tv)
 	return (error);
 }
 
+/*
+ * Spread the splicing work of all sockets over the task queues.  A
+ * socket stays on its task queue until it is freed.
+ */
+struct taskq *
+sosplice_taskq_next(void)
+{
+	unsigned int i;
+
+	i = atomic_inc_int_nv(&sosplice_nexttaskq);
+	return (sosplice_taskq[i % sosplice_ntaskq]);
+}
+
 void
 sounsplice(struct socket *so, struct socket *sosp, int freeing)
 {
 	soassertlocked(so);
 
-	task_del(sosplice_taskq, &so->so_splicetask);
+	task_del(so->so_sp->ssp_taskq, &so->so_splicetask);
 	timeout_del(&so->so_idleto);
 	sosp->so_snd.sb_flags &= ~SB_SPLICE;
 	so->so_rcv.sb_flags &= ~SB_SPLICE;
@@ -1401,6 +1427,12 @@ sotask(void *arg)
 {
 	struct socket *so = arg;
 
+	/*
+	 * XXX For inet sockets solock() is the exclusive net lock, so the
+	 * splicing tasks of different task queues still run one at a
+	 * time.  somove() has to run with the shared net lock and the
+	 * socket buffer locks before they can run in parallel.
+	 */
 	solock(so);
 	if (so->so_rcv.sb_flags & SB_SPLICE) {
 		/*
@@ -1421,7 +1453,7 @@ sotask(void *arg)
  * lock.  As sofree() can be called anytime, sotask() or soidle() could access
  * the socket memory of a freed socket after wakeup.  So delay the pool_put()
  * after all pending socket splicing tasks or timeouts have finished.  Do this
- * by scheduling it on the same threads.
+ * by scheduling it on the same threads, the task queue of the socket.
  */
 void
 soreaper(void *arg)
@@ -1430,7 +1462,7 @@ soreaper(void *arg)
 
 	/* Reuse splice task, sounsplice() has been called before. */
 	task_set(&so->so_sp->ssp_task, soput, so);
-	task_add(sosplice_taskq, &so->so_sp->ssp_task);
+	task_add(so->so_sp->ssp_taskq, &so->so_sp->ssp_task);
 }
 
 void
@@ -1743,7 +1775,7 @@ sorwakeup(struct socket *so)
 		 * Using a thread would make things slower.
 		 */
 		if (so->so_proto->pr_flags & PR_WANTRCVD)
-			task_add(sosplice_taskq, &so->so_splicetask);
+			task_add(so->so_sp->ssp_taskq, &so->so_splicetask);
 		else
 			somove(so, M_DONTWAIT);
 	}
@@ -1761,8 +1793,11 @@ sowwakeup(struct socket *so)
 	soassertlocked(so);
 
 #ifdef SOCKET_SPLICE
-	if (so->so_snd.sb_flags & SB_SPLICE)
-		task_add(sosplice_taskq, &so->so_sp->ssp_soback->so_splicetask);
+	if (so->so_snd.sb_flags & SB_SPLICE) {
+		struct socket *soback = so->so_sp->ssp_soback;
+
+		task_add(soback->so_sp->ssp_taskq, &soback->so_splicetask);
+	}
 	if (issplicedback(so))
 		return;
 #endif
@@ -814,6 +814,120 @@ bad:
 	return (error);
 }
 
+/*
+ * Send data from a file to a stream socket.  The file is read straight
+ * into mbuf clusters which are then queued on the socket, so the data is
+ * copied once inside the kernel instead of through a userland buffer.
+ * A zero nbytes sends everything up to the end of the file.
+ */
+int
+sys_sendfile(struct proc *p, void *v, register_t *retval)
+{
+	struct sys_sendfile_args /* {
+		syscallarg(int) fd;
+		syscallarg(int) s;
+		syscallarg(size_t) nbytes;
+		syscallarg(off_t) offset;
+	} */ *uap = v;
+	struct file *fp, *sfp = NULL;
+	struct socket *so;
+	struct vnode *vp;
+	struct mbuf *m;
+	struct uio auio;
+	struct iovec aiov;
+	size_t resid, len, sent = 0;
+	off_t offset;
+	int flags = 0, error;
+
+	offset = SCARG(uap, offset);
+	resid = SCARG(uap, nbytes);
+	if (offset < 0 || resid > SSIZE_MAX)
+		return (EINVAL);
+	if (resid == 0)
+		resid = SSIZE_MAX;
+
+	if ((error = getvnode(p, SCARG(uap, fd), &fp)) != 0)
+		return (error);
+	vp = fp->f_data;
+	if ((fp->f_flag & FREAD) == 0) {
+		error = EBADF;
+		goto bad;
+	}
+	if (vp->v_type != VREG) {
+		error = EINVAL;
+		goto bad;
+	}
+	if ((error = getsock(p, SCARG(uap, s), &sfp)) != 0)
+		goto bad;
+	so = sfp->f_data;
+	if (so->so_type != SOCK_STREAM) {
+		error = EINVAL;
+		goto bad;
+	}
+	if (sfp->f_flag & FNONBLOCK)
+		flags |= MSG_DONTWAIT;
+
+	while (resid > 0) {
+		/* sosend() wants a prepackaged chain to fit in one go. */
+		len = ulmin(resid, MAXMCLBYTES);
+		len = ulmin(len, so->so_snd.sb_hiwat);
+
+		m = m_clget(NULL, M_WAIT, len);
+		if (m == NULL) {
+			error = ENOBUFS;
+			break;
+		}
+
+		aiov.iov_base = mtod(m, caddr_t);
+		aiov.iov_len = len;
+		auio.uio_iov = &aiov;
+		auio.uio_iovcnt = 1;
+		auio.uio_segflg = UIO_SYSSPACE;
+		auio.uio_rw = UIO_READ;
+		auio.uio_procp = p;
+		auio.uio_offset = offset;
+		auio.uio_resid = len;
+
+		error = (*fp->f_ops->fo_read)(fp, &auio, FO_POSITION);
+		len -= auio.uio_resid;
+		if (error != 0 || len == 0) {
+			/* Read error or end of file. */
+			m_freem(m);
+			break;
+		}
+		m->m_len = m->m_pkthdr.len = len;
+
+		error = sosend(so, NULL, NULL, m, NULL, flags);
+		if (error != 0)
+			break;
+
+		offset += len;
+		resid -= len;
+		sent += len;
+	}
+
+	if (error == EPIPE) {
+		KERNEL_LOCK();
+		ptsignal(p, SIGPIPE, STHREAD);
+		KERNEL_UNLOCK();
+	}
+	if (sent > 0 && (error == ERESTART || error == EINTR ||
+	    error == EWOULDBLOCK))
+		error = 0;
+	if (error == 0) {
+		*retval = sent;
+		mtx_enter(&sfp->f_mtx);
+		sfp->f_wxfer++;
+		sfp->f_wbytes += sent;
+		mtx_leave(&sfp->f_mtx);
+	}
+bad:
+	if (sfp != NULL)
+		FRELE(sfp, p);
+	FRELE(fp, p);
+	return (error);
+}
+
 int
 sys_recvfrom(struct proc *p, void *v, register_t *retval)
 {
@@ -906,6 +1020,7 @@ sys_recvmmsg(struct proc *p, void *v, register_t *retval)
 		syscallarg(int)			flags;
 		syscallarg(struct timespec *)	timeout;
 	} */ *uap = v;
+	struct file *fp;
 	struct mmsghdr mmsg, *mmsgp;
 	struct timespec ts, now, *timeout;
 	struct iovec aiov[UIO_SMALLIOV], *uiov, *iov = aiov;
@@ -938,6 +1053,10 @@ sys_recvmmsg(struct proc *p, void *v, register_t *retval)
 	if (vlen > 1024)
 		vlen = 1024;
 
+	/* Hold the socket for the whole vector, not once per datagram. */
+	if ((error = getsock(p, s, &fp)) != 0)
+		return (error);
+
 	mmsgp = SCARG(uap, mmsg);
 	for (dgrams = 0; dgrams < vlen;) {
 		error = copyin(&mmsgp[dgrams], &mmsg, sizeof(mmsg));
@@ -970,7 +1089,12 @@ sys_recvmmsg(struct proc *p, void *v, register_t *retval)
 		mmsg.msg_hdr.msg_iov = iov;
 		mmsg.msg_hdr.msg_flags = flags & ~MSG_WAITFORONE;
 
-		error = recvit(p, s, &mmsg.msg_hdr, NULL, &retrec);
+		/*
+		 * XXX Each datagram still takes its own trip through
+		 * soreceive() and the receive buffer lock.  Dequeueing the
+		 * whole vector in one pass needs a new soreceive() interface.
+		 */
+		error = recvit_fp(p, fp, s, &mmsg.msg_hdr, NULL, &retrec);
 		if (error) {
 			if (error == EAGAIN && dgrams > 0)
 				error = 0;
@@ -1016,17 +1140,13 @@ sys_recvmmsg(struct proc *p, void *v, register_t *retval)
 	 * will catch it next time.
 	 */
 	if (error && dgrams > 0) {
-		struct file *fp;
 		struct socket *so;
 
-		if (getsock(p, s, &fp) == 0) {
-			so = (struct socket *)fp->f_data;
-			so->so_error = error;
-
-			FRELE(fp, p);
-		}
+		so = (struct socket *)fp->f_data;
+		so->so_error = error;
 		error = 0;
 	}
+	FRELE(fp, p);
 
 	return (error);
 }
@@ -1036,6 +1156,19 @@ recvit(struct proc *p, int s, struct msghdr *mp, caddr_t namelenp,
     register_t *retsize)
 {
 	struct file *fp;
+	int error;
+
+	if ((error = getsock(p, s, &fp)) != 0)
+		return (error);
+	error = recvit_fp(p, fp, s, mp, namelenp, retsize);
+	FRELE(fp, p);
+	return (error);
+}
+
+int
+recvit_fp(struct proc *p, struct file *fp, int s, struct msghdr *mp,
+    caddr_t namelenp, register_t *retsize)
+{
 	struct uio auio;
 	struct iovec *iov;
 	int i;
@@ -1047,9 +1180,6 @@ recvit(struct proc *p, int s, struct msghdr *mp, caddr_t namelenp,
 	int iovlen = 0, kmsgflags;
 #endif
 
-	if ((error = getsock(p, s, &fp)) != 0)
-		return (error);
-
 	auio.uio_iov = mp->msg_iov;
 	auio.uio_iovcnt = mp->msg_iovlen;
 	auio.uio_segflg = UIO_USERSPACE;
@@ -1163,7 +1293,6 @@ recvit(struct proc *p, int s, struct msghdr *mp, caddr_t namelenp,
 		mtx_leave(&fp->f_mtx);
 	}
 out:
-	FRELE(fp, p);
 	m_freem(from);
 	m_freem(control);
 	return (error);
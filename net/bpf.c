@@ -63,9 +63,12 @@
 #include <sys/task.h>
 #include <sys/time.h>
 
+#include <uvm/uvm_extern.h>
+
 #include <net/if.h>
 #include <net/bpf.h>
 #include <net/bpfdesc.h>
+#include <net/bpf_jit.h>
 
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
@@ -85,6 +88,9 @@
 int bpf_bufsize = BPF_BUFSIZE;
 int bpf_maxbufsize = BPF_MAXBUFSIZE;
 
+#define BPF_RING_MAXSLOTS	(1 << 20)
+#define BPF_RING_MINSLOTSIZE	64
+
 /*
  *  bpf_iflist is the list of interfaces; each corresponds to an ifnet
  *  bpf_d_list is the list of descriptors
@@ -123,7 +129,15 @@ void	bpf_attachd(struct bpf_d *, struct bpf_if *);
 void	bpf_detachd(struct bpf_d *);
 void	bpf_resetd(struct bpf_d *);
 
+int	bpf_setring(struct bpf_d *, struct bpf_ringreq *, struct proc *);
+void	bpf_ring_catch(struct bpf_d *, u_char *, size_t, size_t,
+	    const struct bpf_hdr *, int);
+u_int	bpf_ring_used(struct bpf_d *);
+
 void	bpf_prog_smr(void *);
+u_int	bpf_prog_filter(struct bpf_program_smr *, const u_char *, u_int,
+	    u_int);
+u_int	bpf_prog_mfilter(struct bpf_program_smr *, const struct mbuf *, u_int);
 void	bpf_d_smr(void *);
 
 /*
@@ -140,7 +154,6 @@ bpf_movein(struct uio *uio, struct bpf_d *d, struct mbuf **mp,
     struct sockaddr *sockp)
 {
 	struct bpf_program_smr *bps;
-	struct bpf_insn *fcode = NULL;
 	struct mbuf *m;
 	struct m_tag *mtag;
 	int error;
@@ -238,9 +251,7 @@ bpf_movein(struct uio *uio, struct bpf_d *d, struct mbuf **mp,
 
 	smr_read_enter();
 	bps = SMR_PTR_GET(&d->bd_wfilter);
-	if (bps != NULL)
-		fcode = bps->bps_bf.bf_insns;
-	slen = bpf_filter(fcode, mtod(m, u_char *), len, len);
+	slen = bpf_prog_filter(bps, mtod(m, u_char *), len, len);
 	smr_read_leave();
 
 	if (slen < len) {
@@ -412,13 +423,25 @@ int
 bpfclose(dev_t dev, int flag, int mode, struct proc *p)
 {
 	struct bpf_d *d;
+	struct bpf_ringhdr *ring;
 
 	d = bpfilter_lookup(minor(dev));
 	mtx_enter(&d->bd_mtx);
 	bpf_detachd(d);
 	bpf_wakeup(d);
 	LIST_REMOVE(d, bd_list);
+	ring = d->bd_ring;
+	d->bd_ring = NULL;
 	mtx_leave(&d->bd_mtx);
+
+	/*
+	 * The descriptor is detached, so nothing can be writing to the
+	 * ring. The pages stay around until the reader unmaps them too.
+	 */
+	if (ring != NULL) {
+		uvm_unmap(kernel_map, (vaddr_t)ring,
+		    (vaddr_t)ring + d->bd_ringlen);
+	}
 	bpf_put(d);
 
 	return (0);
@@ -458,6 +481,12 @@ bpfread(dev_t dev, struct uio *uio, int ioflag)
 	bpf_get(d);
 	mtx_enter(&d->bd_mtx);
 
+	/* Packets go to the shared ring instead. */
+	if (d->bd_ring != NULL) {
+		error = EINVAL;
+		goto out;
+	}
+
 	/*
 	 * Restrict application to use a buffer the same size as
 	 * as kernel buffers.
@@ -703,6 +732,7 @@ bpf_resetd(struct bpf_d *d)
  *  BIOCVERSION		Get filter language version.
  *  BIOCGHDRCMPLT	Get "header already complete" flag
  *  BIOCSHDRCMPLT	Set "header already complete" flag
+ *  BIOCSRING		Capture into a ring shared with the caller.
  */
 int
 bpfioctl(dev_t dev, u_long cmd, caddr_t addr, int flag, struct proc *p)
@@ -751,9 +781,13 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, int flag, struct proc *p)
 			int n;
 
 			mtx_enter(&d->bd_mtx);
-			n = d->bd_slen;
-			if (d->bd_hbuf != NULL)
-				n += d->bd_hlen;
+			if (d->bd_ring != NULL)
+				n = bpf_ring_used(d);
+			else {
+				n = d->bd_slen;
+				if (d->bd_hbuf != NULL)
+					n += d->bd_hlen;
+			}
 			mtx_leave(&d->bd_mtx);
 
 			*(int *)addr = n;
@@ -786,6 +820,16 @@ bpfioctl(dev_t dev, u_long cmd, caddr_t addr, int flag, struct proc *p)
 		}
 		break;
 
+	/*
+	 * Capture into a ring mapped into the caller.
+	 */
+	case BIOCSRING:
+		if (d->bd_bif != NULL)
+			error = EINVAL;
+		else
+			error = bpf_setring(d, (struct bpf_ringreq *)addr, p);
+		break;
+
 	/*
 	 * Set link layer read filter.
 	 */
@@ -1062,6 +1106,11 @@ bpf_setf(struct bpf_d *d, struct bpf_program *fp, int wf)
 		smr_init(&bps->bps_smr);
 		bps->bps_bf.bf_len = flen;
 		bps->bps_bf.bf_insns = fcode;
+#ifdef __HAVE_BPF_JIT
+		bps->bps_jit = bpf_jit_compile(fcode, flen, bpf_jit_mode);
+#else
+		bps->bps_jit = NULL;
+#endif
 	}
 
 	if (wf == 0) {
@@ -1113,7 +1162,7 @@ bpf_setif(struct bpf_d *d, struct ifreq *ifr)
 	 * just flush the buffer.
 	 */
 	mtx_enter(&d->bd_mtx);
-	if (d->bd_sbuf == NULL) {
+	if (d->bd_ring == NULL && d->bd_sbuf == NULL) {
 		if ((error = bpf_allocbufs(d)))
 			goto out;
 	}
@@ -1192,6 +1241,13 @@ filt_bpfread(struct knote *kn, long hint)
 
 	MUTEX_ASSERT_LOCKED(&d->bd_mtx);
 
+	if (d->bd_ring != NULL) {
+		kn->kn_data = bpf_ring_used(d);
+		if (d->bd_immediate)
+			return (kn->kn_data > 0);
+		return (kn->kn_data >= d->bd_ringslots / 2);
+	}
+
 	kn->kn_data = d->bd_hlen;
 	if (d->bd_immediate)
 		kn->kn_data += d->bd_slen;
@@ -1280,7 +1336,6 @@ _bpf_mtap(caddr_t arg, const struct mbuf *mp, const struct mbuf *m,
 	smr_read_enter();
 	SMR_SLIST_FOREACH(d, &bp->bif_dlist, bd_next) {
 		struct bpf_program_smr *bps;
-		struct bpf_insn *fcode = NULL;
 
 		atomic_inc_long(&d->bd_rcount);
 
@@ -1288,9 +1343,7 @@ _bpf_mtap(caddr_t arg, const struct mbuf *mp, const struct mbuf *m,
 			continue;
 
 		bps = SMR_PTR_GET(&d->bd_rfilter);
-		if (bps != NULL)
-			fcode = bps->bps_bf.bf_insns;
-		slen = bpf_mfilter(fcode, m, pktlen);
+		slen = bpf_prog_mfilter(bps, m, pktlen);
 
 		if (slen == 0)
 			continue;
@@ -1482,6 +1535,11 @@ bpf_catchpacket(struct bpf_d *d, u_char *pkt, size_t pktlen, size_t snaplen,
 
 	hdrlen = d->bd_bif->bif_hdrlen;
 
+	if (d->bd_ring != NULL) {
+		bpf_ring_catch(d, pkt, pktlen, snaplen, tbh, hdrlen);
+		return;
+	}
+
 	/*
 	 * Figure out how many bytes to move.  If the packet is
 	 * greater or equal to the snapshot length, transfer that
@@ -1542,6 +1600,154 @@ bpf_catchpacket(struct bpf_d *d, u_char *pkt, size_t pktlen, size_t snaplen,
 		bpf_wakeup(d);
 }
 
+/*
+ * Number of slots holding packets the reader has not consumed yet.
+ * The consumer index is written by userland, so don't trust it.
+ */
+u_int
+bpf_ring_used(struct bpf_d *d)
+{
+	u_int used;
+
+	MUTEX_ASSERT_LOCKED(&d->bd_mtx);
+
+	used = d->bd_ringprod - READ_ONCE(d->bd_ring->brh_cons);
+	if (used > d->bd_ringslots)
+		used = d->bd_ringslots;
+
+	return (used);
+}
+
+/*
+ * Store a packet in the next free slot of the shared ring.
+ */
+void
+bpf_ring_catch(struct bpf_d *d, u_char *pkt, size_t pktlen, size_t snaplen,
+    const struct bpf_hdr *tbh, int hdrlen)
+{
+	struct bpf_ringhdr *brh = d->bd_ring;
+	struct bpf_hdr *bh;
+	u_int used, totlen;
+
+	MUTEX_ASSERT_LOCKED(&d->bd_mtx);
+
+	used = bpf_ring_used(d);
+	if (used == d->bd_ringslots) {
+		++d->bd_dcount;
+		return;
+	}
+	/* don't write the slot before the reader is done with it */
+	membar_consumer();
+
+	totlen = hdrlen + min(snaplen, pktlen);
+	if (totlen > d->bd_ringslotsize)
+		totlen = d->bd_ringslotsize;
+
+	bh = (struct bpf_hdr *)((caddr_t)brh + sizeof(*brh) +
+	    (d->bd_ringprod & (d->bd_ringslots - 1)) * d->bd_ringslotsize);
+	*bh = *tbh;
+	bh->bh_datalen = pktlen;
+	bh->bh_hdrlen = hdrlen;
+	bh->bh_caplen = totlen - hdrlen;
+	bpf_mcopy(pkt, (u_char *)bh + hdrlen, bh->bh_caplen);
+
+	/* publish the slot */
+	membar_producer();
+	brh->brh_prod = ++d->bd_ringprod;
+
+	/*
+	 * Without immediate mode wake the reader up once, when the ring
+	 * becomes half full.
+	 */
+	if (d->bd_immediate || used + 1 == d->bd_ringslots / 2)
+		bpf_wakeup(d);
+}
+
+/*
+ * Set up a ring of packet slots and map it into both the kernel and
+ * the calling process. The pages are backed by an anonymous object
+ * so they stay valid for the reader after the descriptor is closed.
+ */
+int
+bpf_setring(struct bpf_d *d, struct bpf_ringreq *brq, struct proc *p)
+{
+	struct uvm_object *uao;
+	struct bpf_ringhdr *brh;
+	vaddr_t kva = 0, uva = 0;
+	vsize_t len;
+	u_int nslots, slotsize;
+	int error;
+
+	KERNEL_ASSERT_LOCKED();
+
+	if (d->bd_ring != NULL)
+		return (EBUSY);
+
+	nslots = brq->brq_nslots;
+	if (nslots < 2 || nslots > BPF_RING_MAXSLOTS || !powerof2(nslots))
+		return (EINVAL);
+	slotsize = BPF_WORDALIGN(brq->brq_slotsize);
+	if (slotsize < BPF_RING_MINSLOTSIZE || slotsize > bpf_maxbufsize)
+		return (EINVAL);
+	len = (vsize_t)nslots * slotsize;
+	if (len > bpf_maxbufsize)
+		return (ENOBUFS);
+	len = round_page(sizeof(*brh) + len);
+
+	uao = uao_create(len, 0);
+	if (uao == NULL)
+		return (ENOMEM);
+	if (uvm_map(kernel_map, &kva, len, uao, 0, 0,
+	    UVM_MAPFLAG(PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE,
+	    MAP_INHERIT_NONE, MADV_RANDOM, 0))) {
+		uao_detach(uao);
+		return (ENOMEM);
+	}
+	if (uvm_fault_wire(kernel_map, kva, kva + len,
+	    PROT_READ | PROT_WRITE)) {
+		error = ENOMEM;
+		goto unmap;
+	}
+
+	uao_reference(uao);
+	error = uvm_map(&p->p_vmspace->vm_map, &uva, len, uao, 0, 0,
+	    UVM_MAPFLAG(PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE,
+	    MAP_INHERIT_SHARE, MADV_RANDOM, 0));
+	if (error != 0) {
+		uao_detach(uao);
+		goto unmap;
+	}
+
+	brh = (struct bpf_ringhdr *)kva;
+	brh->brh_nslots = nslots;
+	brh->brh_slotsize = slotsize;
+
+	mtx_enter(&d->bd_mtx);
+	if (d->bd_ring != NULL) {
+		/* lost a race while sleeping in uvm */
+		mtx_leave(&d->bd_mtx);
+		uvm_unmap(&p->p_vmspace->vm_map, uva, uva + len);
+		error = EBUSY;
+		goto unmap;
+	}
+	d->bd_ring = brh;
+	d->bd_ringlen = len;
+	d->bd_ringslots = nslots;
+	d->bd_ringslotsize = slotsize;
+	d->bd_ringprod = 0;
+	mtx_leave(&d->bd_mtx);
+
+	brq->brq_slotsize = slotsize;
+	brq->brq_addr = (void *)uva;
+	brq->brq_len = len;
+
+	return (0);
+
+unmap:
+	uvm_unmap(kernel_map, kva, kva + len);
+	return (error);
+}
+
 /*
  * Initialize all nonzero fields of a descriptor.
  */
@@ -1572,6 +1778,10 @@ bpf_prog_smr(void *bps_arg)
 {
 	struct bpf_program_smr *bps = bps_arg;
 
+#ifdef __HAVE_BPF_JIT
+	if (bps->bps_jit != NULL)
+		bpf_jit_free(bps->bps_jit);
+#endif
 	free(bps->bps_bf.bf_insns, M_DEVBUF,
 	    bps->bps_bf.bf_len * sizeof(struct bpf_insn));
 	free(bps, M_DEVBUF, sizeof(struct bpf_program_smr));
@@ -1712,6 +1922,11 @@ bpf_sysctl_locked(int *name, u_int namelen, void *oldp, size_t *oldlenp,
 	case NET_BPF_MAXBUFSIZE:
 		return sysctl_int_bounded(oldp, oldlenp, newp, newlen,
 		    &bpf_maxbufsize, BPF_MINBUFSIZE, INT_MAX);
+#ifdef __HAVE_BPF_JIT
+	case NET_BPF_JIT:
+		return sysctl_int_bounded(oldp, oldlenp, newp, newlen,
+		    &bpf_jit_mode, BPF_JIT_OFF, BPF_JIT_CHECK);
+#endif
 	default:
 		return (EOPNOTSUPP);
 	}
@@ -1912,3 +2127,33 @@ bpf_mfilter(const struct bpf_insn *pc, const struct mbuf *m, u_int wirelen)
 {
 	return _bpf_filter(pc, &bpf_mbuf_ops, m, wirelen);
 }
+
+/*
+ * Run a filter program from a descriptor, using the compiled version
+ * if there is one.
+ */
+u_int
+bpf_prog_filter(struct bpf_program_smr *bps, const u_char *pkt,
+    u_int wirelen, u_int buflen)
+{
+	if (bps == NULL)
+		return (u_int)-1;
+#ifdef __HAVE_BPF_JIT
+	if (bps->bps_jit != NULL)
+		return bpf_jit_filter(bps->bps_jit, pkt, wirelen, buflen);
+#endif
+	return bpf_filter(bps->bps_bf.bf_insns, pkt, wirelen, buflen);
+}
+
+u_int
+bpf_prog_mfilter(struct bpf_program_smr *bps, const struct mbuf *m,
+    u_int wirelen)
+{
+	if (bps == NULL)
+		return (u_int)-1;
+#ifdef __HAVE_BPF_JIT
+	if (bps->bps_jit != NULL)
+		return bpf_jit_mfilter(bps->bps_jit, m, wirelen);
+#endif
+	return bpf_mfilter(bps->bps_bf.bf_insns, m, wirelen);
+}
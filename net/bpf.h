@@ -91,6 +91,16 @@ struct bpf_version {
 #define BPF_MAJOR_VERSION 1
 #define BPF_MINOR_VERSION 1
 
+/*
+ * Structure for BIOCSRING.
+ */
+struct bpf_ringreq {
+	u_int	 brq_nslots;	/* number of packet slots, a power of 2 */
+	u_int	 brq_slotsize;	/* bytes per slot, including the bpf_hdr */
+	void	*brq_addr;	/* where the ring was mapped */
+	size_t	 brq_len;	/* length of the ring mapping */
+};
+
 /*
  * BPF ioctls
  */
@@ -119,6 +129,7 @@ struct bpf_version {
 #define BIOCGDLTLIST	_IOWR('B',123, struct bpf_dltlist)
 #define BIOCGDIRFILT	_IOR('B',124, u_int)
 #define BIOCSDIRFILT	_IOW('B',125, u_int)
+#define BIOCSRING	_IOWR('B',126, struct bpf_ringreq)
 
 /*
  * Direction filters for BIOCSDIRFILT/BIOCGDIRFILT
@@ -164,6 +175,28 @@ struct bpf_hdr {
 #define SIZEOF_BPF_HDR sizeof(struct bpf_hdr)
 #endif
 
+/*
+ * Header of the ring mapped by BIOCSRING.
+ *
+ * The kernel stores each captured packet in the slot at brh_prod and
+ * then advances brh_prod. The reader processes the slot at brh_cons
+ * and then advances brh_cons. Both indexes count up and wrap around,
+ * and are reduced modulo brh_nslots to find a slot. A packet is
+ * dropped if the ring is full. Each slot starts with a bpf_hdr.
+ */
+struct bpf_ringhdr {
+	volatile u_int32_t brh_prod;	/* written by the kernel */
+	u_int32_t	brh_nslots;
+	u_int32_t	brh_slotsize;
+	u_int32_t	brh_pad0[13];
+	volatile u_int32_t brh_cons;	/* written by the reader */
+	u_int32_t	brh_pad1[15];
+};
+
+#define BPF_RING_SLOT(_brh, _i)						\
+	((struct bpf_hdr *)((char *)(_brh) + sizeof(struct bpf_ringhdr) + \
+	    ((_i) & ((_brh)->brh_nslots - 1)) * (_brh)->brh_slotsize))
+
 /*
  * Data-link level type codes.
  */
@@ -0,0 +1,198 @@
+/*	$OpenBSD$ */
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Machine independent glue for the bpf filter compiler.
+ *
+ * Programs are generated into a scratch buffer, copied into pages that
+ * are mapped writable, and then the mappings are replaced with read-only
+ * executable ones before the code is ever run. The code is never
+ * writable and executable at the same time.
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
+#include <sys/atomic.h>
+
+#include <uvm/uvm_extern.h>
+
+#include <net/bpf.h>
+#include <net/bpf_jit.h>
+
+struct bpf_jit {
+	bpf_jit_func		 bj_func;
+	vaddr_t			 bj_va;
+	vsize_t			 bj_size;
+
+	/* used when cross checking against the interpreter */
+	const struct bpf_insn	*bj_insns;
+	u_int			 bj_len;
+	unsigned int		 bj_mismatch;
+};
+
+int	bpf_jit_mode = BPF_JIT_OFF;	/* enable with sysctl net.bpf.jit */
+
+extern const struct bpf_ops bpf_mbuf_ops;
+
+u_int32_t	bpf_jit_noload(const void *, u_int32_t, int *);
+
+/*
+ * Contiguous buffers are passed to the generated code in full, so
+ * a load that misses the inline bounds check is out of range.
+ */
+const struct bpf_ops bpf_jit_mem_ops = {
+	bpf_jit_noload,
+	bpf_jit_noload,
+	bpf_jit_noload,
+};
+
+u_int32_t
+bpf_jit_noload(const void *arg, u_int32_t k, int *err)
+{
+	*err = 1;
+	return (0);
+}
+
+/*
+ * Programs that load random numbers cannot be compared with the
+ * interpreter.
+ */
+static int
+bpf_jit_random(const struct bpf_insn *insns, u_int len)
+{
+	u_int i;
+
+	for (i = 0; i < len; i++) {
+		if (insns[i].code == (BPF_LD|BPF_W|BPF_RND))
+			return (1);
+	}
+
+	return (0);
+}
+
+struct bpf_jit *
+bpf_jit_compile(const struct bpf_insn *insns, u_int len, int mode)
+{
+	struct bpf_jit *bj;
+	u_char *buf;
+	size_t size, bufsize;
+	vaddr_t va;
+	paddr_t pa;
+
+	if (mode == BPF_JIT_OFF)
+		return (NULL);
+
+	if (bpf_jit_md_compile(insns, len, NULL, &bufsize) != 0)
+		return (NULL);
+
+	buf = malloc(bufsize, M_TEMP, M_WAITOK | M_CANFAIL);
+	if (buf == NULL)
+		return (NULL);
+
+	size = bufsize;
+	if (bpf_jit_md_compile(insns, len, buf, &size) != 0 ||
+	    size != bufsize)
+		goto free;
+
+	bj = malloc(sizeof(*bj), M_DEVBUF, M_WAITOK | M_CANFAIL | M_ZERO);
+	if (bj == NULL)
+		goto free;
+
+	bj->bj_size = round_page(size);
+	bj->bj_va = (vaddr_t)km_alloc(bj->bj_size, &kv_any, &kp_dirty,
+	    &kd_waitok);
+	if (bj->bj_va == 0) {
+		free(bj, M_DEVBUF, sizeof(*bj));
+		goto free;
+	}
+
+	memcpy((void *)bj->bj_va, buf, size);
+	memset((void *)(bj->bj_va + size), 0, bj->bj_size - size);
+	free(buf, M_TEMP, bufsize);
+
+	/* swap the writable mappings for executable ones */
+	for (va = bj->bj_va; va < bj->bj_va + bj->bj_size; va += PAGE_SIZE) {
+		if (!pmap_extract(pmap_kernel(), va, &pa))
+			panic("%s: no page for %lx", __func__, va);
+		pmap_kremove(va, PAGE_SIZE);
+		pmap_kenter_pa(va, pa, PROT_READ | PROT_EXEC);
+	}
+	pmap_update(pmap_kernel());
+	bpf_jit_md_sync(bj->bj_va, size);
+
+	bj->bj_func = (bpf_jit_func)bj->bj_va;
+	if (mode == BPF_JIT_CHECK && !bpf_jit_random(insns, len)) {
+		bj->bj_insns = insns;
+		bj->bj_len = len;
+	}
+
+	return (bj);
+
+free:
+	free(buf, M_TEMP, bufsize);
+	return (NULL);
+}
+
+void
+bpf_jit_free(struct bpf_jit *bj)
+{
+	km_free((void *)bj->bj_va, bj->bj_size, &kv_any, &kp_dirty);
+	free(bj, M_DEVBUF, sizeof(*bj));
+}
+
+static void
+bpf_jit_mismatch(struct bpf_jit *bj, u_int jit, u_int interp)
+{
+	if (atomic_cas_uint(&bj->bj_mismatch, 0, 1) != 0)
+		return;
+
+	printf("bpf jit: %u insn program returned %u, "
+	    "interpreter returned %u\n", bj->bj_len, jit, interp);
+}
+
+u_int
+bpf_jit_filter(struct bpf_jit *bj, const u_char *pkt, u_int wirelen,
+    u_int buflen)
+{
+	u_int rv, xrv;
+
+	rv = (*bj->bj_func)(pkt, buflen, wirelen, NULL, &bpf_jit_mem_ops);
+	if (bj->bj_insns != NULL) {
+		xrv = bpf_filter(bj->bj_insns, pkt, wirelen, buflen);
+		if (rv != xrv)
+			bpf_jit_mismatch(bj, rv, xrv);
+	}
+
+	return (rv);
+}
+
+u_int
+bpf_jit_mfilter(struct bpf_jit *bj, const struct mbuf *m, u_int wirelen)
+{
+	u_int rv, xrv;
+
+	rv = (*bj->bj_func)(mtod(m, const u_char *), m->m_len, wirelen,
+	    m, &bpf_mbuf_ops);
+	if (bj->bj_insns != NULL) {
+		xrv = bpf_mfilter(bj->bj_insns, m, wirelen);
+		if (rv != xrv)
+			bpf_jit_mismatch(bj, rv, xrv);
+	}
+
+	return (rv);
+}
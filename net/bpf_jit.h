@@ -0,0 +1,63 @@
+/*	$OpenBSD$ */
+
+/*
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NET_BPF_JIT_H_
+#define _NET_BPF_JIT_H_
+
+#ifdef _KERNEL
+
+/*
+ * Compiled filter programs.
+ *
+ * The generated code is called as
+ *
+ *	u_int f(const u_char *pkt, u_int buflen, u_int wirelen,
+ *	    const void *arg, const struct bpf_ops *ops);
+ *
+ * Loads that fit within the first buflen bytes at pkt are done inline,
+ * everything else goes through ops with arg, exactly like _bpf_filter().
+ */
+
+#define BPF_JIT_OFF		0	/* use the interpreter */
+#define BPF_JIT_ON		1	/* compile filters */
+#define BPF_JIT_CHECK		2	/* compile and cross check results */
+
+typedef u_int (*bpf_jit_func)(const u_char *, u_int, u_int, const void *,
+	    const struct bpf_ops *);
+
+struct bpf_jit;
+struct mbuf;
+
+extern int bpf_jit_mode;
+
+struct bpf_jit	*bpf_jit_compile(const struct bpf_insn *, u_int, int);
+void		 bpf_jit_free(struct bpf_jit *);
+u_int		 bpf_jit_filter(struct bpf_jit *, const u_char *,
+		     u_int, u_int);
+u_int		 bpf_jit_mfilter(struct bpf_jit *, const struct mbuf *,
+		     u_int);
+
+/*
+ * Machine dependent code generator. Called with buf == NULL to
+ * size the program, and again to emit it.
+ */
+int		 bpf_jit_md_compile(const struct bpf_insn *, u_int, u_char *,
+		     size_t *);
+void		 bpf_jit_md_sync(vaddr_t, vsize_t);
+
+#endif /* _KERNEL */
+
+#endif /* _NET_BPF_JIT_H_ */
@@ -50,6 +50,7 @@
 
 struct bpf_program_smr {
 	struct bpf_program	bps_bf;
+	struct bpf_jit		*bps_jit;	/* compiled bps_bf, or NULL */
 	struct smr_entry	bps_smr;
 };
 
@@ -75,6 +76,16 @@ struct bpf_d {
 	int		bd_hlen;	/* current length of hold buffer */
 	int		bd_bufsize;	/* absolute length of buffers */
 
+	/*
+	 * With BIOCSRING packets are stored in a ring shared with the
+	 * reader instead of the buffer slots above.
+	 */
+	struct bpf_ringhdr *bd_ring;	/* kernel mapping of the ring */
+	vsize_t		bd_ringlen;	/* length of the ring mapping */
+	u_int		bd_ringslots;	/* number of slots in the ring */
+	u_int		bd_ringslotsize; /* length of each slot */
+	u_int		bd_ringprod;	/* next slot to fill */
+
 	int		bd_in_uiomove;	/* for debugging purpose */
 
 	struct bpf_if  *bd_bif;		/* interface descriptor */
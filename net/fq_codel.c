@@ -76,6 +76,8 @@ struct codel_params {
 
 void		 codel_initparams(struct codel_params *, unsigned int,
 		    unsigned int, int);
+void		 codel_copyparams(struct codel_params *,
+		    const struct codel_params *);
 void		 codel_freeparams(struct codel_params *);
 void		 codel_enqueue(struct codel *, int64_t, struct mbuf *);
 struct mbuf	*codel_dequeue(struct codel *, struct codel_params *, int64_t,
@@ -106,6 +108,7 @@ struct fqcodel {
 	struct codel_params	 cparams;
 
 	unsigned int		 nflows;
+	unsigned int		 nqueues;
 	unsigned int		 qlimit;
 	int			 quantum;
 
@@ -283,6 +286,19 @@ codel_initparams(struct codel_params *cp, unsigned int target,
 	cp->quantum = quantum;
 }
 
+void
+codel_copyparams(struct codel_params *cp, const struct codel_params *src)
+{
+	*cp = *src;
+
+	if (src->intervals != codel_intervals) {
+		cp->intervals = mallocarray(nitems(codel_intervals),
+		    sizeof(codel_intervals[0]), M_DEVBUF, M_WAITOK);
+		memcpy(cp->intervals, src->intervals,
+		    nitems(codel_intervals) * sizeof(codel_intervals[0]));
+	}
+}
+
 void
 codel_freeparams(struct codel_params *cp)
 {
@@ -523,8 +539,13 @@ classify_flow(struct fqcodel *fqc, struct mbuf *m)
 {
 	unsigned int index = 0;
 
+	/*
+	 * The low part of the flow id has already picked the transmit
+	 * queue in fqcodel_idx(), use the rest to spread flows over
+	 * all the buckets of this queue.
+	 */
 	if (m->m_pkthdr.csum_flags & M_FLOWID)
-		index = m->m_pkthdr.ph_flowid % fqc->nflows;
+		index = (m->m_pkthdr.ph_flowid / fqc->nqueues) % fqc->nflows;
 
 	DPRINTF("%s: %u\n", __func__, index);
 
@@ -776,6 +797,7 @@ fqcodel_pf_addqueue(void *arg, struct pf_queuespec *qs)
 #endif
 
 	fqc->ifp = ifp;
+	fqc->nqueues = 1;
 
 	DPRINTF("fq-codel on %s: %d queues %d deep, quantum %d target %llums "
 	    "interval %llums\n", ifp->if_xname, fqc->nflows, fqc->qlimit,
@@ -800,9 +822,10 @@ fqcodel_pf_qstats(struct pf_queuespec *qs, void *ubuf, int *nbytes)
 {
 	struct ifnet *ifp = qs->kif->pfik_ifp;
 	struct fqcodel_stats stats;
+	struct ifqueue *ifq;
 	struct fqcodel *fqc;
 	int64_t delay;
-	unsigned int i;
+	unsigned int i, q;
 	int error = 0;
 
 	if (ifp == NULL)
@@ -813,31 +836,36 @@ fqcodel_pf_qstats(struct pf_queuespec *qs, void *ubuf, int *nbytes)
 
 	memset(&stats, 0, sizeof(stats));
 
-	/* XXX: multi-q? */
-	fqc = ifq_q_enter(&ifp->if_snd, ifq_fqcodel_ops);
-	if (fqc == NULL)
-		return (EBADF);
+	for (q = 0; q < ifp->if_nifqs; q++) {
+		ifq = ifp->if_ifqs[q];
 
-	stats.xmit_cnt = fqc->xmit_cnt;
-	stats.drop_cnt = fqc->drop_cnt;
+		fqc = ifq_q_enter(ifq, ifq_fqcodel_ops);
+		if (fqc == NULL) {
+			if (q == 0)
+				return (EBADF);
+			continue;
+		}
 
-	stats.qlength = ifq_len(&ifp->if_snd);
-	stats.qlimit = fqc->qlimit;
+		stats.xmit_cnt.packets += fqc->xmit_cnt.packets;
+		stats.xmit_cnt.bytes += fqc->xmit_cnt.bytes;
+		stats.drop_cnt.packets += fqc->drop_cnt.packets;
+		stats.drop_cnt.bytes += fqc->drop_cnt.bytes;
 
-	stats.flows = 0;
-	stats.delaysum = stats.delaysumsq = 0;
+		stats.qlength += ifq_len(ifq);
+		stats.qlimit += fqc->qlimit;
 
-	for (i = 0; i < fqc->nflows; i++) {
-		if (codel_qlength(&fqc->flows[i].cd) == 0)
-			continue;
-		/* Scale down to microseconds to avoid overflows */
-		delay = codel_delay(&fqc->flows[i].cd) / 1000;
-		stats.delaysum += delay;
-		stats.delaysumsq += delay * delay;
-		stats.flows++;
-	}
+		for (i = 0; i < fqc->nflows; i++) {
+			if (codel_qlength(&fqc->flows[i].cd) == 0)
+				continue;
+			/* Scale down to microseconds to avoid overflows */
+			delay = codel_delay(&fqc->flows[i].cd) / 1000;
+			stats.delaysum += delay;
+			stats.delaysumsq += delay * delay;
+			stats.flows++;
+		}
 
-	ifq_q_leave(&ifp->if_snd, fqc);
+		ifq_q_leave(ifq, fqc);
+	}
 
 	if ((error = copyout((caddr_t)&stats, ubuf, sizeof(stats))) != 0)
 		return (error);
@@ -879,18 +907,57 @@ fqcodel_pf_purge(void *fqc, struct mbuf_list *ml)
 unsigned int
 fqcodel_idx(unsigned int nqueues, const struct mbuf *m)
 {
-	return (0);
+	unsigned int flow = 0;
+
+	if (ISSET(m->m_pkthdr.csum_flags, M_FLOWID))
+		flow = m->m_pkthdr.ph_flowid;
+
+	return (flow % nqueues);
 }
 
 void *
 fqcodel_alloc(unsigned int idx, void *arg)
 {
-	/* Allocation is done in fqcodel_pf_alloc */
-	return (arg);
+	struct fqcodel *tmpl = arg;
+	struct fqcodel *fqc;
+
+	/*
+	 * fqcodel_pf_alloc() sets up the instance for the first ifq.
+	 * Every other transmit queue gets its own flows and codel
+	 * state configured like the first one, so they can be run
+	 * without sharing anything.
+	 */
+	tmpl->nqueues = tmpl->ifp->if_nifqs;
+	if (idx == 0)
+		return (tmpl);
+
+	fqc = malloc(sizeof(struct fqcodel), M_DEVBUF, M_WAITOK | M_ZERO);
+
+	SIMPLEQ_INIT(&fqc->newq);
+	SIMPLEQ_INIT(&fqc->oldq);
+
+	fqc->ifp = tmpl->ifp;
+	fqc->nflows = tmpl->nflows;
+	fqc->nqueues = tmpl->nqueues;
+	fqc->qlimit = tmpl->qlimit;
+	fqc->quantum = tmpl->quantum;
+	fqc->flags = tmpl->flags;
+
+	codel_copyparams(&fqc->cparams, &tmpl->cparams);
+
+	fqc->flows = mallocarray(fqc->nflows, sizeof(struct flow),
+	    M_DEVBUF, M_WAITOK | M_ZERO);
+
+#ifdef FQCODEL_DEBUG
+	for (idx = 0; idx < fqc->nflows; idx++)
+		fqc->flows[idx].id = idx;
+#endif
+
+	return (fqc);
 }
 
 void
 fqcodel_free(unsigned int idx, void *arg)
 {
-	/* nothing to do here */
+	fqcodel_pf_free(arg);
 }
@@ -238,8 +238,26 @@ int	ifq_congestion;
 
 int		 netisr;
 
-#define	NET_TASKQ	4
-struct taskq	*nettqmp[NET_TASKQ];
+/*
+ * There is one softnet thread per cpu, up to NET_TASKQ of them. Besides
+ * the work scheduled on its taskq, each softnet has an input queue that
+ * ifiq_input() steers packets to by flow id, so all packets of a flow
+ * are processed in order by the same thread.
+ */
+#define	NET_TASKQ	32
+
+struct softnet {
+	struct taskq		*sn_taskq;
+	struct mutex		 sn_mtx;
+	struct mbuf_list	 sn_ml;
+	struct task		 sn_task;
+};
+
+struct softnet	softnets[NET_TASKQ];
+unsigned int	nsoftnets;
+
+void	softnet_init(void);
+void	softnet_process(void *);
 
 struct task if_input_task_locked = TASK_INITIALIZER(if_netisr, NULL);
 
@@ -264,10 +282,34 @@ ifinit(void)
 	if_idxmap_init(8); /* 8 is a nice power of 2 for malloc */
 
 	for (i = 0; i < NET_TASKQ; i++) {
-		nettqmp[i] = taskq_create("softnet", 1, IPL_NET, TASKQ_MPSAFE);
-		if (nettqmp[i] == NULL)
+		struct softnet *sn = &softnets[i];
+
+		mtx_init(&sn->sn_mtx, IPL_NET);
+		ml_init(&sn->sn_ml);
+		task_set(&sn->sn_task, softnet_process, sn);
+	}
+}
+
+/*
+ * The number of cpus is not known yet when ifinit() runs, so the
+ * softnet taskqs are created when the first interface is attached.
+ */
+void
+softnet_init(void)
+{
+	unsigned int i, n;
+
+	KERNEL_ASSERT_LOCKED();
+
+	n = min(NET_TASKQ, ncpus);
+	for (i = 0; i < n; i++) {
+		softnets[i].sn_taskq = taskq_create("softnet", 1, IPL_NET,
+		    TASKQ_MPSAFE);
+		if (softnets[i].sn_taskq == NULL)
 			panic("unable to create network taskq %d", i);
 	}
+
+	nsoftnets = n;
 }
 
 static struct if_idxmap if_idxmap;
@@ -850,11 +892,81 @@ if_input_process(struct ifnet *ifp, struct mbuf_list *ml)
 	 */
 
 	NET_LOCK_SHARED();
+#if NETHER > 0
+	/*
+	 * Plain Ethernet ports hand IPv4 to the stack a batch at a time.
+	 * Ports taken over by trunk(4) or aggr(4) have another handler.
+	 */
+	if (ifp->if_input == ether_input) {
+		ether_input_list(ifp, ml);
+		NET_UNLOCK_SHARED();
+		return;
+	}
+#endif
 	while ((m = ml_dequeue(ml)) != NULL)
 		(*ifp->if_input)(ifp, m);
 	NET_UNLOCK_SHARED();
 }
 
+/*
+ * Put a list of packets on the input queue of the softnet thread that
+ * handles the given flow. Nothing is queued if the softnet already has
+ * more than maxlen packets waiting, the caller has to drop them.
+ * Returns how many packets were already on the queue.
+ */
+unsigned int
+softnet_input(unsigned int flow, struct mbuf_list *ml, unsigned int maxlen)
+{
+	struct softnet *sn = &softnets[flow % softnet_count()];
+	unsigned int len;
+
+	mtx_enter(&sn->sn_mtx);
+	len = ml_len(&sn->sn_ml);
+	if (len <= maxlen)
+		ml_enlist(&sn->sn_ml, ml);
+	mtx_leave(&sn->sn_mtx);
+
+	if (ml_empty(ml))
+		task_add(sn->sn_taskq, &sn->sn_task);
+
+	return (len);
+}
+
+void
+softnet_process(void *arg)
+{
+	struct softnet *sn = arg;
+	struct mbuf_list ml, run;
+	struct mbuf *m;
+	struct ifnet *ifp;
+	unsigned int ifidx;
+
+	mtx_enter(&sn->sn_mtx);
+	ml = sn->sn_ml;
+	ml_init(&sn->sn_ml);
+	mtx_leave(&sn->sn_mtx);
+
+	/* packets from different interfaces may be interleaved */
+	while ((m = MBUF_LIST_FIRST(&ml)) != NULL) {
+		ifidx = m->m_pkthdr.ph_ifidx;
+
+		ml_init(&run);
+		do {
+			ml_enqueue(&run, ml_dequeue(&ml));
+			m = MBUF_LIST_FIRST(&ml);
+		} while (m != NULL && m->m_pkthdr.ph_ifidx == ifidx);
+
+		ifp = if_get(ifidx);
+		if (ifp == NULL) {
+			ml_purge(&run);
+			continue;
+		}
+
+		if_input_process(ifp, &run);
+		if_put(ifp);
+	}
+}
+
 void
 if_vinput(struct ifnet *ifp, struct mbuf *m)
 {
@@ -2057,41 +2169,9 @@ ifioctl(struct socket *so, u_long cmd, caddr_t data, struct proc *p)
 			error = ENOTSUP;
 		}
 
-		if (ISSET(ifp->if_capabilities, IFCAP_TSO) &&
-		    ISSET(ifr->ifr_flags, IFXF_TSO) !=
-		    ISSET(ifp->if_xflags, IFXF_TSO)) {
-			struct ifreq ifrq;
-
-			s = splnet();
-
-			if (ISSET(ifr->ifr_flags, IFXF_TSO))
-				ifp->if_xflags |= IFXF_TSO;
-			else
-				ifp->if_xflags &= ~IFXF_TSO;
-
-			NET_ASSERT_LOCKED();	/* for ioctl */
-			KERNEL_ASSERT_LOCKED();	/* for if_flags */
-
-			if (ISSET(ifp->if_flags, IFF_UP)) {
-				/* go down for a moment... */
-				ifp->if_flags &= ~IFF_UP;
-				ifrq.ifr_flags = ifp->if_flags;
-				(*ifp->if_ioctl)(ifp, SIOCSIFFLAGS,
-				    (caddr_t)&ifrq);
-
-				/* ... and up again */
-				ifp->if_flags |= IFF_UP;
-				ifrq.ifr_flags = ifp->if_flags;
-				(*ifp->if_ioctl)(ifp, SIOCSIFFLAGS,
-				    (caddr_t)&ifrq);
-			}
-
-			splx(s);
-		} else if (!ISSET(ifp->if_capabilities, IFCAP_TSO) &&
-		    ISSET(ifr->ifr_flags, IFXF_TSO)) {
-			ifr->ifr_flags &= ~IFXF_TSO;
-			error = ENOTSUP;
-		}
+		if (error == 0 && ISSET(ifr->ifr_flags, IFXF_LRO) !=
+		    ISSET(ifp->if_xflags, IFXF_LRO))
+			error = ifsetlro(ifp, ISSET(ifr->ifr_flags, IFXF_LRO));
 #endif
 
 		if (error == 0)
@@ -3135,6 +3215,57 @@ ifpromisc(struct ifnet *ifp, int pswitch)
 	return (error);
 }
 
+/*
+ * Turn TCP large receive offload on or off.  Interfaces with
+ * IFCAP_LRO merge segments in hardware and are restarted to pick
+ * up the change, other Ethernet interfaces merge them in software
+ * when the packets are queued for the stack.
+ */
+int
+ifsetlro(struct ifnet *ifp, int on)
+{
+	struct ifreq ifrq;
+	int error = 0;
+	int s;
+
+	if (!ISSET(ifp->if_capabilities, IFCAP_LRO) &&
+	    ifp->if_type != IFT_ETHER)
+		return (on ? ENOTSUP : 0);
+
+	NET_ASSERT_LOCKED();	/* for ioctl */
+	KERNEL_ASSERT_LOCKED();	/* for if_flags */
+
+	s = splnet();
+	if (on && !ISSET(ifp->if_xflags, IFXF_LRO)) {
+#if NETHER > 0
+		/* bridged packets must leave the way they came in */
+		if ((error = ether_brport_isset(ifp)) != 0)
+			goto out;
+#endif
+		SET(ifp->if_xflags, IFXF_LRO);
+	} else if (!on && ISSET(ifp->if_xflags, IFXF_LRO))
+		CLR(ifp->if_xflags, IFXF_LRO);
+	else
+		goto out;
+
+	if (ISSET(ifp->if_capabilities, IFCAP_LRO) &&
+	    ISSET(ifp->if_flags, IFF_UP)) {
+		/* go down for a moment... */
+		CLR(ifp->if_flags, IFF_UP);
+		ifrq.ifr_flags = ifp->if_flags;
+		(*ifp->if_ioctl)(ifp, SIOCSIFFLAGS, (caddr_t)&ifrq);
+
+		/* ... and up again */
+		SET(ifp->if_flags, IFF_UP);
+		ifrq.ifr_flags = ifp->if_flags;
+		(*ifp->if_ioctl)(ifp, SIOCSIFFLAGS, (caddr_t)&ifrq);
+	}
+ out:
+	splx(s);
+
+	return (error);
+}
+
 void
 ifa_add(struct ifnet *ifp, struct ifaddr *ifa)
 {
@@ -3399,16 +3530,17 @@ unhandled_af(int af)
 	panic("unhandled af %d", af);
 }
 
-struct taskq *
-net_tq(unsigned int ifindex)
+unsigned int
+softnet_count(void)
 {
-	struct taskq *t = NULL;
-	static int nettaskqs;
+	if (nsoftnets == 0)
+		softnet_init();
 
-	if (nettaskqs == 0)
-		nettaskqs = min(NET_TASKQ, ncpus);
-
-	t = nettqmp[ifindex % nettaskqs];
+	return (nsoftnets);
+}
 
-	return (t);
+struct taskq *
+net_tq(unsigned int ifindex)
+{
+	return (softnets[ifindex % softnet_count()].sn_taskq);
 }
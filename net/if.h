@@ -231,7 +231,7 @@ struct if_status_description {
 #define IFXF_INET6_NOSOII	0x40	/* [N] don't do RFC 7217 */
 #define	IFXF_AUTOCONF4		0x80	/* [N] v4 autoconf (aka dhcp) enabled */
 #define	IFXF_MONITOR		0x100	/* [N] only used for bpf */
-#define	IFXF_TSO		0x200	/* [N] TCP segment offloading */
+#define	IFXF_LRO		0x200	/* [N] TCP large recv offload */
 
 #define	IFXF_CANTCHANGE \
 	(IFXF_MPSAFE|IFXF_CLONED)
@@ -251,7 +251,9 @@ struct if_status_description {
 #define	IFCAP_VLAN_HWTAGGING	0x00000020	/* hardware VLAN tag support */
 #define	IFCAP_CSUM_TCPv6	0x00000080	/* can do IPv6/TCP checksums */
 #define	IFCAP_CSUM_UDPv6	0x00000100	/* can do IPv6/UDP checksums */
-#define	IFCAP_TSO		0x00004000	/* TCP segment offloading */
+#define	IFCAP_TSOv4		0x00001000	/* IPv4/TCP segment offload */
+#define	IFCAP_TSOv6		0x00002000	/* IPv6/TCP segment offload */
+#define	IFCAP_LRO		0x00004000	/* TCP large recv offload */
 #define	IFCAP_WOL		0x00008000	/* can do wake on lan */
 
 #define IFCAP_CSUM_MASK		(IFCAP_CSUM_IPv4 | IFCAP_CSUM_TCPv4 | \
@@ -544,6 +546,7 @@ void	if_getdata(struct ifnet *, struct if_data *);
 void	ifinit(void);
 int	ifioctl(struct socket *, u_long, caddr_t, struct proc *);
 int	ifpromisc(struct ifnet *, int);
+int	ifsetlro(struct ifnet *, int);
 struct	ifg_group *if_creategroup(const char *);
 int	if_addgroup(struct ifnet *, const char *);
 int	if_delgroup(struct ifnet *, const char *);
@@ -557,6 +560,7 @@ int	if_congested(void);
 __dead void	unhandled_af(int);
 int	if_setlladdr(struct ifnet *, const uint8_t *);
 struct taskq * net_tq(unsigned int);
+unsigned int	softnet_count(void);
 
 #endif /* _KERNEL */
 
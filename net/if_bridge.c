@@ -322,6 +322,7 @@ bridge_ioctl(struct ifnet *ifp, u_long cmd, caddr_t data)
 		}
 
 		NET_LOCK();
+		ifsetlro(ifs, 0);
 		error = ifpromisc(ifs, 1);
 		NET_UNLOCK();
 		if (error != 0) {
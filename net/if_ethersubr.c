@@ -142,6 +142,8 @@ u_int8_t etheranyaddr[ETHER_ADDR_LEN] =
     { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
 #define senderr(e) { error = (e); goto bad;}
 
+void	ether_input_demux(struct ifnet *, struct mbuf *, struct mbuf_list *);
+
 int
 ether_ioctl(struct ifnet *ifp, struct arpcom *arp, u_long cmd, caddr_t data)
 {
@@ -380,6 +382,29 @@ ether_output(struct ifnet *ifp, struct mbuf *m, struct sockaddr *dst,
  */
 void
 ether_input(struct ifnet *ifp, struct mbuf *m)
+{
+	ether_input_demux(ifp, m, NULL);
+}
+
+/*
+ * Process a list of packets received on one port.  IPv4 packets are
+ * collected and handed to the stack as a list once the Ethernet
+ * headers of the whole batch have been dealt with.
+ */
+void
+ether_input_list(struct ifnet *ifp, struct mbuf_list *ml)
+{
+	struct mbuf_list ip4ml = MBUF_LIST_INITIALIZER();
+	struct mbuf *m;
+
+	while ((m = ml_dequeue(ml)) != NULL)
+		ether_input_demux(ifp, m, &ip4ml);
+
+	ipv4_input_list(ifp, &ip4ml);
+}
+
+void
+ether_input_demux(struct ifnet *ifp, struct mbuf *m, struct mbuf_list *ip4ml)
 {
 	struct ether_header *eh;
 	void (*input)(struct ifnet *, struct mbuf *);
@@ -570,7 +595,10 @@ ether_input(struct ifnet *ifp, struct mbuf *m)
 	}
 
 	m_adj(m, sizeof(*eh));
-	(*input)(ifp, m);
+	if (ip4ml != NULL && input == ipv4_input)
+		ml_enqueue(ip4ml, m);
+	else
+		(*input)(ifp, m);
 	return;
 dropanyway:
 	m_freem(m);
@@ -92,6 +92,11 @@
 
 #include "bpfilter.h"
 #include "pfsync.h"
+#include "kstat.h"
+
+#if NKSTAT > 0
+#include <sys/kstat.h>
+#endif
 
 #define PFSYNC_DEFER_NSEC 20000000ULL
 
@@ -199,6 +204,24 @@ TAILQ_HEAD(pfsync_deferrals, pfsync_deferral);
 
 void	pfsync_out_tdb(struct tdb *, void *);
 
+/*
+ * State updates are queued on slices picked by hashing the state id,
+ * so updates to one state stay in order while different states don't
+ * contend for the same lock.  Every slice fills its own packets.
+ */
+#define PFSYNC_NSLICES	8
+
+struct pfsync_slice {
+	struct mutex		 s_mtx;
+	struct pf_state_queue	 s_qs[PFSYNC_S_COUNT];
+	size_t			 s_len;		/* bytes queued */
+	unsigned int		 s_count;	/* states queued */
+	uint64_t		 s_stamp;	/* when the first was queued */
+};
+
+/* packets worth of states a bulk update queues per run */
+#define PFSYNC_BULK_PKTS	256
+
 struct pfsync_softc {
 	struct ifnet		 sc_if;
 	unsigned int		 sc_sync_ifidx;
@@ -212,9 +235,8 @@ struct pfsync_softc {
 
 	struct ip		 sc_template;
 
-	struct pf_state_queue	 sc_qs[PFSYNC_S_COUNT];
-	struct mutex		 sc_st_mtx;
-	size_t			 sc_len;
+	struct pfsync_slice	 sc_slices[PFSYNC_NSLICES];
+	size_t			 sc_len;	/* everything but states */
 
 	struct pfsync_upd_reqs	 sc_upd_req_list;
 	struct mutex		 sc_upd_req_mtx;
@@ -239,6 +261,10 @@ struct pfsync_softc {
 	struct pf_state		*sc_bulk_next;
 	struct pf_state		*sc_bulk_last;
 	struct timeout		 sc_bulk_tmo;
+	uint64_t		 sc_bulk_sent;
+
+	uint64_t		 sc_last_input;	/* nsecs uptime */
+	struct kstat		*sc_kstat;
 
 	TAILQ_HEAD(, tdb)	 sc_tdb_q;
 	struct mutex		 sc_tdb_mtx;
@@ -284,6 +310,7 @@ void	pfsync_update_state_req(struct pf_state *);
 
 void	pfsync_drop(struct pfsync_softc *);
 void	pfsync_sendout(void);
+void	pfsync_sendout_snapshot(struct pfsync_softc *, struct pfsync_slice *);
 void	pfsync_send_plus(void *, size_t);
 void	pfsync_timeout(void *);
 void	pfsync_tdb_timeout(void *);
@@ -293,12 +320,27 @@ void	pfsync_bulk_status(u_int8_t);
 void	pfsync_bulk_update(void *);
 void	pfsync_bulk_fail(void *);
 
-void	pfsync_grab_snapshot(struct pfsync_snapshot *, struct pfsync_softc *);
+void	pfsync_grab_snapshot(struct pfsync_snapshot *, struct pfsync_softc *,
+	    struct pfsync_slice *);
 void	pfsync_drop_snapshot(struct pfsync_snapshot *);
 
 void	pfsync_send_dispatch(void *);
 void	pfsync_send_pkt(struct mbuf *);
 
+#if NKSTAT > 0
+void	pfsync_kstat_attach(struct pfsync_softc *);
+#endif
+
+static inline struct pfsync_slice *
+pfsync_slice(struct pfsync_softc *sc, struct pf_state *st)
+{
+	uint32_t h;
+
+	h = (uint32_t)(st->id ^ (st->id >> 32)) ^ st->creatorid;
+
+	return (&sc->sc_slices[h % PFSYNC_NSLICES]);
+}
+
 static struct mbuf_queue	pfsync_mq;
 static struct task	pfsync_task =
     TASK_INITIALIZER(pfsync_send_dispatch, &pfsync_mq);
@@ -322,7 +364,8 @@ pfsync_clone_create(struct if_clone *ifc, int unit)
 {
 	struct pfsync_softc *sc;
 	struct ifnet *ifp;
-	int q;
+	struct pfsync_slice *s;
+	int i, q;
 
 	if (unit != 0)
 		return (EINVAL);
@@ -330,9 +373,12 @@ pfsync_clone_create(struct if_clone *ifc, int unit)
 	pfsync_sync_ok = 1;
 
 	sc = malloc(sizeof(*pfsyncif), M_DEVBUF, M_WAITOK|M_ZERO);
-	for (q = 0; q < PFSYNC_S_COUNT; q++)
-		TAILQ_INIT(&sc->sc_qs[q]);
-	mtx_init(&sc->sc_st_mtx, IPL_MPFLOOR);
+	for (i = 0; i < PFSYNC_NSLICES; i++) {
+		s = &sc->sc_slices[i];
+		mtx_init(&s->s_mtx, IPL_MPFLOOR);
+		for (q = 0; q < PFSYNC_S_COUNT; q++)
+			TAILQ_INIT(&s->s_qs[q]);
+	}
 
 	pool_init(&sc->sc_pool, PFSYNC_PLSIZE, 0, IPL_MPFLOOR, 0, "pfsync",
 	    NULL);
@@ -380,6 +426,10 @@ pfsync_clone_create(struct if_clone *ifc, int unit)
 	bpfattach(&sc->sc_if.if_bpf, ifp, DLT_PFSYNC, PFSYNC_HDRLEN);
 #endif
 
+#if NKSTAT > 0
+	pfsync_kstat_attach(sc);
+#endif
+
 	pfsyncif = sc;
 
 	return (0);
@@ -434,6 +484,11 @@ pfsync_clone_destroy(struct ifnet *ifp)
 
 	NET_UNLOCK();
 
+#if NKSTAT > 0
+	if (sc->sc_kstat != NULL)
+		kstat_destroy(sc->sc_kstat);
+#endif
+
 	pool_destroy(&sc->sc_pool);
 	free(sc->sc_imo.imo_membership, M_IPMOPTS,
 	    sc->sc_imo.imo_max_memberships * sizeof(struct in_multi *));
@@ -529,6 +584,7 @@ pfsync_input(struct mbuf **mp, int *offp, int proto, int af)
 
 	sc->sc_if.if_ipackets++;
 	sc->sc_if.if_ibytes += m->m_pkthdr.len;
+	sc->sc_last_input = getnsecuptime();
 
 	/* verify that the IP TTL is 255. */
 	if (ip->ip_ttl != PFSYNC_DFLTTL) {
@@ -1342,7 +1398,8 @@ pfsync_out_del(struct pf_state *st, void *buf)
 }
 
 void
-pfsync_grab_snapshot(struct pfsync_snapshot *sn, struct pfsync_softc *sc)
+pfsync_grab_snapshot(struct pfsync_snapshot *sn, struct pfsync_softc *sc,
+    struct pfsync_slice *s)
 {
 	int q;
 	struct pf_state *st;
@@ -1352,36 +1409,47 @@ pfsync_grab_snapshot(struct pfsync_snapshot *sn, struct pfsync_softc *sc)
 #endif
 
 	sn->sn_sc = sc;
-
-	mtx_enter(&sc->sc_st_mtx);
-	mtx_enter(&sc->sc_upd_req_mtx);
-	mtx_enter(&sc->sc_tdb_mtx);
-
-	for (q = 0; q < PFSYNC_S_COUNT; q++) {
+	for (q = 0; q < PFSYNC_S_COUNT; q++)
 		TAILQ_INIT(&sn->sn_qs[q]);
-
-		while ((st = TAILQ_FIRST(&sc->sc_qs[q])) != NULL) {
-			TAILQ_REMOVE(&sc->sc_qs[q], st, sync_list);
-			if (st->snapped == 0) {
-				TAILQ_INSERT_TAIL(&sn->sn_qs[q], st, sync_snap);
-				st->snapped = 1;
-			} else {
-				/*
-				 * item is on snapshot list already, so we can
-				 * skip it now.
-				 */
-				pf_state_unref(st);
+	TAILQ_INIT(&sn->sn_upd_req_list);
+	TAILQ_INIT(&sn->sn_tdb_q);
+	sn->sn_plus = NULL;
+	sn->sn_pluslen = 0;
+
+	/* a slice only carries states */
+	if (s != NULL) {
+		mtx_enter(&s->s_mtx);
+		for (q = 0; q < PFSYNC_S_COUNT; q++) {
+			while ((st = TAILQ_FIRST(&s->s_qs[q])) != NULL) {
+				TAILQ_REMOVE(&s->s_qs[q], st, sync_list);
+				if (st->snapped == 0) {
+					TAILQ_INSERT_TAIL(&sn->sn_qs[q], st,
+					    sync_snap);
+					st->snapped = 1;
+				} else {
+					/*
+					 * item is on snapshot list already,
+					 * so we can skip it now.
+					 */
+					pf_state_unref(st);
+				}
 			}
 		}
+		sn->sn_len = PFSYNC_MINPKT + s->s_len;
+		s->s_len = 0;
+		s->s_count = 0;
+		mtx_leave(&s->s_mtx);
+		return;
 	}
 
-	TAILQ_INIT(&sn->sn_upd_req_list);
+	mtx_enter(&sc->sc_upd_req_mtx);
+	mtx_enter(&sc->sc_tdb_mtx);
+
 	while ((ur = TAILQ_FIRST(&sc->sc_upd_req_list)) != NULL) {
 		TAILQ_REMOVE(&sc->sc_upd_req_list, ur, ur_entry);
 		TAILQ_INSERT_TAIL(&sn->sn_upd_req_list, ur, ur_snap);
 	}
 
-	TAILQ_INIT(&sn->sn_tdb_q);
 #if defined(IPSEC)
 	while ((tdb = TAILQ_FIRST(&sc->sc_tdb_q)) != NULL) {
 		TAILQ_REMOVE(&sc->sc_tdb_q, tdb, tdb_sync_entry);
@@ -1404,7 +1472,6 @@ pfsync_grab_snapshot(struct pfsync_snapshot *sn, struct pfsync_softc *sc)
 
 	mtx_leave(&sc->sc_tdb_mtx);
 	mtx_leave(&sc->sc_upd_req_mtx);
-	mtx_leave(&sc->sc_st_mtx);
 }
 
 void
@@ -1470,9 +1537,15 @@ void
 pfsync_drop(struct pfsync_softc *sc)
 {
 	struct pfsync_snapshot	sn;
+	int			i;
 
-	pfsync_grab_snapshot(&sn, sc);
+	pfsync_grab_snapshot(&sn, sc, NULL);
 	pfsync_drop_snapshot(&sn);
+
+	for (i = 0; i < PFSYNC_NSLICES; i++) {
+		pfsync_grab_snapshot(&sn, sc, &sc->sc_slices[i]);
+		pfsync_drop_snapshot(&sn);
+	}
 }
 
 void
@@ -1520,11 +1593,32 @@ pfsync_send_pkt(struct mbuf *m)
 		task_add(net_tq(0), &pfsync_task);
 }
 
+/*
+ * Send everything that is queued.  States go first, so a bulk update
+ * end message follows the last states of the transfer.
+ */
 void
 pfsync_sendout(void)
 {
-	struct pfsync_snapshot sn;
 	struct pfsync_softc *sc = pfsyncif;
+	int i;
+
+	if (sc == NULL)
+		return;
+
+	for (i = 0; i < PFSYNC_NSLICES; i++)
+		pfsync_sendout_snapshot(sc, &sc->sc_slices[i]);
+	pfsync_sendout_snapshot(sc, NULL);
+}
+
+/*
+ * Build a packet from the states queued on a slice, or from all the
+ * other messages if s is NULL.
+ */
+void
+pfsync_sendout_snapshot(struct pfsync_softc *sc, struct pfsync_slice *s)
+{
+	struct pfsync_snapshot sn;
 #if NBPFILTER > 0
 	struct ifnet *ifp = &sc->sc_if;
 #endif
@@ -1537,7 +1631,7 @@ pfsync_sendout(void)
 	int offset;
 	int q, count = 0;
 
-	if (sc == NULL || sc->sc_len == PFSYNC_MINPKT)
+	if (s != NULL ? s->s_len == 0 : sc->sc_len == PFSYNC_MINPKT)
 		return;
 
 	if (!ISSET(sc->sc_if.if_flags, IFF_RUNNING) ||
@@ -1550,7 +1644,7 @@ pfsync_sendout(void)
 		return;
 	}
 
-	pfsync_grab_snapshot(&sn, sc);
+	pfsync_grab_snapshot(&sn, sc, s);
 
 	/*
 	 * Check below is sufficient to prevent us from sending empty packets,
@@ -1694,7 +1788,6 @@ pfsync_sendout(void)
 	}
 
 	if (sc->sc_sync_ifidx == 0) {
-		sc->sc_len = PFSYNC_MINPKT;
 		m_freem(m);
 		return;
 	}
@@ -1727,7 +1820,7 @@ pfsync_insert_state(struct pf_state *st)
 
 	KASSERT(st->sync_state == PFSYNC_S_NONE);
 
-	if (sc->sc_len == PFSYNC_MINPKT)
+	if (pfsync_slice(sc, st)->s_len == 0)
 		timeout_add_sec(&sc->sc_tmo, 1);
 
 	pfsync_q_ins(st, PFSYNC_S_INS);
@@ -1961,7 +2054,7 @@ pfsync_update_state(struct pf_state *st)
 		return;
 	}
 
-	if (sc->sc_len == PFSYNC_MINPKT)
+	if (pfsync_slice(sc, st)->s_len == 0)
 		timeout_add_sec(&sc->sc_tmo, 1);
 
 	switch (st->sync_state) {
@@ -2140,7 +2233,7 @@ pfsync_delete_state(struct pf_state *st)
 		return;
 	}
 
-	if (sc->sc_len == PFSYNC_MINPKT)
+	if (pfsync_slice(sc, st)->s_len == 0)
 		timeout_add_sec(&sc->sc_tmo, 1);
 
 	switch (st->sync_state) {
@@ -2215,12 +2308,11 @@ void
 pfsync_q_ins(struct pf_state *st, int q)
 {
 	struct pfsync_softc *sc = pfsyncif;
-	size_t nlen, sclen;
+	struct pfsync_slice *s = pfsync_slice(sc, st);
+	size_t nlen;
 
-	if (sc->sc_len < PFSYNC_MINPKT)
-		panic("pfsync pkt len is too low %zd", sc->sc_len);
-	do {
-		mtx_enter(&sc->sc_st_mtx);
+	for (;;) {
+		mtx_enter(&s->s_mtx);
 
 		/*
 		 * There are either two threads trying to update the
@@ -2228,40 +2320,47 @@ pfsync_q_ins(struct pf_state *st, int q)
 		 * (is on snapshot queue).
 		 */
 		if (st->sync_state != PFSYNC_S_NONE) {
-			mtx_leave(&sc->sc_st_mtx);
-			break;
+			mtx_leave(&s->s_mtx);
+			return;
 		}
 
 		nlen = pfsync_qs[q].len;
-
-		if (TAILQ_EMPTY(&sc->sc_qs[q]))
+		if (TAILQ_EMPTY(&s->s_qs[q]))
 			nlen += sizeof(struct pfsync_subheader);
 
-		sclen = atomic_add_long_nv(&sc->sc_len, nlen);
-		if (sclen > sc->sc_if.if_mtu) {
-			atomic_sub_long(&sc->sc_len, nlen);
-			mtx_leave(&sc->sc_st_mtx);
-			pfsync_sendout();
-			continue;
+		if (PFSYNC_MINPKT + s->s_len + nlen <= sc->sc_if.if_mtu)
+			break;
+		if (s->s_len == 0) {
+			/* it will never fit */
+			mtx_leave(&s->s_mtx);
+			return;
 		}
 
-		pf_state_ref(st);
+		mtx_leave(&s->s_mtx);
+		pfsync_sendout_snapshot(sc, s);
+	}
+
+	if (s->s_len == 0)
+		s->s_stamp = getnsecuptime();
+	s->s_len += nlen;
+	s->s_count++;
 
-		TAILQ_INSERT_TAIL(&sc->sc_qs[q], st, sync_list);
-		st->sync_state = q;
-		mtx_leave(&sc->sc_st_mtx);
-	} while (0);
+	pf_state_ref(st);
+	TAILQ_INSERT_TAIL(&s->s_qs[q], st, sync_list);
+	st->sync_state = q;
+	mtx_leave(&s->s_mtx);
 }
 
 void
 pfsync_q_del(struct pf_state *st)
 {
 	struct pfsync_softc *sc = pfsyncif;
+	struct pfsync_slice *s = pfsync_slice(sc, st);
 	int q;
 
 	KASSERT(st->sync_state != PFSYNC_S_NONE);
 
-	mtx_enter(&sc->sc_st_mtx);
+	mtx_enter(&s->s_mtx);
 	q = st->sync_state;
 	/*
 	 * re-check under mutex
@@ -2269,15 +2368,16 @@ pfsync_q_del(struct pf_state *st)
 	 * too late, the state is being just processed/dispatched to peer.
 	 */
 	if ((q == PFSYNC_S_NONE) || (st->snapped)) {
-		mtx_leave(&sc->sc_st_mtx);
+		mtx_leave(&s->s_mtx);
 		return;
 	}
-	atomic_sub_long(&sc->sc_len, pfsync_qs[q].len);
-	TAILQ_REMOVE(&sc->sc_qs[q], st, sync_list);
-	if (TAILQ_EMPTY(&sc->sc_qs[q]))
-		atomic_sub_long(&sc->sc_len, sizeof (struct pfsync_subheader));
+	s->s_len -= pfsync_qs[q].len;
+	s->s_count--;
+	TAILQ_REMOVE(&s->s_qs[q], st, sync_list);
+	if (TAILQ_EMPTY(&s->s_qs[q]))
+		s->s_len -= sizeof(struct pfsync_subheader);
 	st->sync_state = PFSYNC_S_NONE;
-	mtx_leave(&sc->sc_st_mtx);
+	mtx_leave(&s->s_mtx);
 
 	pf_state_unref(st);
 }
@@ -2442,6 +2542,7 @@ pfsync_bulk_start(void)
 		pfsync_bulk_status(PFSYNC_BUS_END);
 	else {
 		sc->sc_ureq_received = getuptime();
+		sc->sc_bulk_sent = 0;
 
 		pfsync_bulk_status(PFSYNC_BUS_START);
 		timeout_add(&sc->sc_bulk_tmo, 0);
@@ -2453,13 +2554,17 @@ pfsync_bulk_update(void *arg)
 {
 	struct pfsync_softc *sc;
 	struct pf_state *st;
-	int i = 0;
+	int i = 0, n;
 
 	NET_LOCK();
 	sc = pfsyncif;
 	if (sc == NULL)
 		goto out;
 
+	/* queue several packets worth of states, the slices send them */
+	n = PFSYNC_BULK_PKTS * ((sc->sc_if.if_mtu - PFSYNC_MINPKT -
+	    sizeof(struct pfsync_subheader)) / sizeof(struct pfsync_state));
+
 	rw_enter_read(&pf_state_list.pfs_rwl);
 	st = sc->sc_bulk_next;
 	sc->sc_bulk_next = NULL;
@@ -2480,9 +2585,8 @@ pfsync_bulk_update(void *arg)
 			break;
 		}
 
-		if (i > 1 && (sc->sc_if.if_mtu - sc->sc_len) <
-		    sizeof(struct pfsync_state)) {
-			/* we've filled a packet */
+		if (i >= n) {
+			/* let the packets go out before the next run */
 			sc->sc_bulk_next = st;
 			timeout_add(&sc->sc_bulk_tmo, 1);
 			break;
@@ -2490,6 +2594,7 @@ pfsync_bulk_update(void *arg)
 	}
 
 	rw_exit_read(&pf_state_list.pfs_rwl);
+	sc->sc_bulk_sent += i;
  out:
 	NET_UNLOCK();
 }
@@ -2613,6 +2718,103 @@ pfsyncintr(void)
 	pfsync_sendout();
 }
 
+#if NKSTAT > 0
+struct pfsync_kstat_data {
+	struct kstat_kv		kd_queued;
+	struct kstat_kv		kd_queue_age;
+	struct kstat_kv		kd_sendq_len;
+	struct kstat_kv		kd_sendq_drops;
+	struct kstat_kv		kd_bulk_sending;
+	struct kstat_kv		kd_bulk_sent;
+	struct kstat_kv		kd_bulk_wait;
+	struct kstat_kv		kd_peer_idle;
+};
+
+static const struct pfsync_kstat_data pfsync_kstat_tpl = {
+	KSTAT_KV_INITIALIZER("queued", KSTAT_KV_T_UINT32),
+	KSTAT_KV_INITIALIZER("queue-age-ms", KSTAT_KV_T_UINT64),
+	KSTAT_KV_UNIT_INITIALIZER("sendq-len",
+	    KSTAT_KV_T_UINT32, KSTAT_KV_U_PACKETS),
+	KSTAT_KV_UNIT_INITIALIZER("sendq-drops",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_PACKETS),
+	KSTAT_KV_INITIALIZER("bulk-sending", KSTAT_KV_T_BOOL),
+	KSTAT_KV_INITIALIZER("bulk-sent", KSTAT_KV_T_COUNTER64),
+	KSTAT_KV_INITIALIZER("bulk-wait-sec", KSTAT_KV_T_UINT64),
+	KSTAT_KV_INITIALIZER("peer-idle-ms", KSTAT_KV_T_UINT64),
+};
+
+/*
+ * How far behind replication is: the number of state updates waiting
+ * to be sent and for how long the oldest has waited, the packets not
+ * yet handed to ip_output(), the progress of a bulk update we send,
+ * how long we have waited for one from the peer, and the time since
+ * the peer last sent anything.
+ */
+int
+pfsync_kstat_copy(struct kstat *ks, void *dst)
+{
+	struct pfsync_softc *sc = ks->ks_softc;
+	struct pfsync_kstat_data *kd = dst;
+	struct pfsync_slice *s;
+	uint64_t now, oldest = 0;
+	uint32_t queued = 0;
+	int i;
+
+	*kd = pfsync_kstat_tpl;
+	now = getnsecuptime();
+
+	for (i = 0; i < PFSYNC_NSLICES; i++) {
+		s = &sc->sc_slices[i];
+
+		mtx_enter(&s->s_mtx);
+		if (s->s_count > 0) {
+			queued += s->s_count;
+			if (oldest == 0 || s->s_stamp < oldest)
+				oldest = s->s_stamp;
+		}
+		mtx_leave(&s->s_mtx);
+	}
+
+	kstat_kv_u32(&kd->kd_queued) = queued;
+	if (oldest != 0)
+		kstat_kv_u64(&kd->kd_queue_age) = (now - oldest) / 1000000;
+	kstat_kv_u32(&kd->kd_sendq_len) = mq_len(&pfsync_mq);
+	kstat_kv_u64(&kd->kd_sendq_drops) = mq_drops(&pfsync_mq);
+	kstat_kv_bool(&kd->kd_bulk_sending) = (sc->sc_bulk_last != NULL);
+	kstat_kv_u64(&kd->kd_bulk_sent) = sc->sc_bulk_sent;
+	if (sc->sc_ureq_sent != 0) {
+		kstat_kv_u64(&kd->kd_bulk_wait) =
+		    getuptime() - sc->sc_ureq_sent;
+	}
+	if (sc->sc_last_input != 0) {
+		kstat_kv_u64(&kd->kd_peer_idle) =
+		    (now - sc->sc_last_input) / 1000000;
+	}
+
+	nanouptime(&ks->ks_updated);
+
+	return (0);
+}
+
+void
+pfsync_kstat_attach(struct pfsync_softc *sc)
+{
+	struct kstat *ks;
+
+	ks = kstat_create(sc->sc_if.if_xname, 0, "pfsync", 0,
+	    KSTAT_T_KV, 0);
+	if (ks == NULL)
+		return;
+
+	ks->ks_softc = sc;
+	ks->ks_datalen = sizeof(pfsync_kstat_tpl);
+	ks->ks_copy = pfsync_kstat_copy;
+	kstat_install(ks);
+
+	sc->sc_kstat = ks;
+}
+#endif /* NKSTAT > 0 */
+
 int
 pfsync_sysctl_pfsyncstat(void *oldp, size_t *oldlenp, void *newp)
 {
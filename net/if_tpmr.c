@@ -527,6 +527,7 @@ tpmr_add_port(struct tpmr_softc *sc, const struct ifbreq *req)
 	p->p_ioctl = ifp0->if_ioctl;
 	p->p_output = ifp0->if_output;
 
+	ifsetlro(ifp0, 0);
 	error = ifpromisc(ifp0, 1);
 	if (error != 0)
 		goto free;
@@ -1490,6 +1490,7 @@ veb_add_port(struct veb_softc *sc, const struct ifbreq *req, unsigned int span)
 	} else {
 		ports_ptr = &sc->sc_ports;
 
+		ifsetlro(ifp0, 0);
 		error = ifpromisc(ifp0, 1);
 		if (error != 0)
 			goto free;
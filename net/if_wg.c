@@ -19,6 +19,7 @@
 
 #include "bpfilter.h"
 #include "pf.h"
+#include "kstat.h"
 
 #include <sys/types.h>
 #include <sys/systm.h>
@@ -31,6 +32,10 @@
 #include <sys/ioctl.h>
 #include <sys/mbuf.h>
 
+#if NKSTAT > 0
+#include <sys/kstat.h>
+#endif
+
 #include <net/if.h>
 #include <net/if_var.h>
 #include <net/if_types.h>
@@ -55,6 +60,8 @@
 #define MAX_STAGED_PKT		128
 #define MAX_QUEUED_PKT		1024
 #define MAX_QUEUED_PKT_MASK	(MAX_QUEUED_PKT - 1)
+#define MAX_CRYPT_WORKERS	16
+#define CRYPT_WORKER_PKTS	8	/* queued packets per woken worker */
 
 #define MAX_QUEUED_HANDSHAKES	4096
 
@@ -200,6 +207,9 @@ struct wg_peer {
 	struct mutex		 p_counters_mtx;
 	uint64_t		 p_counters_tx;
 	uint64_t		 p_counters_rx;
+	uint64_t		 p_encap_drops;
+	uint64_t		 p_decap_drops;
+	struct kstat		*p_kstat;
 
 	struct mutex		 p_endpoint_mtx;
 	struct wg_endpoint	 p_endpoint;
@@ -258,8 +268,14 @@ struct wg_softc {
 	struct task		 sc_handshake;
 	struct mbuf_queue	 sc_handshake_queue;
 
-	struct task		 sc_encap;
-	struct task		 sc_decap;
+	/*
+	 * Every worker task drains the shared rings, so up to sc_nworkers
+	 * crypt threads work on one interface at a time. The per peer
+	 * serial queues put the packets back in order afterwards.
+	 */
+	unsigned int		 sc_nworkers;
+	struct task		 sc_encap[MAX_CRYPT_WORKERS];
+	struct task		 sc_decap[MAX_CRYPT_WORKERS];
 	struct wg_ring		 sc_encap_ring;
 	struct wg_ring		 sc_decap_ring;
 };
@@ -275,6 +291,10 @@ int	wg_peer_get_sockaddr(struct wg_peer *, struct sockaddr *);
 void	wg_peer_clear_src(struct wg_peer *);
 void	wg_peer_get_endpoint(struct wg_peer *, struct wg_endpoint *);
 void	wg_peer_counters_add(struct wg_peer *, uint64_t, uint64_t);
+void	wg_peer_drops_add(struct wg_peer *, uint64_t, uint64_t);
+#if NKSTAT > 0
+void	wg_peer_kstat_attach(struct wg_peer *);
+#endif
 
 int	wg_aip_add(struct wg_softc *, struct wg_peer *, struct wg_aip_io *);
 struct wg_peer *
@@ -335,6 +355,7 @@ void	wg_encap(struct wg_softc *, struct mbuf *);
 void	wg_decap(struct wg_softc *, struct mbuf *);
 void	wg_encap_worker(void *);
 void	wg_decap_worker(void *);
+void	wg_crypt_kick(struct wg_softc *, struct wg_ring *, struct task *);
 void	wg_deliver_out(void *);
 void	wg_deliver_in(void *);
 
@@ -406,6 +427,9 @@ wg_peer_create(struct wg_softc *sc, uint8_t public[WG_KEY_SIZE])
 	mtx_init(&peer->p_counters_mtx, IPL_NET);
 	peer->p_counters_tx = 0;
 	peer->p_counters_rx = 0;
+	peer->p_encap_drops = 0;
+	peer->p_decap_drops = 0;
+	peer->p_kstat = NULL;
 
 	mtx_init(&peer->p_endpoint_mtx, IPL_NET);
 	bzero(&peer->p_endpoint, sizeof(peer->p_endpoint));
@@ -443,6 +467,10 @@ wg_peer_create(struct wg_softc *sc, uint8_t public[WG_KEY_SIZE])
 	sc->sc_peer_num++;
 	rw_exit_write(&sc->sc_peer_lock);
 
+#if NKSTAT > 0
+	wg_peer_kstat_attach(peer);
+#endif
+
 	DPRINTF(sc, "Peer %llu created\n", peer->p_id);
 	return peer;
 }
@@ -514,6 +542,11 @@ wg_peer_destroy(struct wg_peer *peer)
 	taskq_barrier(wg_crypt_taskq);
 	taskq_barrier(net_tq(sc->sc_if.if_index));
 
+#if NKSTAT > 0
+	if (peer->p_kstat != NULL)
+		kstat_destroy(peer->p_kstat);
+#endif
+
 	DPRINTF(sc, "Peer %llu destroyed\n", peer->p_id);
 	explicit_bzero(peer, sizeof(*peer));
 	pool_put(&wg_peer_pool, peer);
@@ -581,6 +614,77 @@ wg_peer_counters_add(struct wg_peer *peer, uint64_t tx, uint64_t rx)
 	mtx_leave(&peer->p_counters_mtx);
 }
 
+void
+wg_peer_drops_add(struct wg_peer *peer, uint64_t encap, uint64_t decap)
+{
+	mtx_enter(&peer->p_counters_mtx);
+	peer->p_encap_drops += encap;
+	peer->p_decap_drops += decap;
+	mtx_leave(&peer->p_counters_mtx);
+}
+
+#if NKSTAT > 0
+struct wg_peer_kstat_data {
+	struct kstat_kv		kd_txbytes;
+	struct kstat_kv		kd_rxbytes;
+	struct kstat_kv		kd_encap_qlen;
+	struct kstat_kv		kd_decap_qlen;
+	struct kstat_kv		kd_encap_drops;
+	struct kstat_kv		kd_decap_drops;
+};
+
+static const struct wg_peer_kstat_data wg_peer_kstat_tpl = {
+	KSTAT_KV_UNIT_INITIALIZER("txbytes",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_BYTES),
+	KSTAT_KV_UNIT_INITIALIZER("rxbytes",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_BYTES),
+	KSTAT_KV_UNIT_INITIALIZER("encap-qlen",
+	    KSTAT_KV_T_UINT32, KSTAT_KV_U_PACKETS),
+	KSTAT_KV_UNIT_INITIALIZER("decap-qlen",
+	    KSTAT_KV_T_UINT32, KSTAT_KV_U_PACKETS),
+	KSTAT_KV_UNIT_INITIALIZER("encap-drops",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_PACKETS),
+	KSTAT_KV_UNIT_INITIALIZER("decap-drops",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_PACKETS),
+};
+
+int
+wg_peer_kstat_copy(struct kstat *ks, void *dst)
+{
+	struct wg_peer *peer = ks->ks_softc;
+	struct wg_peer_kstat_data *kd = dst;
+
+	*kd = wg_peer_kstat_tpl;
+	kstat_kv_u64(&kd->kd_txbytes) = peer->p_counters_tx;
+	kstat_kv_u64(&kd->kd_rxbytes) = peer->p_counters_rx;
+	kstat_kv_u32(&kd->kd_encap_qlen) = wg_queue_len(&peer->p_encap_queue);
+	kstat_kv_u32(&kd->kd_decap_qlen) = wg_queue_len(&peer->p_decap_queue);
+	kstat_kv_u64(&kd->kd_encap_drops) = peer->p_encap_drops;
+	kstat_kv_u64(&kd->kd_decap_drops) = peer->p_decap_drops;
+
+	return (0);
+}
+
+void
+wg_peer_kstat_attach(struct wg_peer *peer)
+{
+	struct kstat *ks;
+
+	ks = kstat_create(peer->p_sc->sc_if.if_xname, 0, "wg-peer",
+	    peer->p_id, KSTAT_T_KV, 0);
+	if (ks == NULL)
+		return;
+
+	kstat_set_mutex(ks, &peer->p_counters_mtx);
+	ks->ks_softc = peer;
+	ks->ks_datalen = sizeof(wg_peer_kstat_tpl);
+	ks->ks_copy = wg_peer_kstat_copy;
+	kstat_install(ks);
+
+	peer->p_kstat = ks;
+}
+#endif /* NKSTAT > 0 */
+
 int
 wg_aip_add(struct wg_softc *sc, struct wg_peer *peer, struct wg_aip_io *d)
 {
@@ -1298,7 +1402,7 @@ wg_send_keepalive(void *_peer)
 send:
 	if (noise_remote_ready(&peer->p_remote) == 0) {
 		wg_queue_out(sc, peer);
-		task_add(wg_crypt_taskq, &sc->sc_encap);
+		wg_crypt_kick(sc, &sc->sc_encap_ring, sc->sc_encap);
 	} else {
 		wg_timers_event_want_initiation(&peer->p_timers);
 	}
@@ -1676,6 +1780,25 @@ error:
 	task_add(net_tq(sc->sc_if.if_index), &peer->p_deliver_in);
 }
 
+/*
+ * Wake up enough crypt workers for the packets waiting on the ring. Each
+ * of them keeps draining the ring until it is empty.
+ */
+void
+wg_crypt_kick(struct wg_softc *sc, struct wg_ring *r, struct task *workers)
+{
+	unsigned int i, n;
+
+	mtx_enter(&r->r_mtx);
+	n = r->r_tail - r->r_head;
+	mtx_leave(&r->r_mtx);
+
+	n = howmany(n, CRYPT_WORKER_PKTS);
+	n = MIN(MAX(n, 1), sc->sc_nworkers);
+	for (i = 0; i < n; i++)
+		task_add(wg_crypt_taskq, &workers[i]);
+}
+
 void
 wg_encap_worker(void *_sc)
 {
@@ -1797,6 +1920,7 @@ wg_queue_in(struct wg_softc *sc, struct wg_peer *peer, struct mbuf *m)
 	} else {
 		mtx_leave(&serial->q_mtx);
 		m_freem(m);
+		wg_peer_drops_add(peer, 0, 1);
 		return ENOBUFS;
 	}
 
@@ -1809,6 +1933,7 @@ wg_queue_in(struct wg_softc *sc, struct wg_peer *peer, struct mbuf *m)
 		mtx_leave(&parallel->r_mtx);
 		t = wg_tag_get(m);
 		t->t_done = 1;
+		wg_peer_drops_add(peer, 0, 1);
 		return ENOBUFS;
 	}
 
@@ -1823,7 +1948,7 @@ wg_queue_out(struct wg_softc *sc, struct wg_peer *peer)
 	struct mbuf_list 	 ml, ml_free;
 	struct mbuf		*m;
 	struct wg_tag		*t;
-	int			 dropped;
+	int			 dropped, rdropped = 0;
 
 	/*
 	 * We delist all staged packets and then add them to the queues. This
@@ -1853,11 +1978,14 @@ wg_queue_out(struct wg_softc *sc, struct wg_peer *peer)
 			mtx_leave(&parallel->r_mtx);
 			t = wg_tag_get(m);
 			t->t_done = 1;
+			rdropped++;
 		}
 	}
 
 	if ((dropped = ml_purge(&ml_free)) > 0)
 		counters_add(sc->sc_if.if_counters, ifc_oqdrops, dropped);
+	if (dropped + rdropped > 0)
+		wg_peer_drops_add(peer, dropped + rdropped, 0);
 }
 
 struct mbuf *
@@ -2054,7 +2182,7 @@ wg_input(void *_sc, struct mbuf *m, struct ip *ip, struct ip6_hdr *ip6,
 			if (wg_queue_in(sc, t->t_peer, m) != 0)
 				counters_inc(sc->sc_if.if_counters,
 				    ifc_iqdrops);
-			task_add(wg_crypt_taskq, &sc->sc_decap);
+			wg_crypt_kick(sc, &sc->sc_decap_ring, sc->sc_decap);
 		} else {
 			counters_inc(sc->sc_if.if_counters, ifc_ierrors);
 			m_freem(m);
@@ -2101,7 +2229,7 @@ wg_qstart(struct ifqueue *ifq)
 			wg_timers_event_want_initiation(&peer->p_timers);
 		peer->p_start_onlist = 0;
 	}
-	task_add(wg_crypt_taskq, &sc->sc_encap);
+	wg_crypt_kick(sc, &sc->sc_encap_ring, sc->sc_encap);
 }
 
 int
@@ -2571,6 +2699,7 @@ wg_clone_create(struct if_clone *ifc, int unit)
 	struct ifnet		*ifp;
 	struct wg_softc		*sc;
 	struct noise_upcall	 local_upcall;
+	unsigned int		 i;
 
 	KERNEL_ASSERT_LOCKED();
 
@@ -2640,8 +2769,11 @@ wg_clone_create(struct if_clone *ifc, int unit)
 	task_set(&sc->sc_handshake, wg_handshake_worker, sc);
 	mq_init(&sc->sc_handshake_queue, MAX_QUEUED_HANDSHAKES, IPL_NET);
 
-	task_set(&sc->sc_encap, wg_encap_worker, sc);
-	task_set(&sc->sc_decap, wg_decap_worker, sc);
+	sc->sc_nworkers = MIN(ncpus, MAX_CRYPT_WORKERS);
+	for (i = 0; i < sc->sc_nworkers; i++) {
+		task_set(&sc->sc_encap[i], wg_encap_worker, sc);
+		task_set(&sc->sc_decap[i], wg_decap_worker, sc);
+	}
 
 	bzero(&sc->sc_encap_ring, sizeof(sc->sc_encap_ring));
 	mtx_init(&sc->sc_encap_ring.r_mtx, IPL_NET);
@@ -28,6 +28,12 @@
 
 #include <net/if.h>
 #include <net/if_var.h>
+#include <net/route.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_timer.h>
+#include <netinet/tcp_var.h>
 
 #if NBPFILTER > 0
 #include <net/bpf.h>
@@ -586,6 +592,9 @@ struct ifiq_kstat_data {
 
 	struct kstat_kv kd_enqueues;
 	struct kstat_kv kd_dequeues;
+
+	struct kstat_kv kd_lro_merged;
+	struct kstat_kv kd_lro_flushed;
 };
 
 static const struct ifiq_kstat_data ifiq_kstat_tpl = {
@@ -606,6 +615,11 @@ static const struct ifiq_kstat_data ifiq_kstat_tpl = {
 	    KSTAT_KV_T_COUNTER64),
 	KSTAT_KV_INITIALIZER("dequeues",
 	    KSTAT_KV_T_COUNTER64),
+
+	KSTAT_KV_UNIT_INITIALIZER("lro merged",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_PACKETS),
+	KSTAT_KV_UNIT_INITIALIZER("lro flushed",
+	    KSTAT_KV_T_COUNTER64, KSTAT_KV_U_PACKETS),
 };
 
 int
@@ -625,6 +639,9 @@ ifiq_kstat_copy(struct kstat *ks, void *dst)
 	kstat_kv_u64(&kd->kd_enqueues) = ifiq->ifiq_enqueues;
 	kstat_kv_u64(&kd->kd_dequeues) = ifiq->ifiq_dequeues;
 
+	kstat_kv_u64(&kd->kd_lro_merged) = ifiq->ifiq_lro_merged;
+	kstat_kv_u64(&kd->kd_lro_flushed) = ifiq->ifiq_lro_flushed;
+
 	return (0);
 }
 #endif
@@ -648,6 +665,8 @@ ifiq_init(struct ifiqueue *ifiq, struct ifnet *ifp, unsigned int idx)
 	ifiq->ifiq_fdrops = 0;
 	ifiq->ifiq_qdrops = 0;
 	ifiq->ifiq_errors = 0;
+	ifiq->ifiq_lro_merged = 0;
+	ifiq->ifiq_lro_flushed = 0;
 
 	ifiq->ifiq_idx = idx;
 
@@ -682,6 +701,56 @@ ifiq_destroy(struct ifiqueue *ifiq)
 unsigned int ifiq_maxlen_drop = 2048 * 5;
 unsigned int ifiq_maxlen_return = 2048 * 3;
 
+/*
+ * Hand packets that carry a flow id straight to the softnet thread
+ * for that flow. Runs of packets for the same softnet are queued in
+ * one go. Packets without a flow id are left on ml.
+ */
+static unsigned int
+ifiq_steer(struct mbuf_list *ml, uint64_t *qdrops)
+{
+	struct mbuf_list rest = MBUF_LIST_INITIALIZER();
+	struct mbuf_list run = MBUF_LIST_INITIALIZER();
+	struct mbuf *m;
+	unsigned int nsn = softnet_count();
+	unsigned int sn = 0, flow, len, maxlen = 0;
+
+	while ((m = ml_dequeue(ml)) != NULL) {
+		if (!ISSET(m->m_pkthdr.csum_flags, M_FLOWID)) {
+			ml_enqueue(&rest, m);
+			continue;
+		}
+
+		flow = m->m_pkthdr.ph_flowid % nsn;
+		if (flow != sn && !ml_empty(&run)) {
+			len = softnet_input(sn, &run, ifiq_maxlen_drop);
+			if (len > maxlen)
+				maxlen = len;
+			if (!ml_empty(&run)) {
+				*qdrops += ml_len(&run);
+				ml_purge(&run);
+			}
+		}
+
+		sn = flow;
+		ml_enqueue(&run, m);
+	}
+
+	if (!ml_empty(&run)) {
+		len = softnet_input(sn, &run, ifiq_maxlen_drop);
+		if (len > maxlen)
+			maxlen = len;
+		if (!ml_empty(&run)) {
+			*qdrops += ml_len(&run);
+			ml_purge(&run);
+		}
+	}
+
+	*ml = rest;
+
+	return (maxlen);
+}
+
 int
 ifiq_input(struct ifiqueue *ifiq, struct mbuf_list *ml)
 {
@@ -690,7 +759,10 @@ ifiq_input(struct ifiqueue *ifiq, struct mbuf_list *ml)
 	uint64_t packets;
 	uint64_t bytes = 0;
 	uint64_t fdrops = 0;
-	unsigned int len;
+	uint64_t qdrops = 0;
+	uint64_t lro_merged = 0;
+	uint64_t lro_flushed = 0;
+	unsigned int len, steerlen = 0;
 #if NBPFILTER > 0
 	caddr_t if_bpf;
 #endif
@@ -732,10 +804,41 @@ ifiq_input(struct ifiqueue *ifiq, struct mbuf_list *ml)
 	}
 #endif
 
+	if (ISSET(ifp->if_xflags, IFXF_LRO) &&
+	    !ISSET(ifp->if_xflags, IFXF_MONITOR)) {
+		/* hardware LRO has already done the merging */
+		if (!ISSET(ifp->if_capabilities, IFCAP_LRO))
+			lro_merged = tcp_softlro(ml);
+		MBUF_LIST_FOREACH(ml, m) {
+			if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO))
+				lro_flushed++;
+		}
+	}
+
+	if (__predict_true(!ISSET(ifp->if_xflags, IFXF_MONITOR)) &&
+	    softnet_count() > 1) {
+		steerlen = ifiq_steer(ml, &qdrops);
+		if (ml_empty(ml)) {
+			mtx_enter(&ifiq->ifiq_mtx);
+			ifiq->ifiq_packets += packets;
+			ifiq->ifiq_bytes += bytes;
+			ifiq->ifiq_fdrops += fdrops;
+			ifiq->ifiq_qdrops += qdrops;
+			ifiq->ifiq_lro_merged += lro_merged;
+			ifiq->ifiq_lro_flushed += lro_flushed;
+			mtx_leave(&ifiq->ifiq_mtx);
+
+			return (steerlen > ifiq_maxlen_return);
+		}
+	}
+
 	mtx_enter(&ifiq->ifiq_mtx);
 	ifiq->ifiq_packets += packets;
 	ifiq->ifiq_bytes += bytes;
 	ifiq->ifiq_fdrops += fdrops;
+	ifiq->ifiq_qdrops += qdrops;
+	ifiq->ifiq_lro_merged += lro_merged;
+	ifiq->ifiq_lro_flushed += lro_flushed;
 
 	len = ml_len(&ifiq->ifiq_ml);
 	if (__predict_true(!ISSET(ifp->if_xflags, IFXF_MONITOR))) {
@@ -753,7 +856,7 @@ ifiq_input(struct ifiqueue *ifiq, struct mbuf_list *ml)
 	else
 		ml_purge(ml);
 
-	return (len > ifiq_maxlen_return);
+	return (MAX(len, steerlen) > ifiq_maxlen_return);
 }
 
 void
@@ -101,6 +101,11 @@ struct ifiqueue {
 	/* number of times a list of packets were pulled off ifiq_ml */
 	uint64_t		 ifiq_dequeues;
 
+	/* segments merged into another packet by software LRO */
+	uint64_t		 ifiq_lro_merged;
+	/* packets made of several segments passed up by LRO */
+	uint64_t		 ifiq_lro_flushed;
+
 	struct kstat		*ifiq_kstat;
 
 	/* properties */
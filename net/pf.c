@@ -53,8 +53,12 @@
 #include <sys/proc.h>
 #include <sys/rwlock.h>
 #include <sys/syslog.h>
+#include <sys/malloc.h>
+#include <sys/task.h>
+#include <sys/smr.h>
 
 #include <crypto/sha2.h>
+#include <crypto/siphash.h>
 
 #include <net/if.h>
 #include <net/if_var.h>
@@ -107,12 +111,16 @@ struct pfsync_deferral;
 /*
  * Global variables
  */
-struct pf_state_tree	 pf_statetbl;
+struct pf_statetbl	*pf_statetbl;		/* [P] and SMR */
+unsigned int		 pf_statetbl_nkeys;	/* [P] */
+SIPHASH_KEY		 pf_statetbl_secret;
 struct pf_queuehead	 pf_queues[2];
 struct pf_queuehead	*pf_queues_active;
 struct pf_queuehead	*pf_queues_inactive;
 
 struct pf_status	 pf_status;
+struct cpumem		*pf_counters;
+struct cpumem		*pf_lcounters;
 
 int			 pf_hdr_limit = 20;  /* arbitrary limit, tune in ddb */
 
@@ -185,6 +193,13 @@ void			 pf_detach_state(struct pf_state *);
 struct pf_state_key	*pf_state_key_attach(struct pf_state_key *,
 			     struct pf_state *, int);
 void			 pf_state_key_detach(struct pf_state *, int);
+struct pf_statetbl	*pf_statetbl_alloc(unsigned int, int);
+void			 pf_statetbl_free(struct pf_statetbl *);
+void			 pf_statetbl_insert(struct pf_state_key *);
+void			 pf_statetbl_remove(struct pf_state_key *);
+void			 pf_statetbl_resize(void *);
+void			 pf_state_item_free(void *);
+void			 pf_state_key_free(void *);
 u_int32_t		 pf_tcp_iss(struct pf_pdesc *);
 void			 pf_rule_to_actions(struct pf_rule *,
 			    struct pf_rule_actions *);
@@ -299,8 +314,6 @@ struct pf_pool_limit pf_pool_limits[PF_LIMIT_MAX] = {
 	} while (0)
 
 static __inline int pf_src_compare(struct pf_src_node *, struct pf_src_node *);
-static inline int pf_state_compare_key(const struct pf_state_key *,
-	const struct pf_state_key *);
 static inline int pf_state_compare_id(const struct pf_state *,
 	const struct pf_state *);
 #ifdef INET6
@@ -314,8 +327,12 @@ struct pf_src_tree tree_src_tracking;
 struct pf_state_tree_id tree_id;
 struct pf_state_list pf_state_list = PF_STATE_LIST_INITIALIZER(pf_state_list);
 
+#define PF_STATETBL_MINSIZE	1024
+#define PF_STATETBL_MAXSIZE	(1U << 20)
+
+struct task pf_statetbl_task = TASK_INITIALIZER(pf_statetbl_resize, NULL);
+
 RB_GENERATE(pf_src_tree, pf_src_node, entry, pf_src_compare);
-RBT_GENERATE(pf_state_tree, pf_state_key, sk_entry, pf_state_compare_key);
 RBT_GENERATE(pf_state_tree_id, pf_state, entry_id, pf_state_compare_id);
 
 int
@@ -487,13 +504,13 @@ pf_src_connlimit(struct pf_state **stp)
 
 	if ((*stp)->rule.ptr->max_src_conn &&
 	    (*stp)->rule.ptr->max_src_conn < sn->conn) {
-		pf_status.lcounters[LCNT_SRCCONN]++;
+		pf_lcounter_inc(LCNT_SRCCONN);
 		bad++;
 	}
 
 	if ((*stp)->rule.ptr->max_src_conn_rate.limit &&
 	    pf_check_threshold(&sn->conn_rate)) {
-		pf_status.lcounters[LCNT_SRCCONNRATE]++;
+		pf_lcounter_inc(LCNT_SRCCONNRATE);
 		bad++;
 	}
 
@@ -504,7 +521,7 @@ pf_src_connlimit(struct pf_state **stp)
 		struct pfr_addr p;
 		u_int32_t	killed = 0;
 
-		pf_status.lcounters[LCNT_OVERLOAD_TABLE]++;
+		pf_lcounter_inc(LCNT_OVERLOAD_TABLE);
 		if (pf_status.debug >= LOG_NOTICE) {
 			log(LOG_NOTICE,
 			    "pf: pf_src_connlimit: blocking address ");
@@ -535,7 +552,7 @@ pf_src_connlimit(struct pf_state **stp)
 			struct pf_state_key *sk;
 			struct pf_state *st;
 
-			pf_status.lcounters[LCNT_OVERLOAD_FLUSH]++;
+			pf_lcounter_inc(LCNT_OVERLOAD_FLUSH);
 			RBT_FOREACH(st, pf_state_tree_id, &tree_id) {
 				sk = st->key[PF_SK_WIRE];
 				/*
@@ -583,7 +600,7 @@ pf_insert_src_node(struct pf_src_node **sn, struct pf_rule *rule,
 		k.type = type;
 		pf_addrcpy(&k.addr, src, af);
 		k.rule.ptr = rule;
-		pf_status.scounters[SCNT_SRC_NODE_SEARCH]++;
+		pf_scounter_inc(SCNT_SRC_NODE_SEARCH);
 		*sn = RB_FIND(pf_src_tree, &tree_src_tracking, &k);
 	}
 	if (*sn == NULL) {
@@ -591,7 +608,7 @@ pf_insert_src_node(struct pf_src_node **sn, struct pf_rule *rule,
 		    rule->src_nodes < rule->max_src_nodes)
 			(*sn) = pool_get(&pf_src_tree_pl, PR_NOWAIT | PR_ZERO);
 		else
-			pf_status.lcounters[LCNT_SRCNODES]++;
+			pf_lcounter_inc(LCNT_SRCNODES);
 		if ((*sn) == NULL)
 			return (-1);
 
@@ -622,12 +639,12 @@ pf_insert_src_node(struct pf_src_node **sn, struct pf_rule *rule,
 			(*sn)->kif = kif;
 			pfi_kif_ref(kif, PFI_KIF_REF_SRCNODE);
 		}
-		pf_status.scounters[SCNT_SRC_NODE_INSERT]++;
+		pf_scounter_inc(SCNT_SRC_NODE_INSERT);
 		pf_status.src_nodes++;
 	} else {
 		if (rule->max_src_states &&
 		    (*sn)->states >= rule->max_src_states) {
-			pf_status.lcounters[LCNT_SRCSTATES]++;
+			pf_lcounter_inc(LCNT_SRCSTATES);
 			return (-1);
 		}
 	}
@@ -645,7 +662,7 @@ pf_remove_src_node(struct pf_src_node *sn)
 	    sn->rule.ptr->src_nodes == 0)
 		pf_rm_rule(NULL, sn->rule.ptr);
 	RB_REMOVE(pf_src_tree, &tree_src_tracking, sn);
-	pf_status.scounters[SCNT_SRC_NODE_REMOVALS]++;
+	pf_scounter_inc(SCNT_SRC_NODE_REMOVALS);
 	pf_status.src_nodes--;
 	pfi_kif_unref(sn->kif, PFI_KIF_REF_SRCNODE);
 	pool_put(&pf_src_tree_pl, sn);
@@ -685,29 +702,177 @@ pf_state_rm_src_node(struct pf_state *st, struct pf_src_node *sn)
 
 /* state table stuff */
 
+static inline unsigned int
+pf_state_key_hash(const struct pf_state_key_cmp *key)
+{
+	SIPHASH_CTX	ctx;
+
+	SipHash24_Init(&ctx, &pf_statetbl_secret);
+	switch (key->af) {
+	case AF_INET:
+		SipHash24_Update(&ctx, &key->addr[0].v4, sizeof(struct in_addr));
+		SipHash24_Update(&ctx, &key->addr[1].v4, sizeof(struct in_addr));
+		break;
+#ifdef INET6
+	case AF_INET6:
+		SipHash24_Update(&ctx, &key->addr[0].v6,
+		    sizeof(struct in6_addr));
+		SipHash24_Update(&ctx, &key->addr[1].v6,
+		    sizeof(struct in6_addr));
+		break;
+#endif /* INET6 */
+	}
+	SipHash24_Update(&ctx, key->port, sizeof(key->port));
+	SipHash24_Update(&ctx, &key->rdomain, sizeof(key->rdomain));
+	SipHash24_Update(&ctx, &key->af, sizeof(key->af));
+	SipHash24_Update(&ctx, &key->proto, sizeof(key->proto));
+
+	return (SipHash24_End(&ctx));
+}
+
 static inline int
-pf_state_compare_key(const struct pf_state_key *a,
-    const struct pf_state_key *b)
+pf_state_key_equal(const struct pf_state_key *sk,
+    const struct pf_state_key_cmp *key)
 {
-	int	diff;
+	return (sk->proto == key->proto && sk->af == key->af &&
+	    sk->rdomain == key->rdomain &&
+	    sk->port[0] == key->port[0] && sk->port[1] == key->port[1] &&
+	    pf_addr_compare(&sk->addr[0], &key->addr[0], key->af) == 0 &&
+	    pf_addr_compare(&sk->addr[1], &key->addr[1], key->af) == 0);
+}
 
-	if ((diff = a->hash - b->hash) != 0)
-		return (diff);
-	if ((diff = a->proto - b->proto) != 0)
-		return (diff);
-	if ((diff = a->af - b->af) != 0)
-		return (diff);
-	if ((diff = pf_addr_compare(&a->addr[0], &b->addr[0], a->af)) != 0)
-		return (diff);
-	if ((diff = pf_addr_compare(&a->addr[1], &b->addr[1], a->af)) != 0)
-		return (diff);
-	if ((diff = a->port[0] - b->port[0]) != 0)
-		return (diff);
-	if ((diff = a->port[1] - b->port[1]) != 0)
-		return (diff);
-	if ((diff = a->rdomain - b->rdomain) != 0)
-		return (diff);
-	return (0);
+struct pf_statetbl *
+pf_statetbl_alloc(unsigned int nbuckets, int flags)
+{
+	struct pf_statetbl	*stt;
+	unsigned int		 i;
+
+	KASSERT(powerof2(nbuckets));
+
+	stt = malloc(sizeof(*stt) + nbuckets * sizeof(stt->stt_buckets[0]),
+	    M_PF, flags);
+	if (stt == NULL)
+		return (NULL);
+
+	stt->stt_mask = nbuckets - 1;
+	stt->stt_link = 0;
+	for (i = 0; i < nbuckets; i++)
+		SMR_LIST_INIT(&stt->stt_buckets[i]);
+
+	return (stt);
+}
+
+void
+pf_statetbl_free(struct pf_statetbl *stt)
+{
+	free(stt, M_PF, sizeof(*stt) +
+	    (stt->stt_mask + 1) * sizeof(stt->stt_buckets[0]));
+}
+
+void
+pf_statetbl_init(void)
+{
+	arc4random_buf(&pf_statetbl_secret, sizeof(pf_statetbl_secret));
+	pf_statetbl = pf_statetbl_alloc(PF_STATETBL_MINSIZE, M_WAITOK);
+}
+
+/*
+ * pf_state_key_lookup() may be called with the state lock held, or
+ * inside an SMR read section.  In the latter case the key is only
+ * valid until smr_read_leave(), unless the caller takes a reference.
+ */
+struct pf_state_key *
+pf_state_key_lookup(const struct pf_state_key_cmp *key)
+{
+	struct pf_statetbl	*stt;
+	struct pf_state_keylist	*skl;
+	struct pf_state_key	*sk;
+
+	stt = SMR_PTR_GET(&pf_statetbl);
+	skl = &stt->stt_buckets[pf_state_key_hash(key) & stt->stt_mask];
+	SMR_LIST_FOREACH(sk, skl, sk_entry[stt->stt_link]) {
+		if (pf_state_key_equal(sk, key))
+			break;
+	}
+
+	return (sk);
+}
+
+void
+pf_statetbl_insert(struct pf_state_key *sk)
+{
+	struct pf_statetbl	*stt;
+	unsigned int		 h;
+
+	PF_STATE_ASSERT_LOCKED();
+
+	stt = SMR_PTR_GET_LOCKED(&pf_statetbl);
+	h = pf_state_key_hash((struct pf_state_key_cmp *)sk) & stt->stt_mask;
+	SMR_LIST_INSERT_HEAD_LOCKED(&stt->stt_buckets[h], sk,
+	    sk_entry[stt->stt_link]);
+
+	if (++pf_statetbl_nkeys > 2 * (stt->stt_mask + 1) &&
+	    stt->stt_mask + 1 < PF_STATETBL_MAXSIZE)
+		task_add(systq, &pf_statetbl_task);
+}
+
+void
+pf_statetbl_remove(struct pf_state_key *sk)
+{
+	struct pf_statetbl	*stt;
+
+	PF_STATE_ASSERT_LOCKED();
+
+	stt = SMR_PTR_GET_LOCKED(&pf_statetbl);
+	SMR_LIST_REMOVE_LOCKED(sk, sk_entry[stt->stt_link]);
+
+	if (--pf_statetbl_nkeys < (stt->stt_mask + 1) / 8 &&
+	    stt->stt_mask + 1 > PF_STATETBL_MINSIZE)
+		task_add(systq, &pf_statetbl_task);
+}
+
+/*
+ * Rebuild the state key hash table so there are about as many buckets
+ * as keys.  The new table is linked through the other sk_entry, so
+ * lockless readers can keep walking the old table until it is released
+ * after smr_barrier().
+ */
+void
+pf_statetbl_resize(void *null)
+{
+	struct pf_statetbl	*ostt, *nstt;
+	struct pf_state_key	*sk;
+	unsigned int		 nbuckets, i, h;
+
+	nbuckets = PF_STATETBL_MINSIZE;
+	while (nbuckets < READ_ONCE(pf_statetbl_nkeys) &&
+	    nbuckets < PF_STATETBL_MAXSIZE)
+		nbuckets <<= 1;
+
+	/* only this task replaces the table, so it cannot go away */
+	ostt = SMR_PTR_GET(&pf_statetbl);
+	if (nbuckets == ostt->stt_mask + 1)
+		return;
+
+	nstt = pf_statetbl_alloc(nbuckets, M_WAITOK);
+
+	PF_STATE_ENTER_WRITE();
+	ostt = SMR_PTR_GET_LOCKED(&pf_statetbl);
+	nstt->stt_link = !ostt->stt_link;
+	for (i = 0; i <= ostt->stt_mask; i++) {
+		SMR_LIST_FOREACH_LOCKED(sk, &ostt->stt_buckets[i],
+		    sk_entry[ostt->stt_link]) {
+			h = pf_state_key_hash((struct pf_state_key_cmp *)sk) &
+			    nstt->stt_mask;
+			SMR_LIST_INSERT_HEAD_LOCKED(&nstt->stt_buckets[h], sk,
+			    sk_entry[nstt->stt_link]);
+		}
+	}
+	SMR_PTR_SET_LOCKED(&pf_statetbl, nstt);
+	PF_STATE_EXIT_WRITE();
+
+	smr_barrier();
+	pf_statetbl_free(ostt);
 }
 
 static inline int
@@ -739,12 +904,13 @@ pf_state_key_attach(struct pf_state_key *sk, struct pf_state *st, int idx)
 	PF_ASSERT_LOCKED();
 
 	KASSERT(st->key[idx] == NULL);
-	sk->sk_removed = 0;
-	cur = RBT_INSERT(pf_state_tree, &pf_statetbl, sk);
-	if (cur != NULL) {
-		sk->sk_removed = 1;
+	cur = pf_state_key_lookup((struct pf_state_key_cmp *)sk);
+	if (cur == NULL) {
+		sk->sk_removed = 0;
+		pf_statetbl_insert(sk);
+	} else {
 		/* key exists. check for same kif, if none, add to key */
-		TAILQ_FOREACH(si, &cur->sk_states, si_entry) {
+		SMR_TAILQ_FOREACH_LOCKED(si, &cur->sk_states, si_entry) {
 			struct pf_state *sist = si->si_st;
 			if (sist->kif == st->kif &&
 			    ((sist->key[PF_SK_WIRE]->af == sk->af &&
@@ -793,9 +959,9 @@ pf_state_key_attach(struct pf_state_key *sk, struct pf_state *st, int idx)
 	}
 
 	if ((si = pool_get(&pf_state_item_pl, PR_NOWAIT)) == NULL) {
-		if (TAILQ_EMPTY(&sk->sk_states)) {
+		if (SMR_TAILQ_EMPTY_LOCKED(&sk->sk_states)) {
 			KASSERT(cur == NULL);
-			RBT_REMOVE(pf_state_tree, &pf_statetbl, sk);
+			pf_statetbl_remove(sk);
 			sk->sk_removed = 1;
 			pf_state_key_unref(sk);
 		}
@@ -805,12 +971,13 @@ pf_state_key_attach(struct pf_state_key *sk, struct pf_state *st, int idx)
 
 	st->key[idx] = pf_state_key_ref(sk); /* give a ref to state */
 	si->si_st = pf_state_ref(st);
+	smr_init(&si->si_smr);
 
 	/* list is sorted, if-bound states before floating */
 	if (st->kif == pfi_all)
-		TAILQ_INSERT_TAIL(&sk->sk_states, si, si_entry);
+		SMR_TAILQ_INSERT_TAIL_LOCKED(&sk->sk_states, si, si_entry);
 	else
-		TAILQ_INSERT_HEAD(&sk->sk_states, si, si_entry);
+		SMR_TAILQ_INSERT_HEAD_LOCKED(&sk->sk_states, si, si_entry);
 
 	if (oldst)
 		pf_remove_state(oldst);
@@ -842,25 +1009,34 @@ pf_state_key_detach(struct pf_state *st, int idx)
 	if (sk == NULL)
 		return;
 
-	TAILQ_FOREACH(si, &sk->sk_states, si_entry) {
+	SMR_TAILQ_FOREACH_LOCKED(si, &sk->sk_states, si_entry) {
 		if (si->si_st == st)
 			break;
 	}
 	if (si == NULL)
 		return;
 
-	TAILQ_REMOVE(&sk->sk_states, si, si_entry);
-	pool_put(&pf_state_item_pl, si);
+	SMR_TAILQ_REMOVE_LOCKED(&sk->sk_states, si, si_entry);
 
-	if (TAILQ_EMPTY(&sk->sk_states)) {
-		RBT_REMOVE(pf_state_tree, &pf_statetbl, sk);
+	if (SMR_TAILQ_EMPTY_LOCKED(&sk->sk_states)) {
+		pf_statetbl_remove(sk);
 		sk->sk_removed = 1;
 		pf_state_key_unlink_reverse(sk);
 		pf_state_key_unlink_inpcb(sk);
 		pf_state_key_unref(sk);
 	}
 
-	pf_state_unref(st);
+	/* lockless readers may still see the item and its state */
+	smr_call(&si->si_smr, pf_state_item_free, si);
+}
+
+void
+pf_state_item_free(void *arg)
+{
+	struct pf_state_item	*si = arg;
+
+	pf_state_unref(si->si_st);
+	pool_put(&pf_state_item_pl, si);
 }
 
 struct pf_state_key *
@@ -872,7 +1048,8 @@ pf_alloc_state_key(int pool_flags)
 		return (NULL);
 
 	PF_REF_INIT(sk->sk_refcnt);
-	TAILQ_INIT(&sk->sk_states);
+	SMR_TAILQ_INIT(&sk->sk_states);
+	smr_init(&sk->sk_smr);
 	sk->sk_removed = 1;
 
 	return (sk);
@@ -1061,7 +1238,7 @@ pf_state_insert(struct pfi_kif *kif, struct pf_state_key **skwp,
 		return (-1);
 	}
 	pf_state_list_insert(&pf_state_list, st);
-	pf_status.fcounters[FCNT_STATE_INSERT]++;
+	pf_fcounter_inc(FCNT_STATE_INSERT);
 	pf_status.states++;
 	pfi_kif_ref(kif, PFI_KIF_REF_STATE);
 #if NPFSYNC > 0
@@ -1078,7 +1255,7 @@ pf_state_insert(struct pfi_kif *kif, struct pf_state_key **skwp,
 struct pf_state *
 pf_find_state_byid(struct pf_state_cmp *key)
 {
-	pf_status.fcounters[FCNT_STATE_SEARCH]++;
+	pf_fcounter_inc(FCNT_STATE_SEARCH);
 
 	return (RBT_FIND(pf_state_tree_id, &tree_id, (struct pf_state *)key));
 }
@@ -1117,6 +1294,12 @@ pf_compare_state_keys(struct pf_state_key *a, struct pf_state_key *b,
 	}
 }
 
+/*
+ * Inbound lookups only read the state table and may run inside an SMR
+ * read section.  Outbound lookups can link state keys to each other or
+ * to a socket, which must not race with pf_state_key_detach(), so they
+ * need the state lock.
+ */
 int
 pf_find_state(struct pf_pdesc *pd, struct pf_state_key_cmp *key,
     struct pf_state **stp)
@@ -1125,7 +1308,7 @@ pf_find_state(struct pf_pdesc *pd, struct pf_state_key_cmp *key,
 	struct pf_state_item	*si;
 	struct pf_state		*st = NULL;
 
-	pf_status.fcounters[FCNT_STATE_SEARCH]++;
+	pf_fcounter_inc(FCNT_STATE_SEARCH);
 	if (pf_status.debug >= LOG_DEBUG) {
 		log(LOG_DEBUG, "pf: key search, %s on %s: ",
 		    pd->dir == PF_OUT ? "out" : "in", pd->kif->pfik_name);
@@ -1162,8 +1345,7 @@ pf_find_state(struct pf_pdesc *pd, struct pf_state_key_cmp *key,
 	}
 
 	if (sk == NULL) {
-		if ((sk = RBT_FIND(pf_state_tree, &pf_statetbl,
-		    (struct pf_state_key *)key)) == NULL)
+		if ((sk = pf_state_key_lookup(key)) == NULL)
 			return (PF_DROP);
 		if (pd->dir == PF_OUT && pkt_sk &&
 		    pf_compare_state_keys(pkt_sk, sk, pd->kif, pd->dir) == 0)
@@ -1178,7 +1360,7 @@ pf_find_state(struct pf_pdesc *pd, struct pf_state_key_cmp *key,
 		pf_pkt_addr_changed(pd->m);
 
 	/* list is sorted, if-bound states before floating ones */
-	TAILQ_FOREACH(si, &sk->sk_states, si_entry) {
+	SMR_TAILQ_FOREACH(si, &sk->sk_states, si_entry) {
 		struct pf_state *sist = si->si_st;
 		if (sist->timeout != PFTM_PURGE &&
 		    (sist->kif == pfi_all || sist->kif == pd->kif) &&
@@ -1215,26 +1397,29 @@ pf_find_state_all(struct pf_state_key_cmp *key, u_int dir, int *more)
 	struct pf_state_key	*sk;
 	struct pf_state_item	*si, *ret = NULL;
 
-	pf_status.fcounters[FCNT_STATE_SEARCH]++;
-
-	sk = RBT_FIND(pf_state_tree, &pf_statetbl, (struct pf_state_key *)key);
+	pf_fcounter_inc(FCNT_STATE_SEARCH);
 
+	/* the table may be resized under callers that hold only PF_LOCK */
+	smr_read_enter();
+	sk = pf_state_key_lookup(key);
 	if (sk != NULL) {
-		TAILQ_FOREACH(si, &sk->sk_states, si_entry) {
+		SMR_TAILQ_FOREACH(si, &sk->sk_states, si_entry) {
 			struct pf_state *sist = si->si_st;
 			if (dir == PF_INOUT ||
 			    (sk == (dir == PF_IN ? sist->key[PF_SK_WIRE] :
 			    sist->key[PF_SK_STACK]))) {
-				if (more == NULL)
-					return (sist);
-
 				if (ret)
 					(*more)++;
 				else
 					ret = si;
+
+				if (more == NULL)
+					break;
 			}
 		}
 	}
+	smr_read_leave();
+
 	return (ret ? ret->si_st : NULL);
 }
 
@@ -1750,7 +1935,7 @@ pf_remove_divert_state(struct pf_state_key *sk)
 
 	PF_LOCK();
 	PF_STATE_ENTER_WRITE();
-	TAILQ_FOREACH(si, &sk->sk_states, si_entry) {
+	SMR_TAILQ_FOREACH_LOCKED(si, &sk->sk_states, si_entry) {
 		struct pf_state *sist = si->si_st;
 		if (sk == sist->key[PF_SK_STACK] && sist->rule.ptr &&
 		    (sist->rule.ptr->divert.type == PF_DIVERT_TO ||
@@ -1810,7 +1995,7 @@ pf_free_state(struct pf_state *st)
 	if (st->tag)
 		pf_tag_unref(st->tag);
 	pf_state_unref(st);
-	pf_status.fcounters[FCNT_STATE_REMOVALS]++;
+	pf_fcounter_inc(FCNT_STATE_REMOVALS);
 	pf_status.states--;
 }
 
@@ -2152,6 +2337,117 @@ pf_calc_skip_steps(struct pf_rulequeue *rules)
 		PF_SET_SKIP_STEPS(i);
 }
 
+/*
+ * Rulesets shorter than this are walked with the skip steps alone, and
+ * an index is not built if it would need more slots than the maximum.
+ */
+#define PF_RULE_INDEX_MIN	32
+#define PF_RULE_INDEX_BUCKETS	1024
+#define PF_RULE_INDEX_MAXSLOTS	(1 << 18)
+
+static inline int
+pf_rule_index_port(struct pf_rule *r)
+{
+	return (r->dst.port_op == PF_OP_EQ &&
+	    (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP));
+}
+
+static inline u_int
+pf_rule_index_hash(u_int16_t port, u_int mask)
+{
+	return (((ntohs(port) * 2654435761U) >> 20) & mask);
+}
+
+static void
+pf_rule_index_free(struct pf_rule_index *ri)
+{
+	if (ri != NULL)
+		free(ri, M_PF, ri->ri_size);
+}
+
+void
+pf_calc_rule_index(struct pf_ruleset *rs)
+{
+	struct pf_rule_index *ri = NULL;
+	struct pf_rule *r;
+	u_int *fill = NULL;
+	u_int nbuckets, nport = 0, nwild = 0, nslots, b, i;
+	size_t size;
+
+	pf_rule_index_free(rs->index);
+	rs->index = NULL;
+
+	if (rs->rules.active.rcount < PF_RULE_INDEX_MIN)
+		return;
+
+	TAILQ_FOREACH(r, rs->rules.active.ptr, entries) {
+		if (pf_rule_index_port(r))
+			nport++;
+		else
+			nwild++;
+	}
+	if (nport == 0)
+		return;
+
+	/* every bucket carries a copy of the wildcard rules */
+	for (nbuckets = 16; nbuckets < nport &&
+	    nbuckets < PF_RULE_INDEX_BUCKETS; nbuckets <<= 1)
+		;
+	while (nbuckets > 16 &&
+	    (nbuckets + 1) * nwild + nport > PF_RULE_INDEX_MAXSLOTS)
+		nbuckets >>= 1;
+	nslots = (nbuckets + 1) * nwild + nport;
+	if (nslots > PF_RULE_INDEX_MAXSLOTS)
+		return;
+
+	size = sizeof(*ri) + (nbuckets + 2) * sizeof(u_int) +
+	    nslots * sizeof(struct pf_rule *);
+	ri = malloc(size, M_PF, M_NOWAIT | M_ZERO);
+	fill = mallocarray(nbuckets + 1, sizeof(*fill), M_TEMP,
+	    M_NOWAIT | M_ZERO);
+	if (ri == NULL || fill == NULL)
+		goto fail;
+
+	ri->ri_size = size;
+	ri->ri_mask = nbuckets - 1;
+	ri->ri_rules = (struct pf_rule **)(ri + 1);
+	ri->ri_start = (u_int *)(ri->ri_rules + nslots);
+
+	/* size the lists, the wildcard list goes last */
+	TAILQ_FOREACH(r, rs->rules.active.ptr, entries) {
+		if (pf_rule_index_port(r))
+			fill[pf_rule_index_hash(r->dst.port[0],
+			    ri->ri_mask)]++;
+	}
+	ri->ri_start[0] = 0;
+	for (b = 0; b < nbuckets; b++)
+		ri->ri_start[b + 1] = ri->ri_start[b] + fill[b] + nwild;
+	ri->ri_start[nbuckets + 1] = ri->ri_start[nbuckets] + nwild;
+	KASSERT(ri->ri_start[nbuckets + 1] == nslots);
+
+	for (b = 0; b <= nbuckets; b++)
+		fill[b] = ri->ri_start[b];
+	TAILQ_FOREACH(r, rs->rules.active.ptr, entries) {
+		if (pf_rule_index_port(r)) {
+			b = pf_rule_index_hash(r->dst.port[0], ri->ri_mask);
+			ri->ri_rules[fill[b]++] = r;
+			continue;
+		}
+		for (i = 0; i <= nbuckets; i++)
+			ri->ri_rules[fill[i]++] = r;
+	}
+
+	free(fill, M_TEMP, (nbuckets + 1) * sizeof(*fill));
+	rs->index = ri;
+	return;
+
+fail:
+	/* fall back to walking the whole list */
+	free(fill, M_TEMP, (nbuckets + 1) * sizeof(*fill));
+	if (ri != NULL)
+		free(ri, M_PF, size);
+}
+
 int
 pf_addr_wrap_neq(struct pf_addr_wrap *aw1, struct pf_addr_wrap *aw2)
 {
@@ -3967,23 +4263,93 @@ pf_rule_to_actions(struct pf_rule *r, struct pf_rule_actions *a)
 		a->delay = r->delay;
 }
 
-#define PF_TEST_ATTRIB(t, a)			\
-	if (t) {				\
-		r = a;				\
-		continue;			\
-	} else do {				\
+/*
+ * Position in the candidate list of a ruleset index. Rules that are
+ * not on the list cannot match the packet, so every step to a rule in
+ * the ruleset is moved forward to the next candidate at or after it.
+ */
+struct pf_rule_cursor {
+	struct pf_rule_index	 *rc_ix;
+	struct pf_rule		**rc_rules;
+	u_int			  rc_n;
+	u_int			  rc_i;
+	u_int16_t		  rc_port;
+	u_int8_t		  rc_proto;
+};
+
+static inline void
+pf_rule_cursor_init(struct pf_rule_cursor *rc, struct pf_ruleset *rs)
+{
+	rc->rc_ix = rs->index;
+	rc->rc_rules = NULL;
+}
+
+static struct pf_rule *
+pf_rule_cursor_next(struct pf_rule_cursor *rc, struct pf_pdesc *pd,
+    struct pf_rule *r)
+{
+	struct pf_rule_index *ri = rc->rc_ix;
+	u_int b, lo, hi, mid;
+
+	if (ri == NULL || r == NULL)
+		return (r);
+
+	/*
+	 * Match rules may rewrite the destination port while the ruleset
+	 * is evaluated, so pick the list again whenever it changes.
+	 */
+	if (rc->rc_rules == NULL || rc->rc_proto != pd->virtual_proto ||
+	    rc->rc_port != pd->ndport) {
+		switch (pd->virtual_proto) {
+		case IPPROTO_TCP:
+		case IPPROTO_UDP:
+			b = pf_rule_index_hash(pd->ndport, ri->ri_mask);
+			break;
+		default:
+			b = ri->ri_mask + 1;
+			break;
+		}
+		rc->rc_rules = ri->ri_rules + ri->ri_start[b];
+		rc->rc_n = ri->ri_start[b + 1] - ri->ri_start[b];
+		rc->rc_i = 0;
+		rc->rc_proto = pd->virtual_proto;
+		rc->rc_port = pd->ndport;
+	}
+
+	lo = rc->rc_i;
+	hi = rc->rc_n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rc->rc_rules[mid]->nr < r->nr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	rc->rc_i = lo;
+
+	return (lo < rc->rc_n ? rc->rc_rules[lo] : NULL);
+}
+
+#define PF_TEST_ATTRIB(t, a)					\
+	if (t) {						\
+		r = pf_rule_cursor_next(&rc, ctx->pd, a);	\
+		continue;					\
+	} else do {						\
 	} while (0)
 
 enum pf_test_status
 pf_match_rule(struct pf_test_ctx *ctx, struct pf_ruleset *ruleset)
 {
 	struct pf_rule *r;
+	struct pf_rule_cursor rc;
 	struct pf_anchor *child = NULL;
 	int target;
 
 	pf_anchor_stack_init();
 enter_ruleset:
-	r = TAILQ_FIRST(ruleset->rules.active.ptr);
+	pf_rule_cursor_init(&rc, ruleset);
+	r = pf_rule_cursor_next(&rc, ctx->pd,
+	    TAILQ_FIRST(ruleset->rules.active.ptr));
 	while (r != NULL) {
 		PF_TEST_ATTRIB(r->rule_flag & PFRULE_EXPIRED,
 		    TAILQ_NEXT(r, entries));
@@ -4121,7 +4487,8 @@ enter_ruleset:
 				    rule_flag | PFRULE_EXPIRED) == rule_flag) {
 					r->exptime = gettime();
 				} else {
-					r = TAILQ_NEXT(r, entries);
+					r = pf_rule_cursor_next(&rc, ctx->pd,
+					    TAILQ_NEXT(r, entries));
 					continue;
 				}
 			}
@@ -4206,10 +4573,11 @@ next_rule:
 				;
 			}
 		}
-		r = TAILQ_NEXT(r, entries);
+		r = pf_rule_cursor_next(&rc, ctx->pd, TAILQ_NEXT(r, entries));
 	}
 
 	if (pf_anchor_stack_pop(&ruleset, &r, &child, &target) == 0) {
+		pf_rule_cursor_init(&rc, ruleset);
 		switch (target) {
 		case PF_NEXT_CHILD:
 			goto next_child;
@@ -4284,6 +4652,11 @@ pf_test_rule(struct pf_pdesc *pd, struct pf_rule **rm, struct pf_state **sm,
 #endif /* INET6 */
 	}
 
+	/*
+	 * XXX The rule index only narrows the walk; rule evaluation still
+	 * runs under the pf lock.  Evaluating without it needs lock free
+	 * rule counters, thresholds and translation pools first.
+	 */
 	ruleset = &pf_main_ruleset;
 	rv = pf_match_rule(&ctx, ruleset);
 	if (rv == PF_TEST_FAIL) {
@@ -4385,7 +4758,7 @@ pf_test_rule(struct pf_pdesc *pd, struct pf_rule **rm, struct pf_state **sm,
 		}
 
 		if (r->max_states && (r->states_cur >= r->max_states)) {
-			pf_status.lcounters[LCNT_STATES]++;
+			pf_lcounter_inc(LCNT_STATES);
 			REASON_SET(&ctx.reason, PFRES_MAXSTATES);
 			goto cleanup;
 		}
@@ -6513,6 +6886,14 @@ pf_route(struct pf_pdesc *pd, struct pf_state *st)
 		ip = mtod(m0, struct ip *);
 	}
 
+	error = tcp_if_output_tso(ifp, &m0, sintosa(dst), rt,
+	    IFCAP_TSOv4, ifp->if_mtu);
+	if (error || m0 == NULL)
+		goto done;
+	error = udp_if_output_gso(ifp, &m0, sintosa(dst), rt, ifp->if_mtu);
+	if (error || m0 == NULL)
+		goto done;
+
 	in_proto_cksum_out(m0, ifp);
 
 	if (ntohs(ip->ip_len) <= ifp->if_mtu) {
@@ -6651,6 +7032,13 @@ pf_route6(struct pf_pdesc *pd, struct pf_state *st)
 		}
 	}
 
+	if (tcp_if_output_tso(ifp, &m0, sin6tosa(dst), rt,
+	    IFCAP_TSOv6, ifp->if_mtu) || m0 == NULL)
+		goto done;
+	if (udp_if_output_gso(ifp, &m0, sin6tosa(dst), rt, ifp->if_mtu) ||
+	    m0 == NULL)
+		goto done;
+
 	in6_proto_cksum_out(m0, ifp);
 
 	/*
@@ -7627,10 +8015,17 @@ pf_test(sa_family_t af, int fwdir, struct ifnet *ifp, struct mbuf **m0)
 		key.port[pd.didx] = pd.odport;
 		key.hash = pd.hash;
 
-		PF_STATE_ENTER_READ();
-		action = pf_find_state(&pd, &key, &st);
-		st = pf_state_ref(st);
-		PF_STATE_EXIT_READ();
+		if (pd.dir == PF_IN) {
+			smr_read_enter();
+			action = pf_find_state(&pd, &key, &st);
+			st = pf_state_ref(st);
+			smr_read_leave();
+		} else {
+			PF_STATE_ENTER_READ();
+			action = pf_find_state(&pd, &key, &st);
+			st = pf_state_ref(st);
+			PF_STATE_EXIT_READ();
+		}
 
 		/* check for syncookies if tcp ack and no active state */
 		if (pd.dir == PF_IN && pd.virtual_proto == IPPROTO_TCP &&
@@ -7643,11 +8038,11 @@ pf_test(sa_family_t af, int fwdir, struct ifnet *ifp, struct mbuf **m0)
 				action = pf_test(af, fwdir, ifp, &msyn);
 				m_freem(msyn);
 				if (action == PF_PASS || action == PF_AFRT) {
-					PF_STATE_ENTER_READ();
 					pf_state_unref(st);
+					smr_read_enter();
 					action = pf_find_state(&pd, &key, &st);
 					st = pf_state_ref(st);
-					PF_STATE_EXIT_READ();
+					smr_read_leave();
 					if (st == NULL)
 						return (PF_DROP);
 					st->src.seqhi = st->dst.seqhi =
@@ -8059,10 +8454,19 @@ pf_state_key_unref(struct pf_state_key *sk)
 		KASSERT(sk->sk_reverse == NULL);
 		/* state key must be unlinked from socket */
 		KASSERT(sk->sk_inp == NULL);
-		pool_put(&pf_state_key_pl, sk);
+		/* lockless readers may still be looking at the key */
+		smr_call(&sk->sk_smr, pf_state_key_free, sk);
 	}
 }
 
+void
+pf_state_key_free(void *arg)
+{
+	struct pf_state_key *sk = arg;
+
+	pool_put(&pf_state_key_pl, sk);
+}
+
 int
 pf_state_key_isvalid(struct pf_state_key *sk)
 {
@@ -95,6 +95,8 @@ int			 pfclose(dev_t, int, int, struct proc *);
 int			 pfioctl(dev_t, u_long, caddr_t, int, struct proc *);
 int			 pf_begin_rules(u_int32_t *, const char *);
 void			 pf_rollback_rules(u_int32_t, char *);
+void			 pf_attach_queues(struct ifnet *,
+			    const struct ifq_ops *, void *);
 void			 pf_remove_queues(void);
 int			 pf_commit_queues(void);
 void			 pf_free_queues(struct pf_queuehead *);
@@ -214,6 +216,7 @@ pfattach(int num)
 		pf_pool_limits[PF_LIMIT_TABLE_ENTRIES].limit =
 		    PFR_KENTRY_HIWAT_SMALL;
 
+	pf_statetbl_init();
 	RB_INIT(&tree_src_tracking);
 	RB_INIT(&pf_anchors);
 	pf_init_ruleset(&pf_main_ruleset);
@@ -258,6 +261,8 @@ pfattach(int num)
 
 	pf_normalize_init();
 	memset(&pf_status, 0, sizeof(pf_status));
+	pf_counters = counters_alloc(PFC_MAX);
+	pf_lcounters = counters_alloc(LCNT_MAX);
 	pf_status.debug = LOG_ERR;
 	pf_status.reass = PF_REASS_ENABLED;
 
@@ -573,6 +578,29 @@ pf_free_queues(struct pf_queuehead *where)
 	}
 }
 
+/*
+ * hfsc keeps a single hierarchy and can only run on the first ifq, so
+ * the other transmit queues go back to priq. fq-codel flows are
+ * independent of each other and get an instance on every ifq.
+ */
+void
+pf_attach_queues(struct ifnet *ifp, const struct ifq_ops *ops, void *disc)
+{
+	struct ifqueue *ifq;
+	unsigned int i;
+
+	ifq_attach(&ifp->if_snd, ops, disc);
+
+	for (i = 1; i < ifp->if_nifqs; i++) {
+		ifq = ifp->if_ifqs[i];
+
+		if (ops == ifq_fqcodel_ops)
+			ifq_attach(ifq, ops, disc);
+		else if (ifq->ifq_ops != ifq_priq_ops)
+			ifq_attach(ifq, ifq_priq_ops, NULL);
+	}
+}
+
 void
 pf_remove_queues(void)
 {
@@ -588,7 +616,7 @@ pf_remove_queues(void)
 		if (ifp == NULL)
 			continue;
 
-		ifq_attach(&ifp->if_snd, ifq_priq_ops, NULL);
+		pf_attach_queues(ifp, ifq_priq_ops, NULL);
 	}
 }
 
@@ -679,7 +707,7 @@ pf_create_queues(void)
 		if (qif != NULL)
 			continue;
 
-		ifq_attach(&ifp->if_snd, ifq_priq_ops, NULL);
+		pf_attach_queues(ifp, ifq_priq_ops, NULL);
 	}
 
 	/* commit the new queues */
@@ -689,7 +717,7 @@ pf_create_queues(void)
 
 		ifp = qif->ifp;
 
-		ifq_attach(&ifp->if_snd, qif->ifqops, qif->disc);
+		pf_attach_queues(ifp, qif->ifqops, qif->disc);
 		free(qif, M_TEMP, sizeof(*qif));
 	}
 
@@ -851,7 +879,7 @@ pf_commit_rules(u_int32_t ticket, char *anchor)
 
 	rs->rules.active.ticket = rs->rules.inactive.ticket;
 	pf_calc_skip_steps(rs->rules.active.ptr);
-
+	pf_calc_rule_index(rs);
 
 	/* Purge the old rule list. */
 	while ((rule = TAILQ_FIRST(old_rules)) != NULL)
@@ -1710,6 +1738,7 @@ pfioctl(dev_t dev, u_long cmd, caddr_t addr, int flags, struct proc *p)
 		ruleset->rules.active.ticket++;
 
 		pf_calc_skip_steps(ruleset->rules.active.ptr);
+		pf_calc_rule_index(ruleset);
 		pf_remove_if_empty_ruleset(ruleset);
 
 		PF_UNLOCK();
@@ -1774,13 +1803,13 @@ pfioctl(dev_t dev, u_long cmd, caddr_t addr, int flags, struct proc *p)
 				key.port[sidx] = psk->psk_src.port[0];
 				key.port[didx] = psk->psk_dst.port[0];
 
-				sk = RBT_FIND(pf_state_tree, &pf_statetbl,
-				    &key);
+				sk = pf_state_key_lookup(
+				    (struct pf_state_key_cmp *)&key);
 				if (sk == NULL)
 					continue;
 
-				TAILQ_FOREACH_SAFE(si, &sk->sk_states,
-				    si_entry, sit) {
+				SMR_TAILQ_FOREACH_SAFE_LOCKED(si,
+				    &sk->sk_states, si_entry, sit) {
 					struct pf_state *sist = si->si_st;
 					if (((sist->key[PF_SK_WIRE]->af ==
 					    sist->key[PF_SK_STACK]->af &&
@@ -1911,7 +1940,7 @@ pfioctl(dev_t dev, u_long cmd, caddr_t addr, int flags, struct proc *p)
 		struct pf_status *s = (struct pf_status *)addr;
 		NET_LOCK();
 		PF_LOCK();
-		memcpy(s, &pf_status, sizeof(struct pf_status));
+		pf_status_read(s);
 		pfi_update_status(s->ifname, s);
 		PF_UNLOCK();
 		NET_UNLOCK();
@@ -1949,9 +1978,7 @@ pfioctl(dev_t dev, u_long cmd, caddr_t addr, int flags, struct proc *p)
 			goto fail;
 		}
 
-		memset(pf_status.counters, 0, sizeof(pf_status.counters));
-		memset(pf_status.fcounters, 0, sizeof(pf_status.fcounters));
-		memset(pf_status.scounters, 0, sizeof(pf_status.scounters));
+		counters_zero(pf_counters, PFC_MAX);
 		pf_status.since = getuptime();
 
 		PF_UNLOCK();
@@ -2352,14 +2379,10 @@ pfioctl(dev_t dev, u_long cmd, caddr_t addr, int flags, struct proc *p)
 			error = ENODEV;
 			goto fail;
 		}
-		NET_LOCK();
-		PF_LOCK();
 		error = pfr_set_addrs(&io->pfrio_table, io->pfrio_buffer,
 		    io->pfrio_size, &io->pfrio_size2, &io->pfrio_nadd,
 		    &io->pfrio_ndel, &io->pfrio_nchange, io->pfrio_flags |
 		    PFR_FLAG_USERIOCTL, 0);
-		PF_UNLOCK();
-		NET_UNLOCK();
 		break;
 	}
 
@@ -3230,6 +3253,20 @@ pf_rule_checkaf(struct pf_rule *r)
 	return (0);
 }
 
+void
+pf_status_read(struct pf_status *s)
+{
+	uint64_t counters[PFC_MAX];
+
+	memcpy(s, &pf_status, sizeof(*s));
+
+	counters_read(pf_counters, counters, nitems(counters));
+	memcpy(s->counters, counters, sizeof(s->counters));
+	memcpy(s->fcounters, counters + PFC_FCNT, sizeof(s->fcounters));
+	memcpy(s->scounters, counters + PFC_SCNT, sizeof(s->scounters));
+	counters_read(pf_lcounters, s->lcounters, nitems(s->lcounters));
+}
+
 int
 pf_sysctl(void *oldp, size_t *oldlenp, void *newp, size_t newlen)
 {
@@ -3237,7 +3274,7 @@ pf_sysctl(void *oldp, size_t *oldlenp, void *newp, size_t newlen)
 
 	NET_LOCK_SHARED();
 	PF_LOCK();
-	memcpy(&pfs, &pf_status, sizeof(struct pf_status));
+	pf_status_read(&pfs);
 	pfi_update_status(pfs.ifname, &pfs);
 	PF_UNLOCK();
 	NET_UNLOCK_SHARED();
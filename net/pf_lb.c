@@ -278,7 +278,7 @@ pf_map_addr_sticky(sa_family_t af, struct pf_rule *r, struct pf_addr *saddr,
 	k.type = type;
 	pf_addrcpy(&k.addr, saddr, af);
 	k.rule.ptr = r;
-	pf_status.scounters[SCNT_SRC_NODE_SEARCH]++;
+	pf_scounter_inc(SCNT_SRC_NODE_SEARCH);
 	sns[type] = RB_FIND(pf_src_tree, &tree_src_tracking, &k);
 	if (sns[type] == NULL)
 		return (-1);
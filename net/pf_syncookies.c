@@ -190,7 +190,7 @@ pf_synflood_check(struct pf_pdesc *pd)
 		pf_status.syncookies_active = 1;
 		DPFPRINTF(LOG_WARNING,
 		    "synflood detected, enabling syncookies");
-		pf_status.lcounters[LCNT_SYNFLOODS]++;
+		pf_lcounter_inc(LCNT_SYNFLOODS);
 	}
 
 	return (pf_status.syncookies_active);
@@ -208,7 +208,7 @@ pf_syncookie_send(struct pf_pdesc *pd)
 	    iss, ntohl(pd->hdr.tcp.th_seq) + 1, TH_SYN|TH_ACK, 0, mss,
 	    0, 1, 0, pd->rdomain);
 	pf_status.syncookies_inflight[pf_syncookie_status.oddeven]++;
-	pf_status.lcounters[LCNT_SYNCOOKIES_SENT]++;
+	pf_lcounter_inc(LCNT_SYNCOOKIES_SENT);
 }
 
 uint8_t
@@ -232,7 +232,7 @@ pf_syncookie_validate(struct pf_pdesc *pd)
 		return (0);
 
 	pf_status.syncookies_inflight[cookie.flags.oddeven]--;
-	pf_status.lcounters[LCNT_SYNCOOKIES_VALID]++;
+	pf_lcounter_inc(LCNT_SYNCOOKIES_VALID);
 	return (1);
 }
 
@@ -37,6 +37,8 @@
 #include <sys/pool.h>
 #include <sys/syslog.h>
 #include <sys/proc.h>
+#include <sys/smr.h>
+#include <sys/task.h>
 
 #include <net/if.h>
 
@@ -111,6 +113,37 @@
 #define ENQUEUE_UNMARKED_ONLY	(1)
 #define INVERT_NEG_FLAG		(1)
 
+/*
+ * Tables with at least PFR_KINDEX_MIN entries get a lookup index:
+ * the prefixes are flattened into a sorted array of disjoint address
+ * ranges, each pointing to the entry with the longest matching prefix.
+ * A lookup is a binary search over contiguous memory instead of a
+ * walk down the radix tree.  The index is immutable.  Every change
+ * to the radix tree retires it and a task builds a new one, so the
+ * radix tree stays authoritative and is used until the new index is
+ * published.
+ */
+#define PFR_KINDEX_MIN		64
+
+struct pfr_kkey {
+	u_int64_t		 hi;
+	u_int64_t		 lo;
+};
+
+struct pfr_krange {
+	struct pfr_kkey		 pfrr_start;
+	struct pfr_kkey		 pfrr_end;
+	struct pfr_kentry	*pfrr_ke;
+	sa_family_t		 pfrr_af;
+};
+
+struct pfr_kindex {
+	struct smr_entry	 pfri_smr;
+	struct pfr_krange	*pfri_ranges;
+	u_int			 pfri_cnt;	/* all ranges */
+	u_int			 pfri_cnt4;	/* AF_INET ones come first */
+};
+
 struct pfr_walktree {
 	enum pfrw_op {
 		PFRW_MARK,
@@ -119,7 +152,8 @@ struct pfr_walktree {
 		PFRW_GET_ADDRS,
 		PFRW_GET_ASTATS,
 		PFRW_POOL_GET,
-		PFRW_DYNADDR_UPDATE
+		PFRW_DYNADDR_UPDATE,
+		PFRW_KINDEX
 	}	 pfrw_op;
 	union {
 		struct pfr_addr		*pfrw1_addr;
@@ -127,6 +161,7 @@ struct pfr_walktree {
 		struct pfr_kentryworkq	*pfrw1_workq;
 		struct pfr_kentry	*pfrw1_kentry;
 		struct pfi_dynaddr	*pfrw1_dyn;
+		struct pfr_krange	*pfrw1_range;
 	}	 pfrw_1;
 	int	 pfrw_free;
 	int	 pfrw_flags;
@@ -136,6 +171,7 @@ struct pfr_walktree {
 #define pfrw_workq	pfrw_1.pfrw1_workq
 #define pfrw_kentry	pfrw_1.pfrw1_kentry
 #define pfrw_dyn	pfrw_1.pfrw1_dyn
+#define pfrw_range	pfrw_1.pfrw1_range
 #define pfrw_cnt	pfrw_free
 
 #define senderr(e)	do { rv = (e); goto _bad; } while (0)
@@ -203,6 +239,17 @@ int			 pfr_skip_table(struct pfr_table *,
 			    struct pfr_ktable *, int);
 struct pfr_kentry	*pfr_kentry_byidx(struct pfr_ktable *, int, int);
 int			 pfr_islinklocal(sa_family_t, struct pf_addr *);
+struct pfr_kentry	*pfr_kentry_match(struct pfr_ktable *,
+			    struct pf_addr *, sa_family_t);
+void			 pfr_kindex_invalidate(struct pfr_ktable *);
+void			 pfr_kindex_retire(struct pfr_ktable *);
+void			 pfr_kindex_free(void *);
+void			 pfr_kindex_build(void *);
+void			 pfr_krange_fill(struct pfr_krange *,
+			    struct pfr_kentry *);
+void			 pfr_krange_sort(struct pfr_krange *, u_int);
+u_int			 pfr_krange_sweep(const struct pfr_krange *, u_int,
+			    struct pfr_krange *);
 
 RB_PROTOTYPE(pfr_ktablehead, pfr_ktable, pfrkt_tree, pfr_ktable_compare);
 RB_GENERATE(pfr_ktablehead, pfr_ktable, pfrkt_tree, pfr_ktable_compare);
@@ -210,6 +257,9 @@ RB_GENERATE(pfr_ktablehead, pfr_ktable, pfrkt_tree, pfr_ktable_compare);
 struct pfr_ktablehead	 pfr_ktables;
 struct pfr_table	 pfr_nulltable;
 int			 pfr_ktable_cnt;
+u_int			 pfr_kindex_gen;
+struct task		 pfr_kindex_task =
+			    TASK_INITIALIZER(pfr_kindex_build, NULL);
 
 int
 pfr_gcd(int m, int n)
@@ -524,73 +574,109 @@ pfr_set_addrs(struct pfr_table *tbl, struct pfr_addr *addr, int size,
     u_int32_t ignore_pfrt_flags)
 {
 	struct pfr_ktable	*kt, *tmpkt;
-	struct pfr_kentryworkq	 addq, delq, changeq;
-	struct pfr_kentry	*p, *q;
+	struct pfr_kentryworkq	 addq, delq, changeq, ioq, garbageq;
+	struct pfr_kentry	*p, *ke, *last = NULL;
 	struct pfr_addr		 ad;
 	int			 i, rv, xadd = 0, xdel = 0, xchange = 0;
+	int			 locked = 0;
 	time_t			 tzero = gettime();
 
 	ACCEPT_FLAGS(flags, PFR_FLAG_DUMMY | PFR_FLAG_FEEDBACK);
 	if (pfr_validate_table(tbl, ignore_pfrt_flags, flags &
 	    PFR_FLAG_USERIOCTL))
 		return (EINVAL);
-	kt = pfr_lookup_table(tbl);
-	if (kt == NULL || !(kt->pfrkt_flags & PFR_TFLAG_ACTIVE))
-		return (ESRCH);
-	if (kt->pfrkt_flags & PFR_TFLAG_CONST)
-		return (EPERM);
 	tmpkt = pfr_create_ktable(&pfr_nulltable, 0, 0,
 	    (flags & PFR_FLAG_USERIOCTL? PR_WAITOK : PR_NOWAIT));
 	if (tmpkt == NULL)
 		return (ENOMEM);
-	pfr_mark_addrs(kt);
 	SLIST_INIT(&addq);
 	SLIST_INIT(&delq);
 	SLIST_INIT(&changeq);
+	SLIST_INIT(&ioq);
+	SLIST_INIT(&garbageq);
+
+	/*
+	 * Copy in and allocate the new entries before the table is
+	 * locked, so replacing a large table does not hold up packet
+	 * processing for all of that.  Keep them in order, the first
+	 * of duplicate addresses wins.
+	 */
 	for (i = 0; i < size; i++) {
 		YIELD(flags & PFR_FLAG_USERIOCTL);
 		if (COPYIN(addr+i, &ad, sizeof(ad), flags))
 			senderr(EFAULT);
 		if (pfr_validate_addr(&ad))
 			senderr(EINVAL);
-		ad.pfra_fback = PFR_FB_NONE;
-		p = pfr_lookup_addr(kt, &ad, 1);
+
+		ke = pfr_create_kentry_unlocked(&ad, flags);
+		if (ke == NULL)
+			senderr(ENOMEM);
+		ke->pfrke_fb = PFR_FB_NONE;
+		if (last == NULL)
+			SLIST_INSERT_HEAD(&ioq, ke, pfrke_ioq);
+		else
+			SLIST_INSERT_AFTER(last, ke, pfrke_ioq);
+		last = ke;
+	}
+
+	/* ioctls come in unlocked, pfi_table_update() holds the locks */
+	if (flags & PFR_FLAG_USERIOCTL) {
+		NET_LOCK();
+		PF_LOCK();
+		locked = 1;
+	}
+	kt = pfr_lookup_table(tbl);
+	if (kt == NULL || !(kt->pfrkt_flags & PFR_TFLAG_ACTIVE))
+		senderr(ESRCH);
+	if (kt->pfrkt_flags & PFR_TFLAG_CONST)
+		senderr(EPERM);
+	pfr_mark_addrs(kt);
+	for (i = 0; (ke = SLIST_FIRST(&ioq)) != NULL; i++) {
+		SLIST_REMOVE_HEAD(&ioq, pfrke_ioq);
+		pfr_kentry_kif_ref(ke);
+		p = pfr_lookup_kentry(kt, ke, 1);
 		if (p != NULL) {
 			if (p->pfrke_flags & PFRKE_FLAG_MARK) {
-				ad.pfra_fback = PFR_FB_DUPLICATE;
+				ke->pfrke_fb = PFR_FB_DUPLICATE;
 				goto _skip;
 			}
 			p->pfrke_flags |= PFRKE_FLAG_MARK;
-			if ((p->pfrke_flags & PFRKE_FLAG_NOT) != ad.pfra_not) {
+			if ((p->pfrke_flags & PFRKE_FLAG_NOT) !=
+			    (ke->pfrke_flags & PFRKE_FLAG_NOT)) {
 				SLIST_INSERT_HEAD(&changeq, p, pfrke_workq);
-				ad.pfra_fback = PFR_FB_CHANGED;
+				ke->pfrke_fb = PFR_FB_CHANGED;
 				xchange++;
 			}
 		} else {
-			q = pfr_lookup_addr(tmpkt, &ad, 1);
-			if (q != NULL) {
-				ad.pfra_fback = PFR_FB_DUPLICATE;
+			if (pfr_lookup_kentry(tmpkt, ke, 1) != NULL) {
+				ke->pfrke_fb = PFR_FB_DUPLICATE;
 				goto _skip;
 			}
-			p = pfr_create_kentry(&ad);
-			if (p == NULL)
-				senderr(ENOMEM);
-			if (pfr_route_kentry(tmpkt, p)) {
-				pfr_destroy_kentry(p);
-				ad.pfra_fback = PFR_FB_NONE;
+			if (pfr_route_kentry(tmpkt, ke)) {
+				ke->pfrke_fb = PFR_FB_NONE;
 				goto _skip;
 			}
-			SLIST_INSERT_HEAD(&addq, p, pfrke_workq);
-			ad.pfra_fback = PFR_FB_ADDED;
+			SLIST_INSERT_HEAD(&addq, ke, pfrke_workq);
+			ke->pfrke_fb = PFR_FB_ADDED;
 			xadd++;
-			if (p->pfrke_type == PFRKE_COST)
+			if (ke->pfrke_type == PFRKE_COST)
 				kt->pfrkt_refcntcost++;
-			pfr_ktable_winfo_update(kt, p);
+			pfr_ktable_winfo_update(kt, ke);
 		}
 _skip:
-		if (flags & PFR_FLAG_FEEDBACK)
-			if (COPYOUT(&ad, addr+i, sizeof(ad), flags))
+		if (flags & PFR_FLAG_FEEDBACK) {
+			bzero(&ad, sizeof(ad));
+			pfr_fill_feedback((struct pfr_kentry_all *)ke, &ad);
+			if (COPYOUT(&ad, addr+i, sizeof(ad), flags)) {
+				if (ke->pfrke_fb != PFR_FB_ADDED)
+					SLIST_INSERT_HEAD(&garbageq, ke,
+					    pfrke_ioq);
 				senderr(EFAULT);
+			}
+		}
+		/* entries that made it to the table are not ours anymore */
+		if (ke->pfrke_fb != PFR_FB_ADDED)
+			SLIST_INSERT_HEAD(&garbageq, ke, pfrke_ioq);
 	}
 	pfr_enqueue_addrs(kt, &delq, &xdel, ENQUEUE_UNMARKED_ONLY);
 	if ((flags & PFR_FLAG_FEEDBACK) && *size2) {
@@ -614,6 +700,12 @@ _skip:
 		pfr_clstats_kentries(&changeq, tzero, INVERT_NEG_FLAG);
 	} else
 		pfr_destroy_kentries(&addq);
+	if (locked) {
+		PF_UNLOCK();
+		NET_UNLOCK();
+	}
+
+	pfr_destroy_ioq(&garbageq, flags);
 	if (nadd != NULL)
 		*nadd = xadd;
 	if (ndel != NULL)
@@ -627,6 +719,12 @@ _skip:
 _bad:
 	pfr_clean_node_mask(tmpkt, &addq);
 	pfr_destroy_kentries(&addq);
+	if (locked) {
+		PF_UNLOCK();
+		NET_UNLOCK();
+	}
+	pfr_destroy_ioq(&garbageq, flags);
+	pfr_destroy_ioq(&ioq, flags);
 	if (flags & PFR_FLAG_FEEDBACK)
 		pfr_reset_feedback(addr, size, flags);
 	pfr_destroy_ktable(tmpkt, 0);
@@ -1289,7 +1387,11 @@ pfr_route_kentry(struct pfr_ktable *kt, struct pfr_kentry *ke)
 	} else
 		rn = rn_addroute(&ke->pfrke_sa, NULL, head, ke->pfrke_node, 0);
 
-	return (rn == NULL ? -1 : 0);
+	if (rn == NULL)
+		return (-1);
+
+	pfr_kindex_invalidate(kt);
+	return (0);
 }
 
 int
@@ -1322,6 +1424,8 @@ pfr_unroute_kentry(struct pfr_ktable *kt, struct pfr_kentry *ke)
 		DPFPRINTF(LOG_ERR, "pfr_unroute_kentry: delete failed.\n");
 		return (-1);
 	}
+
+	pfr_kindex_invalidate(kt);
 	return (0);
 }
 
@@ -1454,6 +1558,10 @@ pfr_walktree(struct radix_node *rn, void *arg, u_int id)
 			unhandled_af(ke->pfrke_af);
 		}
 		break;
+	case PFRW_KINDEX:
+		if (w->pfrw_free-- > 0)
+			pfr_krange_fill(w->pfrw_range++, ke);
+		break;
 	}
 	return (0);
 }
@@ -2114,6 +2222,7 @@ pfr_commit_ktable(struct pfr_ktable *kt, time_t tzero)
 		SWAP(struct radix_node_head *, kt->pfrkt_ip6,
 		    shadow->pfrkt_ip6);
 		SWAP(int, kt->pfrkt_cnt, shadow->pfrkt_cnt);
+		pfr_kindex_invalidate(kt);
 		pfr_clstats_ktable(kt, tzero, 1);
 	}
 	nflags = ((shadow->pfrkt_flags & PFR_TFLAG_USRMASK) |
@@ -2258,6 +2367,9 @@ pfr_setflags_ktable(struct pfr_ktable *kt, int newf)
 		pfr_destroy_ktable(kt->pfrkt_shadow, 1);
 		kt->pfrkt_shadow = NULL;
 	}
+	/* addresses of inactive tables are not indexed, catch up now */
+	if ((newf & PFR_TFLAG_ACTIVE) && !(kt->pfrkt_flags & PFR_TFLAG_ACTIVE))
+		task_add(systq, &pfr_kindex_task);
 	kt->pfrkt_flags = newf;
 }
 
@@ -2369,6 +2481,7 @@ pfr_destroy_ktable(struct pfr_ktable *kt, int flushaddr)
 		pfr_clean_node_mask(kt, &addrq);
 		pfr_destroy_kentries(&addrq);
 	}
+	pfr_kindex_retire(kt);
 	if (kt->pfrkt_ip4 != NULL)
 		free(kt->pfrkt_ip4, M_RTABLE, sizeof(*kt->pfrkt_ip4));
 	if (kt->pfrkt_ip6 != NULL)
@@ -2421,36 +2534,13 @@ struct pfr_kentry *
 pfr_kentry_byaddr(struct pfr_ktable *kt, struct pf_addr *a, sa_family_t af,
     int exact)
 {
-	struct pfr_kentry	*ke = NULL;
-	struct sockaddr_in	 tmp4;
-#ifdef INET6
-	struct sockaddr_in6	 tmp6;
-#endif /* INET6 */
+	struct pfr_kentry	*ke;
 
 	kt = pfr_ktable_select_active(kt);
 	if (kt == NULL)
 		return (0);
 
-	switch (af) {
-	case AF_INET:
-		bzero(&tmp4, sizeof(tmp4));
-		tmp4.sin_len = sizeof(tmp4);
-		tmp4.sin_family = AF_INET;
-		tmp4.sin_addr.s_addr = a->addr32[0];
-		ke = (struct pfr_kentry *)rn_match(&tmp4, kt->pfrkt_ip4);
-		break;
-#ifdef INET6
-	case AF_INET6:
-		bzero(&tmp6, sizeof(tmp6));
-		tmp6.sin6_len = sizeof(tmp6);
-		tmp6.sin6_family = AF_INET6;
-		bcopy(a, &tmp6.sin6_addr, sizeof(tmp6.sin6_addr));
-		ke = (struct pfr_kentry *)rn_match(&tmp6, kt->pfrkt_ip6);
-		break;
-#endif /* INET6 */
-	default:
-		unhandled_af(af);
-	}
+	ke = pfr_kentry_match(kt, a, af);
 	if (exact && ke && KENTRY_NETWORK(ke))
 		ke = NULL;
 
@@ -2461,12 +2551,7 @@ void
 pfr_update_stats(struct pfr_ktable *kt, struct pf_addr *a, struct pf_pdesc *pd,
     int op, int notrule)
 {
-	struct pfr_kentry	*ke = NULL;
-	struct sockaddr_in	 tmp4;
-#ifdef INET6
-	struct sockaddr_in6	 tmp6;
-#endif /* INET6 */
-	sa_family_t		 af = pd->af;
+	struct pfr_kentry	*ke;
 	u_int64_t		 len = pd->tot_len;
 	int			 dir_idx = (pd->dir == PF_OUT);
 	int			 op_idx;
@@ -2475,26 +2560,7 @@ pfr_update_stats(struct pfr_ktable *kt, struct pf_addr *a, struct pf_pdesc *pd,
 	if (kt == NULL)
 		return;
 
-	switch (af) {
-	case AF_INET:
-		bzero(&tmp4, sizeof(tmp4));
-		tmp4.sin_len = sizeof(tmp4);
-		tmp4.sin_family = AF_INET;
-		tmp4.sin_addr.s_addr = a->addr32[0];
-		ke = (struct pfr_kentry *)rn_match(&tmp4, kt->pfrkt_ip4);
-		break;
-#ifdef INET6
-	case AF_INET6:
-		bzero(&tmp6, sizeof(tmp6));
-		tmp6.sin6_len = sizeof(tmp6);
-		tmp6.sin6_family = AF_INET6;
-		bcopy(a, &tmp6.sin6_addr, sizeof(tmp6.sin6_addr));
-		ke = (struct pfr_kentry *)rn_match(&tmp6, kt->pfrkt_ip6);
-		break;
-#endif /* INET6 */
-	default:
-		unhandled_af(af);
-	}
+	ke = pfr_kentry_match(kt, a, pd->af);
 
 	switch (op) {
 	case PF_PASS:
@@ -2530,6 +2596,394 @@ pfr_update_stats(struct pfr_ktable *kt, struct pf_addr *a, struct pf_pdesc *pd,
 	}
 }
 
+static inline void
+pfr_kkey_set(struct pfr_kkey *k, struct pf_addr *a, sa_family_t af)
+{
+	switch (af) {
+	case AF_INET:
+		k->hi = 0;
+		k->lo = ntohl(a->addr32[0]);
+		break;
+#ifdef INET6
+	case AF_INET6:
+		k->hi = (u_int64_t)ntohl(a->addr32[0]) << 32 |
+		    ntohl(a->addr32[1]);
+		k->lo = (u_int64_t)ntohl(a->addr32[2]) << 32 |
+		    ntohl(a->addr32[3]);
+		break;
+#endif /* INET6 */
+	default:
+		unhandled_af(af);
+	}
+}
+
+static inline int
+pfr_kkey_cmp(const struct pfr_kkey *a, const struct pfr_kkey *b)
+{
+	if (a->hi != b->hi)
+		return (a->hi < b->hi ? -1 : 1);
+	if (a->lo != b->lo)
+		return (a->lo < b->lo ? -1 : 1);
+	return (0);
+}
+
+/* returns 1 if the key wrapped around */
+static inline int
+pfr_kkey_inc(struct pfr_kkey *k)
+{
+	if (++k->lo != 0)
+		return (0);
+	return (++k->hi == 0);
+}
+
+static inline void
+pfr_kkey_dec(struct pfr_kkey *k)
+{
+	if (k->lo-- == 0)
+		k->hi--;
+}
+
+/*
+ * Longest prefix match of an address in a table.  The index is read
+ * under SMR, without it the radix tree is used.  The entries themselves
+ * are still protected by PF_LOCK.
+ */
+struct pfr_kentry *
+pfr_kentry_match(struct pfr_ktable *kt, struct pf_addr *a, sa_family_t af)
+{
+	struct pfr_kentry	*ke = NULL;
+	struct pfr_kindex	*ki;
+	struct pfr_krange	*r;
+	struct pfr_kkey		 key;
+	struct sockaddr_in	 tmp4;
+#ifdef INET6
+	struct sockaddr_in6	 tmp6;
+#endif /* INET6 */
+	u_int			 lo, hi, mid;
+
+	smr_read_enter();
+	ki = SMR_PTR_GET(&kt->pfrkt_kindex);
+	if (ki != NULL) {
+		switch (af) {
+		case AF_INET:
+			r = ki->pfri_ranges;
+			hi = ki->pfri_cnt4;
+			break;
+#ifdef INET6
+		case AF_INET6:
+			r = ki->pfri_ranges + ki->pfri_cnt4;
+			hi = ki->pfri_cnt - ki->pfri_cnt4;
+			break;
+#endif /* INET6 */
+		default:
+			unhandled_af(af);
+		}
+
+		/* find the last range starting at or below the address */
+		pfr_kkey_set(&key, a, af);
+		lo = 0;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (pfr_kkey_cmp(&r[mid].pfrr_start, &key) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo > 0 && pfr_kkey_cmp(&key, &r[lo - 1].pfrr_end) <= 0)
+			ke = r[lo - 1].pfrr_ke;
+		smr_read_leave();
+
+		return (ke);
+	}
+	smr_read_leave();
+
+	switch (af) {
+	case AF_INET:
+		bzero(&tmp4, sizeof(tmp4));
+		tmp4.sin_len = sizeof(tmp4);
+		tmp4.sin_family = AF_INET;
+		tmp4.sin_addr.s_addr = a->addr32[0];
+		ke = (struct pfr_kentry *)rn_match(&tmp4, kt->pfrkt_ip4);
+		break;
+#ifdef INET6
+	case AF_INET6:
+		bzero(&tmp6, sizeof(tmp6));
+		tmp6.sin6_len = sizeof(tmp6);
+		tmp6.sin6_family = AF_INET6;
+		bcopy(a, &tmp6.sin6_addr, sizeof(tmp6.sin6_addr));
+		ke = (struct pfr_kentry *)rn_match(&tmp6, kt->pfrkt_ip6);
+		break;
+#endif /* INET6 */
+	default:
+		unhandled_af(af);
+	}
+
+	return (ke);
+}
+
+void
+pfr_kindex_invalidate(struct pfr_ktable *kt)
+{
+	kt->pfrkt_kgen = ++pfr_kindex_gen;
+	pfr_kindex_retire(kt);
+	if (kt->pfrkt_flags & PFR_TFLAG_ACTIVE)
+		task_add(systq, &pfr_kindex_task);
+}
+
+void
+pfr_kindex_retire(struct pfr_ktable *kt)
+{
+	struct pfr_kindex	*ki;
+
+	ki = SMR_PTR_GET_LOCKED(&kt->pfrkt_kindex);
+	if (ki == NULL)
+		return;
+
+	SMR_PTR_SET_LOCKED(&kt->pfrkt_kindex, NULL);
+	smr_call(&ki->pfri_smr, pfr_kindex_free, ki);
+}
+
+void
+pfr_kindex_free(void *arg)
+{
+	struct pfr_kindex	*ki = arg;
+
+	free(ki->pfri_ranges, M_RTABLE,
+	    ki->pfri_cnt * sizeof(*ki->pfri_ranges));
+	free(ki, M_RTABLE, sizeof(*ki));
+}
+
+/*
+ * Build the index of tables that have none.  The prefixes are
+ * collected under PF_LOCK, sorting and flattening them is done
+ * unlocked.  The result is only published if the table has not
+ * been modified in the meantime, otherwise the next run retries.
+ */
+void
+pfr_kindex_build(void *null)
+{
+	struct pfr_walktree	 w;
+	struct pfr_table	 tbl;
+	struct pfr_ktable	*kt, *okt;
+	struct pfr_kindex	*ki;
+	struct pfr_krange	*pfx, *ranges;
+	u_int			 gen, n, n4, cnt, cnt4;
+
+	for (;;) {
+		PF_LOCK();
+		RB_FOREACH(kt, pfr_ktablehead, &pfr_ktables) {
+			if ((kt->pfrkt_flags & PFR_TFLAG_ACTIVE) &&
+			    kt->pfrkt_cnt >= PFR_KINDEX_MIN &&
+			    kt->pfrkt_ktried != kt->pfrkt_kgen &&
+			    SMR_PTR_GET_LOCKED(&kt->pfrkt_kindex) == NULL)
+				break;
+		}
+		if (kt == NULL) {
+			PF_UNLOCK();
+			return;
+		}
+		kt->pfrkt_ktried = gen = kt->pfrkt_kgen;
+		okt = kt;
+		tbl = kt->pfrkt_t;
+		n = kt->pfrkt_cnt;
+		PF_UNLOCK();
+
+		pfx = mallocarray(n, sizeof(*pfx), M_TEMP,
+		    M_WAITOK | M_CANFAIL);
+		if (pfx == NULL)
+			continue;
+
+		PF_LOCK();
+		kt = pfr_lookup_table(&tbl);
+		if (kt != okt || kt->pfrkt_kgen != gen) {
+			PF_UNLOCK();
+			free(pfx, M_TEMP, n * sizeof(*pfx));
+			continue;
+		}
+		bzero(&w, sizeof(w));
+		w.pfrw_op = PFRW_KINDEX;
+		w.pfrw_range = pfx;
+		w.pfrw_free = n;
+		rn_walktree(kt->pfrkt_ip4, pfr_walktree, &w);
+		rn_walktree(kt->pfrkt_ip6, pfr_walktree, &w);
+		PF_UNLOCK();
+
+		if (w.pfrw_free != 0) {
+			/* the entry count is off, leave it to the radix tree */
+			free(pfx, M_TEMP, n * sizeof(*pfx));
+			continue;
+		}
+
+		pfr_krange_sort(pfx, n);
+		for (n4 = 0; n4 < n && pfx[n4].pfrr_af == AF_INET; n4++)
+			;
+		cnt4 = pfr_krange_sweep(pfx, n4, NULL);
+		cnt = cnt4 + pfr_krange_sweep(pfx + n4, n - n4, NULL);
+
+		ranges = mallocarray(cnt, sizeof(*ranges), M_RTABLE,
+		    M_WAITOK | M_CANFAIL);
+		if (ranges == NULL) {
+			free(pfx, M_TEMP, n * sizeof(*pfx));
+			continue;
+		}
+		pfr_krange_sweep(pfx, n4, ranges);
+		pfr_krange_sweep(pfx + n4, n - n4, ranges + cnt4);
+		free(pfx, M_TEMP, n * sizeof(*pfx));
+
+		ki = malloc(sizeof(*ki), M_RTABLE, M_WAITOK | M_ZERO);
+		ki->pfri_ranges = ranges;
+		ki->pfri_cnt = cnt;
+		ki->pfri_cnt4 = cnt4;
+
+		PF_LOCK();
+		kt = pfr_lookup_table(&tbl);
+		if (kt == okt && kt->pfrkt_kgen == gen &&
+		    SMR_PTR_GET_LOCKED(&kt->pfrkt_kindex) == NULL) {
+			SMR_PTR_SET_LOCKED(&kt->pfrkt_kindex, ki);
+			ki = NULL;
+		}
+		PF_UNLOCK();
+
+		if (ki != NULL)
+			pfr_kindex_free(ki);
+	}
+}
+
+void
+pfr_krange_fill(struct pfr_krange *r, struct pfr_kentry *ke)
+{
+	u_int8_t	net = ke->pfrke_net;
+
+	pfr_kkey_set(&r->pfrr_start, SUNION2PF(&ke->pfrke_sa, ke->pfrke_af),
+	    ke->pfrke_af);
+	r->pfrr_end = r->pfrr_start;
+	switch (ke->pfrke_af) {
+	case AF_INET:
+		r->pfrr_end.lo |= 0xffffffffULL >> net;
+		break;
+#ifdef INET6
+	case AF_INET6:
+		if (net < 64) {
+			r->pfrr_end.hi |= ~0ULL >> net;
+			r->pfrr_end.lo = ~0ULL;
+		} else if (net < 128)
+			r->pfrr_end.lo |= ~0ULL >> (net - 64);
+		break;
+#endif /* INET6 */
+	}
+	r->pfrr_ke = ke;
+	r->pfrr_af = ke->pfrke_af;
+}
+
+/* order by family, then start address, enclosing prefixes first */
+static inline int
+pfr_krange_cmp(const struct pfr_krange *a, const struct pfr_krange *b)
+{
+	int d;
+
+	if (a->pfrr_af != b->pfrr_af)
+		return (a->pfrr_af < b->pfrr_af ? -1 : 1);
+	if ((d = pfr_kkey_cmp(&a->pfrr_start, &b->pfrr_start)) != 0)
+		return (d);
+	return (pfr_kkey_cmp(&b->pfrr_end, &a->pfrr_end));
+}
+
+static inline void
+pfr_krange_sift(struct pfr_krange *r, u_int root, u_int n)
+{
+	struct pfr_krange	 t;
+	u_int			 child;
+
+	while ((child = 2 * root + 1) < n) {
+		if (child + 1 < n && pfr_krange_cmp(&r[child],
+		    &r[child + 1]) < 0)
+			child++;
+		if (pfr_krange_cmp(&r[root], &r[child]) >= 0)
+			return;
+		t = r[root];
+		r[root] = r[child];
+		r[child] = t;
+		root = child;
+	}
+}
+
+void
+pfr_krange_sort(struct pfr_krange *r, u_int n)
+{
+	struct pfr_krange	 t;
+	u_int			 i;
+
+	if (n < 2)
+		return;
+
+	for (i = n / 2; i-- > 0; )
+		pfr_krange_sift(r, i, n);
+	for (i = n - 1; i > 0; i--) {
+		t = r[0];
+		r[0] = r[i];
+		r[i] = t;
+		pfr_krange_sift(r, 0, i);
+	}
+}
+
+static inline void
+pfr_krange_emit(struct pfr_krange *out, u_int i, const struct pfr_kkey *start,
+    const struct pfr_kkey *end, const struct pfr_krange *pfx)
+{
+	if (out == NULL)
+		return;
+
+	out[i].pfrr_start = *start;
+	out[i].pfrr_end = *end;
+	out[i].pfrr_ke = pfx->pfrr_ke;
+	out[i].pfrr_af = pfx->pfrr_af;
+}
+
+/*
+ * Flatten sorted prefixes of one family into disjoint ranges, each
+ * belonging to the innermost prefix covering it.  Prefixes are either
+ * nested or disjoint, so a stack of the enclosing ones is enough.
+ * Returns the number of ranges, which are only stored if out is set.
+ */
+u_int
+pfr_krange_sweep(const struct pfr_krange *pfx, u_int n,
+    struct pfr_krange *out)
+{
+	const struct pfr_krange	*stack[128 + 1], *t;
+	struct pfr_kkey		 pos = { 0, 0 }, last;
+	u_int			 i, sp = 0, cnt = 0;
+	int			 wrapped = 0;
+
+	for (i = 0; i <= n; i++) {
+		/* close the prefixes that end before the next one starts */
+		while (sp > 0 && (i == n || pfr_kkey_cmp(
+		    &stack[sp - 1]->pfrr_end, &pfx[i].pfrr_start) < 0)) {
+			t = stack[--sp];
+			if (wrapped || pfr_kkey_cmp(&pos, &t->pfrr_end) > 0)
+				continue;
+			pfr_krange_emit(out, cnt++, &pos, &t->pfrr_end, t);
+			pos = t->pfrr_end;
+			wrapped = pfr_kkey_inc(&pos);
+		}
+		if (i == n)
+			break;
+
+		/* the enclosing prefix covers the gap up to this one */
+		if (sp > 0 && pfr_kkey_cmp(&pos, &pfx[i].pfrr_start) < 0) {
+			last = pfx[i].pfrr_start;
+			pfr_kkey_dec(&last);
+			pfr_krange_emit(out, cnt++, &pos, &last,
+			    stack[sp - 1]);
+		}
+		pos = pfx[i].pfrr_start;
+		wrapped = 0;
+		KASSERT(sp < nitems(stack));
+		stack[sp++] = &pfx[i];
+	}
+
+	return (cnt);
+}
+
 struct pfr_ktable *
 pfr_attach_table(struct pf_ruleset *rs, char *name, int wait)
 {
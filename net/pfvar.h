@@ -827,6 +827,7 @@ struct pf_ruleset {
 			int			 open;
 		}			 active, inactive;
 	}			 rules;
+	struct pf_rule_index	*index;
 	struct pf_anchor	*anchor;
 	u_int32_t		 tticket;
 	int			 tables;
@@ -1012,6 +1013,9 @@ struct pfr_ktable {
 	SLIST_ENTRY(pfr_ktable)	 pfrkt_workq;
 	struct radix_node_head	*pfrkt_ip4;
 	struct radix_node_head	*pfrkt_ip6;
+	struct pfr_kindex	*pfrkt_kindex;
+	u_int			 pfrkt_kgen;
+	u_int			 pfrkt_ktried;
 	struct pfr_ktable	*pfrkt_shadow;
 	struct pfr_ktable	*pfrkt_root;
 	struct pf_ruleset	*pfrkt_rs;
@@ -1040,9 +1044,6 @@ RB_PROTOTYPE(pf_state_tree_ext_gwy, pf_state_key,
 
 RB_HEAD(pfi_ifhead, pfi_kif);
 
-/* state tables */
-extern struct pf_state_tree	 pf_statetbl;
-
 /* keep synced with pfi_kif, used in RB_FIND */
 struct pfi_kif_cmp {
 	char				 pfik_name[IFNAMSIZ];
@@ -1203,7 +1204,7 @@ enum pfi_kif_refs {
 		if ((void *)(a) != NULL) { \
 			*(a) = (x); \
 			if (x < PFRES_MAX) \
-				pf_status.counters[x]++; \
+				pf_counter_inc(x); \
 		} \
 	} while (0)
 
@@ -1602,6 +1603,8 @@ extern int			 pf_tbladdr_setup(struct pf_ruleset *,
 extern void			 pf_tbladdr_remove(struct pf_addr_wrap *);
 extern void			 pf_tbladdr_copyout(struct pf_addr_wrap *);
 extern void			 pf_calc_skip_steps(struct pf_rulequeue *);
+extern void			 pf_calc_rule_index(struct pf_ruleset *);
+extern void			 pf_status_read(struct pf_status *);
 extern void			 pf_purge_expired_src_nodes(void);
 extern void			 pf_purge_expired_states(u_int32_t);
 extern void			 pf_purge_expired_rules(void);
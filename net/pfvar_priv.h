@@ -40,14 +40,16 @@
 #include <sys/rwlock.h>
 #include <sys/mutex.h>
 #include <sys/percpu.h>
+#include <sys/smr.h>
 
 struct pf_state_item {
-	TAILQ_ENTRY(pf_state_item)
+	SMR_TAILQ_ENTRY(pf_state_item)
 				 si_entry;
 	struct pf_state		*si_st;
+	struct smr_entry	 si_smr;
 };
 
-TAILQ_HEAD(pf_statelisthead, pf_state_item);
+SMR_TAILQ_HEAD(pf_statelisthead, pf_state_item);
 
 struct pf_state_key {
 	struct pf_addr	 addr[2];
@@ -57,16 +59,33 @@ struct pf_state_key {
 	sa_family_t	 af;
 	u_int8_t	 proto;
 
-	RB_ENTRY(pf_state_key)	 sk_entry;
+	SMR_LIST_ENTRY(pf_state_key) sk_entry[2];
 	struct pf_statelisthead	 sk_states;
 	struct pf_state_key	*sk_reverse;
 	struct inpcb		*sk_inp;
 	pf_refcnt_t		 sk_refcnt;
 	u_int8_t		 sk_removed;
+	struct smr_entry	 sk_smr;
 };
 
-RBT_HEAD(pf_state_tree, pf_state_key);
-RBT_PROTOTYPE(pf_state_tree, pf_state_key, sk_entry, pf_state_compare_key);
+SMR_LIST_HEAD(pf_state_keylist, pf_state_key);
+
+/*
+ * The state keys live in a hash table that is modified with the state
+ * lock held for writing, and may be searched inside an SMR read section.
+ * Each key has two hash chain entries so the table can be rebuilt with
+ * a different size while readers still walk the old one.
+ */
+struct pf_statetbl {
+	unsigned int		 stt_mask;	/* nbuckets - 1 */
+	unsigned int		 stt_link;	/* sk_entry[] in use */
+	struct pf_state_keylist	 stt_buckets[];
+};
+
+extern struct pf_statetbl	*pf_statetbl;
+
+void			 pf_statetbl_init(void);
+struct pf_state_key	*pf_state_key_lookup(const struct pf_state_key_cmp *);
 
 #define PF_REVERSED_KEY(key, family)				\
 	((key[PF_SK_WIRE]->af != key[PF_SK_STACK]->af) &&	\
@@ -304,6 +323,20 @@ struct pf_pdesc {
 	} hdr;
 };
 
+/*
+ * Active rules of a ruleset grouped by tcp/udp destination port. Each
+ * bucket lists, in rule order, the rules that match on a port hashing
+ * to it plus every rule that does not test for a single destination
+ * port. The last list only holds the latter and is used for packets
+ * without ports. Built when the rules are loaded, never modified.
+ */
+struct pf_rule_index {
+	u_int			  ri_mask;
+	u_int			 *ri_start;	/* ri_mask + 3 offsets */
+	struct pf_rule		**ri_rules;
+	size_t			  ri_size;
+};
+
 struct pf_anchor_stackframe {
 	struct pf_ruleset	*sf_rs;
 	union {
@@ -322,6 +355,42 @@ enum {
 
 extern struct cpumem *pf_anchor_stack;
 
+/*
+ * The counters in pf_status are kept per cpu and summed up by
+ * pf_status_read(). The limit counters live apart so DIOCCLRSTATUS
+ * can keep leaving them alone.
+ */
+#define PFC_FCNT	PFRES_MAX
+#define PFC_SCNT	(PFC_FCNT + FCNT_MAX)
+#define PFC_MAX		(PFC_SCNT + SCNT_MAX)
+
+extern struct cpumem *pf_counters;
+extern struct cpumem *pf_lcounters;
+
+static inline void
+pf_counter_inc(unsigned int c)
+{
+	counters_inc(pf_counters, c);
+}
+
+static inline void
+pf_fcounter_inc(unsigned int c)
+{
+	counters_inc(pf_counters, PFC_FCNT + c);
+}
+
+static inline void
+pf_scounter_inc(unsigned int c)
+{
+	counters_inc(pf_counters, PFC_SCNT + c);
+}
+
+static inline void
+pf_lcounter_inc(unsigned int c)
+{
+	counters_inc(pf_lcounters, c);
+}
+
 extern struct task	pf_purge_task;
 extern struct timeout	pf_purge_to;
 
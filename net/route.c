@@ -114,6 +114,9 @@
 #include <sys/pool.h>
 #include <sys/atomic.h>
 #include <sys/rwlock.h>
+#include <sys/percpu.h>
+#include <sys/smr.h>
+#include <sys/task.h>
 
 #include <net/if.h>
 #include <net/if_var.h>
@@ -150,6 +153,46 @@ extern unsigned int	rtmap_limit;
 struct cpumem *		rtcounters;
 int			rttrash;	/* routes not in table but not freed */
 
+/*
+ * Per-CPU cache of recent lookups in front of the routing tables.
+ *
+ * Every change to a routing table bumps rt_gen, which invalidates all
+ * cached entries at once.  Entries hold a reference to their route.
+ * A cpu drops stale entries when it finds them, and deleting a route
+ * schedules rt_cache_flush() to release the references held by all
+ * cpus, so deleted routes and their ifa do not stay around.  Remote
+ * cpus take the reference of a hit inside an SMR read section, the
+ * flush waits for them before it frees.  Multipath routes depend on
+ * the source address and are never cached.
+ */
+#define RTCACHE_SIZE	256		/* entries per cpu, power of 2 */
+
+struct rtcache_entry {
+	struct rtentry		*rce_rt;
+	unsigned int		 rce_gen;
+	unsigned int		 rce_tableid;
+	sa_family_t		 rce_af;
+	union {
+		struct in_addr	 in;
+#ifdef INET6
+		struct in6_addr	 in6;
+#endif
+	}			 rce_dst;
+};
+
+struct rtcache {
+	struct rtcache_entry	 rc_entries[RTCACHE_SIZE];
+	struct rtentry		*rc_flushed[RTCACHE_SIZE]; /* rt_cache_flush */
+};
+
+struct cpumem *		rtcaches;
+unsigned int		rt_gen = 1;
+struct task		rt_cache_flush_task;
+
+struct rtentry *rt_cache_match(unsigned int, struct sockaddr *, uint32_t *);
+void	rt_cache_invalidate(void);
+void	rt_cache_flush(void *);
+
 struct pool	rtentry_pool;		/* pool for rtentry structures */
 struct pool	rttimer_pool;		/* pool for rttimer structures */
 
@@ -178,6 +221,8 @@ void
 route_init(void)
 {
 	rtcounters = counters_alloc(rts_ncounters);
+	rtcaches = cpumem_malloc(sizeof(struct rtcache), M_RTABLE);
+	task_set(&rt_cache_flush_task, rt_cache_flush, NULL);
 
 	pool_init(&rtentry_pool, sizeof(struct rtentry), 0, IPL_MPFLOOR, 0,
 	    "rtentry", NULL);
@@ -226,7 +271,7 @@ rt_match(struct sockaddr *dst, uint32_t *src, int flags, unsigned int tableid)
 {
 	struct rtentry		*rt = NULL;
 
-	rt = rtable_match(tableid, dst, src);
+	rt = rt_cache_match(tableid, dst, src);
 	if (rt == NULL) {
 		rtstat_inc(rts_unreach);
 		return (NULL);
@@ -239,6 +284,170 @@ rt_match(struct sockaddr *dst, uint32_t *src, int flags, unsigned int tableid)
 	return (rt);
 }
 
+static inline int
+rt_cache_key(struct rtcache_entry *key, unsigned int tableid,
+    struct sockaddr *dst)
+{
+	uint32_t h;
+
+	key->rce_tableid = tableid;
+	key->rce_af = dst->sa_family;
+
+	switch (dst->sa_family) {
+	case AF_INET:
+		key->rce_dst.in = satosin(dst)->sin_addr;
+		h = key->rce_dst.in.s_addr;
+		break;
+#ifdef INET6
+	case AF_INET6:
+		key->rce_dst.in6 = satosin6(dst)->sin6_addr;
+		h = key->rce_dst.in6.s6_addr32[0] ^
+		    key->rce_dst.in6.s6_addr32[1] ^
+		    key->rce_dst.in6.s6_addr32[2] ^
+		    key->rce_dst.in6.s6_addr32[3];
+		break;
+#endif
+	default:
+		return (-1);
+	}
+
+	h ^= tableid;
+	h *= 0x9e3779b1;
+
+	return ((h >> 24) & (RTCACHE_SIZE - 1));
+}
+
+static inline int
+rt_cache_cmp(const struct rtcache_entry *a, const struct rtcache_entry *b)
+{
+	if (a->rce_tableid != b->rce_tableid || a->rce_af != b->rce_af)
+		return (1);
+
+	switch (a->rce_af) {
+	case AF_INET:
+		return (a->rce_dst.in.s_addr != b->rce_dst.in.s_addr);
+#ifdef INET6
+	case AF_INET6:
+		return (!IN6_ARE_ADDR_EQUAL(&a->rce_dst.in6,
+		    &b->rce_dst.in6));
+#endif
+	}
+
+	return (1);
+}
+
+/*
+ * Look the destination up in the cache of the current cpu before
+ * walking the routing table.  A hit costs no more than taking the
+ * reference the caller gets back anyway.
+ */
+struct rtentry *
+rt_cache_match(unsigned int tableid, struct sockaddr *dst, uint32_t *src)
+{
+	struct rtcache_entry	 key, *rce;
+	struct rtcache		*rc;
+	struct rtentry		*rt, *ort;
+	unsigned int		 gen;
+	int			 slot, s;
+
+	slot = rt_cache_key(&key, tableid, dst);
+	if (slot == -1)
+		return (rtable_match(tableid, dst, src));
+
+	/* read the generation before the table it protects */
+	gen = READ_ONCE(rt_gen);
+	membar_consumer();
+
+	s = splsoftnet();
+	rc = cpumem_enter(rtcaches);
+	rce = &rc->rc_entries[slot];
+	smr_read_enter();
+	rt = SMR_PTR_GET(&rce->rce_rt);
+	if (rt != NULL && rce->rce_gen == gen && !rt_cache_cmp(rce, &key)) {
+		rtref(rt);
+		smr_read_leave();
+		cpumem_leave(rtcaches, rc);
+		splx(s);
+
+		rtstat_inc(rts_cachehit);
+		return (rt);
+	}
+	smr_read_leave();
+	/* drop a stale entry, unless rt_cache_flush() took it already */
+	ort = NULL;
+	if (rt != NULL && rce->rce_gen != gen)
+		ort = atomic_swap_ptr(&rce->rce_rt, NULL);
+	cpumem_leave(rtcaches, rc);
+	splx(s);
+
+	/* the last reference may need the kernel lock */
+	rtfree(ort);
+
+	rtstat_inc(rts_cachemiss);
+
+	rt = rtable_match(tableid, dst, src);
+	if (rt == NULL || ISSET(rt->rt_flags, RTF_MPATH))
+		return (rt);
+
+	rtref(rt);
+
+	s = splsoftnet();
+	rc = cpumem_enter(rtcaches);
+	rce = &rc->rc_entries[slot];
+	/* only this cpu writes the key, rt_cache_flush() swaps rce_rt */
+	rce->rce_gen = gen;
+	rce->rce_tableid = key.rce_tableid;
+	rce->rce_af = key.rce_af;
+	rce->rce_dst = key.rce_dst;
+	ort = atomic_swap_ptr(&rce->rce_rt, rt);
+	cpumem_leave(rtcaches, rc);
+	splx(s);
+
+	/* the last reference may need the kernel lock */
+	rtfree(ort);
+
+	return (rt);
+}
+
+/*
+ * Called after every change to a routing table.
+ */
+void
+rt_cache_invalidate(void)
+{
+	membar_producer();
+	atomic_inc_int(&rt_gen);
+}
+
+/*
+ * Release the references held by the caches of all cpus.  A cpu may
+ * be taking a reference to an entry we remove, so wait for its SMR
+ * read section to end before the routes are freed.
+ */
+void
+rt_cache_flush(void *null)
+{
+	struct cpumem_iter	 cmi;
+	struct rtcache		*rc;
+	int			 i;
+
+	CPUMEM_FOREACH(rc, &cmi, rtcaches) {
+		for (i = 0; i < RTCACHE_SIZE; i++) {
+			rc->rc_flushed[i] =
+			    atomic_swap_ptr(&rc->rc_entries[i].rce_rt, NULL);
+		}
+	}
+
+	smr_barrier();
+
+	CPUMEM_FOREACH(rc, &cmi, rtcaches) {
+		for (i = 0; i < RTCACHE_SIZE; i++) {
+			rtfree(rc->rc_flushed[i]);
+			rc->rc_flushed[i] = NULL;
+		}
+	}
+}
+
 int
 rt_clone(struct rtentry **rtp, struct sockaddr *dst, unsigned int rtableid)
 {
@@ -785,10 +994,13 @@ rtrequest_delete(struct rt_addrinfo *info, u_int8_t prio, struct ifnet *ifp,
 
 	error = rtable_delete(tableid, info->rti_info[RTAX_DST],
 	    info->rti_info[RTAX_NETMASK], rt);
+	rt_cache_invalidate();
 	if (error != 0) {
 		rtfree(rt);
 		return (ESRCH);
 	}
+	/* do not let the caches pin the deleted route */
+	task_add(systqmp, &rt_cache_flush_task);
 
 	/* Release next hop cache before flushing cloned entries. */
 	rt_putgwroute(rt);
@@ -957,6 +1169,7 @@ rtrequest(int req, struct rt_addrinfo *info, u_int8_t prio,
 			}
 			rtfree(crt);
 		}
+		rt_cache_invalidate();
 		if (error != 0) {
 			ifafree(ifa);
 			rtfree(rt->rt_parent);
@@ -1754,6 +1967,7 @@ rt_if_linkstate_change(struct rtentry *rt, void *arg, u_int id)
 		rt->rt_flags |= RTF_UP;
 		error = rtable_mpath_reprio(id, rt_key(rt), rt_plen(rt),
 		    rt->rt_priority & RTP_MASK, rt);
+		rt_cache_invalidate();
 	} else {
 		/*
 		 * Remove redirected and cloned routes (mainly ARP)
@@ -1772,6 +1986,7 @@ rt_if_linkstate_change(struct rtentry *rt, void *arg, u_int id)
 		rt->rt_flags &= ~RTF_UP;
 		error = rtable_mpath_reprio(id, rt_key(rt), rt_plen(rt),
 		    rt->rt_priority | RTP_DOWN, rt);
+		rt_cache_invalidate();
 	}
 	if_group_routechange(rt_key(rt), rt_plen2mask(rt, &sa_mask));
 
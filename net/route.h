@@ -195,6 +195,8 @@ struct	rtstat {
 	u_int32_t rts_newgateway;	/* routes modified by redirects */
 	u_int32_t rts_unreach;		/* lookups which failed */
 	u_int32_t rts_wildcard;		/* lookups satisfied by a wildcard */
+	u_int32_t rts_cachehit;		/* lookups answered by the cache */
+	u_int32_t rts_cachemiss;	/* lookups that missed the cache */
 };
 
 /*
@@ -397,6 +399,8 @@ enum rtstat_counters {
 	rts_newgateway,		/* routes modified by redirects */
 	rts_unreach,		/* lookups which failed */
 	rts_wildcard,		/* lookups satisfied by a wildcard */
+	rts_cachehit,		/* lookups answered by the cache */
+	rts_cachemiss,		/* lookups that missed the cache */
 
 	rts_ncounters
 };
@@ -276,6 +276,7 @@ void	ether_ifattach(struct ifnet *);
 void	ether_ifdetach(struct ifnet *);
 int	ether_ioctl(struct ifnet *, struct arpcom *, u_long, caddr_t);
 void	ether_input(struct ifnet *, struct mbuf *);
+void	ether_input_list(struct ifnet *, struct mbuf_list *);
 int	ether_resolve(struct ifnet *, struct mbuf *, struct sockaddr *,
 	    struct rtentry *, struct ether_header *);
 struct mbuf *
@@ -766,12 +766,14 @@ extern const u_char inetctlerrmap[];
 extern const struct in_addr zeroin_addr;
 
 struct mbuf;
+struct mbuf_list;
 struct sockaddr;
 struct sockaddr_in;
 struct ifaddr;
 struct in_ifaddr;
 
 void	   ipv4_input(struct ifnet *, struct mbuf *);
+void	   ipv4_input_list(struct ifnet *, struct mbuf_list *);
 struct mbuf *
 	   ipv4_check(struct ifnet *, struct mbuf *);
 
@@ -779,6 +781,8 @@ int	   in_broadcast(struct in_addr, u_int);
 int	   in_canforward(struct in_addr);
 int	   in_cksum(struct mbuf *, int);
 int	   in4_cksum(struct mbuf *, u_int8_t, int, int);
+void	   in_hdr_cksum_out(struct mbuf *, struct ifnet *);
+int	   in_ifcap_cksum(struct mbuf *, struct ifnet *, int);
 void	   in_proto_cksum_out(struct mbuf *, struct ifnet *);
 void	   in_ifdetach(struct ifnet *);
 int	   in_mask2len(struct in_addr *);
@@ -819,5 +823,42 @@ ifatoia(struct ifaddr *ifa)
 {
 	return ((struct in_ifaddr *)(ifa));
 }
+
+/*
+ * Ones' complement sum of n 16-bit words for the in*_cksum() routines.
+ * The words are added 32 bits at a time into a 64-bit accumulator
+ * that cannot overflow, which folds down to the same 16-bit sum.
+ * w must be 16-bit aligned, 32-bit loads are aligned here.
+ */
+static inline uint32_t
+in_cksum_words(const uint16_t *w, int n)
+{
+	const uint32_t *l;
+	uint64_t sum = 0;
+
+	if (n > 0 && ((u_long)w & 2)) {
+		sum += *w++;
+		n--;
+	}
+	l = (const uint32_t *)w;
+	while (n >= 16) {
+		sum += (uint64_t)l[0] + l[1] + l[2] + l[3] +
+		    l[4] + l[5] + l[6] + l[7];
+		l += 8;
+		n -= 16;
+	}
+	while (n >= 2) {
+		sum += *l++;
+		n -= 2;
+	}
+	if (n > 0)
+		sum += *(const uint16_t *)l;
+
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 32) + (sum & 0xffffffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return (sum);
+}
 #endif /* _KERNEL */
 #endif /* _NETINET_IN_H_ */
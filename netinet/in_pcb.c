@@ -121,14 +121,21 @@ struct baddynamicports rootonlyports;
 struct pool inpcb_pool;
 
 void	in_pcbhash_insert(struct inpcb *);
+void	in_pcbhash_remove(struct inpcb *);
+struct inpcb *in_pcbhash_find(struct inpcbtable *, u_int,
+    const struct in_addr *, u_short, const struct in_addr *, u_short);
 struct inpcb *in_pcbhash_lookup(struct inpcbtable *, u_int,
     const struct in_addr *, u_short, const struct in_addr *, u_short);
-int	in_pcbresize(struct inpcbtable *, int);
+struct inpcbhash *in_pcbhash_alloc(int);
+void	in_pcbhash_free(struct inpcbhash *);
+void	in_pcbresize(void *);
+void	in_pcbunref_smr(void *);
 
 #define	INPCBHASH_LOADFACTOR(_x)	(((_x) * 3) / 4)
 
-struct inpcbhead *in_pcbhash(struct inpcbtable *, u_int,
+struct inpcbhashhead *in_pcbhash(struct inpcbhash *, u_int,
     const struct in_addr *, u_short, const struct in_addr *, u_short);
+struct inpcbhashhead *in_pcbhash_head(struct inpcbhash *, struct inpcb *);
 struct inpcbhead *in_pcblhash(struct inpcbtable *, u_int, u_short);
 
 /*
@@ -142,22 +149,36 @@ in_init(void)
 	    IPL_SOFTNET, 0, "inpcb", NULL);
 }
 
-struct inpcbhead *
-in_pcbhash(struct inpcbtable *table, u_int rdomain,
+struct inpcbhashhead *
+in_pcbhash(struct inpcbhash *ih, u_int rdomain,
     const struct in_addr *faddr, u_short fport,
     const struct in_addr *laddr, u_short lport)
 {
 	SIPHASH_CTX ctx;
 	u_int32_t nrdom = htonl(rdomain);
 
-	SipHash24_Init(&ctx, &table->inpt_key);
+	SipHash24_Init(&ctx, &ih->ih_key);
 	SipHash24_Update(&ctx, &nrdom, sizeof(nrdom));
 	SipHash24_Update(&ctx, faddr, sizeof(*faddr));
 	SipHash24_Update(&ctx, &fport, sizeof(fport));
 	SipHash24_Update(&ctx, laddr, sizeof(*laddr));
 	SipHash24_Update(&ctx, &lport, sizeof(lport));
 
-	return (&table->inpt_hashtbl[SipHash24_End(&ctx) & table->inpt_mask]);
+	return (&ih->ih_heads[SipHash24_End(&ctx) & ih->ih_mask]);
+}
+
+struct inpcbhashhead *
+in_pcbhash_head(struct inpcbhash *ih, struct inpcb *inp)
+{
+#ifdef INET6
+	if (inp->inp_flags & INP_IPV6)
+		return (in6_pcbhash(ih, rtable_l2(inp->inp_rtableid),
+		    &inp->inp_faddr6, inp->inp_fport,
+		    &inp->inp_laddr6, inp->inp_lport));
+#endif /* INET6 */
+	return (in_pcbhash(ih, rtable_l2(inp->inp_rtableid),
+	    &inp->inp_faddr, inp->inp_fport,
+	    &inp->inp_laddr, inp->inp_lport));
 }
 
 struct inpcbhead *
@@ -179,14 +200,14 @@ in_pcbinit(struct inpcbtable *table, int hashsize)
 	mtx_init(&table->inpt_mtx, IPL_SOFTNET);
 	rw_init(&table->inpt_notify, "inpnotify");
 	TAILQ_INIT(&table->inpt_queue);
-	table->inpt_hashtbl = hashinit(hashsize, M_PCB, M_WAITOK,
-	    &table->inpt_mask);
+	table->inpt_hash = in_pcbhash_alloc(hashsize);
 	table->inpt_lhashtbl = hashinit(hashsize, M_PCB, M_WAITOK,
 	    &table->inpt_lmask);
 	table->inpt_count = 0;
 	table->inpt_size = hashsize;
-	arc4random_buf(&table->inpt_key, sizeof(table->inpt_key));
+	table->inpt_hashgen = 0;
 	arc4random_buf(&table->inpt_lkey, sizeof(table->inpt_lkey));
+	task_set(&table->inpt_resize, in_pcbresize, table);
 }
 
 /*
@@ -257,7 +278,7 @@ in_pcballoc(struct socket *so, struct inpcbtable *table, int wait)
 
 	mtx_enter(&table->inpt_mtx);
 	if (table->inpt_count++ > INPCBHASH_LOADFACTOR(table->inpt_size))
-		(void)in_pcbresize(table, table->inpt_size * 2);
+		task_add(systq, &table->inpt_resize);
 	TAILQ_INSERT_HEAD(&table->inpt_queue, inp, inp_queue);
 	in_pcbhash_insert(inp);
 	mtx_leave(&table->inpt_mtx);
@@ -597,13 +618,13 @@ in_pcbdetach(struct inpcb *inp)
 	}
 #endif
 	mtx_enter(&table->inpt_mtx);
-	LIST_REMOVE(inp, inp_lhash);
-	LIST_REMOVE(inp, inp_hash);
+	in_pcbhash_remove(inp);
 	TAILQ_REMOVE(&table->inpt_queue, inp, inp_queue);
 	table->inpt_count--;
 	mtx_leave(&table->inpt_mtx);
 
-	in_pcbunref(inp);
+	/* Lookups under SMR may still find the PCB in its hash chain. */
+	smr_call(&inp->inp_smr, in_pcbunref_smr, inp);
 }
 
 struct inpcb *
@@ -622,8 +643,6 @@ in_pcbunref(struct inpcb *inp)
 		return;
 	if (refcnt_rele(&inp->inp_refcnt) == 0)
 		return;
-	KASSERT((LIST_NEXT(inp, inp_hash) == NULL) ||
-	    (LIST_NEXT(inp, inp_hash) == _Q_INVALID));
 	KASSERT((LIST_NEXT(inp, inp_lhash) == NULL) ||
 	    (LIST_NEXT(inp, inp_lhash) == _Q_INVALID));
 	KASSERT((TAILQ_NEXT(inp, inp_queue) == NULL) ||
@@ -631,6 +650,12 @@ in_pcbunref(struct inpcb *inp)
 	pool_put(&inpcb_pool, inp);
 }
 
+void
+in_pcbunref_smr(void *arg)
+{
+	in_pcbunref(arg);
+}
+
 void
 in_setsockaddr(struct inpcb *inp, struct mbuf *nam)
 {
@@ -1045,8 +1070,10 @@ in_pcbrehash(struct inpcb *inp)
 	struct inpcbtable *table = inp->inp_table;
 
 	mtx_enter(&table->inpt_mtx);
-	LIST_REMOVE(inp, inp_lhash);
-	LIST_REMOVE(inp, inp_hash);
+	/* Tell lookups under SMR that they may have missed the PCB. */
+	table->inpt_hashgen++;
+	membar_producer();
+	in_pcbhash_remove(inp);
 	in_pcbhash_insert(inp);
 	mtx_leave(&table->inpt_mtx);
 }
@@ -1055,6 +1082,7 @@ void
 in_pcbhash_insert(struct inpcb *inp)
 {
 	struct inpcbtable *table = inp->inp_table;
+	struct inpcbhash *ih = table->inpt_hash;
 	struct inpcbhead *head;
 
 	NET_ASSERT_LOCKED();
@@ -1062,32 +1090,37 @@ in_pcbhash_insert(struct inpcb *inp)
 
 	head = in_pcblhash(table, inp->inp_rtableid, inp->inp_lport);
 	LIST_INSERT_HEAD(head, inp, inp_lhash);
-#ifdef INET6
-	if (inp->inp_flags & INP_IPV6)
-		head = in6_pcbhash(table, rtable_l2(inp->inp_rtableid),
-		    &inp->inp_faddr6, inp->inp_fport,
-		    &inp->inp_laddr6, inp->inp_lport);
-	else
-#endif /* INET6 */
-		head = in_pcbhash(table, rtable_l2(inp->inp_rtableid),
-		    &inp->inp_faddr, inp->inp_fport,
-		    &inp->inp_laddr, inp->inp_lport);
-	LIST_INSERT_HEAD(head, inp, inp_hash);
+	SMR_LIST_INSERT_HEAD_LOCKED(in_pcbhash_head(ih, inp), inp,
+	    inp_hash[ih->ih_link]);
 }
 
+void
+in_pcbhash_remove(struct inpcb *inp)
+{
+	struct inpcbtable *table = inp->inp_table;
+
+	MUTEX_ASSERT_LOCKED(&table->inpt_mtx);
+
+	LIST_REMOVE(inp, inp_lhash);
+	SMR_LIST_REMOVE_LOCKED(inp, inp_hash[table->inpt_hash->ih_link]);
+}
+
+/*
+ * Walk the local and foreign hash chain.  The caller must either be
+ * in a SMR read section or hold the table mutex.
+ */
 struct inpcb *
-in_pcbhash_lookup(struct inpcbtable *table, u_int rdomain,
+in_pcbhash_find(struct inpcbtable *table, u_int rdomain,
     const struct in_addr *faddr, u_short fport,
     const struct in_addr *laddr, u_short lport)
 {
-	struct inpcbhead *head;
+	struct inpcbhash *ih;
+	struct inpcbhashhead *head;
 	struct inpcb *inp;
 
-	NET_ASSERT_LOCKED();
-	MUTEX_ASSERT_LOCKED(&table->inpt_mtx);
-
-	head = in_pcbhash(table, rdomain, faddr, fport, laddr, lport);
-	LIST_FOREACH(inp, head, inp_hash) {
+	ih = SMR_PTR_GET(&table->inpt_hash);
+	head = in_pcbhash(ih, rdomain, faddr, fport, laddr, lport);
+	SMR_LIST_FOREACH(inp, head, inp_hash[ih->ih_link]) {
 #ifdef INET6
 		if (ISSET(inp->inp_flags, INP_IPV6))
 			continue;
@@ -1099,59 +1132,110 @@ in_pcbhash_lookup(struct inpcbtable *table, u_int rdomain,
 			break;
 		}
 	}
-	if (inp != NULL) {
-		/*
-		 * Move this PCB to the head of hash chain so that
-		 * repeated accesses are quicker.  This is analogous to
-		 * the historic single-entry PCB cache.
-		 */
-		if (inp != LIST_FIRST(head)) {
-			LIST_REMOVE(inp, inp_hash);
-			LIST_INSERT_HEAD(head, inp, inp_hash);
-		}
-	}
 	return (inp);
 }
 
-int
-in_pcbresize(struct inpcbtable *table, int hashsize)
+/*
+ * Look up a PCB without the table mutex and return it with a reference.
+ * The hash reference of a detached PCB is dropped after a SMR grace
+ * period, so anything found in a chain can still be referenced.  When
+ * in_pcbrehash() moves a PCB while we walk its chain, we may skip the
+ * rest of the chain.  Such a miss is retried with the mutex held.
+ */
+struct inpcb *
+in_pcbhash_lookup(struct inpcbtable *table, u_int rdomain,
+    const struct in_addr *faddr, u_short fport,
+    const struct in_addr *laddr, u_short lport)
 {
-	u_long nmask, nlmask;
-	int osize;
-	void *nhashtbl, *nlhashtbl, *ohashtbl, *olhashtbl;
 	struct inpcb *inp;
+	u_int gen;
 
-	MUTEX_ASSERT_LOCKED(&table->inpt_mtx);
+	NET_ASSERT_LOCKED();
 
-	ohashtbl = table->inpt_hashtbl;
-	olhashtbl = table->inpt_lhashtbl;
+	smr_read_enter();
+	gen = READ_ONCE(table->inpt_hashgen);
+	membar_consumer();
+	inp = in_pcbhash_find(table, rdomain, faddr, fport, laddr, lport);
+	in_pcbref(inp);
+	smr_read_leave();
+	if (inp != NULL)
+		return (inp);
+
+	membar_consumer();
+	if (READ_ONCE(table->inpt_hashgen) == gen)
+		return (NULL);
+
+	mtx_enter(&table->inpt_mtx);
+	inp = in_pcbhash_find(table, rdomain, faddr, fport, laddr, lport);
+	in_pcbref(inp);
+	mtx_leave(&table->inpt_mtx);
+	return (inp);
+}
+
+struct inpcbhash *
+in_pcbhash_alloc(int hashsize)
+{
+	struct inpcbhash *ih;
+
+	ih = malloc(sizeof(*ih), M_PCB, M_WAITOK | M_ZERO);
+	ih->ih_heads = hashinit(hashsize, M_PCB, M_WAITOK, &ih->ih_mask);
+	ih->ih_size = hashsize;
+	arc4random_buf(&ih->ih_key, sizeof(ih->ih_key));
+
+	return (ih);
+}
+
+void
+in_pcbhash_free(struct inpcbhash *ih)
+{
+	hashfree(ih->ih_heads, ih->ih_size, M_PCB);
+	free(ih, M_PCB, sizeof(*ih));
+}
+
+/*
+ * Double the hash tables from a task, lookups continue on the old
+ * local and foreign hash while it runs.
+ */
+void
+in_pcbresize(void *arg)
+{
+	struct inpcbtable *table = arg;
+	struct inpcbhash *nih, *oih;
+	struct inpcbhead *nlhashtbl, *olhashtbl, *head;
+	struct inpcb *inp;
+	u_long nlmask;
+	int hashsize, osize;
+
+	/* Only this task changes inpt_size, allocate without the mutex. */
 	osize = table->inpt_size;
+	hashsize = osize * 2;
+	nih = in_pcbhash_alloc(hashsize);
+	nlhashtbl = hashinit(hashsize, M_PCB, M_WAITOK, &nlmask);
 
-	nhashtbl = hashinit(hashsize, M_PCB, M_NOWAIT, &nmask);
-	if (nhashtbl == NULL)
-		return ENOBUFS;
-	nlhashtbl = hashinit(hashsize, M_PCB, M_NOWAIT, &nlmask);
-	if (nlhashtbl == NULL) {
-		hashfree(nhashtbl, hashsize, M_PCB);
-		return ENOBUFS;
-	}
-	table->inpt_hashtbl = nhashtbl;
+	mtx_enter(&table->inpt_mtx);
+	oih = table->inpt_hash;
+	olhashtbl = table->inpt_lhashtbl;
+	nih->ih_link = !oih->ih_link;
 	table->inpt_lhashtbl = nlhashtbl;
-	table->inpt_mask = nmask;
 	table->inpt_lmask = nlmask;
 	table->inpt_size = hashsize;
-	arc4random_buf(&table->inpt_key, sizeof(table->inpt_key));
 	arc4random_buf(&table->inpt_lkey, sizeof(table->inpt_lkey));
 
 	TAILQ_FOREACH(inp, &table->inpt_queue, inp_queue) {
 		LIST_REMOVE(inp, inp_lhash);
-		LIST_REMOVE(inp, inp_hash);
-		in_pcbhash_insert(inp);
+		head = in_pcblhash(table, inp->inp_rtableid, inp->inp_lport);
+		LIST_INSERT_HEAD(head, inp, inp_lhash);
+		SMR_LIST_INSERT_HEAD_LOCKED(in_pcbhash_head(nih, inp), inp,
+		    inp_hash[nih->ih_link]);
 	}
-	hashfree(ohashtbl, osize, M_PCB);
+	SMR_PTR_SET_LOCKED(&table->inpt_hash, nih);
+	mtx_leave(&table->inpt_mtx);
+
 	hashfree(olhashtbl, osize, M_PCB);
 
-	return (0);
+	/* The next resize reuses the old inp_hash entry. */
+	smr_barrier();
+	in_pcbhash_free(oih);
 }
 
 #ifdef DIAGNOSTIC
@@ -1175,10 +1259,7 @@ in_pcblookup(struct inpcbtable *table, struct in_addr faddr,
 	u_int rdomain;
 
 	rdomain = rtable_l2(rtable);
-	mtx_enter(&table->inpt_mtx);
 	inp = in_pcbhash_lookup(table, rdomain, &faddr, fport, &laddr, lport);
-	in_pcbref(inp);
-	mtx_leave(&table->inpt_mtx);
 #ifdef DIAGNOSTIC
 	if (inp == NULL && in_pcbnotifymiss) {
 		printf("%s: faddr=%08x fport=%d laddr=%08x lport=%d rdom=%u\n",
@@ -1239,14 +1320,11 @@ in_pcblookup_listen(struct inpcbtable *table, struct in_addr laddr,
 #endif
 
 	rdomain = rtable_l2(rtable);
-	mtx_enter(&table->inpt_mtx);
 	inp = in_pcbhash_lookup(table, rdomain, &zeroin_addr, 0, key1, lport);
 	if (inp == NULL && key1->s_addr != key2->s_addr) {
 		inp = in_pcbhash_lookup(table, rdomain,
 		    &zeroin_addr, 0, key2, lport);
 	}
-	in_pcbref(inp);
-	mtx_leave(&table->inpt_mtx);
 #ifdef DIAGNOSTIC
 	if (inp == NULL && in_pcbnotifymiss) {
 		printf("%s: laddr=%08x lport=%d rdom=%u\n",
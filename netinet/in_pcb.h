@@ -68,6 +68,8 @@
 #include <sys/mutex.h>
 #include <sys/rwlock.h>
 #include <sys/refcnt.h>
+#include <sys/smr.h>
+#include <sys/task.h>
 #include <netinet/ip6.h>
 #include <netinet6/ip6_var.h>
 #include <netinet/icmp6.h>
@@ -80,6 +82,7 @@
  *	I	immutable after creation
  *	N	net lock
  *	t	inpt_mtx		pcb table mutex
+ *	t,S	inpt_mtx for writing and SMR for reading
  *	y	inpt_notify		pcb table rwlock for notify
  *	p	inpcb_mtx		pcb mutex
  */
@@ -102,7 +105,7 @@ union inpaddru {
  * control block.
  */
 struct inpcb {
-	LIST_ENTRY(inpcb) inp_hash;		/* [t] local and foreign hash */
+	SMR_LIST_ENTRY(inpcb) inp_hash[2];	/* [t,S] local and foreign */
 	LIST_ENTRY(inpcb) inp_lhash;		/* [t] local port hash */
 	TAILQ_ENTRY(inpcb) inp_queue;		/* [t] inet PCB queue */
 	SIMPLEQ_ENTRY(inpcb) inp_notify;	/* [y] notify or udp append */
@@ -124,6 +127,7 @@ struct inpcb {
 #define	inp_route	inp_ru.ru_route
 #define	inp_route6	inp_ru.ru_route6
 	struct    refcnt inp_refcnt;	/* refcount PCB, delay memory free */
+	struct	  smr_entry inp_smr;	/* drop hash reference after SMR */
 	struct	  mutex inp_mtx;	/* protect PCB and socket members */
 	int	  inp_flags;		/* generic IP/datagram flags */
 	union {				/* Header prototype. */
@@ -162,19 +166,36 @@ struct inpcb {
 	u_int	inp_rtableid;
 	int	inp_pipex;		/* pipex indication */
 	uint16_t inp_flowid;
+	uint16_t inp_udpgso;		/* UDP_SEGMENT datagram size */
 };
 
 LIST_HEAD(inpcbhead, inpcb);
+SMR_LIST_HEAD(inpcbhashhead, inpcb);
+
+/*
+ * The local and foreign hash is searched under SMR.  A resize links
+ * the PCBs into the new chains with the other inp_hash entry, so the
+ * old chains stay usable until every reader has left them.
+ */
+struct inpcbhash {
+	struct	inpcbhashhead *ih_heads;	/* [I] hash chains */
+	SIPHASH_KEY ih_key;			/* [I] secret for hash */
+	u_long	ih_mask;			/* [I] hash mask */
+	int	ih_size;			/* [I] hash size */
+	int	ih_link;			/* [I] index into inp_hash */
+};
 
 struct inpcbtable {
 	struct mutex inpt_mtx;			/* protect queue and hash */
 	struct rwlock inpt_notify;		/* protect inp_notify list */
 	TAILQ_HEAD(inpthead, inpcb) inpt_queue;	/* [t] inet PCB queue */
-	struct	inpcbhead *inpt_hashtbl;	/* [t] local and foreign hash */
+	struct	inpcbhash *inpt_hash;		/* [t,S] local and foreign */
 	struct	inpcbhead *inpt_lhashtbl;	/* [t] local port hash */
-	SIPHASH_KEY inpt_key, inpt_lkey;	/* [t] secrets for hashes */
-	u_long	inpt_mask, inpt_lmask;		/* [t] hash masks */
+	SIPHASH_KEY inpt_lkey;			/* [t] secret for local hash */
+	u_long	inpt_lmask;			/* [t] local hash mask */
 	int	inpt_count, inpt_size;		/* [t] queue count, hash size */
+	u_int	inpt_hashgen;			/* [t] count of rehashed PCBs */
+	struct	task inpt_resize;		/* [I] grow hash tables */
 };
 
 /* flags in inp_flags: */
@@ -294,8 +315,8 @@ struct inpcb *
 	 in_pcblookup_listen(struct inpcbtable *, struct in_addr, u_int,
 	    struct mbuf *, u_int);
 #ifdef INET6
-struct inpcbhead *
-	 in6_pcbhash(struct inpcbtable *, u_int, const struct in6_addr *,
+struct inpcbhashhead *
+	 in6_pcbhash(struct inpcbhash *, u_int, const struct in6_addr *,
 	    u_short, const struct in6_addr *, u_short);
 struct inpcb *
 	 in6_pcblookup(struct inpcbtable *, const struct in6_addr *,
@@ -188,7 +188,7 @@ const struct protosw inetsw[] = {
   .pr_flags	= PR_ATOMIC|PR_ADDR|PR_SPLICE,
   .pr_input	= udp_input,
   .pr_ctlinput	= udp_ctlinput,
-  .pr_ctloutput	= ip_ctloutput,
+  .pr_ctloutput	= udp_ctloutput,
   .pr_usrreqs	= &udp_usrreqs,
   .pr_init	= udp_init,
   .pr_sysctl	= udp_sysctl
@@ -41,6 +41,10 @@
 #include <sys/systm.h>
 #include <sys/mbuf.h>
 #include <sys/socket.h>
+#include <sys/malloc.h>
+#include <sys/pool.h>
+#include <sys/mutex.h>
+#include <sys/task.h>
 
 #include <net/if.h>
 #include <net/if_var.h>
@@ -80,12 +84,72 @@
 	do { } while (0)
 #endif
 
+/*
+ * With net.inet.esp.async set, the cipher and MAC run on the crypto
+ * worker threads instead of the thread that received or sent the packet.
+ * Each SA is hashed onto one of the per softnet completion queues below.
+ * Packets are put on it in the order they are submitted and taken off
+ * in the same order, once their crypto is done, so that the replay
+ * window and the peer do not see reordered packets.  The rest of the
+ * ESP processing then continues in the softnet thread owning the queue.
+ */
+struct esp_async {
+	TAILQ_ENTRY(esp_async)	 ea_entry;	/* [q] */
+	struct esp_asyncq	*ea_q;		/* [I] */
+	struct cryptop		*ea_crp;	/* [I] */
+	struct mbuf		*ea_m;		/* [I] */
+	struct tdb		*ea_tdb;	/* [I] reference held */
+	int			 ea_skip;	/* [I] */
+	int			 ea_protoff;	/* [I] */
+	int			 ea_output;	/* [I] */
+	int			 ea_done;	/* [q] crypto has completed */
+	uint8_t			 ea_abuf[AH_HMAC_MAX_HASHLEN]; /* [I] */
+};
+
+TAILQ_HEAD(esp_asynclist, esp_async);
+
+struct esp_asyncq {
+	struct mutex		 eq_mtx;
+	struct esp_asynclist	 eq_list;	/* [q] in submission order */
+	struct task		 eq_task;
+	unsigned int		 eq_idx;	/* [I] softnet thread */
+};
+
+struct pool esp_async_pool;
+struct esp_asyncq *esp_asyncqs;
+unsigned int esp_nasyncqs;
+
+int	esp_input_cb(struct mbuf **, struct tdb *, int, int, const uint8_t *);
+int	esp_async_dispatch(struct cryptop *, struct mbuf *, struct tdb *,
+	    int, int, const uint8_t *, int);
+void	esp_async_done(struct cryptop *);
+void	esp_async_task(void *);
+void	esp_async_input(struct esp_async *);
+void	esp_async_output(struct esp_async *);
+
 /*
  * esp_attach() is called from the transformation initialization code.
  */
 int
 esp_attach(void)
 {
+	struct esp_asyncq *q;
+	unsigned int i;
+
+	pool_init(&esp_async_pool, sizeof(struct esp_async), 0, IPL_SOFTNET,
+	    0, "espasync", NULL);
+
+	esp_nasyncqs = softnet_count();
+	esp_asyncqs = mallocarray(esp_nasyncqs, sizeof(*esp_asyncqs), M_TDB,
+	    M_WAITOK | M_ZERO);
+	for (i = 0; i < esp_nasyncqs; i++) {
+		q = &esp_asyncqs[i];
+		mtx_init(&q->eq_mtx, IPL_SOFTNET);
+		TAILQ_INIT(&q->eq_list);
+		task_set(&q->eq_task, esp_async_task, q);
+		q->eq_idx = i;
+	}
+
 	return 0;
 }
 
@@ -344,16 +408,15 @@ esp_input(struct mbuf **mp, struct tdb *tdb, int skip, int protoff)
 {
 	const struct auth_hash *esph = tdb->tdb_authalgxform;
 	const struct enc_xform *espx = tdb->tdb_encalgxform;
-	struct mbuf *m = *mp, *m1, *mo;
+	struct mbuf *m = *mp;
 	struct cryptodesc *crde = NULL, *crda = NULL;
 	struct cryptop *crp = NULL;
-	int plen, alen, hlen, error, roff;
+	int plen, alen, hlen, error;
 	uint32_t btsx, esn;
 #ifdef ENCDEBUG
 	char buf[INET6_ADDRSTRLEN];
 #endif
 	uint8_t abuf[AH_HMAC_MAX_HASHLEN];
-	uint8_t lastthree[3], aalg[AH_HMAC_MAX_HASHLEN];
 
 	/* Determine the ESP header length */
 	hlen = 2 * sizeof(u_int32_t) + tdb->tdb_ivlen; /* "new" ESP */
@@ -502,6 +565,16 @@ esp_input(struct mbuf **mp, struct tdb *tdb, int skip, int protoff)
 			crde->crd_len = plen;
 	}
 
+	if (esp_async) {
+		if (esp_async_dispatch(crp, m, tdb, skip, protoff,
+		    esph ? abuf : NULL, 0) != 0) {
+			espstat_inc(esps_crypto);
+			goto drop;
+		}
+		*mp = NULL;
+		return IPSEC_INPUT_QUEUED;
+	}
+
 	while ((error = crypto_invoke(crp)) == EAGAIN) {
 		/* Reset the session ID */
 		if (tdb->tdb_cryptoid != 0)
@@ -515,7 +588,34 @@ esp_input(struct mbuf **mp, struct tdb *tdb, int skip, int protoff)
 
 	/* Release the crypto descriptors */
 	crypto_freereq(crp);
-	crp = NULL;
+
+	return esp_input_cb(mp, tdb, skip, protoff, abuf);
+
+ drop:
+	m_freemp(mp);
+	crypto_freereq(crp);
+	return IPPROTO_DONE;
+}
+
+/*
+ * ESP input processing once the crypto is done: verify the authenticator
+ * saved in abuf, commit the replay window and strip the ESP framing.
+ */
+int
+esp_input_cb(struct mbuf **mp, struct tdb *tdb, int skip, int protoff,
+    const uint8_t *abuf)
+{
+	const struct auth_hash *esph = tdb->tdb_authalgxform;
+	struct mbuf *m = *mp, *m1, *mo;
+	int hlen, roff;
+	uint32_t btsx, esn;
+#ifdef ENCDEBUG
+	char buf[INET6_ADDRSTRLEN];
+#endif
+	uint8_t lastthree[3], aalg[AH_HMAC_MAX_HASHLEN];
+
+	/* Determine the ESP header length */
+	hlen = 2 * sizeof(u_int32_t) + tdb->tdb_ivlen; /* "new" ESP */
 
 	/* If authentication was performed, check now. */
 	if (esph != NULL) {
@@ -678,7 +778,6 @@ esp_input(struct mbuf **mp, struct tdb *tdb, int skip, int protoff)
 
  drop:
 	m_freemp(mp);
-	crypto_freereq(crp);
 	return IPPROTO_DONE;
 }
 
@@ -946,6 +1045,15 @@ esp_output(struct mbuf *m, struct tdb *tdb, int skip, int protoff)
 			crda->crd_len = m->m_pkthdr.len - (skip + alen);
 	}
 
+	if (esp_async) {
+		error = esp_async_dispatch(crp, m, tdb, skip, protoff, NULL, 1);
+		if (error) {
+			espstat_inc(esps_crypto);
+			goto drop;
+		}
+		return 0;
+	}
+
 	while ((error = crypto_invoke(crp)) == EAGAIN) {
 		/* Reset the session ID */
 		if (tdb->tdb_cryptoid != 0)
@@ -972,6 +1080,182 @@ esp_output(struct mbuf *m, struct tdb *tdb, int skip, int protoff)
 	return error;
 }
 
+/*
+ * Hand a prepared crypto request over to the crypto workers.  The packet,
+ * the request and a reference to the SA are owned by the completion queue
+ * from now on.
+ */
+int
+esp_async_dispatch(struct cryptop *crp, struct mbuf *m, struct tdb *tdb,
+    int skip, int protoff, const uint8_t *abuf, int output)
+{
+	struct esp_asyncq *q;
+	struct esp_async *ea;
+
+	ea = pool_get(&esp_async_pool, PR_NOWAIT);
+	if (ea == NULL)
+		return ENOBUFS;
+
+	q = &esp_asyncqs[ntohl(tdb->tdb_spi) % esp_nasyncqs];
+
+	ea->ea_q = q;
+	ea->ea_crp = crp;
+	ea->ea_m = m;
+	ea->ea_tdb = tdb_ref(tdb);
+	ea->ea_skip = skip;
+	ea->ea_protoff = protoff;
+	ea->ea_output = output;
+	ea->ea_done = 0;
+	if (abuf != NULL)
+		memcpy(ea->ea_abuf, abuf, tdb->tdb_authalgxform->authsize);
+
+	crp->crp_callback = esp_async_done;
+	crp->crp_opaque = ea;
+
+	mtx_enter(&q->eq_mtx);
+	TAILQ_INSERT_TAIL(&q->eq_list, ea, ea_entry);
+	mtx_leave(&q->eq_mtx);
+
+	crypto_dispatch(crp);
+
+	return 0;
+}
+
+/*
+ * Called on a crypto worker.  Only the queue may be touched here, the
+ * packet may already be on its way once the mutex has been released.
+ */
+void
+esp_async_done(struct cryptop *crp)
+{
+	struct esp_async *ea = crp->crp_opaque;
+	struct esp_asyncq *q = ea->ea_q;
+	int run;
+
+	mtx_enter(&q->eq_mtx);
+	ea->ea_done = 1;
+	run = (TAILQ_FIRST(&q->eq_list) == ea);
+	mtx_leave(&q->eq_mtx);
+
+	if (run)
+		task_add(net_tq(q->eq_idx), &q->eq_task);
+}
+
+void
+esp_async_task(void *arg)
+{
+	struct esp_asyncq *q = arg;
+	struct esp_asynclist inq, outq;
+	struct esp_async *ea;
+
+	TAILQ_INIT(&inq);
+	TAILQ_INIT(&outq);
+
+	mtx_enter(&q->eq_mtx);
+	while ((ea = TAILQ_FIRST(&q->eq_list)) != NULL && ea->ea_done) {
+		TAILQ_REMOVE(&q->eq_list, ea, ea_entry);
+		if (ea->ea_output)
+			TAILQ_INSERT_TAIL(&outq, ea, ea_entry);
+		else
+			TAILQ_INSERT_TAIL(&inq, ea, ea_entry);
+	}
+	mtx_leave(&q->eq_mtx);
+
+	if (!TAILQ_EMPTY(&outq)) {
+		NET_LOCK_SHARED();
+		while ((ea = TAILQ_FIRST(&outq)) != NULL) {
+			TAILQ_REMOVE(&outq, ea, ea_entry);
+			esp_async_output(ea);
+		}
+		NET_UNLOCK_SHARED();
+	}
+
+	/* Local delivery needs the exclusive lock, see ip_ours(). */
+	if (!TAILQ_EMPTY(&inq)) {
+		NET_LOCK();
+		while ((ea = TAILQ_FIRST(&inq)) != NULL) {
+			TAILQ_REMOVE(&inq, ea, ea_entry);
+			esp_async_input(ea);
+		}
+		NET_UNLOCK();
+	}
+}
+
+void
+esp_async_input(struct esp_async *ea)
+{
+	struct cryptop *crp = ea->ea_crp;
+	struct tdb *tdb = ea->ea_tdb;
+	struct mbuf *m = ea->ea_m;
+	int af = tdb->tdb_dst.sa.sa_family;
+	int skip = ea->ea_skip;
+	int prot;
+
+	NET_ASSERT_LOCKED_EXCLUSIVE();
+
+	/*
+	 * No kernel lock, the lifetime checks that notify pfkey ran in
+	 * esp_input() before the crypto.  esp_zeroize() takes it itself to
+	 * release the crypto session.
+	 */
+
+	/* Reset the session ID */
+	if (tdb->tdb_cryptoid != 0)
+		tdb->tdb_cryptoid = crp->crp_sid;
+
+	if (crp->crp_etype) {
+		DPRINTF("crypto error %d", crp->crp_etype);
+		ipsecstat_inc(ipsec_noxform);
+		m_freemp(&m);
+		prot = IPPROTO_DONE;
+	} else
+		prot = esp_input_cb(&m, tdb, skip, ea->ea_protoff,
+		    ea->ea_abuf);
+	if (prot == IPPROTO_DONE) {
+		ipsecstat_inc(ipsec_idrops);
+		tdbstat_inc(tdb, tdb_idrops);
+	}
+	tdb_unref(tdb);
+
+	crypto_freereq(crp);
+	pool_put(&esp_async_pool, ea);
+
+	/* Continue where ipsec_common_input() left the packet. */
+	if (prot != IPPROTO_DONE)
+		ip_deliver(&m, &skip, prot, af);
+}
+
+void
+esp_async_output(struct esp_async *ea)
+{
+	struct cryptop *crp = ea->ea_crp;
+	struct tdb *tdb = ea->ea_tdb;
+	struct mbuf *m = ea->ea_m;
+	int error;
+
+	NET_ASSERT_LOCKED();
+
+	/* ipsp_process_done() takes the kernel lock for a bundled SA */
+
+	/* Reset the session ID */
+	if (tdb->tdb_cryptoid != 0)
+		tdb->tdb_cryptoid = crp->crp_sid;
+
+	if (crp->crp_etype) {
+		DPRINTF("crypto error %d", crp->crp_etype);
+		ipsecstat_inc(ipsec_noxform);
+		m_freem(m);
+	} else {
+		error = ipsp_process_done(m, tdb);
+		if (error)
+			espstat_inc(esps_outfail);
+	}
+	tdb_unref(tdb);
+
+	crypto_freereq(crp);
+	pool_put(&esp_async_pool, ea);
+}
+
 #define SEEN_SIZE	howmany(TDB_REPLAYMAX, 32)
 
 /*
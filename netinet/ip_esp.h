@@ -74,7 +74,8 @@ struct espstat {
 #define	ESPCTL_UDPENCAP_ENABLE	2	/* Enable ESP over UDP */
 #define	ESPCTL_UDPENCAP_PORT	3	/* UDP port for encapsulation */
 #define	ESPCTL_STATS		4	/* ESP Stats */
-#define ESPCTL_MAXID		5
+#define	ESPCTL_ASYNC		5	/* Run crypto on the worker threads */
+#define ESPCTL_MAXID		6
 
 #define ESPCTL_NAMES { \
 	{ 0, 0 }, \
@@ -82,6 +83,7 @@ struct espstat {
 	{ "udpencap", CTLTYPE_INT }, \
 	{ "udpencap_port", CTLTYPE_INT }, \
 	{ "stats", CTLTYPE_STRUCT }, \
+	{ "async", CTLTYPE_INT }, \
 }
 
 #ifdef _KERNEL
@@ -134,6 +136,7 @@ espstat_add(enum espstat_counters c, uint64_t v)
 }
 
 extern int esp_enable;
+extern int esp_async;
 extern int udpencap_enable;
 extern int udpencap_port;
 
@@ -61,6 +61,8 @@
 #include <netinet/in_var.h>
 #include <netinet/ip_var.h>
 #include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <netinet/udp_var.h>
 #include <net/if_types.h>
 
 #ifdef INET6
@@ -141,6 +143,30 @@ int	ip_ours(struct mbuf **, int *, int, int);
 int	ip_dooptions(struct mbuf *, struct ifnet *);
 int	in_ouraddr(struct mbuf *, struct ifnet *, struct rtentry **);
 
+/*
+ * State kept while ipv4_input_list() runs a list of received packets
+ * through the stack.  The route of the last destination is reused for
+ * following packets to the same address, and packets to be forwarded
+ * are collected in runs sharing a route and sent out back to back.
+ */
+struct ip_fwdbatch {
+	struct ifnet		*fb_ifp;	/* receiving interface */
+	struct rtentry		*fb_rt;		/* last route looked up */
+	struct in_addr		 fb_dst;	/* destination of fb_rt */
+	u_int			 fb_rtableid;	/* routing table of fb_rt */
+	struct mbuf_list	 fb_ml;		/* run waiting for output */
+	struct rtentry		*fb_mlrt;	/* route of the run */
+};
+
+int	ip_input_batch(struct mbuf **, int *, int, int, struct ifnet *,
+	    struct ip_fwdbatch *);
+struct rtentry *ip_fwdbatch_route(struct ip_fwdbatch *, struct mbuf *);
+void	ip_fwdbatch_setroute(struct ip_fwdbatch *, struct mbuf *,
+	    struct rtentry *);
+void	ip_fwdbatch_enqueue(struct ip_fwdbatch *, struct mbuf *,
+	    struct rtentry *);
+void	ip_fwdbatch_flush(struct ip_fwdbatch *);
+
 int		ip_fragcheck(struct mbuf **, int *);
 struct mbuf *	ip_reass(struct ipqent *, struct ipq *);
 void		ip_freef(struct ipq *);
@@ -260,6 +286,7 @@ ipintr(void)
 {
 	struct mbuf *m;
 
+	udp_wakeup_defer();
 	while ((m = niq_dequeue(&ipintrq)) != NULL) {
 		struct ip *ip;
 		int off, nxt;
@@ -275,6 +302,7 @@ ipintr(void)
 		nxt = ip_deliver(&m, &off, nxt, AF_INET);
 		KASSERT(nxt == IPPROTO_DONE);
 	}
+	udp_wakeup_flush();
 }
 
 /*
@@ -292,6 +320,34 @@ ipv4_input(struct ifnet *ifp, struct mbuf *m)
 	KASSERT(nxt == IPPROTO_DONE);
 }
 
+/*
+ * IPv4 input routine for a list of packets received on one interface.
+ */
+void
+ipv4_input_list(struct ifnet *ifp, struct mbuf_list *ml)
+{
+	struct ip_fwdbatch fb;
+	struct mbuf *m;
+	int off, nxt;
+
+	if (ml_empty(ml))
+		return;
+
+	memset(&fb, 0, sizeof(fb));
+	fb.fb_ifp = ifp;
+	ml_init(&fb.fb_ml);
+
+	while ((m = ml_dequeue(ml)) != NULL) {
+		off = 0;
+		nxt = ip_input_batch(&m, &off, IPPROTO_IPV4, AF_UNSPEC, ifp,
+		    &fb);
+		KASSERT(nxt == IPPROTO_DONE);
+	}
+
+	ip_fwdbatch_flush(&fb);
+	rtfree(fb.fb_rt);
+}
+
 struct mbuf *
 ipv4_check(struct ifnet *ifp, struct mbuf *m)
 {
@@ -387,6 +443,13 @@ bad:
 
 int
 ip_input_if(struct mbuf **mp, int *offp, int nxt, int af, struct ifnet *ifp)
+{
+	return (ip_input_batch(mp, offp, nxt, af, ifp, NULL));
+}
+
+int
+ip_input_batch(struct mbuf **mp, int *offp, int nxt, int af,
+    struct ifnet *ifp, struct ip_fwdbatch *fb)
 {
 	struct mbuf	*m;
 	struct rtentry	*rt = NULL;
@@ -443,13 +506,19 @@ ip_input_if(struct mbuf **mp, int *offp, int nxt, int af, struct ifnet *ifp)
 		goto out;
 	}
 
+	if (fb != NULL)
+		rt = ip_fwdbatch_route(fb, m);
 	switch(in_ouraddr(m, ifp, &rt)) {
 	case 2:
 		goto bad;
 	case 1:
+		if (fb != NULL)
+			ip_fwdbatch_setroute(fb, m, rt);
 		nxt = ip_ours(mp, offp, nxt, af);
 		goto out;
 	}
+	if (fb != NULL)
+		ip_fwdbatch_setroute(fb, m, rt);
 
 	if (IN_MULTICAST(ip->ip_dst.s_addr)) {
 		/*
@@ -545,7 +614,13 @@ ip_input_if(struct mbuf **mp, int *offp, int nxt, int af, struct ifnet *ifp)
 	}
 #endif /* IPSEC */
 
-	ip_forward(m, ifp, rt, pfrdr);
+	if (fb != NULL && !pfrdr)
+		ip_fwdbatch_enqueue(fb, m, rt);
+	else {
+		if (fb != NULL)
+			ip_fwdbatch_flush(fb);
+		ip_forward(m, ifp, rt, pfrdr);
+	}
 	*mp = NULL;
 	return IPPROTO_DONE;
  bad:
@@ -748,6 +823,76 @@ ip_deliver(struct mbuf **mp, int *offp, int nxt, int af)
 }
 #undef IPSTAT_INC
 
+/*
+ * Return a reference to the route remembered for the destination of the
+ * packet, or NULL if it has to be looked up.  Multipath routes are
+ * picked by source address, so they are never reused.
+ */
+struct rtentry *
+ip_fwdbatch_route(struct ip_fwdbatch *fb, struct mbuf *m)
+{
+	struct ip *ip = mtod(m, struct ip *);
+	struct rtentry *rt = fb->fb_rt;
+
+	if (rt == NULL || fb->fb_dst.s_addr != ip->ip_dst.s_addr ||
+	    fb->fb_rtableid != m->m_pkthdr.ph_rtableid ||
+	    ISSET(rt->rt_flags, RTF_MPATH) || !rtisvalid(rt))
+		return (NULL);
+
+	rtref(rt);
+	return (rt);
+}
+
+void
+ip_fwdbatch_setroute(struct ip_fwdbatch *fb, struct mbuf *m,
+    struct rtentry *rt)
+{
+	struct ip *ip = mtod(m, struct ip *);
+
+	if (rt == NULL || rt == fb->fb_rt)
+		return;
+
+	rtfree(fb->fb_rt);
+	rtref(rt);
+	fb->fb_rt = rt;
+	fb->fb_dst = ip->ip_dst;
+	fb->fb_rtableid = m->m_pkthdr.ph_rtableid;
+}
+
+/*
+ * Add a packet to the run waiting to be forwarded, the reference to
+ * rt is consumed.  A packet with a different route ends the run.
+ */
+void
+ip_fwdbatch_enqueue(struct ip_fwdbatch *fb, struct mbuf *m,
+    struct rtentry *rt)
+{
+	if (!ml_empty(&fb->fb_ml) && fb->fb_mlrt != rt)
+		ip_fwdbatch_flush(fb);
+
+	if (ml_empty(&fb->fb_ml))
+		fb->fb_mlrt = rt;
+	else
+		rtfree(rt);
+	ml_enqueue(&fb->fb_ml, m);
+}
+
+void
+ip_fwdbatch_flush(struct ip_fwdbatch *fb)
+{
+	struct rtentry *rt = fb->fb_mlrt;
+	struct mbuf *m;
+
+	while ((m = ml_dequeue(&fb->fb_ml)) != NULL) {
+		if (rt != NULL)
+			rtref(rt);
+		ip_forward(m, fb->fb_ifp, rt, 0);
+	}
+
+	rtfree(rt);
+	fb->fb_mlrt = NULL;
+}
+
 int
 in_ouraddr(struct mbuf *m, struct ifnet *ifp, struct rtentry **prt)
 {
@@ -770,12 +915,16 @@ in_ouraddr(struct mbuf *m, struct ifnet *ifp, struct rtentry **prt)
 
 	ip = mtod(m, struct ip *);
 
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_len = sizeof(sin);
-	sin.sin_family = AF_INET;
-	sin.sin_addr = ip->ip_dst;
-	rt = rtalloc_mpath(sintosa(&sin), &ip->ip_src.s_addr,
-	    m->m_pkthdr.ph_rtableid);
+	/* the caller may already know the route */
+	rt = *prt;
+	if (rt == NULL) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_len = sizeof(sin);
+		sin.sin_family = AF_INET;
+		sin.sin_addr = ip->ip_dst;
+		rt = rtalloc_mpath(sintosa(&sin), &ip->ip_src.s_addr,
+		    m->m_pkthdr.ph_rtableid);
+	}
 	if (rtisvalid(rt)) {
 		if (ISSET(rt->rt_flags, RTF_LOCAL))
 			match = 1;
@@ -206,6 +206,8 @@ static int tdb_count;					/* [D] */
 void
 ipsp_init(void)
 {
+	const struct xformsw *xsp;
+
 	pool_init(&tdb_pool, sizeof(struct tdb), 0, IPL_SOFTNET, 0,
 	    "tdb", NULL);
 
@@ -216,6 +218,9 @@ ipsp_init(void)
 	    M_WAITOK | M_ZERO);
 	tdbsrc = mallocarray(tdb_hashmask + 1, sizeof(struct tdb *), M_TDB,
 	    M_WAITOK | M_ZERO);
+
+	for (xsp = xformsw; xsp < xformswNXFORMSW; xsp++)
+		(*xsp->xf_attach)();
 }
 
 /*
@@ -527,6 +527,9 @@ struct xformsw {
 	int	(*xf_output)(struct mbuf *, struct tdb *, int, int);
 };
 
+/* Returned by xf_input when the packet will be completed asynchronously. */
+#define	IPSEC_INPUT_QUEUED	(-1)
+
 extern int ipsec_in_use;
 extern u_int64_t ipsec_last_added;
 extern int encdebug;			/* enable message reporting */
@@ -84,7 +84,6 @@ void ip_mloopback(struct ifnet *, struct mbuf *, struct sockaddr_in *);
 static __inline u_int16_t __attribute__((__unused__))
     in_cksum_phdr(u_int32_t, u_int32_t, u_int32_t);
 void in_delayed_cksum(struct mbuf *);
-int in_ifcap_cksum(struct mbuf *, struct ifnet *, int);
 
 int ip_output_ipsec_lookup(struct mbuf *m, int hlen, struct inpcb *inp,
     struct tdb **, int ipsecflowinfo);
@@ -252,10 +251,13 @@ reroute:
 				error = 0;
 			goto bad;
 		}
-		if (tdb != NULL) {
+		if (tdb != NULL &&
+		    !ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO) &&
+		    !ISSET(m->m_flags, M_UDP_GSO)) {
 			/*
 			 * If it needs TCP/UDP hardware-checksumming, do the
-			 * computation now.
+			 * computation now.  TSO and GSO packets are checksummed
+			 * when they are chopped before encryption.
 			 */
 			in_proto_cksum_out(m, NULL);
 		}
@@ -410,6 +412,33 @@ sendit:
 	 * Check if the packet needs encapsulation.
 	 */
 	if (tdb != NULL) {
+		/* Encryption needs real segments, chop TSO packets first */
+		if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO) ||
+		    ISSET(m->m_flags, M_UDP_GSO)) {
+			if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO)) {
+				error = tcp_chopper(m, &fml, NULL,
+				    m->m_pkthdr.ph_mss);
+				if (error)
+					goto done;
+				tcpstat_inc(tcps_outswtso);
+			} else {
+				error = udp_chopper(m, &fml, NULL,
+				    m->m_pkthdr.ph_mss);
+				if (error)
+					goto done;
+				udpstat_inc(udps_outswgso);
+			}
+			while ((m = ml_dequeue(&fml)) != NULL) {
+				/* Callee frees mbuf */
+				error = ip_output_ipsec_send(tdb, m, ro,
+				    (flags & IP_FORWARDING) ? 1 : 0);
+				if (error)
+					break;
+			}
+			ml_purge(&fml);
+			goto done;
+		}
+
 		/* Callee frees mbuf */
 		error = ip_output_ipsec_send(tdb, m, ro,
 		    (flags & IP_FORWARDING) ? 1 : 0);
@@ -443,6 +472,20 @@ sendit:
 		goto reroute;
 	}
 #endif
+
+	/*
+	 * TCP and UDP super packets are handed to the hardware or split
+	 * into segments in software before the generic checksum and
+	 * fragmentation handling below.
+	 */
+	error = tcp_if_output_tso(ifp, &m, sintosa(dst), ro->ro_rt,
+	    IFCAP_TSOv4, mtu);
+	if (error || m == NULL)
+		goto done;
+	error = udp_if_output_gso(ifp, &m, sintosa(dst), ro->ro_rt, mtu);
+	if (error || m == NULL)
+		goto done;
+
 	in_proto_cksum_out(m, ifp);
 
 #ifdef IPSEC
@@ -457,14 +500,7 @@ sendit:
 	 * If small enough for interface, can just send directly.
 	 */
 	if (ntohs(ip->ip_len) <= mtu) {
-		ip->ip_sum = 0;
-		if (in_ifcap_cksum(m, ifp, IFCAP_CSUM_IPv4))
-			m->m_pkthdr.csum_flags |= M_IPV4_CSUM_OUT;
-		else {
-			ipstat_inc(ips_outswcsum);
-			ip->ip_sum = in_cksum(m, hlen);
-		}
-
+		in_hdr_cksum_out(m, ifp);
 		error = ifp->if_output(ifp, m, sintosa(dst), ro->ro_rt);
 		goto done;
 	}
@@ -1859,6 +1895,20 @@ in_delayed_cksum(struct mbuf *m)
 		*(u_int16_t *)(mtod(m, caddr_t) + offset) = csum;
 }
 
+void
+in_hdr_cksum_out(struct mbuf *m, struct ifnet *ifp)
+{
+	struct ip *ip = mtod(m, struct ip *);
+
+	ip->ip_sum = 0;
+	if (in_ifcap_cksum(m, ifp, IFCAP_CSUM_IPv4))
+		SET(m->m_pkthdr.csum_flags, M_IPV4_CSUM_OUT);
+	else {
+		ipstat_inc(ips_outswcsum);
+		ip->ip_sum = in_cksum(m, ip->ip_hl << 2);
+	}
+}
+
 void
 in_proto_cksum_out(struct mbuf *m, struct ifnet *ifp)
 {
@@ -1870,7 +1920,12 @@ in_proto_cksum_out(struct mbuf *m, struct ifnet *ifp)
 		u_int16_t csum = 0, offset;
 
 		offset = ip->ip_hl << 2;
-		if (m->m_pkthdr.csum_flags & (M_TCP_CSUM_OUT|M_UDP_CSUM_OUT))
+		if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO)) {
+			/* hardware adds the length of each segment */
+			csum = in_cksum_phdr(ip->ip_src.s_addr,
+			    ip->ip_dst.s_addr, htonl(ip->ip_p));
+		} else if (m->m_pkthdr.csum_flags &
+		    (M_TCP_CSUM_OUT|M_UDP_CSUM_OUT))
 			csum = in_cksum_phdr(ip->ip_src.s_addr,
 			    ip->ip_dst.s_addr, htonl(ntohs(ip->ip_len) -
 			    offset + ip->ip_p));
@@ -109,6 +109,7 @@ int ipsec_exp_first_use = IPSEC_DEFAULT_EXP_FIRST_USE;
 int ipsec_expire_acquire = IPSEC_DEFAULT_EXPIRE_ACQUIRE;
 
 int esp_enable = 1;
+int esp_async = 0;
 int ah_enable = 1;
 int ipcomp_enable = 0;
 
@@ -116,6 +117,7 @@ const struct sysctl_bounded_args espctl_vars[] = {
 	{ESPCTL_ENABLE, &esp_enable, 0, 1},
 	{ESPCTL_UDPENCAP_ENABLE, &udpencap_enable, 0, 1},
 	{ESPCTL_UDPENCAP_PORT, &udpencap_port, 0, 65535},
+	{ESPCTL_ASYNC, &esp_async, 0, 1},
 };
 const struct sysctl_bounded_args ahctl_vars[] = {
 	{AHCTL_ENABLE, &ah_enable, 0, 1},
@@ -331,7 +333,10 @@ ipsec_common_input(struct mbuf **mp, int skip, int protoff, int af, int sproto,
 	 * everything else.
 	 */
 	prot = (*(tdbp->tdb_xform->xf_input))(mp, tdbp, skip, protoff);
-	if (prot == IPPROTO_DONE) {
+	if (prot == IPSEC_INPUT_QUEUED) {
+		/* The transform finishes the packet later on its own. */
+		prot = IPPROTO_DONE;
+	} else if (prot == IPPROTO_DONE) {
 		ipsecstat_inc(ipsec_idrops);
 		tdbstat_inc(tdbp, tdb_idrops);
 	}
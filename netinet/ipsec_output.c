@@ -512,9 +512,10 @@ ipsp_process_done(struct mbuf *m, struct tdb *tdb)
 	/* If there's another (bundled) TDB to apply, do so. */
 	tdbo = tdb_ref(tdb->tdb_onext);
 	if (tdbo != NULL) {
-		KERNEL_ASSERT_LOCKED();
+		KERNEL_LOCK();
 		error = ipsp_process_packet(m, tdbo,
 		    tdb->tdb_dst.sa.sa_family, 0);
+		KERNEL_UNLOCK();
 		tdb_unref(tdbo);
 		return error;
 	}
@@ -128,6 +128,9 @@ struct tcphdr {
 #define	TCP_SACK_ENABLE		0x08   /* enable SACKs (if disabled by def.) */
 #define	TCP_INFO		0x09   /* retrieve tcp_info structure */
 #define	TCP_NOPUSH		0x10   /* don't push last block of write */
+#define	TCP_CONGESTION		0x20   /* congestion control algorithm */
+
+#define	TCP_CA_NAME_MAX		16     /* max congestion control name len */
 
 #define	TCPI_OPT_TIMESTAMPS	0x01
 #define	TCPI_OPT_SACK		0x02
@@ -85,6 +85,7 @@
 #include <net/route.h>
 
 #include <netinet/in.h>
+#include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/in_pcb.h>
 #include <netinet/ip_var.h>
@@ -168,8 +169,8 @@ do { \
  * Macro to compute ACK transmission behavior.  Delay the ACK unless
  * we have already delayed an ACK (must send an ACK every two segments).
  * We also ACK immediately if we received a PUSH and the ACK-on-PUSH
- * option is enabled or when the packet is coming from a loopback
- * interface.
+ * option is enabled, when the packet is coming from a loopback
+ * interface or when LRO has merged several segments into it.
  */
 #define	TCP_SETUP_ACK(tp, tiflags, m) \
 do { \
@@ -178,6 +179,8 @@ do { \
 		ifp = if_get(m->m_pkthdr.ph_ifidx); \
 	if (TCP_TIMER_ISARMED(tp, TCPT_DELACK) || \
 	    (tcp_ack_on_push && (tiflags) & TH_PUSH) || \
+	    (m && (m->m_flags & M_PKTHDR) && \
+	    ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO)) || \
 	    (ifp && (ifp->if_flags & IFF_LOOPBACK))) \
 		tp->t_flags |= TF_ACKNOW; \
 	else \
@@ -192,8 +195,9 @@ void	 syn_cache_put(struct syn_cache *);
 void	 syn_cache_rm(struct syn_cache *);
 int	 syn_cache_respond(struct syn_cache *, struct mbuf *, uint32_t);
 void	 syn_cache_timer(void *);
-void	 syn_cache_reaper(void *);
-void	 syn_cache_insert(struct syn_cache *, struct tcpcb *);
+void	 syn_cache_timer_arm(struct syn_cache *, uint32_t);
+void	 syn_cache_insert(struct syn_cache *, struct tcpcb *, uint32_t);
+struct syn_cache_part *syn_cache_part(struct sockaddr *, struct sockaddr *);
 void	 syn_cache_reset(struct sockaddr *, struct sockaddr *,
 		struct tcphdr *, u_int);
 int	 syn_cache_add(struct sockaddr *, struct sockaddr *, struct tcphdr *,
@@ -475,6 +479,8 @@ tcp_input(struct mbuf **mp, int *offp, int proto, int af)
 			goto drop;
 		}
 	}
+	if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO))
+		tcpstat_inc(tcps_inpktlro);
 
 	/*
 	 * Check that TCP offset makes sense,
@@ -1504,7 +1510,9 @@ trimthenstep6:
 
 				win = min(tp->snd_wnd, tp->snd_cwnd) / tp->t_maxseg;
 				if (win > 1) {
-					tp->snd_ssthresh = win / 2 * tp->t_maxseg;
+					tp->snd_ssthresh =
+					    (*tp->t_cc->cc_ssthresh)(tp,
+					    TCP_CC_ECN);
 					tp->snd_cwnd = tp->snd_ssthresh;
 					tp->snd_last = tp->snd_max;
 					tp->t_flags |= TF_SEND_CWR;
@@ -1586,9 +1594,6 @@ trimthenstep6:
 					tp->t_dupacks = 0;
 				else if (++tp->t_dupacks == tcprexmtthresh) {
 					tcp_seq onxt = tp->snd_nxt;
-					u_long win =
-					    ulmin(tp->snd_wnd, tp->snd_cwnd) /
-						2 / tp->t_maxseg;
 
 					if (SEQ_LT(th->th_ack, tp->snd_last)){
 						/*
@@ -1598,9 +1603,9 @@ trimthenstep6:
 						tp->t_dupacks = 0;
 						goto drop;
 					}
-					if (win < 2)
-						win = 2;
-					tp->snd_ssthresh = win * tp->t_maxseg;
+					tp->snd_ssthresh =
+					    (*tp->t_cc->cc_ssthresh)(tp,
+					    TCP_CC_DUPACK);
 					tp->snd_last = tp->snd_max;
 					if (tp->sack_enable) {
 						TCP_TIMER_DISARM(tp, TCPT_REXMT);
@@ -1713,22 +1718,11 @@ trimthenstep6:
 		} else if (TCP_TIMER_ISARMED(tp, TCPT_PERSIST) == 0)
 			TCP_TIMER_ARM(tp, TCPT_REXMT, tp->t_rxtcur);
 		/*
-		 * When new data is acked, open the congestion window.
-		 * If the window gives us less than ssthresh packets
-		 * in flight, open exponentially (maxseg per packet).
-		 * Otherwise open linearly: maxseg per window
-		 * (maxseg^2 / cwnd per packet).
+		 * When new data is acked, open the congestion window
+		 * as the congestion control algorithm sees fit.
 		 */
-		{
-		u_int cw = tp->snd_cwnd;
-		u_int incr = tp->t_maxseg;
-
-		if (cw > tp->snd_ssthresh)
-			incr = max(incr * incr / cw, 1);
 		if (tp->t_dupacks < tcprexmtthresh)
-			tp->snd_cwnd = ulmin(cw + incr,
-			    TCP_MAXWIN << tp->snd_scale);
-		}
+			(*tp->t_cc->cc_ack)(tp, acked);
 		ND6_HINT(tp);
 		if (acked > so->so_snd.sb_cc) {
 			if (tp->snd_wnd > so->so_snd.sb_cc)
@@ -3093,8 +3087,9 @@ int	tcp_syn_cache_limit = TCP_SYN_HASH_SIZE*TCP_SYN_BUCKET_SIZE;
 int	tcp_syn_bucket_limit = 3*TCP_SYN_BUCKET_SIZE;
 int	tcp_syn_use_limit = 100000;
 
-struct syn_cache_set tcp_syn_cache[2];
-int tcp_syn_cache_active;
+struct syn_cache_part *tcp_syn_cache;
+int tcp_syn_cache_nparts;
+u_int32_t tcp_syn_part_random[5];
 
 #define SYN_HASH(sa, sp, dp, rand) \
 	(((sa)->s_addr ^ (rand)[0]) *				\
@@ -3133,15 +3128,16 @@ do {									\
 } while (/*CONSTCOND*/0)
 #endif /* INET6 */
 
+struct pool syn_cache_pool;
+
 void
 syn_cache_rm(struct syn_cache *sc)
 {
-	sc->sc_flags |= SCF_DEAD;
 	TAILQ_REMOVE(&sc->sc_buckethead->sch_bucket, sc, sc_bucketq);
 	sc->sc_tp = NULL;
 	LIST_REMOVE(sc, sc_tpq);
 	sc->sc_buckethead->sch_length--;
-	timeout_del(&sc->sc_timer);
+	TAILQ_REMOVE(&sc->sc_part->scp_rxtq[sc->sc_rxtshift], sc, sc_rxtq);
 	sc->sc_set->scs_count--;
 }
 
@@ -3153,41 +3149,69 @@ syn_cache_put(struct syn_cache *sc)
 		rtfree(sc->sc_route4.ro_rt);
 		sc->sc_route4.ro_rt = NULL;
 	}
-	timeout_set(&sc->sc_timer, syn_cache_reaper, sc);
-	timeout_add(&sc->sc_timer, 0);
+	pool_put(&syn_cache_pool, sc);
 }
 
-struct pool syn_cache_pool;
-
 /*
  * We don't estimate RTT with SYNs, so each packet starts with the default
  * RTT and each timer step has a fixed timeout value.
  */
-#define	SYN_CACHE_TIMER_ARM(sc)						\
-do {									\
-	TCPT_RANGESET((sc)->sc_rxtcur,					\
-	    TCPTV_SRTTDFLT * tcp_backoff[(sc)->sc_rxtshift], TCPTV_MIN,	\
-	    TCPTV_REXMTMAX);						\
-	if (!timeout_initialized(&(sc)->sc_timer))			\
-		timeout_set_proc(&(sc)->sc_timer, syn_cache_timer, (sc)); \
-	timeout_add_msec(&(sc)->sc_timer, (sc)->sc_rxtcur);		\
-} while (/*CONSTCOND*/0)
+void
+syn_cache_timer_arm(struct syn_cache *sc, uint32_t now)
+{
+	struct syn_cache_part *part = sc->sc_part;
+
+	TCPT_RANGESET(sc->sc_rxtcur,
+	    TCPTV_SRTTDFLT * tcp_backoff[sc->sc_rxtshift], TCPTV_MIN,
+	    TCPTV_REXMTMAX);
+	sc->sc_rxtexpire = now + sc->sc_rxtcur;
+	TAILQ_INSERT_TAIL(&part->scp_rxtq[sc->sc_rxtshift], sc, sc_rxtq);
+
+	if (!timeout_pending(&part->scp_timer) ||
+	    (int32_t)(sc->sc_rxtexpire - part->scp_expire) < 0) {
+		part->scp_expire = sc->sc_rxtexpire;
+		timeout_add_msec(&part->scp_timer, sc->sc_rxtcur);
+	}
+}
+
+struct syn_cache_part *
+syn_cache_part(struct sockaddr *src, struct sockaddr *dst)
+{
+	u_int32_t hash;
+
+	SYN_HASHALL(hash, src, dst, tcp_syn_part_random);
+	return (&tcp_syn_cache[hash % tcp_syn_cache_nparts]);
+}
 
 void
 syn_cache_init(void)
 {
-	int i;
+	struct syn_cache_part *part;
+	struct syn_cache_set *set;
+	int i, j, k;
+
+	tcp_syn_cache_nparts = min(ncpus, TCP_SYN_MAXPARTS);
+	tcp_syn_cache = mallocarray(tcp_syn_cache_nparts,
+	    sizeof(struct syn_cache_part), M_SYNCACHE, M_WAITOK|M_ZERO);
+	arc4random_buf(tcp_syn_part_random, sizeof(tcp_syn_part_random));
+
+	for (i = 0; i < tcp_syn_cache_nparts; i++) {
+		part = &tcp_syn_cache[i];
+
+		/* Initialize the hash buckets. */
+		for (j = 0; j < 2; j++) {
+			set = &part->scp_set[j];
+			set->scs_buckethead = mallocarray(tcp_syn_hash_size,
+			    sizeof(struct syn_cache_head), M_SYNCACHE,
+			    M_WAITOK|M_ZERO);
+			set->scs_size = tcp_syn_hash_size;
+			for (k = 0; k < tcp_syn_hash_size; k++)
+				TAILQ_INIT(&set->scs_buckethead[k].sch_bucket);
+		}
 
-	/* Initialize the hash buckets. */
-	tcp_syn_cache[0].scs_buckethead = mallocarray(tcp_syn_hash_size,
-	    sizeof(struct syn_cache_head), M_SYNCACHE, M_WAITOK|M_ZERO);
-	tcp_syn_cache[1].scs_buckethead = mallocarray(tcp_syn_hash_size,
-	    sizeof(struct syn_cache_head), M_SYNCACHE, M_WAITOK|M_ZERO);
-	tcp_syn_cache[0].scs_size = tcp_syn_hash_size;
-	tcp_syn_cache[1].scs_size = tcp_syn_hash_size;
-	for (i = 0; i < tcp_syn_hash_size; i++) {
-		TAILQ_INIT(&tcp_syn_cache[0].scs_buckethead[i].sch_bucket);
-		TAILQ_INIT(&tcp_syn_cache[1].scs_buckethead[i].sch_bucket);
+		for (k = 0; k <= TCP_MAXRXTSHIFT; k++)
+			TAILQ_INIT(&part->scp_rxtq[k]);
+		timeout_set_proc(&part->scp_timer, syn_cache_timer, part);
 	}
 
 	/* Initialize the syn cache pool. */
@@ -3196,15 +3220,19 @@ syn_cache_init(void)
 }
 
 void
-syn_cache_insert(struct syn_cache *sc, struct tcpcb *tp)
+syn_cache_insert(struct syn_cache *sc, struct tcpcb *tp, uint32_t now)
 {
-	struct syn_cache_set *set = &tcp_syn_cache[tcp_syn_cache_active];
+	struct syn_cache_part *part;
+	struct syn_cache_set *set;
 	struct syn_cache_head *scp;
 	struct syn_cache *sc2;
 	int i;
 
 	NET_ASSERT_LOCKED();
 
+	part = syn_cache_part(&sc->sc_src.sa, &sc->sc_dst.sa);
+	set = &part->scp_set[part->scp_active];
+
 	/*
 	 * If there are no entries in the hash table, reinitialize
 	 * the hash secrets.  To avoid useless cache swaps and
@@ -3264,7 +3292,8 @@ syn_cache_insert(struct syn_cache *sc, struct tcpcb *tp)
 #endif
 		syn_cache_rm(sc2);
 		syn_cache_put(sc2);
-	} else if (set->scs_count >= tcp_syn_cache_limit) {
+	} else if (set->scs_count >=
+	    max(1, tcp_syn_cache_limit / tcp_syn_cache_nparts)) {
 		struct syn_cache_head *scp2, *sce;
 
 		tcpstat_inc(tcps_sc_overflowed);
@@ -3305,7 +3334,8 @@ syn_cache_insert(struct syn_cache *sc, struct tcpcb *tp)
 	 */
 	sc->sc_rxttot = 0;
 	sc->sc_rxtshift = 0;
-	SYN_CACHE_TIMER_ARM(sc);
+	sc->sc_part = part;
+	syn_cache_timer_arm(sc, now);
 
 	/* Link it from tcpcb entry */
 	LIST_INSERT_HEAD(&tp->t_sc, sc, sc_tpq);
@@ -3324,66 +3354,76 @@ syn_cache_insert(struct syn_cache *sc, struct tcpcb *tp)
 	 * the passive syn cache is empty, exchange their roles.
 	 */
 	if (set->scs_use <= 0 &&
-	    tcp_syn_cache[!tcp_syn_cache_active].scs_count == 0)
-		tcp_syn_cache_active = !tcp_syn_cache_active;
+	    part->scp_set[!part->scp_active].scs_count == 0)
+		part->scp_active = !part->scp_active;
 }
 
 /*
- * Walk the timer queues, looking for SYN,ACKs that need to be retransmitted.
- * If we have retransmitted an entry the maximum number of times, expire
- * that entry.
+ * Walk the rexmt queues of a partition, looking for SYN,ACKs that need
+ * to be retransmitted.  If we have retransmitted an entry the maximum
+ * number of times, expire that entry.
  */
 void
 syn_cache_timer(void *arg)
 {
-	struct syn_cache *sc = arg;
-	uint32_t now;
+	struct syn_cache_part *part = arg;
+	struct syn_cache *sc;
+	uint32_t now, next = 0;
+	int i, pending = 0;
 
 	NET_LOCK();
-	if (sc->sc_flags & SCF_DEAD)
-		goto out;
-
 	now = tcp_now();
 
-	if (__predict_false(sc->sc_rxtshift == TCP_MAXRXTSHIFT)) {
-		/* Drop it -- too many retransmissions. */
-		goto dropit;
-	}
+	for (i = 0; i <= TCP_MAXRXTSHIFT; i++) {
+		while ((sc = TAILQ_FIRST(&part->scp_rxtq[i])) != NULL) {
+			if ((int32_t)(now - sc->sc_rxtexpire) < 0)
+				break;
 
-	/*
-	 * Compute the total amount of time this entry has
-	 * been on a queue.  If this entry has been on longer
-	 * than the keep alive timer would allow, expire it.
-	 */
-	sc->sc_rxttot += sc->sc_rxtcur;
-	if (sc->sc_rxttot >= TCP_TIME(tcptv_keep_init))
-		goto dropit;
+			if (__predict_false(sc->sc_rxtshift ==
+			    TCP_MAXRXTSHIFT)) {
+				/* Drop it -- too many retransmissions. */
+				goto dropit;
+			}
 
-	tcpstat_inc(tcps_sc_retransmitted);
-	(void) syn_cache_respond(sc, NULL, now);
+			/*
+			 * Compute the total amount of time this entry has
+			 * been on a queue.  If this entry has been on longer
+			 * than the keep alive timer would allow, expire it.
+			 */
+			sc->sc_rxttot += sc->sc_rxtcur;
+			if (sc->sc_rxttot >= TCP_TIME(tcptv_keep_init))
+				goto dropit;
 
-	/* Advance the timer back-off. */
-	sc->sc_rxtshift++;
-	SYN_CACHE_TIMER_ARM(sc);
+			tcpstat_inc(tcps_sc_retransmitted);
+			(void) syn_cache_respond(sc, NULL, now);
 
- out:
-	NET_UNLOCK();
-	return;
+			/* Advance the timer back-off. */
+			TAILQ_REMOVE(&part->scp_rxtq[i], sc, sc_rxtq);
+			sc->sc_rxtshift++;
+			syn_cache_timer_arm(sc, now);
+			continue;
 
  dropit:
-	tcpstat_inc(tcps_sc_timed_out);
-	syn_cache_rm(sc);
-	syn_cache_put(sc);
-	NET_UNLOCK();
-}
-
-void
-syn_cache_reaper(void *arg)
-{
-	struct syn_cache *sc = arg;
+			tcpstat_inc(tcps_sc_timed_out);
+			syn_cache_rm(sc);
+			syn_cache_put(sc);
+		}
+	}
 
-	pool_put(&syn_cache_pool, (sc));
-	return;
+	/* Run again when the first remaining entry expires. */
+	for (i = 0; i <= TCP_MAXRXTSHIFT; i++) {
+		sc = TAILQ_FIRST(&part->scp_rxtq[i]);
+		if (sc == NULL)
+			continue;
+		if (!pending || (int32_t)(sc->sc_rxtexpire - next) < 0)
+			next = sc->sc_rxtexpire;
+		pending = 1;
+	}
+	if (pending) {
+		part->scp_expire = next;
+		timeout_add_msec(&part->scp_timer, next - now);
+	}
+	NET_UNLOCK();
 }
 
 /*
@@ -3417,6 +3457,7 @@ struct syn_cache *
 syn_cache_lookup(struct sockaddr *src, struct sockaddr *dst,
     struct syn_cache_head **headp, u_int rtableid)
 {
+	struct syn_cache_part *part;
 	struct syn_cache_set *sets[2];
 	struct syn_cache *sc;
 	struct syn_cache_head *scp;
@@ -3426,8 +3467,9 @@ syn_cache_lookup(struct sockaddr *src, struct sockaddr *dst,
 	NET_ASSERT_LOCKED();
 
 	/* Check the active cache first, the passive cache is likely empty. */
-	sets[0] = &tcp_syn_cache[tcp_syn_cache_active];
-	sets[1] = &tcp_syn_cache[!tcp_syn_cache_active];
+	part = syn_cache_part(src, dst);
+	sets[0] = &part->scp_set[part->scp_active];
+	sets[1] = &part->scp_set[!part->scp_active];
 	for (i = 0; i < 2; i++) {
 		if (sets[i]->scs_count == 0)
 			continue;
@@ -3592,6 +3634,7 @@ syn_cache_get(struct sockaddr *src, struct sockaddr *dst, struct tcphdr *th,
 
 	tp = intotcpcb(inp);
 	tp->t_flags = sototcpcb(oso)->t_flags & (TF_NOPUSH|TF_NODELAY);
+	tcp_cc_init(tp, sototcpcb(oso)->t_cc);
 	if (sc->sc_request_r_scale != 15) {
 		tp->requested_s_scale = sc->sc_requested_s_scale;
 		tp->request_r_scale = sc->sc_request_r_scale;
@@ -3901,7 +3944,7 @@ syn_cache_add(struct sockaddr *src, struct sockaddr *dst, struct tcphdr *th,
 #endif
 	sc->sc_tp = tp;
 	if (syn_cache_respond(sc, m, now) == 0) {
-		syn_cache_insert(sc, tp);
+		syn_cache_insert(sc, tp, now);
 		tcpstat_inc(tcps_sndacks);
 		tcpstat_inc(tcps_sndtotal);
 	} else {
@@ -4158,3 +4201,260 @@ syn_cache_respond(struct syn_cache *sc, struct mbuf *m, uint32_t now)
 	}
 	return (error);
 }
+
+/*
+ * Software large receive offload.  Received Ethernet frames carrying
+ * in-order TCP segments of the same connection are merged into one
+ * large packet before they enter the stack, so the IP, PCB lookup and
+ * socket buffer work is done once per batch instead of per segment.
+ * Only segments whose checksums were verified by the hardware are
+ * merged.  The result is flagged M_TCP_TSO with the segment size in
+ * ph_mss, so it is split again if it is forwarded.
+ */
+
+#define TCP_SOFTLRO_FLOWS	8
+
+struct tcp_softlro_pkt {
+	struct mbuf		*head;
+	struct mbuf		*tail;
+	struct ether_header	*eh;
+	struct ip		*ip;
+#ifdef INET6
+	struct ip6_hdr		*ip6;
+#endif
+	struct tcphdr		*th;
+	u_int			 hlen;
+	u_int			 paylen;
+	tcp_seq			 nxtseq;
+};
+
+/*
+ * Returns -1 if the packet is not TCP, 0 if it is TCP but cannot be
+ * merged, and 1 if it is a candidate for merging.
+ */
+static int
+tcp_softlro_parse(struct mbuf *m, struct tcp_softlro_pkt *p)
+{
+	u_int hlen = ETHER_HDR_LEN, iplen, thlen;
+
+	memset(p, 0, sizeof(*p));
+
+	if (m->m_len < hlen)
+		return (-1);
+	p->eh = mtod(m, struct ether_header *);
+
+	switch (ntohs(p->eh->ether_type)) {
+	case ETHERTYPE_IP:
+		if (m->m_len < hlen + sizeof(struct ip))
+			return (-1);
+		p->ip = (struct ip *)(mtod(m, caddr_t) + hlen);
+		if (p->ip->ip_v != IPVERSION || p->ip->ip_hl != 5 ||
+		    p->ip->ip_p != IPPROTO_TCP ||
+		    ISSET(p->ip->ip_off, htons(IP_MF | IP_OFFMASK)))
+			return (-1);
+		iplen = ntohs(p->ip->ip_len);
+		hlen += sizeof(struct ip);
+		break;
+#ifdef INET6
+	case ETHERTYPE_IPV6:
+		if (m->m_len < hlen + sizeof(struct ip6_hdr))
+			return (-1);
+		p->ip6 = (struct ip6_hdr *)(mtod(m, caddr_t) + hlen);
+		if ((p->ip6->ip6_vfc & IPV6_VERSION_MASK) != IPV6_VERSION ||
+		    p->ip6->ip6_nxt != IPPROTO_TCP)
+			return (-1);
+		iplen = sizeof(struct ip6_hdr) + ntohs(p->ip6->ip6_plen);
+		hlen += sizeof(struct ip6_hdr);
+		break;
+#endif
+	default:
+		return (-1);
+	}
+
+	if (m->m_len < hlen + sizeof(struct tcphdr))
+		return (-1);
+	p->th = (struct tcphdr *)(mtod(m, caddr_t) + hlen);
+
+	thlen = p->th->th_off << 2;
+	if (thlen < sizeof(struct tcphdr) || m->m_len < hlen + thlen)
+		return (0);
+	p->hlen = hlen + thlen;
+
+	/* Ethernet padding must not end up in the middle of the stream */
+	if (ETHER_HDR_LEN + iplen != m->m_pkthdr.len ||
+	    m->m_pkthdr.len <= p->hlen)
+		return (0);
+	p->paylen = m->m_pkthdr.len - p->hlen;
+	p->nxtseq = ntohl(p->th->th_seq) + p->paylen;
+
+	if ((p->th->th_flags & ~TH_PUSH) != TH_ACK)
+		return (0);
+	if (!ISSET(m->m_pkthdr.csum_flags, M_TCP_CSUM_IN_OK) ||
+	    ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO))
+		return (0);
+	if (p->ip != NULL &&
+	    !ISSET(m->m_pkthdr.csum_flags, M_IPV4_CSUM_IN_OK))
+		return (0);
+
+	return (1);
+}
+
+static int
+tcp_softlro_match(const struct tcp_softlro_pkt *h,
+    const struct tcp_softlro_pkt *p)
+{
+	if (h->th->th_sport != p->th->th_sport ||
+	    h->th->th_dport != p->th->th_dport)
+		return (0);
+
+	if (h->ip != NULL) {
+		return (p->ip != NULL &&
+		    h->ip->ip_src.s_addr == p->ip->ip_src.s_addr &&
+		    h->ip->ip_dst.s_addr == p->ip->ip_dst.s_addr);
+	}
+#ifdef INET6
+	if (h->ip6 != NULL) {
+		return (p->ip6 != NULL &&
+		    IN6_ARE_ADDR_EQUAL(&h->ip6->ip6_src, &p->ip6->ip6_src) &&
+		    IN6_ARE_ADDR_EQUAL(&h->ip6->ip6_dst, &p->ip6->ip6_dst));
+	}
+#endif
+
+	return (0);
+}
+
+static int
+tcp_softlro_mergeable(const struct tcp_softlro_pkt *h,
+    const struct tcp_softlro_pkt *p, const struct mbuf *m)
+{
+	const struct mbuf *head = h->head;
+
+	if (ISSET(h->th->th_flags, TH_PUSH))
+		return (0);
+	if (ntohl(p->th->th_seq) != h->nxtseq ||
+	    SEQ_LT(ntohl(p->th->th_ack), ntohl(h->th->th_ack)))
+		return (0);
+	if (head->m_pkthdr.len - ETHER_HDR_LEN + p->paylen > IP_MAXPACKET)
+		return (0);
+
+	if (ISSET(head->m_flags, M_VLANTAG) != ISSET(m->m_flags, M_VLANTAG) ||
+	    (ISSET(m->m_flags, M_VLANTAG) &&
+	    head->m_pkthdr.ether_vtag != m->m_pkthdr.ether_vtag))
+		return (0);
+	if (memcmp(h->eh, p->eh, ETHER_ADDR_LEN * 2) != 0)
+		return (0);
+
+	if (h->ip != NULL) {
+		if (h->ip->ip_tos != p->ip->ip_tos ||
+		    h->ip->ip_ttl != p->ip->ip_ttl ||
+		    h->ip->ip_off != p->ip->ip_off)
+			return (0);
+	}
+#ifdef INET6
+	if (h->ip6 != NULL) {
+		if (h->ip6->ip6_flow != p->ip6->ip6_flow ||
+		    h->ip6->ip6_hlim != p->ip6->ip6_hlim)
+			return (0);
+	}
+#endif
+
+	/* options, usually the timestamp, must be the same */
+	if (h->th->th_off != p->th->th_off ||
+	    memcmp(h->th + 1, p->th + 1,
+	    (p->th->th_off << 2) - sizeof(struct tcphdr)) != 0)
+		return (0);
+
+	return (1);
+}
+
+static void
+tcp_softlro_merge(struct tcp_softlro_pkt *h, const struct tcp_softlro_pkt *p,
+    struct mbuf *m)
+{
+	struct mbuf *head = h->head;
+
+	if (!ISSET(head->m_pkthdr.csum_flags, M_TCP_TSO)) {
+		/* checksums have to be calculated if it is forwarded */
+		SET(head->m_pkthdr.csum_flags, M_TCP_TSO | M_TCP_CSUM_OUT);
+		head->m_pkthdr.ph_mss = h->paylen;
+	}
+	if (p->paylen > head->m_pkthdr.ph_mss)
+		head->m_pkthdr.ph_mss = p->paylen;
+
+	h->th->th_ack = p->th->th_ack;
+	h->th->th_win = p->th->th_win;
+	h->th->th_flags |= p->th->th_flags & TH_PUSH;
+
+	if (h->ip != NULL)
+		h->ip->ip_len = htons(ntohs(h->ip->ip_len) + p->paylen);
+#ifdef INET6
+	if (h->ip6 != NULL)
+		h->ip6->ip6_plen = htons(ntohs(h->ip6->ip6_plen) + p->paylen);
+#endif
+	h->nxtseq += p->paylen;
+
+	m_adj(m, p->hlen);
+	m_removehdr(m);
+	head->m_pkthdr.len += p->paylen;
+	h->tail->m_next = m;
+	while (m->m_next != NULL)
+		m = m->m_next;
+	h->tail = m;
+}
+
+/*
+ * Merge the packets on ml in place.  Returns the number of segments
+ * that were appended to an earlier packet.
+ */
+u_int
+tcp_softlro(struct mbuf_list *ml)
+{
+	struct mbuf_list out = MBUF_LIST_INITIALIZER();
+	struct tcp_softlro_pkt flows[TCP_SOFTLRO_FLOWS], p;
+	struct mbuf *m, *n;
+	u_int i, nflows = 0, evict = 0, merged = 0;
+	int mergeable;
+
+	while ((m = ml_dequeue(ml)) != NULL) {
+		mergeable = tcp_softlro_parse(m, &p);
+		if (mergeable == -1) {
+			ml_enqueue(&out, m);
+			continue;
+		}
+
+		for (i = 0; i < nflows; i++) {
+			if (tcp_softlro_match(&flows[i], &p))
+				break;
+		}
+		if (i < nflows && mergeable &&
+		    tcp_softlro_mergeable(&flows[i], &p, m)) {
+			tcp_softlro_merge(&flows[i], &p, m);
+			merged++;
+			continue;
+		}
+
+		ml_enqueue(&out, m);
+		if (!mergeable) {
+			/* later segments must not overtake this one */
+			if (i < nflows)
+				flows[i] = flows[--nflows];
+			continue;
+		}
+
+		if (i == nflows) {
+			if (nflows < TCP_SOFTLRO_FLOWS)
+				nflows++;
+			else
+				i = evict++ % TCP_SOFTLRO_FLOWS;
+		}
+		for (n = m; n->m_next != NULL; n = n->m_next)
+			;
+		p.head = m;
+		p.tail = n;
+		flows[i] = p;
+	}
+
+	*ml = out;
+
+	return (merged);
+}
@@ -80,6 +80,7 @@
 #include <sys/kernel.h>
 
 #include <net/if.h>
+#include <net/if_var.h>
 #include <net/route.h>
 #if NPF > 0
 #include <net/pfvar.h>
@@ -200,7 +201,8 @@ tcp_output(struct tcpcb *tp)
 	u_int32_t optbuf[howmany(MAX_TCPOPTLEN, sizeof(u_int32_t))];
 	u_char *opt = (u_char *)optbuf;
 	unsigned int optlen, hdrlen, packetlen;
-	int idle, sendalot = 0;
+	unsigned int tsomss = 0;
+	int idle, sendalot = 0, tso = 0;
 	int i, sack_rxmit = 0;
 	struct sackhole *p;
 	uint32_t now;
@@ -231,13 +233,16 @@ tcp_output(struct tcpcb *tp)
 	 * to send, then transmit; otherwise, investigate further.
 	 */
 	idle = (tp->t_flags & TF_LASTIDLE) || (tp->snd_max == tp->snd_una);
-	if (idle && (now - tp->t_rcvtime) >= tp->t_rxtcur)
+	if (idle && (now - tp->t_rcvtime) >= tp->t_rxtcur) {
 		/*
 		 * We have been idle for "a while" and no acks are
 		 * expected to clock out any data we send --
 		 * slow start to get ack "clock" running again.
 		 */
 		tp->snd_cwnd = 2 * tp->t_maxseg;
+		if (tp->t_cc->cc_idle != NULL)
+			(*tp->t_cc->cc_idle)(tp);
+	}
 
 	/* remember 'idle' for next invocation of tcp_output */
 	if (idle && soissending(so)) {
@@ -346,8 +351,35 @@ again:
 	txmaxseg = ulmin(so->so_snd.sb_hiwat / 2, tp->t_maxseg);
 
 	if (len > txmaxseg) {
-		len = txmaxseg;
-		sendalot = 1;
+		/*
+		 * Build one large packet and let the interface or
+		 * tcp_chopper() cut it into segments later.  Anything
+		 * that varies per segment must be sent the classic way.
+		 */
+		if (tcp_do_tso &&
+		    tp->t_inpcb->inp_options == NULL &&
+		    tp->t_inpcb->inp_outputopts6 == NULL &&
+#ifdef TCP_SIGNATURE
+		    (tp->t_flags & TF_SIGNATURE) == 0 &&
+#endif
+		    so->so_snd.sb_hiwat / 2 >= 2 * tp->t_maxseg &&
+		    len >= 2 * tp->t_maxseg &&
+		    tp->rcv_numsacks == 0 && sack_rxmit == 0 &&
+		    (flags & (TH_SYN|TH_RST|TH_FIN)) == 0) {
+			tso = 1;
+			if (len > so->so_snd.sb_hiwat / 2) {
+				len = so->so_snd.sb_hiwat / 2;
+				sendalot = 1;
+			}
+			/* avoid a small trailing segment */
+			if (len % tp->t_maxseg != 0) {
+				len -= len % tp->t_maxseg;
+				sendalot = 1;
+			}
+		} else {
+			len = txmaxseg;
+			sendalot = 1;
+		}
 	}
 	if (off + len < so->so_snd.sb_cc)
 		flags &= ~TH_FIN;
@@ -365,7 +397,7 @@ again:
 	 * to send into a small window), then must resend.
 	 */
 	if (len) {
-		if (len == txmaxseg)
+		if (len == txmaxseg || tso)
 			goto send;
 		if ((idle || (tp->t_flags & TF_NODELAY)) &&
 		    len + off >= so->so_snd.sb_cc && !soissending(so) &&
@@ -616,8 +648,26 @@ send:
 	/*
 	 * Adjust data length if insertion of options will
 	 * bump the packet length beyond the t_maxopd length.
+	 * A TSO packet must fit into the largest mbuf cluster, so
+	 * drivers can always defragment it, and carry a whole number
+	 * of segments.
 	 */
-	if (len > tp->t_maxopd - optlen) {
+	if (tso) {
+		long maxlen;
+
+		tsomss = ulmin(tp->t_maxseg, tp->t_maxopd - optlen);
+		maxlen = MAXMCLBYTES - max_linkhdr - hdrlen;
+		if (len > maxlen) {
+			len = maxlen;
+			sendalot = 1;
+		}
+		if (len % tsomss != 0) {
+			len -= len % tsomss;
+			sendalot = 1;
+		}
+		if (len <= tsomss)
+			tso = 0;
+	} else if (len > tp->t_maxopd - optlen) {
 		len = tp->t_maxopd - optlen;
 		sendalot = 1;
 		flags &= ~TH_FIN;
@@ -895,6 +945,11 @@ send:
 
 	/* Defer checksumming until later (ip_output() or hardware) */
 	m->m_pkthdr.csum_flags |= M_TCP_CSUM_OUT;
+	if (tso) {
+		m->m_pkthdr.ph_mss = tsomss;
+		m->m_pkthdr.csum_flags |= M_TCP_TSO;
+		tcpstat_inc(tcps_outpkttso);
+	}
 
 	/*
 	 * In transmit state, time the transmission and arrange for
@@ -1026,6 +1081,9 @@ send:
 	/* force routing table */
 	m->m_pkthdr.ph_rtableid = tp->t_inpcb->inp_rtableid;
 
+	/* path MTU discovery sees the size of the segments on the wire */
+	packetlen = tso ? hdrlen + tsomss : m->m_pkthdr.len;
+
 #if NPF > 0
 	pf_mbuf_link_inpcb(m, tp->t_inpcb);
 #endif
@@ -1038,7 +1096,6 @@ send:
 
 			ip = mtod(m, struct ip *);
 			ip->ip_len = htons(m->m_pkthdr.len);
-			packetlen = m->m_pkthdr.len;
 			ip->ip_ttl = tp->t_inpcb->inp_ip.ip_ttl;
 			ip->ip_tos = tp->t_inpcb->inp_ip.ip_tos;
 #ifdef TCP_ECN
@@ -1062,7 +1119,6 @@ send:
 			ip6 = mtod(m, struct ip6_hdr *);
 			ip6->ip6_plen = m->m_pkthdr.len -
 				sizeof(struct ip6_hdr);
-			packetlen = m->m_pkthdr.len;
 			ip6->ip6_nxt = IPPROTO_TCP;
 			ip6->ip6_hlim = in6_selecthlim(tp->t_inpcb);
 #ifdef TCP_ECN
@@ -1153,3 +1209,265 @@ tcp_setpersist(struct tcpcb *tp)
 	if (tp->t_rxtshift < TCP_MAXRXTSHIFT)
 		tp->t_rxtshift++;
 }
+
+/*
+ * Split a TSO packet into mss sized segments.  The IP and TCP headers
+ * are copied into every segment, then lengths, sequence numbers and
+ * flags are fixed up.  Checksums are computed in software unless the
+ * interface can do them.  On error all packets are freed.
+ */
+int
+tcp_chopper(struct mbuf *m0, struct mbuf_list *ml, struct ifnet *ifp,
+    u_int mss)
+{
+	struct ip *ip = NULL;
+#ifdef INET6
+	struct ip6_hdr *ip6 = NULL;
+#endif
+	struct tcphdr *th;
+	int firstlen, iphlen, hlen, tlen, off;
+	int error;
+
+	ml_init(ml);
+	ml_enqueue(ml, m0);
+
+	ip = mtod(m0, struct ip *);
+	switch (ip->ip_v) {
+	case 4:
+		iphlen = ip->ip_hl << 2;
+		if (ISSET(ip->ip_off, htons(IP_OFFMASK | IP_MF)) ||
+		    iphlen != sizeof(struct ip) || ip->ip_p != IPPROTO_TCP) {
+			/* only TCP without fragment or IP option supported */
+			error = EPROTOTYPE;
+			goto bad;
+		}
+		break;
+#ifdef INET6
+	case 6:
+		ip = NULL;
+		ip6 = mtod(m0, struct ip6_hdr *);
+		iphlen = sizeof(struct ip6_hdr);
+		if (ip6->ip6_nxt != IPPROTO_TCP) {
+			/* only TCP without IPv6 header chain supported */
+			error = EPROTOTYPE;
+			goto bad;
+		}
+		break;
+#endif
+	default:
+		panic("%s: unknown ip version %d", __func__, ip->ip_v);
+	}
+
+	tlen = m0->m_pkthdr.len;
+	if (tlen < iphlen + sizeof(struct tcphdr)) {
+		error = ENOPROTOOPT;
+		goto bad;
+	}
+	/* IP and TCP header should be contiguous, this check is paranoia */
+	if (m0->m_len < iphlen + sizeof(*th)) {
+		ml_dequeue(ml);
+		if ((m0 = m_pullup(m0, iphlen + sizeof(*th))) == NULL) {
+			error = ENOBUFS;
+			goto bad;
+		}
+		ml_enqueue(ml, m0);
+	}
+	th = (struct tcphdr *)(mtod(m0, caddr_t) + iphlen);
+	hlen = iphlen + (th->th_off << 2);
+	if (tlen < hlen) {
+		error = ENOPROTOOPT;
+		goto bad;
+	}
+	if (m0->m_len < hlen) {
+		ml_dequeue(ml);
+		if ((m0 = m_pullup(m0, hlen)) == NULL) {
+			error = ENOBUFS;
+			goto bad;
+		}
+		ml_enqueue(ml, m0);
+	}
+	/* m_pullup() may have moved the headers */
+	if (ip != NULL)
+		ip = mtod(m0, struct ip *);
+#ifdef INET6
+	if (ip6 != NULL)
+		ip6 = mtod(m0, struct ip6_hdr *);
+#endif
+	th = (struct tcphdr *)(mtod(m0, caddr_t) + iphlen);
+
+	/* the first segment stays in the original mbuf */
+	firstlen = MIN(tlen - hlen, mss);
+
+	CLR(m0->m_pkthdr.csum_flags, M_TCP_TSO);
+	for (off = hlen + firstlen; off < tlen; off += mss) {
+		struct mbuf *m;
+		struct tcphdr *mhth;
+		int len;
+
+		len = MIN(tlen - off, mss);
+
+		MGETHDR(m, M_DONTWAIT, MT_HEADER);
+		if (m == NULL) {
+			error = ENOBUFS;
+			goto bad;
+		}
+		ml_enqueue(ml, m);
+		if ((error = m_dup_pkthdr(m, m0, M_DONTWAIT)) != 0)
+			goto bad;
+
+		/* IP and TCP header, leave space for the link layer header */
+		if (max_linkhdr + hlen > MHLEN) {
+			MCLGET(m, M_DONTWAIT);
+			if (!ISSET(m->m_flags, M_EXT)) {
+				error = ENOBUFS;
+				goto bad;
+			}
+		}
+		m->m_data += max_linkhdr;
+		m->m_len = hlen;
+
+		/* copy and adjust TCP header */
+		mhth = (struct tcphdr *)(mtod(m, caddr_t) + iphlen);
+		memcpy(mhth, th, hlen - iphlen);
+		mhth->th_seq = htonl(ntohl(th->th_seq) + (off - hlen));
+		if (off + len < tlen)
+			CLR(mhth->th_flags, TH_PUSH|TH_FIN);
+		/* congestion window reduced is signaled only once */
+		CLR(mhth->th_flags, TH_CWR);
+
+		/* add mbuf chain with payload */
+		m->m_pkthdr.len = hlen + len;
+		if ((m->m_next = m_copym(m0, off, len, M_DONTWAIT)) == NULL) {
+			error = ENOBUFS;
+			goto bad;
+		}
+
+		/* copy and adjust IP header, calculate checksum */
+		SET(m->m_pkthdr.csum_flags, M_TCP_CSUM_OUT);
+		if (ip != NULL) {
+			struct ip *mhip;
+
+			mhip = mtod(m, struct ip *);
+			*mhip = *ip;
+			mhip->ip_len = htons(hlen + len);
+			mhip->ip_id = htons(ip_randomid());
+			in_hdr_cksum_out(m, ifp);
+			in_proto_cksum_out(m, ifp);
+		}
+#ifdef INET6
+		if (ip6 != NULL) {
+			struct ip6_hdr *mhip6;
+
+			mhip6 = mtod(m, struct ip6_hdr *);
+			*mhip6 = *ip6;
+			mhip6->ip6_plen = htons(hlen - iphlen + len);
+			in6_proto_cksum_out(m, ifp);
+		}
+#endif
+	}
+
+	/* adjust IP header, calculate checksum */
+	m_adj(m0, -(tlen - (hlen + firstlen)));
+	if (firstlen < tlen - hlen)
+		CLR(th->th_flags, TH_PUSH|TH_FIN);
+	SET(m0->m_pkthdr.csum_flags, M_TCP_CSUM_OUT);
+	if (ip != NULL) {
+		ip->ip_len = htons(m0->m_pkthdr.len);
+		in_hdr_cksum_out(m0, ifp);
+		in_proto_cksum_out(m0, ifp);
+	}
+#ifdef INET6
+	if (ip6 != NULL) {
+		ip6->ip6_plen = htons(m0->m_pkthdr.len - iphlen);
+		in6_proto_cksum_out(m0, ifp);
+	}
+#endif
+
+	return 0;
+ bad:
+	tcpstat_inc(tcps_outbadtso);
+	ml_purge(ml);
+	return error;
+}
+
+/*
+ * Send a TSO packet to the interface.  Hardware that can segment
+ * gets the packet as is, for all other interfaces tcp_chopper()
+ * splits it in software.  Packets without M_TCP_TSO are left to
+ * the caller in *mp, otherwise *mp is consumed.
+ */
+int
+tcp_if_output_tso(struct ifnet *ifp, struct mbuf **mp, struct sockaddr *dst,
+    struct rtentry *rt, uint32_t ifcap, u_int mtu)
+{
+	struct mbuf_list ml;
+	struct mbuf *m;
+	u_int hlen;
+	int error;
+
+	if (!ISSET((*mp)->m_pkthdr.csum_flags, M_TCP_TSO))
+		return 0;
+
+	/* each segment including its headers must fit into the mtu */
+	hlen = mtod(*mp, struct ip *)->ip_hl << 2;
+#ifdef INET6
+	if (ifcap == IFCAP_TSOv6)
+		hlen = sizeof(struct ip6_hdr);
+#endif
+	if ((*mp)->m_len >= hlen + sizeof(struct tcphdr))
+		hlen += ((struct tcphdr *)(mtod(*mp, caddr_t) + hlen))->th_off
+		    << 2;
+	else
+		hlen += sizeof(struct tcphdr) + MAX_TCPOPTLEN;
+	if (hlen + (*mp)->m_pkthdr.ph_mss > mtu) {
+		/* caller must fail later or fragment */
+		CLR((*mp)->m_pkthdr.csum_flags, M_TCP_TSO);
+		return 0;
+	}
+
+	/* network interface hardware will do TSO */
+	if (in_ifcap_cksum(*mp, ifp, ifcap)) {
+		switch (ifcap) {
+		case IFCAP_TSOv4:
+			if (!ISSET(ifp->if_capabilities, IFCAP_CSUM_TCPv4) ||
+			    mtod(*mp, struct ip *)->ip_hl != 5)
+				goto chop;
+			in_hdr_cksum_out(*mp, ifp);
+			in_proto_cksum_out(*mp, ifp);
+			break;
+#ifdef INET6
+		case IFCAP_TSOv6:
+			if (!ISSET(ifp->if_capabilities, IFCAP_CSUM_TCPv6) ||
+			    mtod(*mp, struct ip6_hdr *)->ip6_nxt !=
+			    IPPROTO_TCP)
+				goto chop;
+			in6_proto_cksum_out(*mp, ifp);
+			break;
+#endif
+		default:
+			goto chop;
+		}
+		error = ifp->if_output(ifp, *mp, dst, rt);
+		if (!error)
+			tcpstat_inc(tcps_outhwtso);
+		goto done;
+	}
+
+ chop:
+	/* as fallback do TSO in software */
+	error = tcp_chopper(*mp, &ml, ifp, (*mp)->m_pkthdr.ph_mss);
+	if (error)
+		goto done;
+	while ((m = ml_dequeue(&ml)) != NULL) {
+		error = ifp->if_output(ifp, m, dst, rt);
+		if (error)
+			break;
+	}
+	ml_purge(&ml);
+	if (!error)
+		tcpstat_inc(tcps_outswtso);
+
+ done:
+	*mp = NULL;
+	return error;
+}
@@ -78,6 +78,7 @@
 #include <sys/protosw.h>
 #include <sys/kernel.h>
 #include <sys/pool.h>
+#include <sys/sysctl.h>
 
 #include <net/route.h>
 
@@ -119,6 +120,7 @@ int	tcp_ack_on_push = 0;	/* set to enable immediate ACK-on-PUSH */
 int	tcp_do_ecn = 0;		/* RFC3168 ECN enabled/disabled? */
 #endif
 int	tcp_do_rfc3390 = 2;	/* Increase TCP's Initial Window to 10*mss */
+int	tcp_do_tso = 1;		/* TCP segmentation offload */
 
 #ifndef TCB_INITIAL_HASH_SIZE
 #define	TCB_INITIAL_HASH_SIZE	128
@@ -450,6 +452,7 @@ tcp_newtcpcb(struct inpcb *inp, int wait)
 	    TCPTV_MIN, TCPTV_REXMTMAX);
 	tp->snd_cwnd = TCP_MAXWIN << TCP_MAX_WINSHIFT;
 	tp->snd_ssthresh = TCP_MAXWIN << TCP_MAX_WINSHIFT;
+	tcp_cc_init(tp, tcp_cc_default);
 	
 	tp->t_pmtud_mtu_sent = 0;
 	tp->t_pmtud_mss_acked = 0;
@@ -948,6 +951,216 @@ tcp_set_iss_tsm(struct tcpcb *tp)
 	tp->ts_modulate = digest.words[1];
 }
 
+/*
+ * Congestion control.  NewReno is the traditional behaviour.  CUBIC
+ * (RFC 8312) grows the window as a cubic function of the time since
+ * the last congestion event, independent of the round trip time, so
+ * it keeps long fat networks busy.
+ */
+
+void	 tcp_newreno_ack(struct tcpcb *, u_long);
+u_long	 tcp_newreno_ssthresh(struct tcpcb *, int);
+void	 tcp_cubic_ack(struct tcpcb *, u_long);
+u_long	 tcp_cubic_ssthresh(struct tcpcb *, int);
+void	 tcp_cubic_idle(struct tcpcb *);
+
+const struct tcp_cc tcp_cc_newreno = {
+	.cc_name =	"newreno",
+	.cc_ack =	tcp_newreno_ack,
+	.cc_ssthresh =	tcp_newreno_ssthresh,
+};
+
+const struct tcp_cc tcp_cc_cubic = {
+	.cc_name =	"cubic",
+	.cc_ack =	tcp_cubic_ack,
+	.cc_ssthresh =	tcp_cubic_ssthresh,
+	.cc_idle =	tcp_cubic_idle,
+};
+
+const struct tcp_cc *const tcp_cc_algos[] = {
+	&tcp_cc_newreno,
+	&tcp_cc_cubic,
+};
+
+const struct tcp_cc *tcp_cc_default = &tcp_cc_newreno;
+
+const struct tcp_cc *
+tcp_cc_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nitems(tcp_cc_algos); i++) {
+		if (strcmp(tcp_cc_algos[i]->cc_name, name) == 0)
+			return (tcp_cc_algos[i]);
+	}
+
+	return (NULL);
+}
+
+void
+tcp_cc_init(struct tcpcb *tp, const struct tcp_cc *cc)
+{
+	tp->t_cc = cc;
+	memset(&tp->t_ccs, 0, sizeof(tp->t_ccs));
+	if (cc->cc_init != NULL)
+		(*cc->cc_init)(tp);
+}
+
+int
+tcp_cc_sysctl(void *oldp, size_t *oldlenp, void *newp, size_t newlen)
+{
+	char name[TCP_CA_NAME_MAX];
+	const struct tcp_cc *cc;
+	int error;
+
+	strlcpy(name, tcp_cc_default->cc_name, sizeof(name));
+	error = sysctl_tstring(oldp, oldlenp, newp, newlen, name, sizeof(name));
+	if (error || newp == NULL)
+		return (error);
+
+	if ((cc = tcp_cc_lookup(name)) == NULL)
+		return (EINVAL);
+	tcp_cc_default = cc;
+
+	return (0);
+}
+
+/*
+ * If the window gives us less than ssthresh packets in flight, open
+ * exponentially (maxseg per packet).  Otherwise open linearly: maxseg
+ * per window (maxseg^2 / cwnd per packet).
+ */
+void
+tcp_newreno_ack(struct tcpcb *tp, u_long acked)
+{
+	u_int cw = tp->snd_cwnd;
+	u_int incr = tp->t_maxseg;
+
+	if (cw > tp->snd_ssthresh)
+		incr = max(incr * incr / cw, 1);
+	tp->snd_cwnd = ulmin(cw + incr, TCP_MAXWIN << tp->snd_scale);
+}
+
+/*
+ * Use half the current window, truncated to a multiple of the mss.
+ * Loss recovery needs at least 2 mss to get exponential growth again.
+ */
+u_long
+tcp_newreno_ssthresh(struct tcpcb *tp, int event)
+{
+	u_long win;
+
+	win = ulmin(tp->snd_wnd, tp->snd_cwnd) / 2 / tp->t_maxseg;
+	if (event != TCP_CC_ECN && win < 2)
+		win = 2;
+
+	return (win * tp->t_maxseg);
+}
+
+#define CUBIC_BETA		717	/* window reduction, 0.7 * 1024 */
+#define CUBIC_BETA_SCALE	1024
+#define CUBIC_DMAX		(1 << 20) /* limit (t - K) to 17 minutes */
+
+/*
+ * Integer cube root, see Hacker's Delight.
+ */
+static uint32_t
+tcp_cubic_cbrt(uint64_t x)
+{
+	uint64_t y = 0, b;
+	int s;
+
+	for (s = 63; s >= 0; s -= 3) {
+		y += y;
+		b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			y++;
+		}
+	}
+
+	return (y);
+}
+
+void
+tcp_cubic_ack(struct tcpcb *tp, u_long acked)
+{
+	struct tcp_cubic *cu = &tp->t_ccs.cubic;
+	u_long cwnd = tp->snd_cwnd, mss = tp->t_maxseg;
+	int64_t d, w;
+	uint32_t now;
+
+	/* slow start does not differ from NewReno */
+	if (cwnd <= tp->snd_ssthresh) {
+		tp->snd_cwnd = ulmin(cwnd + mss, TCP_MAXWIN << tp->snd_scale);
+		return;
+	}
+
+	now = tcp_now();
+	if (cu->cu_epoch == 0) {
+		cu->cu_epoch = now ? now : 1;
+		if (cwnd < cu->cu_wmax) {
+			/* K = cbrt((wmax - cwnd) / C) with C = 0.4 */
+			cu->cu_k = tcp_cubic_cbrt((uint64_t)(cu->cu_wmax - cwnd) *
+			    2500000000ULL / mss);
+		} else {
+			cu->cu_k = 0;
+			cu->cu_wmax = cwnd;
+		}
+		cu->cu_west = cwnd;
+	}
+
+	/* W(t) = C * (t - K)^3 + wmax, looking one round trip ahead */
+	d = (int64_t)(now - cu->cu_epoch) +
+	    (tp->t_srtt >> (TCP_RTT_SHIFT + TCP_RTT_BASE_SHIFT)) - cu->cu_k;
+	if (d > CUBIC_DMAX)
+		d = CUBIC_DMAX;
+	else if (d < -CUBIC_DMAX)
+		d = -CUBIC_DMAX;
+	w = (int64_t)cu->cu_wmax + d * d * d / 10000000 * 4 * (int64_t)mss /
+	    1000;
+
+	/* stay at least as aggressive as NewReno would be */
+	cu->cu_west += (uint64_t)acked * mss *
+	    3 * (CUBIC_BETA_SCALE - CUBIC_BETA) /
+	    (CUBIC_BETA_SCALE + CUBIC_BETA) / cwnd;
+	if (w < (int64_t)cu->cu_west)
+		w = cu->cu_west;
+
+	if (w > (int64_t)cwnd) {
+		w = ulmin(w, cwnd + cwnd / 2);
+		cwnd += ulmax((uint64_t)(w - cwnd) * acked / cwnd, 1);
+		tp->snd_cwnd = ulmin(cwnd, TCP_MAXWIN << tp->snd_scale);
+	}
+}
+
+u_long
+tcp_cubic_ssthresh(struct tcpcb *tp, int event)
+{
+	struct tcp_cubic *cu = &tp->t_ccs.cubic;
+	u_long cwnd;
+
+	cwnd = ulmin(tp->snd_wnd, tp->snd_cwnd);
+
+	/* fast convergence, leave bandwidth to newer flows */
+	if (cwnd < cu->cu_wlastmax)
+		cu->cu_wmax = (uint64_t)cwnd *
+		    (CUBIC_BETA_SCALE + CUBIC_BETA) / (2 * CUBIC_BETA_SCALE);
+	else
+		cu->cu_wmax = cwnd;
+	cu->cu_wlastmax = cwnd;
+	cu->cu_epoch = 0;
+
+	return (ulmax((uint64_t)cwnd * CUBIC_BETA / CUBIC_BETA_SCALE,
+	    2 * tp->t_maxseg));
+}
+
+void
+tcp_cubic_idle(struct tcpcb *tp)
+{
+	tp->t_ccs.cubic.cu_epoch = 0;
+}
+
 #ifdef TCP_SIGNATURE
 int
 tcp_signature_tdb_attach(void)
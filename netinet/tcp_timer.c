@@ -359,19 +359,17 @@ tcp_timer_rexmt(void *arg)
 	 * drops but still "push" the network to take advantage
 	 * of improving conditions, we switch from exponential
 	 * to linear window opening at some threshold size.
-	 * For a threshold, we use half the current window
-	 * size, truncated to a multiple of the mss.
+	 * The congestion control algorithm picks the threshold,
+	 * NewReno uses half the current window size, truncated
+	 * to a multiple of the mss.
 	 *
 	 * (the minimum cwnd that will give us exponential
 	 * growth is 2 mss.  We don't allow the threshold
 	 * to go below this.)
 	 */
 	{
-		u_long win = ulmin(tp->snd_wnd, tp->snd_cwnd) / 2 / tp->t_maxseg;
-		if (win < 2)
-			win = 2;
+		tp->snd_ssthresh = (*tp->t_cc->cc_ssthresh)(tp, TCP_CC_RTO);
 		tp->snd_cwnd = tp->t_maxseg;
-		tp->snd_ssthresh = win * tp->t_maxseg;
 		tp->t_dupacks = 0;
 #ifdef TCP_ECN
 		tp->snd_last = tp->snd_max;
@@ -169,6 +169,7 @@ const struct sysctl_bounded_args tcpctl_vars[] = {
 	{ TCPCTL_SYN_BUCKET_LIMIT, &tcp_syn_bucket_limit, 1, INT_MAX },
 	{ TCPCTL_RFC3390, &tcp_do_rfc3390, 0, 2 },
 	{ TCPCTL_ALWAYS_KEEPALIVE, &tcp_always_keepalive, 0, 1 },
+	{ TCPCTL_TSO, &tcp_do_tso, 0, 1 },
 };
 
 struct	inpcbtable tcbtable;
@@ -391,6 +392,27 @@ tcp_ctloutput(int op, struct socket *so, int level, int optname,
 			else
 				tp->sack_enable = 0;
 			break;
+
+		case TCP_CONGESTION: {
+			char name[TCP_CA_NAME_MAX];
+			const struct tcp_cc *cc;
+
+			if (m == NULL || m->m_len == 0) {
+				error = EINVAL;
+				break;
+			}
+
+			i = min(m->m_len, sizeof(name) - 1);
+			memcpy(name, mtod(m, char *), i);
+			name[i] = '\0';
+			if ((cc = tcp_cc_lookup(name)) == NULL) {
+				error = ENOENT;
+				break;
+			}
+			if (cc != tp->t_cc)
+				tcp_cc_init(tp, cc);
+			break;
+		}
 #ifdef TCP_SIGNATURE
 		case TCP_MD5SIG:
 			if (m == NULL || m->m_len < sizeof (int)) {
@@ -437,6 +459,10 @@ tcp_ctloutput(int op, struct socket *so, int level, int optname,
 		case TCP_INFO:
 			error = tcp_fill_info(tp, so, m);
 			break;
+		case TCP_CONGESTION:
+			m->m_len = strlcpy(mtod(m, char *), tp->t_cc->cc_name,
+			    TCP_CA_NAME_MAX) + 1;
+			break;
 #ifdef TCP_SIGNATURE
 		case TCP_MD5SIG:
 			m->m_len = sizeof(int);
@@ -1233,8 +1259,9 @@ tcp_sysctl_tcpstat(void *oldp, size_t *oldlenp, void *newp)
 {
 	uint64_t counters[tcps_ncounters];
 	struct tcpstat tcpstat;
+	struct syn_cache_part *part;
 	struct syn_cache_set *set;
-	int i = 0;
+	int i = 0, j;
 
 #define ASSIGN(field)	do { tcpstat.field = counters[i++]; } while (0)
 
@@ -1338,22 +1365,37 @@ tcp_sysctl_tcpstat(void *oldp, size_t *oldlenp, void *newp)
 	ASSIGN(tcps_sack_rcv_opts);
 	ASSIGN(tcps_sack_snd_opts);
 	ASSIGN(tcps_sack_drop_opts);
+	ASSIGN(tcps_outpkttso);
+	ASSIGN(tcps_outbadtso);
+	ASSIGN(tcps_outswtso);
+	ASSIGN(tcps_outhwtso);
+	ASSIGN(tcps_inpktlro);
 
 #undef ASSIGN
 
-	set = &tcp_syn_cache[tcp_syn_cache_active];
-	tcpstat.tcps_sc_hash_size = set->scs_size;
-	tcpstat.tcps_sc_entry_count = set->scs_count;
+	tcpstat.tcps_sc_hash_size = 0;
+	tcpstat.tcps_sc_entry_count = 0;
 	tcpstat.tcps_sc_entry_limit = tcp_syn_cache_limit;
 	tcpstat.tcps_sc_bucket_maxlen = 0;
-	for (i = 0; i < set->scs_size; i++) {
-		if (tcpstat.tcps_sc_bucket_maxlen <
-		    set->scs_buckethead[i].sch_length)
-			tcpstat.tcps_sc_bucket_maxlen =
-				set->scs_buckethead[i].sch_length;
-	}
 	tcpstat.tcps_sc_bucket_limit = tcp_syn_bucket_limit;
-	tcpstat.tcps_sc_uses_left = set->scs_use;
+	tcpstat.tcps_sc_uses_left = tcp_syn_use_limit;
+	for (i = 0; i < tcp_syn_cache_nparts; i++) {
+		part = &tcp_syn_cache[i];
+		set = &part->scp_set[part->scp_active];
+		/* Hash size is per partition, as before the split. */
+		if (tcpstat.tcps_sc_hash_size < set->scs_size)
+			tcpstat.tcps_sc_hash_size = set->scs_size;
+		tcpstat.tcps_sc_entry_count += set->scs_count;
+		for (j = 0; j < set->scs_size; j++) {
+			if (tcpstat.tcps_sc_bucket_maxlen <
+			    set->scs_buckethead[j].sch_length)
+				tcpstat.tcps_sc_bucket_maxlen =
+					set->scs_buckethead[j].sch_length;
+		}
+		/* Report the partition that reseeds next. */
+		if (tcpstat.tcps_sc_uses_left > set->scs_use)
+			tcpstat.tcps_sc_uses_left = set->scs_use;
+	}
 
 	return (sysctl_rdstruct(oldp, oldlenp, newp,
 	    &tcpstat, sizeof(tcpstat)));
@@ -1366,7 +1408,8 @@ int
 tcp_sysctl(int *name, u_int namelen, void *oldp, size_t *oldlenp, void *newp,
     size_t newlen)
 {
-	int error, nval;
+	struct syn_cache_set *set;
+	int error, nval, i;
 
 	/* All sysctl names at this level are terminal. */
 	if (namelen != 1)
@@ -1428,6 +1471,12 @@ tcp_sysctl(int *name, u_int namelen, void *oldp, size_t *oldlenp, void *newp,
 	case TCPCTL_STATS:
 		return (tcp_sysctl_tcpstat(oldp, oldlenp, newp));
 
+	case TCPCTL_CONGCTL:
+		NET_LOCK();
+		error = tcp_cc_sysctl(oldp, oldlenp, newp, newlen);
+		NET_UNLOCK();
+		return (error);
+
 	case TCPCTL_SYN_USE_LIMIT:
 		NET_LOCK();
 		error = sysctl_int_bounded(oldp, oldlenp, newp, newlen,
@@ -1437,10 +1486,13 @@ tcp_sysctl(int *name, u_int namelen, void *oldp, size_t *oldlenp, void *newp,
 			 * Global tcp_syn_use_limit is used when reseeding a
 			 * new cache.  Also update the value in active cache.
 			 */
-			if (tcp_syn_cache[0].scs_use > tcp_syn_use_limit)
-				tcp_syn_cache[0].scs_use = tcp_syn_use_limit;
-			if (tcp_syn_cache[1].scs_use > tcp_syn_use_limit)
-				tcp_syn_cache[1].scs_use = tcp_syn_use_limit;
+			for (i = 0; i < tcp_syn_cache_nparts; i++) {
+				set = tcp_syn_cache[i].scp_set;
+				if (set[0].scs_use > tcp_syn_use_limit)
+					set[0].scs_use = tcp_syn_use_limit;
+				if (set[1].scs_use > tcp_syn_use_limit)
+					set[1].scs_use = tcp_syn_use_limit;
+			}
 		}
 		NET_UNLOCK();
 		return (error);
@@ -1456,10 +1508,13 @@ tcp_sysctl(int *name, u_int namelen, void *oldp, size_t *oldlenp, void *newp,
 			 * switch sets as soon as possible.  Then
 			 * the actual hash array will be reallocated.
 			 */
-			if (tcp_syn_cache[0].scs_size != nval)
-				tcp_syn_cache[0].scs_use = 0;
-			if (tcp_syn_cache[1].scs_size != nval)
-				tcp_syn_cache[1].scs_use = 0;
+			for (i = 0; i < tcp_syn_cache_nparts; i++) {
+				set = tcp_syn_cache[i].scp_set;
+				if (set[0].scs_size != nval)
+					set[0].scs_use = 0;
+				if (set[1].scs_size != nval)
+					set[1].scs_use = 0;
+			}
 			tcp_syn_hash_size = nval;
 		}
 		NET_UNLOCK();
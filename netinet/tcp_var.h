@@ -64,6 +64,17 @@ struct tcpqent {
 	struct mbuf	*tcpqe_m;	/* mbuf contains packet */
 };
 
+/*
+ * Per connection state of the CUBIC congestion control algorithm.
+ */
+struct tcp_cubic {
+	u_long		cu_wmax;	/* window before the last reduction */
+	u_long		cu_wlastmax;	/* previous value of cu_wmax */
+	u_long		cu_west;	/* estimate of the NewReno window */
+	uint32_t	cu_epoch;	/* start of avoidance epoch, msec */
+	uint32_t	cu_k;		/* time to grow back to cu_wmax, msec */
+};
+
 /*
  * Tcp control block, one per tcp; fields:
  */
@@ -148,6 +159,10 @@ struct tcpcb {
 					 * for slow start exponential to
 					 * linear switch
 					 */
+	const struct tcp_cc *t_cc;	/* congestion control algorithm */
+	union {
+		struct tcp_cubic cubic;
+	} t_ccs;			/* congestion control state */
 
 /* auto-sizing variables */
 	u_int	rfbuf_cnt;	/* recv buffer autoscaling byte count */
@@ -211,6 +226,23 @@ struct tcpcb {
 #define	sototcpcb(so)	(intotcpcb(sotoinpcb(so)))
 
 #ifdef _KERNEL
+/*
+ * Congestion control algorithm.  cc_ssthresh is called when loss or
+ * congestion is detected and returns the new slow start threshold,
+ * cc_ack opens the window when new data is acked outside of recovery.
+ */
+struct tcp_cc {
+	const char	*cc_name;
+	void		(*cc_init)(struct tcpcb *);
+	void		(*cc_ack)(struct tcpcb *, u_long);
+	u_long		(*cc_ssthresh)(struct tcpcb *, int);
+	void		(*cc_idle)(struct tcpcb *);
+};
+
+#define	TCP_CC_DUPACK	1	/* fast retransmit after duplicate acks */
+#define	TCP_CC_ECN	2	/* ECN echo received */
+#define	TCP_CC_RTO	3	/* retransmit timeout */
+
 /*
  * Handy way of passing around TCP option info.
  */
@@ -227,6 +259,7 @@ struct tcp_opt_info {
 
 #define	TCP_SYN_HASH_SIZE	293
 #define	TCP_SYN_BUCKET_SIZE	35
+#define	TCP_SYN_MAXPARTS	32	/* at most one partition per cpu */
 
 union syn_cache_sa {
 	struct sockaddr sa;
@@ -236,7 +269,7 @@ union syn_cache_sa {
 
 struct syn_cache {
 	TAILQ_ENTRY(syn_cache) sc_bucketq;	/* link on bucket list */
-	struct timeout sc_timer;		/* rexmt timer */
+	TAILQ_ENTRY(syn_cache) sc_rxtq;		/* link on rexmt queue */
 	union {					/* cached route */
 		struct route route4;
 #ifdef INET6
@@ -250,6 +283,7 @@ struct syn_cache {
 	long sc_win;				/* advertised window */
 	struct syn_cache_head *sc_buckethead;	/* our bucket index */
 	struct syn_cache_set *sc_set;		/* our syn cache set */
+	struct syn_cache_part *sc_part;		/* our syn cache partition */
 	u_int32_t sc_hash;
 	u_int32_t sc_timestamp;			/* timestamp from SYN */
 	u_int32_t sc_modulate;			/* our timestamp modulator */
@@ -262,13 +296,13 @@ struct syn_cache {
 	tcp_seq sc_iss;
 	u_int sc_rtableid;
 	u_int sc_rxtcur;			/* current rxt timeout */
+	u_int32_t sc_rxtexpire;			/* when rxt timeout expires */
 	u_int sc_rxttot;			/* total time spend on queues */
 	u_short sc_rxtshift;			/* for computing backoff */
 	u_short sc_flags;
 
 #define	SCF_UNREACH		0x0001		/* we've had an unreach error */
 #define	SCF_TIMESTAMP		0x0002		/* peer will do timestamps */
-#define	SCF_DEAD		0x0004		/* this entry to be released */
 #define	SCF_SACK_PERMIT		0x0008		/* permit sack */
 #define	SCF_ECN_PERMIT		0x0010		/* permit ecn */
 #define	SCF_SIGNATURE		0x0020		/* enforce tcp signatures */
@@ -296,6 +330,20 @@ struct syn_cache_set {
 	u_int32_t	scs_random[5];
 };
 
+/*
+ * The syn cache is split into partitions by a hash over addresses and
+ * ports.  Each partition rotates its own pair of sets and retransmits
+ * all its entries from one timeout.  Entries on the same rexmt queue
+ * have the same backoff, so every queue is sorted by expiry.
+ */
+struct syn_cache_part {
+	struct		syn_cache_set scp_set[2];
+	int		scp_active;		/* active set, 0 or 1 */
+	struct		timeout scp_timer;	/* rexmt timer */
+	u_int32_t	scp_expire;		/* when scp_timer fires */
+	TAILQ_HEAD(, syn_cache) scp_rxtq[TCP_MAXRXTSHIFT + 1];
+};
+
 #endif /* _KERNEL */
 
 /*
@@ -442,6 +490,12 @@ struct	tcpstat {
 	u_int64_t tcps_sack_rcv_opts;		/* SACK options received */
 	u_int64_t tcps_sack_snd_opts;		/* SACK options sent */
 	u_int64_t tcps_sack_drop_opts;		/* SACK options dropped */
+
+	u_int64_t tcps_outpkttso;	/* packets sent with TSO */
+	u_int64_t tcps_outbadtso;	/* TSO packets dropped by driver */
+	u_int64_t tcps_outswtso;	/* TSO packets chopped in software */
+	u_int64_t tcps_outhwtso;	/* TSO packets handed to hardware */
+	u_int64_t tcps_inpktlro;	/* packets merged by LRO */
 };
 
 /*
@@ -473,7 +527,9 @@ struct	tcpstat {
 #define	TCPCTL_SYN_USE_LIMIT   23 /* number of uses before reseeding hash */
 #define TCPCTL_ROOTONLY	       24 /* return root only port bitmap */
 #define	TCPCTL_SYN_HASH_SIZE   25 /* number of buckets in the hash */
-#define	TCPCTL_MAXID	       26
+#define	TCPCTL_TSO	       26 /* enable TCP segmentation offload */
+#define	TCPCTL_CONGCTL	       27 /* default congestion control */
+#define	TCPCTL_MAXID	       28
 
 #define	TCPCTL_NAMES { \
 	{ 0, 0 }, \
@@ -502,6 +558,8 @@ struct	tcpstat {
 	{ "synuselimit", 	CTLTYPE_INT }, \
 	{ "rootonly", CTLTYPE_STRUCT }, \
 	{ "synhashsize", 	CTLTYPE_INT }, \
+	{ "tso",	CTLTYPE_INT }, \
+	{ "congctl",	CTLTYPE_STRING }, \
 }
 
 struct tcp_ident_mapping {
@@ -614,6 +672,11 @@ enum tcpstat_counters {
 	tcps_sack_rcv_opts,
 	tcps_sack_snd_opts,
 	tcps_sack_drop_opts,
+	tcps_outpkttso,
+	tcps_outbadtso,
+	tcps_outswtso,
+	tcps_outhwtso,
+	tcps_inpktlro,
 	tcps_ncounters,
 };
 
@@ -666,6 +729,8 @@ extern	struct pool sackhl_pool;
 extern	int tcp_sackhole_limit;	/* max entries for tcp sack queues */
 extern	int tcp_do_ecn;		/* RFC3168 ECN enabled/disabled? */
 extern	int tcp_do_rfc3390;	/* RFC3390 Increasing TCP's Initial Window */
+extern	int tcp_do_tso;		/* enable TSO for TCP output packets */
+extern	const struct tcp_cc *tcp_cc_default; /* for new connections */
 
 extern	struct pool tcpqe_pool;
 extern	int tcp_reass_limit;	/* max entries for tcp reass queues */
@@ -674,10 +739,14 @@ extern	int tcp_syn_hash_size;  /* adjustable size of the hash array */
 extern	int tcp_syn_cache_limit; /* max entries for compressed state engine */
 extern	int tcp_syn_bucket_limit;/* max entries per hash bucket */
 extern	int tcp_syn_use_limit;   /* number of uses before reseeding hash */
-extern	struct syn_cache_set tcp_syn_cache[];
-extern	int tcp_syn_cache_active; /* active syn cache, may be 0 or 1 */
+extern	struct syn_cache_part *tcp_syn_cache;
+extern	int tcp_syn_cache_nparts; /* number of syn cache partitions */
 
 void	 tcp_canceltimers(struct tcpcb *);
+const struct tcp_cc *
+	 tcp_cc_lookup(const char *);
+void	 tcp_cc_init(struct tcpcb *, const struct tcp_cc *);
+int	 tcp_cc_sysctl(void *, size_t *, void *, size_t);
 struct tcpcb *
 	 tcp_close(struct tcpcb *);
 int	 tcp_freeq(struct tcpcb *);
@@ -707,6 +776,9 @@ struct tcpcb *
 	 tcp_newtcpcb(struct inpcb *, int);
 void	 tcp_notify(struct inpcb *, int);
 int	 tcp_output(struct tcpcb *);
+int	 tcp_chopper(struct mbuf *, struct mbuf_list *, struct ifnet *, u_int);
+int	 tcp_if_output_tso(struct ifnet *, struct mbuf **, struct sockaddr *,
+	    struct rtentry *, uint32_t, u_int);
 void	 tcp_pulloutofband(struct socket *, u_int, struct mbuf *, int);
 int	 tcp_reass(struct tcpcb *, struct tcphdr *, struct mbuf *, int *);
 void	 tcp_rscale(struct tcpcb *, u_long);
@@ -716,6 +788,7 @@ void	 tcp_setpersist(struct tcpcb *);
 void	 tcp_update_sndspace(struct tcpcb *);
 void	 tcp_update_rcvspace(struct tcpcb *);
 void	 tcp_slowtimo(void);
+u_int	 tcp_softlro(struct mbuf_list *);
 struct mbuf *
 	 tcp_template(struct tcpcb *);
 #ifndef SMALL_KERNEL
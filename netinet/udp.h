@@ -46,4 +46,9 @@ struct udphdr {
 	u_int16_t uh_sum;		/* udp checksum */
 };
 
+/*
+ * User-settable options (used with setsockopt).
+ */
+#define	UDP_SEGMENT	1	/* int; size of datagrams to send */
+
 #endif /* _NETINET_UDP_H_ */
@@ -163,6 +163,22 @@ const struct sysctl_bounded_args udpctl_vars[] = {
 struct	inpcbtable udbtable;
 struct	cpumem *udpcounters;
 
+/*
+ * While ipintr() and ip6intr() drain their queues, datagrams are
+ * appended to the socket buffers right away but the receivers are
+ * only woken up once per batch by udp_wakeup_flush().  Both run with
+ * the exclusive net lock, which also keeps the sockets from going away.
+ */
+#define UDP_WAKEUP_MAX	16
+
+struct udp_wakeups {
+	struct inpcb	*uw_inp[UDP_WAKEUP_MAX];
+	unsigned int	 uw_count;
+	int		 uw_defer;
+} udp_wakeups;
+
+void	udp_wakeup(struct inpcb *);
+
 void	udp_sbappend(struct inpcb *, struct mbuf *, struct ip *,
 	    struct ip6_hdr *, int, struct udphdr *, struct sockaddr *,
 	    u_int32_t);
@@ -688,7 +704,59 @@ udp_sbappend(struct inpcb *inp, struct mbuf *m, struct ip *ip,
 	}
 	mtx_leave(&inp->inp_mtx);
 
-	sorwakeup(so);
+	udp_wakeup(inp);
+}
+
+void
+udp_wakeup_defer(void)
+{
+	NET_ASSERT_LOCKED_EXCLUSIVE();
+
+	udp_wakeups.uw_defer = 1;
+}
+
+void
+udp_wakeup(struct inpcb *inp)
+{
+	struct udp_wakeups *uw = &udp_wakeups;
+	unsigned int i;
+
+	if (!uw->uw_defer || rw_status(&netlock) != RW_WRITE) {
+		sorwakeup(inp->inp_socket);
+		return;
+	}
+
+	for (i = 0; i < uw->uw_count; i++) {
+		if (uw->uw_inp[i] == inp)
+			return;
+	}
+	if (uw->uw_count == nitems(uw->uw_inp)) {
+		/* wake the oldest receiver early to make room */
+		sorwakeup(uw->uw_inp[0]->inp_socket);
+		in_pcbunref(uw->uw_inp[0]);
+		memmove(&uw->uw_inp[0], &uw->uw_inp[1],
+		    (uw->uw_count - 1) * sizeof(uw->uw_inp[0]));
+		uw->uw_count--;
+	}
+	uw->uw_inp[uw->uw_count++] = in_pcbref(inp);
+}
+
+void
+udp_wakeup_flush(void)
+{
+	struct udp_wakeups *uw = &udp_wakeups;
+	struct inpcb *inp;
+	unsigned int i;
+
+	NET_ASSERT_LOCKED_EXCLUSIVE();
+
+	for (i = 0; i < uw->uw_count; i++) {
+		inp = uw->uw_inp[i];
+		sorwakeup(inp->inp_socket);
+		in_pcbunref(inp);
+	}
+	uw->uw_count = 0;
+	uw->uw_defer = 0;
 }
 
 /*
@@ -930,6 +998,11 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct mbuf *addr,
 		error = EMSGSIZE;
 		goto release;
 	}
+	if (inp->inp_udpgso != 0 &&
+	    howmany(len, inp->inp_udpgso) > UDP_GSO_MAXSEGS) {
+		error = EMSGSIZE;
+		goto release;
+	}
 
 	memset(&src_sin, 0, sizeof(src_sin));
 
@@ -1024,6 +1097,13 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct mbuf *addr,
 		laddr = inp->inp_laddr;
 	}
 
+	/* multicast loopback would deliver the unsegmented datagram */
+	if (inp->inp_udpgso != 0 && len > inp->inp_udpgso &&
+	    IN_MULTICAST(sin ? sin->sin_addr.s_addr : inp->inp_faddr.s_addr)) {
+		error = EOPNOTSUPP;
+		goto release;
+	}
+
 	/*
 	 * Calculate data length and get a mbuf
 	 * for UDP and IP headers.
@@ -1052,6 +1132,11 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct mbuf *addr,
 	((struct ip *)ui)->ip_tos = inp->inp_ip.ip_tos;
 	if (udpcksum)
 		m->m_pkthdr.csum_flags |= M_UDP_CSUM_OUT;
+	if (inp->inp_udpgso != 0 && len > inp->inp_udpgso) {
+		/* segmented after the route and pf decisions */
+		m->m_flags |= M_UDP_GSO;
+		m->m_pkthdr.ph_mss = inp->inp_udpgso;
+	}
 
 	udpstat_inc(udps_opackets);
 
@@ -1076,6 +1161,278 @@ release:
 	goto bail;
 }
 
+/*
+ * Split a UDP GSO packet into datagrams with segsz bytes of payload,
+ * the last one may be shorter.  The IP and UDP headers are copied into
+ * every datagram, then lengths are fixed up.  Checksums are computed
+ * in software unless the interface can do them.  On error all packets
+ * are freed.
+ */
+int
+udp_chopper(struct mbuf *m0, struct mbuf_list *ml, struct ifnet *ifp,
+    u_int segsz)
+{
+	struct ip *ip = NULL;
+#ifdef INET6
+	struct ip6_hdr *ip6 = NULL;
+#endif
+	struct udphdr *uh;
+	int firstlen, iphlen, hlen, tlen, off;
+	int error;
+
+	ml_init(ml);
+	ml_enqueue(ml, m0);
+
+	ip = mtod(m0, struct ip *);
+	switch (ip->ip_v) {
+	case 4:
+		iphlen = ip->ip_hl << 2;
+		if (ISSET(ip->ip_off, htons(IP_OFFMASK | IP_MF)) ||
+		    ip->ip_p != IPPROTO_UDP) {
+			error = EPROTOTYPE;
+			goto bad;
+		}
+		break;
+#ifdef INET6
+	case 6:
+		ip = NULL;
+		ip6 = mtod(m0, struct ip6_hdr *);
+		iphlen = sizeof(struct ip6_hdr);
+		if (ip6->ip6_nxt != IPPROTO_UDP) {
+			/* only UDP without IPv6 header chain supported */
+			error = EPROTOTYPE;
+			goto bad;
+		}
+		break;
+#endif
+	default:
+		panic("%s: unknown ip version %d", __func__, ip->ip_v);
+	}
+
+	tlen = m0->m_pkthdr.len;
+	hlen = iphlen + sizeof(struct udphdr);
+	if (tlen < hlen || segsz == 0) {
+		error = ENOPROTOOPT;
+		goto bad;
+	}
+	if (m0->m_len < hlen) {
+		ml_dequeue(ml);
+		if ((m0 = m_pullup(m0, hlen)) == NULL) {
+			error = ENOBUFS;
+			goto bad;
+		}
+		ml_enqueue(ml, m0);
+	}
+	/* m_pullup() may have moved the headers */
+	if (ip != NULL)
+		ip = mtod(m0, struct ip *);
+#ifdef INET6
+	if (ip6 != NULL)
+		ip6 = mtod(m0, struct ip6_hdr *);
+#endif
+	uh = (struct udphdr *)(mtod(m0, caddr_t) + iphlen);
+
+	/* the first datagram stays in the original mbuf */
+	firstlen = MIN(tlen - hlen, segsz);
+
+	CLR(m0->m_flags, M_UDP_GSO);
+	for (off = hlen + firstlen; off < tlen; off += segsz) {
+		struct mbuf *m;
+		struct udphdr *mhuh;
+		int len;
+
+		len = MIN(tlen - off, segsz);
+
+		MGETHDR(m, M_DONTWAIT, MT_HEADER);
+		if (m == NULL) {
+			error = ENOBUFS;
+			goto bad;
+		}
+		ml_enqueue(ml, m);
+		if ((error = m_dup_pkthdr(m, m0, M_DONTWAIT)) != 0)
+			goto bad;
+
+		/* IP and UDP header, leave space for the link layer header */
+		if (max_linkhdr + hlen > MHLEN) {
+			MCLGET(m, M_DONTWAIT);
+			if (!ISSET(m->m_flags, M_EXT)) {
+				error = ENOBUFS;
+				goto bad;
+			}
+		}
+		m->m_data += max_linkhdr;
+		m->m_len = hlen;
+		memcpy(mtod(m, caddr_t), mtod(m0, caddr_t), hlen);
+
+		mhuh = (struct udphdr *)(mtod(m, caddr_t) + iphlen);
+		mhuh->uh_ulen = htons(sizeof(struct udphdr) + len);
+
+		/* add mbuf chain with payload */
+		m->m_pkthdr.len = hlen + len;
+		if ((m->m_next = m_copym(m0, off, len, M_DONTWAIT)) == NULL) {
+			error = ENOBUFS;
+			goto bad;
+		}
+
+		/* adjust IP header, calculate checksum */
+		if (ip != NULL) {
+			struct ip *mhip;
+
+			mhip = mtod(m, struct ip *);
+			mhip->ip_len = htons(hlen + len);
+			mhip->ip_id = htons(ip_randomid());
+			in_hdr_cksum_out(m, ifp);
+			in_proto_cksum_out(m, ifp);
+		}
+#ifdef INET6
+		if (ip6 != NULL) {
+			struct ip6_hdr *mhip6;
+
+			mhip6 = mtod(m, struct ip6_hdr *);
+			mhip6->ip6_plen = htons(hlen - iphlen + len);
+			in6_proto_cksum_out(m, ifp);
+		}
+#endif
+	}
+
+	/* adjust IP header, calculate checksum */
+	m_adj(m0, -(tlen - (hlen + firstlen)));
+	uh->uh_ulen = htons(sizeof(struct udphdr) + firstlen);
+	if (ip != NULL) {
+		ip->ip_len = htons(m0->m_pkthdr.len);
+		in_hdr_cksum_out(m0, ifp);
+		in_proto_cksum_out(m0, ifp);
+	}
+#ifdef INET6
+	if (ip6 != NULL) {
+		ip6->ip6_plen = htons(m0->m_pkthdr.len - iphlen);
+		in6_proto_cksum_out(m0, ifp);
+	}
+#endif
+
+	return 0;
+ bad:
+	udpstat_inc(udps_outbadgso);
+	ml_purge(ml);
+	return error;
+}
+
+/*
+ * Send a UDP GSO packet to the interface.  No driver can segment UDP,
+ * udp_chopper() splits it in software.  Packets without M_UDP_GSO are
+ * left to the caller in *mp, otherwise *mp is consumed.
+ */
+int
+udp_if_output_gso(struct ifnet *ifp, struct mbuf **mp, struct sockaddr *dst,
+    struct rtentry *rt, u_int mtu)
+{
+	struct mbuf_list ml;
+	struct mbuf *m;
+	u_int hlen;
+	int error;
+
+	if (!ISSET((*mp)->m_flags, M_UDP_GSO))
+		return 0;
+
+	/*
+	 * Each datagram including its headers must fit into the mtu.
+	 * Fragmenting the super packet would deliver a single datagram
+	 * to the peer, so refuse to send it at all.
+	 */
+	hlen = mtod(*mp, struct ip *)->ip_hl << 2;
+#ifdef INET6
+	if (mtod(*mp, struct ip *)->ip_v == 6)
+		hlen = sizeof(struct ip6_hdr);
+#endif
+	hlen += sizeof(struct udphdr);
+	if (hlen + (*mp)->m_pkthdr.ph_mss > mtu) {
+		udpstat_inc(udps_outbadgso);
+		error = EMSGSIZE;
+		m_freem(*mp);
+		goto done;
+	}
+
+	error = udp_chopper(*mp, &ml, ifp, (*mp)->m_pkthdr.ph_mss);
+	if (error)
+		goto done;
+	while ((m = ml_dequeue(&ml)) != NULL) {
+		error = ifp->if_output(ifp, m, dst, rt);
+		if (error)
+			break;
+	}
+	ml_purge(&ml);
+	if (!error)
+		udpstat_inc(udps_outswgso);
+
+ done:
+	*mp = NULL;
+	return error;
+}
+
+int
+udp_ctloutput(int op, struct socket *so, int level, int optname,
+    struct mbuf *m)
+{
+	struct inpcb *inp;
+	int error = 0;
+	int i;
+
+	inp = sotoinpcb(so);
+	if (inp == NULL)
+		return (ECONNRESET);
+	if (level != IPPROTO_UDP) {
+		switch (so->so_proto->pr_domain->dom_family) {
+#ifdef INET6
+		case PF_INET6:
+			error = ip6_ctloutput(op, so, level, optname, m);
+			break;
+#endif /* INET6 */
+		case PF_INET:
+			error = ip_ctloutput(op, so, level, optname, m);
+			break;
+		default:
+			error = EAFNOSUPPORT;	/*?*/
+			break;
+		}
+		return (error);
+	}
+
+	switch (op) {
+	case PRCO_SETOPT:
+		switch (optname) {
+		case UDP_SEGMENT:
+			if (m == NULL || m->m_len < sizeof (int)) {
+				error = EINVAL;
+				break;
+			}
+			i = *mtod(m, int *);
+			if (i < 0 || i > IP_MAXPACKET) {
+				error = EINVAL;
+				break;
+			}
+			inp->inp_udpgso = i;
+			break;
+		default:
+			error = ENOPROTOOPT;
+			break;
+		}
+		break;
+
+	case PRCO_GETOPT:
+		switch (optname) {
+		case UDP_SEGMENT:
+			m->m_len = sizeof(int);
+			*mtod(m, int *) = inp->inp_udpgso;
+			break;
+		default:
+			error = ENOPROTOOPT;
+			break;
+		}
+		break;
+	}
+	return (error);
+}
+
 int
 udp_attach(struct socket *so, int proto, int wait)
 {
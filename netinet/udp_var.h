@@ -68,6 +68,8 @@ struct	udpstat {
 				/* output statistics: */
 	u_long	udps_opackets;		/* total output packets */
 	u_long	udps_outswcsum;		/* output software-csummed packets */
+	u_long	udps_outbadgso;		/* GSO packets dropped */
+	u_long	udps_outswgso;		/* GSO packets split in software */
 };
 
 /*
@@ -111,12 +113,16 @@ enum udpstat_counters {
 			/* output statistics: */
 	udps_opackets,		/* total output packets */
 	udps_outswcsum,		/* output software-csummed packets */
+	udps_outbadgso,		/* GSO packets dropped */
+	udps_outswgso,		/* GSO packets split in software */
 
 	udps_ncounters
 };
 
 extern struct cpumem *udpcounters;
 
+#define	UDP_GSO_MAXSEGS	64	/* datagrams per UDP_SEGMENT send */
+
 static inline void
 udpstat_inc(enum udpstat_counters c)
 {
@@ -137,7 +143,13 @@ void	udp6_ctlinput(int, struct sockaddr *, u_int, void *);
 #endif /* INET6 */
 void	 udp_ctlinput(int, struct sockaddr *, u_int, void *);
 void	 udp_init(void);
+int	 udp_ctloutput(int, struct socket *, int, int, struct mbuf *);
+int	 udp_chopper(struct mbuf *, struct mbuf_list *, struct ifnet *, u_int);
+int	 udp_if_output_gso(struct ifnet *, struct mbuf **, struct sockaddr *,
+	    struct rtentry *, u_int);
 int	 udp_input(struct mbuf **, int *, int, int);
+void	 udp_wakeup_defer(void);
+void	 udp_wakeup_flush(void);
 #ifdef INET6
 int	 udp6_output(struct inpcb *, struct mbuf *, struct mbuf *,
 	struct mbuf *);
@@ -178,28 +178,15 @@ skip_phdr:
 		byte_swapped = 1;
 	}
 	/*
-	 * Unroll the loop to make overhead from
-	 * branches &c small.
+	 * Sum the whole words, mlen ends up as -1 if
+	 * an odd byte is left over.
 	 */
-	while ((mlen -= 32) >= 0) {
-		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-		sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-		sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
-		sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-		w += 16;
-	}
-	mlen += 32;
-	while ((mlen -= 8) >= 0) {
-		sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-		w += 4;
-	}
-	mlen += 8;
-	if (mlen == 0 && byte_swapped == 0)
+	sum += in_cksum_words(w, mlen >> 1);
+	w += mlen >> 1;
+	mlen = (mlen & 1) ? -1 : -2;
+	if (mlen == -2 && byte_swapped == 0)
 		goto next;
 	REDUCE;
-	while ((mlen -= 2) >= 0) {
-		sum += *w++;
-	}
 	if (byte_swapped) {
 		REDUCE;
 		sum <<= 8;
@@ -254,28 +241,15 @@ skip_phdr:
 			byte_swapped = 1;
 		}
 		/*
-		 * Unroll the loop to make overhead from
-		 * branches &c small.
+		 * Sum the whole words, mlen ends up as -1 if
+		 * an odd byte is left over.
 		 */
-		while ((mlen -= 32) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
-			sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
-			sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
-			w += 16;
-		}
-		mlen += 32;
-		while ((mlen -= 8) >= 0) {
-			sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
-			w += 4;
-		}
-		mlen += 8;
-		if (mlen == 0 && byte_swapped == 0)
+		sum += in_cksum_words(w, mlen >> 1);
+		w += mlen >> 1;
+		mlen = (mlen & 1) ? -1 : -2;
+		if (mlen == -2 && byte_swapped == 0)
 			continue;
 		REDUCE;
-		while ((mlen -= 2) >= 0) {
-			sum += *w++;
-		}
 		if (byte_swapped) {
 			REDUCE;
 			sum <<= 8;
@@ -126,25 +126,27 @@
 
 const struct in6_addr zeroin6_addr;
 
+struct inpcb *in6_pcbhash_find(struct inpcbtable *, u_int,
+    const struct in6_addr *, u_short, const struct in6_addr *, u_short);
 struct inpcb *in6_pcbhash_lookup(struct inpcbtable *, u_int,
     const struct in6_addr *, u_short, const struct in6_addr *, u_short);
 
-struct inpcbhead *
-in6_pcbhash(struct inpcbtable *table, u_int rdomain,
+struct inpcbhashhead *
+in6_pcbhash(struct inpcbhash *ih, u_int rdomain,
     const struct in6_addr *faddr, u_short fport,
     const struct in6_addr *laddr, u_short lport)
 {
 	SIPHASH_CTX ctx;
 	u_int32_t nrdom = htonl(rdomain);
 
-	SipHash24_Init(&ctx, &table->inpt_key);
+	SipHash24_Init(&ctx, &ih->ih_key);
 	SipHash24_Update(&ctx, &nrdom, sizeof(nrdom));
 	SipHash24_Update(&ctx, faddr, sizeof(*faddr));
 	SipHash24_Update(&ctx, &fport, sizeof(fport));
 	SipHash24_Update(&ctx, laddr, sizeof(*laddr));
 	SipHash24_Update(&ctx, &lport, sizeof(lport));
 
-	return (&table->inpt_hashtbl[SipHash24_End(&ctx) & table->inpt_mask]);
+	return (&ih->ih_heads[SipHash24_End(&ctx) & ih->ih_mask]);
 }
 
 int
@@ -541,18 +543,17 @@ in6_pcbnotify(struct inpcbtable *table, struct sockaddr_in6 *dst,
 }
 
 struct inpcb *
-in6_pcbhash_lookup(struct inpcbtable *table, u_int rdomain,
+in6_pcbhash_find(struct inpcbtable *table, u_int rdomain,
     const struct in6_addr *faddr, u_short fport,
     const struct in6_addr *laddr, u_short lport)
 {
-	struct inpcbhead *head;
+	struct inpcbhash *ih;
+	struct inpcbhashhead *head;
 	struct inpcb *inp;
 
-	NET_ASSERT_LOCKED();
-	MUTEX_ASSERT_LOCKED(&table->inpt_mtx);
-
-	head = in6_pcbhash(table, rdomain, faddr, fport, laddr, lport);
-	LIST_FOREACH(inp, head, inp_hash) {
+	ih = SMR_PTR_GET(&table->inpt_hash);
+	head = in6_pcbhash(ih, rdomain, faddr, fport, laddr, lport);
+	SMR_LIST_FOREACH(inp, head, inp_hash[ih->ih_link]) {
 		if (!ISSET(inp->inp_flags, INP_IPV6))
 			continue;
 		if (inp->inp_fport == fport && inp->inp_lport == lport &&
@@ -562,17 +563,39 @@ in6_pcbhash_lookup(struct inpcbtable *table, u_int rdomain,
 			break;
 		}
 	}
-	if (inp != NULL) {
-		/*
-		 * Move this PCB to the head of hash chain so that
-		 * repeated accesses are quicker.  This is analogous to
-		 * the historic single-entry PCB cache.
-		 */
-		if (inp != LIST_FIRST(head)) {
-			LIST_REMOVE(inp, inp_hash);
-			LIST_INSERT_HEAD(head, inp, inp_hash);
-		}
-	}
+	return (inp);
+}
+
+/*
+ * Lockless lookup with a retry under the mutex, see in_pcbhash_lookup().
+ */
+struct inpcb *
+in6_pcbhash_lookup(struct inpcbtable *table, u_int rdomain,
+    const struct in6_addr *faddr, u_short fport,
+    const struct in6_addr *laddr, u_short lport)
+{
+	struct inpcb *inp;
+	u_int gen;
+
+	NET_ASSERT_LOCKED();
+
+	smr_read_enter();
+	gen = READ_ONCE(table->inpt_hashgen);
+	membar_consumer();
+	inp = in6_pcbhash_find(table, rdomain, faddr, fport, laddr, lport);
+	in_pcbref(inp);
+	smr_read_leave();
+	if (inp != NULL)
+		return (inp);
+
+	membar_consumer();
+	if (READ_ONCE(table->inpt_hashgen) == gen)
+		return (NULL);
+
+	mtx_enter(&table->inpt_mtx);
+	inp = in6_pcbhash_find(table, rdomain, faddr, fport, laddr, lport);
+	in_pcbref(inp);
+	mtx_leave(&table->inpt_mtx);
 	return (inp);
 }
 
@@ -584,10 +607,7 @@ in6_pcblookup(struct inpcbtable *table, const struct in6_addr *faddr,
 	u_int rdomain;
 
 	rdomain = rtable_l2(rtable);
-	mtx_enter(&table->inpt_mtx);
 	inp = in6_pcbhash_lookup(table, rdomain, faddr, fport, laddr, lport);
-	in_pcbref(inp);
-	mtx_leave(&table->inpt_mtx);
 #ifdef DIAGNOSTIC
 	if (inp == NULL && in_pcbnotifymiss) {
 		printf("%s: faddr= fport=%d laddr= lport=%d rdom=%u\n",
@@ -636,14 +656,11 @@ in6_pcblookup_listen(struct inpcbtable *table, struct in6_addr *laddr,
 #endif
 
 	rdomain = rtable_l2(rtable);
-	mtx_enter(&table->inpt_mtx);
 	inp = in6_pcbhash_lookup(table, rdomain, &zeroin6_addr, 0, key1, lport);
 	if (inp == NULL && ! IN6_ARE_ADDR_EQUAL(key1, key2)) {
 		inp = in6_pcbhash_lookup(table, rdomain,
 		    &zeroin6_addr, 0, key2, lport);
 	}
-	in_pcbref(inp);
-	mtx_leave(&table->inpt_mtx);
 #ifdef DIAGNOSTIC
 	if (inp == NULL && in_pcbnotifymiss) {
 		printf("%s: laddr= lport=%d rdom=%u\n",
@@ -139,7 +139,7 @@ const struct protosw inet6sw[] = {
   .pr_flags	= PR_ATOMIC|PR_ADDR|PR_SPLICE,
   .pr_input	= udp_input,
   .pr_ctlinput	= udp6_ctlinput,
-  .pr_ctloutput	= ip6_ctloutput,
+  .pr_ctloutput	= udp_ctloutput,
   .pr_usrreqs	= &udp6_usrreqs,
   .pr_sysctl	= udp_sysctl
 },
@@ -53,6 +53,9 @@
 #include <netinet6/ip6_var.h>
 #include <netinet/icmp6.h>
 #include <netinet6/nd6.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_timer.h>
+#include <netinet/tcp_var.h>
 
 #if NPF > 0
 #include <net/pfvar.h>
@@ -63,7 +66,6 @@
 #include <netinet/ip_ah.h>
 #include <netinet/ip_esp.h>
 #include <netinet/udp.h>
-#include <netinet/tcp.h>
 #endif
 
 /*
@@ -90,6 +92,7 @@ ip6_forward(struct mbuf *m, struct rtentry *rt, int srcrt)
 	struct mbuf *mcopy = NULL;
 #ifdef IPSEC
 	struct tdb *tdb = NULL;
+	struct mbuf_list fml;
 #endif /* IPSEC */
 	char src6[INET6_ADDRSTRLEN], dst6[INET6_ADDRSTRLEN];
 
@@ -219,7 +222,22 @@ reroute:
 		/* Callee frees mbuf */
 		ro.ro_rt = rt;
 		ro.ro_tableid = m->m_pkthdr.ph_rtableid;
-		error = ip6_output_ipsec_send(tdb, m, &ro, 0, 1);
+		/* Encryption needs real segments, chop LRO packets first */
+		if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO)) {
+			error = tcp_chopper(m, &fml, NULL,
+			    m->m_pkthdr.ph_mss);
+			if (error)
+				goto senderr;
+			tcpstat_inc(tcps_outswtso);
+			while ((m = ml_dequeue(&fml)) != NULL) {
+				error = ip6_output_ipsec_send(tdb, m, &ro,
+				    0, 1);
+				if (error)
+					break;
+			}
+			ml_purge(&fml);
+		} else
+			error = ip6_output_ipsec_send(tdb, m, &ro, 0, 1);
 		rt = ro.ro_rt;
 		if (error)
 			goto senderr;
@@ -309,6 +327,16 @@ reroute:
 		goto reroute;
 	}
 #endif
+
+	error = tcp_if_output_tso(ifp, &m, sin6tosa(sin6), rt, IFCAP_TSOv6,
+	    ifp->if_mtu);
+	if (error)
+		ip6stat_inc(ip6s_cantforward);
+	else if (m == NULL)
+		ip6stat_inc(ip6s_forward);
+	if (error || m == NULL)
+		goto senderr;
+
 	in6_proto_cksum_out(m, ifp);
 
 	/* Check the size after pf_test to give pf a chance to refragment. */
@@ -333,9 +361,7 @@ reroute:
 		}
 	}
 
-#if NPF > 0 || defined(IPSEC)
 senderr:
-#endif
 	if (mcopy == NULL)
 		goto out;
 
@@ -91,6 +91,8 @@
 
 #include <netinet/in_pcb.h>
 #include <netinet/ip_var.h>
+#include <netinet/udp.h>
+#include <netinet/udp_var.h>
 #include <netinet6/in6_var.h>
 #include <netinet6/in6_ifattach.h>
 #include <netinet/ip6.h>
@@ -224,6 +226,7 @@ ip6intr(void)
 {
 	struct mbuf *m;
 
+	udp_wakeup_defer();
 	while ((m = niq_dequeue(&ip6intrq)) != NULL) {
 		struct m_tag *mtag;
 		int off, nxt;
@@ -251,6 +254,7 @@ ip6intr(void)
 		nxt = ip_deliver(&m, &off, nxt, AF_INET6);
 		KASSERT(nxt == IPPROTO_DONE);
 	}
+	udp_wakeup_flush();
 }
 
 void
@@ -441,6 +441,32 @@ reroute:
 		 * packet just because ip6_dst is different from what tdb has.
 		 * XXX
 		 */
+		/* Encryption needs real segments, chop TSO packets first */
+		if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO) ||
+		    ISSET(m->m_flags, M_UDP_GSO)) {
+			if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO)) {
+				error = tcp_chopper(m, &fml, NULL,
+				    m->m_pkthdr.ph_mss);
+				if (error)
+					goto done;
+				tcpstat_inc(tcps_outswtso);
+			} else {
+				error = udp_chopper(m, &fml, NULL,
+				    m->m_pkthdr.ph_mss);
+				if (error)
+					goto done;
+				udpstat_inc(udps_outswgso);
+			}
+			while ((m = ml_dequeue(&fml)) != NULL) {
+				error = ip6_output_ipsec_send(tdb, m, ro,
+				    exthdrs.ip6e_rthdr ? 1 : 0, 0);
+				if (error)
+					break;
+			}
+			ml_purge(&fml);
+			goto done;
+		}
+
 		error = ip6_output_ipsec_send(tdb, m, ro,
 		    exthdrs.ip6e_rthdr ? 1 : 0, 0);
 		goto done;
@@ -664,6 +690,19 @@ reroute:
 			ip6->ip6_dst.s6_addr16[1] = dst_scope;
 	}
 
+	/*
+	 * TCP and UDP super packets are handed to the hardware or split
+	 * into segments in software before the generic checksum and
+	 * fragmentation handling below.
+	 */
+	error = tcp_if_output_tso(ifp, &m, sin6tosa(dst), ro->ro_rt,
+	    IFCAP_TSOv6, mtu);
+	if (error || m == NULL)
+		goto done;
+	error = udp_if_output_gso(ifp, &m, sin6tosa(dst), ro->ro_rt, mtu);
+	if (error || m == NULL)
+		goto done;
+
 	in6_proto_cksum_out(m, ifp);
 
 	/*
@@ -2714,8 +2753,13 @@ in6_proto_cksum_out(struct mbuf *m, struct ifnet *ifp)
 		u_int16_t csum;
 
 		offset = ip6_lasthdr(m, 0, IPPROTO_IPV6, &nxt);
-		csum = in6_cksum_phdr(&ip6->ip6_src, &ip6->ip6_dst,
-		    htonl(m->m_pkthdr.len - offset), htonl(nxt));
+		if (ISSET(m->m_pkthdr.csum_flags, M_TCP_TSO)) {
+			/* hardware adds the length of each segment */
+			csum = in6_cksum_phdr(&ip6->ip6_src, &ip6->ip6_dst,
+			    htonl(0), htonl(nxt));
+		} else
+			csum = in6_cksum_phdr(&ip6->ip6_src, &ip6->ip6_dst,
+			    htonl(m->m_pkthdr.len - offset), htonl(nxt));
 		if (nxt == IPPROTO_TCP)
 			offset += offsetof(struct tcphdr, th_sum);
 		else if (nxt == IPPROTO_UDP)
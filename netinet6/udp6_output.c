@@ -179,6 +179,25 @@ udp6_output(struct inpcb *in6p, struct mbuf *m, struct mbuf *addr6,
 		fport = in6p->inp_fport;
 	}
 
+	/* jumbograms cannot be segmented */
+	if (in6p->inp_udpgso != 0 && ulen > in6p->inp_udpgso &&
+	    (plen > 0xffff ||
+	    howmany(ulen, in6p->inp_udpgso) > UDP_GSO_MAXSEGS)) {
+		error = EMSGSIZE;
+		goto release;
+	}
+	/*
+	 * Multicast loopback would deliver the unsegmented datagram,
+	 * and udp_chopper() cannot copy IPv6 extension headers.
+	 */
+	if (in6p->inp_udpgso != 0 && ulen > in6p->inp_udpgso &&
+	    (IN6_IS_ADDR_MULTICAST(faddr) || (optp != NULL &&
+	    (optp->ip6po_hbh != NULL || optp->ip6po_dest1 != NULL ||
+	    optp->ip6po_rthdr != NULL || optp->ip6po_dest2 != NULL)))) {
+		error = EOPNOTSUPP;
+		goto release;
+	}
+
 	hlen = sizeof(struct ip6_hdr);
 
 	/*
@@ -216,6 +235,11 @@ udp6_output(struct inpcb *in6p, struct mbuf *m, struct mbuf *addr6,
 	ip6->ip6_dst	= *faddr;
 
 	m->m_pkthdr.csum_flags |= M_UDP_CSUM_OUT;
+	if (in6p->inp_udpgso != 0 && ulen > in6p->inp_udpgso) {
+		/* segmented after the route and pf decisions */
+		m->m_flags |= M_UDP_GSO;
+		m->m_pkthdr.ph_mss = in6p->inp_udpgso;
+	}
 
 	flags = 0;
 	if (in6p->inp_flags & IN6P_MINMTU)
@@ -451,12 +451,14 @@ struct sockpeercred {
  */
 #define NET_BPF_BUFSIZE		1		/* default buffer size */
 #define NET_BPF_MAXBUFSIZE	2		/* maximum buffer size */
-#define NET_BPF_MAXID		3
+#define NET_BPF_JIT		3		/* compile filter programs */
+#define NET_BPF_MAXID		4
 
 #define CTL_NET_BPF_NAMES { \
 	{ 0, 0 }, \
 	{ "bufsize", CTLTYPE_INT }, \
 	{ "maxbufsize", CTLTYPE_INT }, \
+	{ "jit", CTLTYPE_INT }, \
 }
 
 /*
@@ -587,6 +589,7 @@ int	socketpair(int, int, int, int *);
 
 #if __BSD_VISIBLE
 int	accept4(int, struct sockaddr *__restrict, socklen_t *__restrict, int);
+ssize_t	sendfile(int, int, size_t, off_t);
 #endif
 
 #if __BSD_VISIBLE
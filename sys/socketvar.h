@@ -100,6 +100,7 @@ struct socket {
 		struct	timeval ssp_idletv;	/* idle timeout */
 		struct	timeout ssp_idleto;
 		struct	task ssp_task;		/* task for somove */
+		struct	taskq *ssp_taskq;	/* task queue for ssp_task */
 	} *so_sp;
 /*
  * Variables for socket buffering.
@@ -372,6 +373,8 @@ void	sounlock_shared(struct socket *);
 
 int	sendit(struct proc *, int, struct msghdr *, int, register_t *);
 int	recvit(struct proc *, int, struct msghdr *, caddr_t, register_t *);
+int	recvit_fp(struct proc *, struct file *, int, struct msghdr *, caddr_t,
+	    register_t *);
 int	doaccept(struct proc *, int, struct sockaddr *, socklen_t *, int,
 	    register_t *);
 
@@ -439,6 +439,9 @@
 /* syscall: "ypconnect" ret: "int" args: "int" */
 #define	SYS_ypconnect	150
 
+/* syscall: "sendfile" ret: "ssize_t" args: "int" "int" "size_t" "off_t" */
+#define	SYS_sendfile	151
+
 /* syscall: "nfssvc" ret: "int" args: "int" "void *" */
 #define	SYS_nfssvc	155
 
@@ -739,6 +739,13 @@ struct sys_ypconnect_args {
 	syscallarg(int) type;
 };
 
+struct sys_sendfile_args {
+	syscallarg(int) fd;
+	syscallarg(int) s;
+	syscallarg(size_t) nbytes;
+	syscallarg(off_t) offset;
+};
+
 struct sys_nfssvc_args {
 	syscallarg(int) flag;
 	syscallarg(void *) argp;
@@ -1366,6 +1373,7 @@ int	sys_setthrname(struct proc *, void *, register_t *);
 int	sys_setsid(struct proc *, void *, register_t *);
 int	sys_quotactl(struct proc *, void *, register_t *);
 int	sys_ypconnect(struct proc *, void *, register_t *);
+int	sys_sendfile(struct proc *, void *, register_t *);
 #if defined(NFSCLIENT) || defined(NFSSERVER)
 int	sys_nfssvc(struct proc *, void *, register_t *);
 #else